@@ -3,6 +3,11 @@ layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec2 texCoords;
 
+// Per-instance attributes (Objects::renderInstanced), used instead of model
+// when instanced is set
+layout (location = 7) in mat4 aInstanceModel;
+layout (location = 11) in mat3 aInstanceNormalMatrix;
+
 out vec2 TexCoords;
 
 out VS_OUT {
@@ -15,14 +20,19 @@ out VS_OUT {
 uniform mat4 projection;
 uniform mat4 view;
 uniform mat4 model;
+uniform bool instanced;
 uniform mat4 lightProjection;
 uniform mat4 lightView;
 
+// Matches depthprepass.vs for the GL_EQUAL depth test after a pre-pass
+invariant gl_Position;
+
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f);
-    vs_out.FragPos = vec3(model * vec4(position, 1.0));
-    vs_out.Normal = transpose(inverse(mat3(model))) * normal;
+    mat4 M = instanced ? aInstanceModel : model;
+    gl_Position = projection * view * M * vec4(position, 1.0f);
+    vs_out.FragPos = vec3(M * vec4(position, 1.0));
+    vs_out.Normal = (instanced ? aInstanceNormalMatrix : transpose(inverse(mat3(model)))) * normal;
     vs_out.TexCoords = texCoords;
     vs_out.FragPosLightSpace = lightProjection * lightView * vec4(vs_out.FragPos, 1.0);
 }
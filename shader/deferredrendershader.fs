@@ -15,12 +15,40 @@ uniform sampler2D gNormal;
 uniform sampler2D gAlbedoSpec;
 uniform sampler2D gShadow;
 uniform sampler2D ssaoColorBufferBlur;
+// Temporally accumulated reflections (ssr/ssrshader.fs), used instead of the
+// per-frame ray march when ssr_temporal is set
+uniform sampler2D ssrColor;
+uniform bool ssr_temporal;
+// GTAO bent normals: the ambient light comes from a sky above a darker ground
+uniform sampler2D bentNormals;
+uniform bool bent_normal_ambient;
 
 uniform vec3 lightPos;
 uniform vec3 viewPos;
 
 uniform mat4 VPMatrix;
 
+// Hi-Z tracing: min depth pyramid of gShadow.g (r = closest depth per cell)
+uniform sampler2D hiZ;
+uniform int hiZLevels;
+uniform bool hiz_ssr;
+
+// Stencil class the draw is limited to (1 opaque, 2 mirror), 0 when a single
+// pass shades every pixel and classifies them from the G-buffer
+uniform int stencil_class;
+
+// Local point/spot lights (lights.h): 3 texels per light, (offset, count) per
+// cluster into the index list. light_assignment 0 shades every light.
+uniform samplerBuffer lightData;
+uniform usamplerBuffer clusterGrid;
+uniform usamplerBuffer clusterIndices;
+uniform int numLocalLights;
+uniform int light_assignment;
+uniform ivec3 clusterDims;
+// slice = log(view depth) * x - y
+uniform vec2 clusterSliceScaleBias;
+uniform mat4 view;
+
 uniform int numray;
 uniform bool AO;
 
@@ -46,6 +74,42 @@ vec3 evalDirectLight(vec3 lightColor, float shadow)
     return lightColor;
 }
 
+vec3 evalLocalLight(int index, vec3 fragPos, vec3 normal, vec3 color)
+{
+    vec4 position_radius = texelFetch(lightData, 3 * index);
+    vec4 color_cos_outer = texelFetch(lightData, 3 * index + 1);
+    vec4 direction_cos_inner = texelFetch(lightData, 3 * index + 2);
+    vec3 to_light = position_radius.xyz - fragPos;
+    float dist = length(to_light);
+    if (dist >= position_radius.w)
+        return vec3(0.0);
+    vec3 lightDir = to_light / dist;
+    // Inverse square falloff windowed to zero at the radius
+    float window = clamp(1.0 - pow(dist / position_radius.w, 4.0), 0.0, 1.0);
+    float attenuation = window * window / (dist * dist + 1.0);
+    if (color_cos_outer.w >= -1.0)
+        attenuation *= smoothstep(color_cos_outer.w, direction_cos_inner.w, dot(-lightDir, direction_cos_inner.xyz));
+    return evalDiffuse(lightDir, color, normal) * color_cos_outer.rgb * attenuation;
+}
+
+vec3 evalLocalLights(vec3 fragPos, vec3 normal, vec3 color)
+{
+    vec3 L = vec3(0.0);
+    if (light_assignment == 0) {
+        for (int i = 0; i < numLocalLights; i++)
+            L += evalLocalLight(i, fragPos, normal, color);
+        return L;
+    }
+    float view_depth = -(view * vec4(fragPos, 1.0)).z;
+    ivec2 tile = min(ivec2(TexCoords * vec2(clusterDims.xy)), clusterDims.xy - 1);
+    int slice = clamp(int(log(view_depth) * clusterSliceScaleBias.x - clusterSliceScaleBias.y), 0, clusterDims.z - 1);
+    int cluster = (slice * clusterDims.y + tile.y) * clusterDims.x + tile.x;
+    uvec2 offset_count = texelFetch(clusterGrid, cluster).xy;
+    for (uint i = 0u; i < offset_count.y; i++)
+        L += evalLocalLight(int(texelFetch(clusterIndices, int(offset_count.x + i)).r), fragPos, normal, color);
+    return L;
+}
+
 // Indirect lightning
 // ------------------
 
@@ -123,6 +187,65 @@ vec3 rayMarch(vec3 origin_point, vec3 ray_dir) {
     return vec3(-1000, -1000, -1000);
 }
 
+// Hierarchical-Z trace in screen space (uv, depth). Depth after projection
+// is affine along the projected ray, so the ray is a line in that space and
+// it can step a whole pyramid cell at a time while it stays in front of the
+// closest depth of the cell, refining only where it may hit. Covers the
+// whole screen in at most HIZ_MAX_ITERATIONS fetches. Returns (uv, depth)
+// of the hit, x < 0 on a miss. start_offset is in level 0 texels.
+#define HIZ_MAX_ITERATIONS 64
+vec3 traceHiZ(vec3 origin_point, vec3 ray_dir, float start_offset) {
+    vec2 size0 = vec2(textureSize(hiZ, 0));
+    vec3 S = vec3(TexCoords, GetGBufferDepth(TexCoords));
+    // A point a little along the ray gives the screen-space direction, a far
+    // end point could lie behind the camera
+    vec4 clip = VPMatrix * vec4(origin_point + 0.01 * ray_dir, 1.0);
+    vec3 D = clip.xyz / clip.w * 0.5 + 0.5 - S;
+    float texels = length(D.xy * size0);
+    if (texels < 1e-6)
+        return vec3(-1.0);
+    // One level 0 texel per unit of t
+    D /= texels;
+    vec2 safe_D = vec2(abs(D.x) < 1e-8 ? 1e-8 : D.x, abs(D.y) < 1e-8 ? 1e-8 : D.y);
+    
+    int level = 0;
+    float t = 1.0 + start_offset;
+    for (int i = 0; i < HIZ_MAX_ITERATIONS; i++) {
+        vec3 p = S + t * D;
+        if (p.x <= 0.0 || p.x >= 1.0 || p.y <= 0.0 || p.y >= 1.0 || p.z <= 0.0 || p.z >= 1.0)
+            return vec3(-1.0);
+        
+        vec2 size = vec2(textureSize(hiZ, level));
+        vec2 cell = floor(p.xy * size);
+        float min_depth = texelFetch(hiZ, ivec2(cell), level).r;
+        
+        // Where the ray leaves the cell, and where it reaches its closest depth
+        vec2 t_boundary = ((cell + step(0.0, safe_D)) / size - S.xy) / safe_D;
+        float t_exit = min(t_boundary.x, t_boundary.y) + 0.01;
+        float t_surface = p.z >= min_depth ? t : (D.z > 0.0 ? (min_depth - S.z) / D.z : 1e20);
+        
+        if (t_surface < t_exit) {
+            if (level == 0) {
+                vec3 hit = S + t_surface * D;
+                if (LinearizeDepth(hit.z) - LinearizeDepth(min_depth) < 0.15)
+                    return hit;
+                // Passed behind the surface
+                t = t_exit;
+            }
+            else {
+                t = t_surface;
+                level--;
+            }
+        }
+        else {
+            // Empty cell: continue on a coarser level
+            t = t_exit;
+            level = min(level + 1, hiZLevels - 1);
+        }
+    }
+    return vec3(-1.0);
+}
+
 void main()
 {
     // retrieve data from gbuffer
@@ -140,13 +263,19 @@ void main()
     vec3 lightColor = vec3(1.5);
     vec3 lightDir = normalize(lightPos - fragPos);
     
-    if (depth < 1.0f) {
+    bool mirror = stencil_class == 0 ? is_mirror >= 0.01 : stencil_class == 2;
+    
+    if (stencil_class != 0 || depth < 1.0f) {
         
         vec3 L = vec3(0.0f);
         
-        if (is_mirror < 0.01) {
+        if (!mirror) {
             // Materials
             vec3 ambientBRDF = evalAmbient(color, ao);
+            if (bent_normal_ambient) {
+                vec3 bent = texture(bentNormals, TexCoords).rgb;
+                ambientBRDF *= 0.75 + 0.25 * bent.y;
+            }
             //vec3 ambientBRDF = vec3(ao);
             vec3 diffuseBRDF = evalDiffuse(lightDir, color, normal);
             //vec3 diffuseBRDF = vec3(0.0f);
@@ -155,6 +284,11 @@ void main()
             vec3 directLight = evalDirectLight(lightColor, shadow);
             
             L = ambientBRDF * lightColor + diffuseBRDF * directLight;
+            if (numLocalLights > 0)
+                L += evalLocalLights(fragPos, normal, color);
+        }
+        else if (ssr_temporal) {
+            L = texture(ssrColor, TexCoords).rgb;
         }
         else {
             // Sample a light
@@ -162,8 +296,18 @@ void main()
             vec3 dir_new = reflect(-viewDir, normal);
             
             // Ray trace
-            vec3 hit_pos = rayMarch(fragPos, dir_new);
-            if (abs(hit_pos.x + 1000) > 0.0001) {
+            vec3 hit_pos;
+            bool hit;
+            if (hiz_ssr) {
+                vec3 hit_screen = traceHiZ(fragPos, dir_new, 0.0);
+                hit = hit_screen.x >= 0.0;
+                hit_pos = texture(gPosition, hit_screen.xy).xyz;
+            }
+            else {
+                hit_pos = rayMarch(fragPos, dir_new);
+                hit = abs(hit_pos.x + 1000) > 0.0001;
+            }
+            if (hit) {
                 vec2 uv_new = GetScreenCoord(hit_pos);
                 vec3 color_new = texture(gAlbedoSpec, uv_new).rgb;
                 vec3 normal_new = texture(gNormal, uv_new).rgb;
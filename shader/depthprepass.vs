@@ -0,0 +1,21 @@
+#version 330 core
+layout (location = 0) in vec3 position;
+
+// Per-instance attributes (Objects::renderInstanced), used instead of model
+// when instanced is set
+layout (location = 7) in mat4 aInstanceModel;
+
+uniform mat4 projection;
+uniform mat4 view;
+uniform mat4 model;
+uniform bool instanced;
+
+// Same expression as blinnphongshader_shadow.vs, so that the lighting pass
+// can test against these depths with GL_EQUAL
+invariant gl_Position;
+
+void main()
+{
+    mat4 M = instanced ? aInstanceModel : model;
+    gl_Position = projection * view * M * vec4(position, 1.0f);
+}
@@ -24,6 +24,19 @@ in vec4 FragPosLightSpace;
 #define BLOCKER_SEARCH_POISSON_RADIUS POISSON_RADIUS
 #define PCF_POISSON_RADIUS 2 * POISSON_RADIUS
 
+// Exponential variance shadow maps, must match momentshader.fs
+#define LIGHT_NEAR 1.0
+#define LIGHT_FAR 40.0
+#define EVSM_POSITIVE_EXPONENT 40.0
+#define EVSM_NEGATIVE_EXPONENT 5.0
+#define EVSM_MIN_VARIANCE 0.0001
+#define EVSM_LIGHT_BLEEDING_REDUCTION 0.3
+
+// Offsets (in vec4) of the 16, 32 and 64 sample sets inside the PoissonDisk block
+#define POISSON_SET_16 0
+#define POISSON_SET_32 8
+#define POISSON_SET_64 24
+
 uniform sampler2D texture_diffuse1;
 uniform sampler2D shadowMap;
 
@@ -32,10 +45,20 @@ uniform vec3 viewPos;
 
 uniform int imgui_shadowtype;
 
-uniform int is_mirror;
+// Min/max depth mip chain of the shadow map (r = min, g = max)
+uniform sampler2D shadowMinMax;
+uniform int shadowMinMaxLevels;
+uniform bool pcss_accelerated;
+
+// Blurred and mipmapped EVSM moments
+uniform sampler2D shadowMoments;
 
-// Global list for poisson disk samples
-vec2 poissonDisk[NUM_SAMPLES];
+// Spiral poisson disks precomputed on the CPU, two samples per vec4
+layout (std140) uniform PoissonDisk {
+    vec4 poissonSets[56];
+};
+
+uniform int is_mirror;
 
 // Hw1 of GAMES 202
 float rand_1to1(float x) {
@@ -50,38 +73,34 @@ float rand_2to1(vec2 uv) {
 	return fract(sin(sn) * c);
 }
 
-void poissonDiskSamples(const in vec2 randomSeed) {
-    float ANGLE_STEP = TWO_PI * float(NUM_RINGS) / float( NUM_SAMPLES );
-    float INV_NUM_SAMPLES = 1.0 / float(NUM_SAMPLES);
+vec2 poissonSample(int disk, int i) {
+    vec4 pair = poissonSets[disk + (i >> 1)];
+    return (i & 1) == 0 ? pair.xy : pair.zw;
+}
 
+// The precomputed spirals start at angle 0, rotating them by a random angle
+// per fragment gives the same pattern as regenerating the disk in the shader
+mat2 poissonRotation(const in vec2 randomSeed) {
     float angle = rand_2to1(randomSeed) * TWO_PI;
-    float radius = INV_NUM_SAMPLES;
-    float radiusStep = radius;
-
-    for( int i = 0; i < NUM_SAMPLES; i ++ ) {
-        poissonDisk[i] = vec2(cos(angle), sin(angle)) * pow(radius, 0.75);
-        radius += radiusStep;
-        angle += ANGLE_STEP;
-    }
+    float c = cos(angle);
+    float s = sin(angle);
+    return mat2(c, s, -s, c);
 }
 
-void uniformDiskSamples(const in vec2 randomSeed) {
-    float randNum = rand_2to1(randomSeed);
-    float sampleX = rand_1to1( randNum ) ;
-    float sampleY = rand_1to1( sampleX ) ;
-
-    float angle = sampleX * TWO_PI;
-    float radius = sqrt(sampleY);
-
-    for( int i = 0; i < NUM_SAMPLES; i ++ ) {
-        poissonDisk[i] = vec2(radius * cos(angle), radius * sin(angle));
-
-        sampleX = rand_1to1( sampleY );
-        sampleY = rand_1to1( sampleX );
-
-        angle = sampleX * TWO_PI;
-        radius = sqrt(sampleY);
-    }
+// Conservative min/max depth of the shadow map inside a square of the given
+// radius (in texels), read from the coarsest level where it spans <= 2x2 texels
+vec2 regionMinMax(vec2 uv, float radius) {
+    int level = clamp(int(ceil(log2(max(2.0 * radius, 1.0)))), 0, shadowMinMaxLevels - 1);
+    ivec2 size = textureSize(shadowMinMax, level);
+    vec2 texel = uv * vec2(textureSize(shadowMinMax, 0));
+    float scale = exp2(-float(level));
+    ivec2 lo = clamp(ivec2(floor((texel - radius) * scale)), ivec2(0), size - 1);
+    ivec2 hi = clamp(ivec2(floor((texel + radius) * scale)), ivec2(0), size - 1);
+    vec2 a = texelFetch(shadowMinMax, lo, level).rg;
+    vec2 b = texelFetch(shadowMinMax, ivec2(hi.x, lo.y), level).rg;
+    vec2 c = texelFetch(shadowMinMax, ivec2(lo.x, hi.y), level).rg;
+    vec2 d = texelFetch(shadowMinMax, hi, level).rg;
+    return vec2(min(min(a.r, b.r), min(c.r, d.r)), max(max(a.g, b.g), max(c.g, d.g)));
 }
 
 // --------------------------------------------
@@ -146,13 +165,13 @@ float PCFShadowCalculationPoissonDiskSample()
     float bias = max(0.001 * (1.0 - dot(normal, lightDir)), 0.0005);
 
     // PCF (percentage-closer filtering)
-    poissonDiskSamples(projCoords.xy);
+    mat2 rotation = poissonRotation(projCoords.xy);
 
     float shadow = 0.0;
     vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
 
     for (int i = 0; i < NUM_SAMPLES; i++) {
-        vec2 coord = projCoords.xy + poissonDisk[i] * texelSize * POISSON_RADIUS;
+        vec2 coord = projCoords.xy + rotation * poissonSample(POISSON_SET_64, i) * texelSize * POISSON_RADIUS;
         float pcfDepth = texture(shadowMap, coord).r;
         shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
     }
@@ -247,10 +266,10 @@ float PCSSShadowCalculationPoissonDiskSample()
     int count = 0;
     float averageNeighborDepth = 0;
 
-    poissonDiskSamples(projCoords.xy);
+    mat2 rotation = poissonRotation(projCoords.xy);
 
     for (int i = 0; i < NUM_SAMPLES; i++) {
-        vec2 coord = projCoords.xy + poissonDisk[i] * texelSize * PCF_POISSON_RADIUS;
+        vec2 coord = projCoords.xy + rotation * poissonSample(POISSON_SET_64, i) * texelSize * PCF_POISSON_RADIUS;
 
         float neighborDepth = texture(shadowMap, coord).r;
         if (currentDepth - bias > neighborDepth) {
@@ -269,7 +288,7 @@ float PCSSShadowCalculationPoissonDiskSample()
     float shadow = 0.0;
 
     for (int i = 0; i < NUM_SAMPLES; i++) {
-        vec2 coord = projCoords.xy + poissonDisk[i] * texelSize * half_kernel_size;
+        vec2 coord = projCoords.xy + rotation * poissonSample(POISSON_SET_64, i) * texelSize * half_kernel_size;
         float pcfDepth = texture(shadowMap, coord).r;
         shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
     }
@@ -278,6 +297,123 @@ float PCSSShadowCalculationPoissonDiskSample()
     return shadow;
 }
 
+float PCSSShadowCalculationAccelerated()
+{
+    vec3 normal = normalize(Normal);
+    vec3 lightDir = normalize(lightPos - FragPos);
+
+    vec3 projCoords = FragPosLightSpace.xyz / FragPosLightSpace.w;
+    projCoords = projCoords * 0.5 + 0.5;
+    float currentDepth = projCoords.z;
+
+    float bias = max(0.001 * (1.0 - dot(normal, lightDir)), 0.0005);
+    float receiverDepth = currentDepth - bias;
+
+    // Early out on the min/max mips: nothing in the search region can block,
+    // or everything in it does
+    vec2 regionDepth = regionMinMax(projCoords.xy, PCF_POISSON_RADIUS);
+    if (receiverDepth <= regionDepth.r) {
+        return 0.0;
+    }
+    if (receiverDepth > regionDepth.g) {
+        return 1.0;
+    }
+
+    vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
+    mat2 rotation = poissonRotation(projCoords.xy);
+
+    // Blocker search, the region is known to be partially occluded
+    int count = 0;
+    float averageNeighborDepth = 0;
+    for (int i = 0; i < 32; i++) {
+        vec2 coord = projCoords.xy + rotation * poissonSample(POISSON_SET_32, i) * texelSize * PCF_POISSON_RADIUS;
+        float neighborDepth = texture(shadowMap, coord).r;
+        if (receiverDepth > neighborDepth) {
+            averageNeighborDepth += neighborDepth;
+            count++;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    averageNeighborDepth = averageNeighborDepth / count;
+
+    // Same penumbra estimate as PCSSShadowCalculationPoissonDiskSample
+    float half_kernel_size = (currentDepth - averageNeighborDepth) / averageNeighborDepth * 800.0;
+
+    // Hard shadow edge, a single compare is enough
+    if (half_kernel_size < 1.0) {
+        return receiverDepth > texture(shadowMap, projCoords.xy).r ? 1.0 : 0.0;
+    }
+
+    // Filter region fully lit or fully shadowed
+    regionDepth = regionMinMax(projCoords.xy, half_kernel_size);
+    if (receiverDepth <= regionDepth.r) {
+        return 0.0;
+    }
+    if (receiverDepth > regionDepth.g) {
+        return 1.0;
+    }
+
+    // Number of taps grows with the penumbra width
+    int disk = POISSON_SET_16;
+    int num_samples = 16;
+    if (half_kernel_size > 12.0) {
+        disk = POISSON_SET_64;
+        num_samples = 64;
+    }
+    else if (half_kernel_size > 4.0) {
+        disk = POISSON_SET_32;
+        num_samples = 32;
+    }
+
+    float shadow = 0.0;
+    for (int i = 0; i < num_samples; i++) {
+        vec2 coord = projCoords.xy + rotation * poissonSample(disk, i) * texelSize * half_kernel_size;
+        float pcfDepth = texture(shadowMap, coord).r;
+        shadow += receiverDepth > pcfDepth ? 1.0 : 0.0;
+    }
+    shadow /= num_samples;
+
+    return shadow;
+}
+
+// Upper bound of the fraction of light reaching a receiver at depth mean
+float chebyshevUpperBound(vec2 moments, float mean, float minVariance)
+{
+    if (mean <= moments.x) {
+        return 1.0;
+    }
+    float variance = max(moments.y - moments.x * moments.x, minVariance);
+    float d = mean - moments.x;
+    float pMax = variance / (variance + d * d);
+    // Cut the tail of the bound to reduce light bleeding
+    return clamp((pMax - EVSM_LIGHT_BLEEDING_REDUCTION) / (1.0 - EVSM_LIGHT_BLEEDING_REDUCTION), 0.0, 1.0);
+}
+
+float EVSMShadowCalculation()
+{
+    vec4 fragPosLightSpace = FragPosLightSpace;
+    vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
+    projCoords = projCoords * 0.5 + 0.5;
+
+    // Same warped linear depth as written by momentshader.fs
+    float depth = (fragPosLightSpace.w - LIGHT_NEAR) / (LIGHT_FAR - LIGHT_NEAR);
+    depth = 2.0 * depth - 1.0;
+    vec2 warpedDepth = vec2(exp(EVSM_POSITIVE_EXPONENT * depth), -exp(-EVSM_NEGATIVE_EXPONENT * depth));
+
+    // Single filtered fetch, the mip level follows the screen footprint
+    vec4 moments = texture(shadowMoments, projCoords.xy);
+
+    // Scale the minimum variance by the derivative of the warp
+    vec2 depthScale = EVSM_MIN_VARIANCE * vec2(EVSM_POSITIVE_EXPONENT, EVSM_NEGATIVE_EXPONENT) * warpedDepth;
+    vec2 minVariance = depthScale * depthScale;
+
+    float positive = chebyshevUpperBound(moments.xy, warpedDepth.x, minVariance.x);
+    float negative = chebyshevUpperBound(moments.zw, warpedDepth.y, minVariance.y);
+    return 1.0 - min(positive, negative);
+}
+
 void main()
 {
     gPosition.rgb = FragPos;
@@ -301,7 +437,15 @@ void main()
         shadow = PCFShadowCalculationPoissonDiskSample();
     }
     else if (imgui_shadowtype == 3) {
-        shadow = PCSSShadowCalculationPoissonDiskSample();
+        if (pcss_accelerated) {
+            shadow = PCSSShadowCalculationAccelerated();
+        }
+        else {
+            shadow = PCSSShadowCalculationPoissonDiskSample();
+        }
+    }
+    else if (imgui_shadowtype == 4) {
+        shadow = EVSMShadowCalculation();
     }
     
     gShadow.r = shadow;
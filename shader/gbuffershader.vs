@@ -3,6 +3,11 @@ layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
 
+// Per-instance attributes (Objects::renderInstanced), used instead of model
+// when instanced is set
+layout (location = 7) in mat4 aInstanceModel;
+layout (location = 11) in mat3 aInstanceNormalMatrix;
+
 out vec3 FragPos;
 out vec2 TexCoords;
 out vec3 Normal;
@@ -11,6 +16,7 @@ out vec4 FragPosLightSpace;
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
+uniform bool instanced;
 
 // For shadowmap
 uniform mat4 lightProjection;
@@ -18,14 +24,14 @@ uniform mat4 lightView;
 
 void main()
 {
-    vec4 worldPos = model * vec4(aPos, 1.0);
+    vec4 worldPos = (instanced ? aInstanceModel : model) * vec4(aPos, 1.0);
     
     // Position
     FragPos = worldPos.xyz;
     TexCoords = aTexCoords;
     
     // Normal
-    mat3 normalMatrix = transpose(inverse(mat3(model)));
+    mat3 normalMatrix = instanced ? aInstanceNormalMatrix : transpose(inverse(mat3(model)));
     Normal = normalMatrix * aNormal;
     
     // Light space fragment position (for shadowmap)
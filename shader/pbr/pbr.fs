@@ -5,6 +5,7 @@ in VS_OUT {
     vec3 frag_pos;
     vec3 normal;
     vec2 texture_coords;
+    flat int material;
 } fs_in;
 
 uniform vec3 cam_pos;
@@ -16,6 +17,11 @@ uniform float metallic;
 uniform float roughness;
 uniform float ao;
 
+// (metallic, roughness) per instance material when drawn instanced
+#define MAX_MATERIALS 32
+uniform vec2 materials[MAX_MATERIALS];
+uniform bool instanced;
+
 #define PI 3.1415927
 
 /* Schlick approximation of Fresnel equation
@@ -67,6 +73,8 @@ float geometry_smith(vec3 N, vec3 V, vec3 L, float roughness)
 
 void main()
 {
+    vec2 metallic_roughness = instanced ? materials[fs_in.material] : vec2(metallic, roughness);
+    
     vec3 N = normalize(fs_in.normal);
     vec3 V = normalize(cam_pos - fs_in.frag_pos);
 
@@ -79,14 +87,14 @@ void main()
 
     // Fresnel
     vec3 F0 = vec3(0.04);
-    F0 = mix(F0, albedo, metallic);
+    F0 = mix(F0, albedo, metallic_roughness.x);
     vec3 F = fresnel_schlick(N, V, F0);
 
     // Normal distribution function
-    float D = normal_distribution_trowbridge_reitz_ggx(N, H, roughness);
+    float D = normal_distribution_trowbridge_reitz_ggx(N, H, metallic_roughness.y);
     
     // Geometry
-    float G = geometry_smith(N, V, L, roughness);
+    float G = geometry_smith(N, V, L, metallic_roughness.y);
 
     // Cook-Torrance BRDF
     vec3 nominator = D * F * G;
@@ -95,7 +103,7 @@ void main()
 
     vec3 kS = F;
     vec3 kD = vec3(1.0) - kS;
-    kD *= 1.0 - metallic;
+    kD *= 1.0 - metallic_roughness.x;
 
     float NdotL = max(dot(N, L), 0.0);        
     vec3 Lo = (kD * albedo / PI + kS * specular) * radiance * NdotL;
@@ -3,21 +3,31 @@ layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec2 texture_coords;
 
+// Per-instance attributes (Objects::renderInstanced), used instead of model
+// when instanced is set
+layout (location = 7) in mat4 instance_model;
+layout (location = 11) in mat3 instance_normal_matrix;
+layout (location = 14) in int instance_material;
+
 out VS_OUT {
     vec3 frag_pos;
     vec3 normal;
     vec2 texture_coords;
+    flat int material;
 } vs_out;
 
 uniform mat4 projection;
 uniform mat4 view;
 uniform mat4 model;
+uniform bool instanced;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f);
-    vs_out.frag_pos = vec3(model * vec4(position, 1.0));
+    mat4 M = instanced ? instance_model : model;
+    gl_Position = projection * view * M * vec4(position, 1.0f);
+    vs_out.frag_pos = vec3(M * vec4(position, 1.0));
     // vs_out.normal = transpose(inverse(mat3(model))) * normal;
-    vs_out.normal = normal;
+    vs_out.normal = instanced ? instance_normal_matrix * normal : normal;
     vs_out.texture_coords = texture_coords;
+    vs_out.material = instanced ? instance_material : 0;
 }
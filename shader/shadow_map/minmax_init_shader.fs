@@ -0,0 +1,13 @@
+#version 330 core
+// Level 0 of a min/max depth pyramid: copy one channel of the depth source
+out vec2 MinMax;
+
+uniform sampler2D depthMap;
+// Channel of depthMap holding the depth (r for a depth texture, g for gShadow)
+uniform int channel;
+
+void main()
+{
+    float depth = texelFetch(depthMap, ivec2(gl_FragCoord.xy), 0)[channel];
+    MinMax = vec2(depth, depth);
+}
@@ -0,0 +1,23 @@
+#version 330 core
+// Reduce the previous level (the only level visible through base/max level)
+// of a min/max depth pyramid by 2x2. On odd sized levels the last row and
+// column are folded into the last texel so no depth is ever skipped.
+out vec2 MinMax;
+
+uniform sampler2D pyramid;
+
+void main()
+{
+    ivec2 prev_size = textureSize(pyramid, 0);
+    ivec2 base = ivec2(gl_FragCoord.xy) * 2;
+    ivec2 extent = ivec2(2) + ivec2(equal(base + ivec2(3), prev_size));
+
+    vec2 result = vec2(1.0, 0.0);
+    for (int x = 0; x < extent.x; x++) {
+        for (int y = 0; y < extent.y; y++) {
+            vec2 texel = texelFetch(pyramid, min(base + ivec2(x, y), prev_size - 1), 0).rg;
+            result = vec2(min(result.r, texel.r), max(result.g, texel.g));
+        }
+    }
+    MinMax = result;
+}
@@ -0,0 +1,25 @@
+#version 330 core
+// One direction of the separable gaussian blur applied to the moment map
+out vec4 Moments;
+
+in vec2 TexCoords;
+
+uniform sampler2D moments;
+// (1, 0) for the horizontal pass, (0, 1) for the vertical pass
+uniform vec2 direction;
+uniform int blur_radius;
+
+void main()
+{
+    vec2 texelSize = 1.0 / vec2(textureSize(moments, 0));
+    float sigma = max(float(blur_radius) * 0.5, 0.5);
+
+    vec4 result = vec4(0.0);
+    float weight_sum = 0.0;
+    for (int i = -blur_radius; i <= blur_radius; i++) {
+        float weight = exp(-float(i * i) / (2.0 * sigma * sigma));
+        result += weight * texture(moments, TexCoords + float(i) * direction * texelSize);
+        weight_sum += weight;
+    }
+    Moments = result / weight_sum;
+}
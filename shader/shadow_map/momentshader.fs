@@ -0,0 +1,24 @@
+// Exponential variance shadow maps (EVSM)
+// Reference: Lauritzen and McCool, Layered Variance Shadow Maps (GI 2008)
+#version 330 core
+
+// Must match the light projection set up in main.cpp
+#define LIGHT_NEAR 1.0
+#define LIGHT_FAR 40.0
+
+#define EVSM_POSITIVE_EXPONENT 40.0
+#define EVSM_NEGATIVE_EXPONENT 5.0
+
+out vec4 Moments;
+
+in float LightDepth;
+
+void main()
+{
+    float depth = (LightDepth - LIGHT_NEAR) / (LIGHT_FAR - LIGHT_NEAR);
+    depth = 2.0 * depth - 1.0;
+
+    float pos = exp(EVSM_POSITIVE_EXPONENT * depth);
+    float neg = -exp(-EVSM_NEGATIVE_EXPONENT * depth);
+    Moments = vec4(pos, pos * pos, neg, neg * neg);
+}
@@ -0,0 +1,21 @@
+#version 330 core
+layout (location = 0) in vec3 position;
+
+// Per-instance attributes (Objects::renderInstanced), used instead of model
+// when instanced is set
+layout (location = 7) in mat4 aInstanceModel;
+
+out float LightDepth;
+
+uniform mat4 lightProjection;
+uniform mat4 lightView;
+uniform mat4 model;
+uniform bool instanced;
+
+void main()
+{
+    mat4 M = instanced ? aInstanceModel : model;
+    gl_Position = lightProjection * lightView * M * vec4(position, 1.0f);
+    // View space distance along the light axis (w of a perspective projection)
+    LightDepth = gl_Position.w;
+}
@@ -0,0 +1,116 @@
+#version 330 core
+layout (location = 0) out vec4 FragColor;
+// View-independent (world space) bent normal, xyz
+layout (location = 1) out vec4 BentNormal;
+
+#define PI 3.1415927
+#define HALF_PI 1.5707963
+
+in vec2 TexCoords;
+
+uniform sampler2D gPosition;
+uniform sampler2D gNormal;
+uniform sampler2D gShadow;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+// World space radius of the horizon search
+uniform float radius;
+// Screen-space directions, and samples per direction and side
+uniform int slices;
+uniform int steps;
+// Rotates the directions between frames for the temporal accumulation
+uniform int frameIndex;
+
+// Interleaved gradient noise
+float noise(vec2 pixel)
+{
+    return fract(52.9829189 * fract(dot(pixel, vec2(0.06711056, 0.00583715))));
+}
+
+vec3 viewPosition(vec2 uv)
+{
+    return (view * vec4(texture(gPosition, uv).xyz, 1.0)).xyz;
+}
+
+// Ground-truth AO (Jimenez et al. 2016): per slice, the horizon angle on
+// either side of the pixel is searched in screen space and the cosine
+// weighted visibility between both horizons is integrated analytically.
+void main()
+{
+    if (texture(gShadow, TexCoords).g >= 1.0) {
+        FragColor = vec4(1.0);
+        BentNormal = vec4(0.0, 1.0, 0.0, 1.0);
+        return;
+    }
+    
+    vec3 P = viewPosition(TexCoords);
+    vec3 N = normalize(mat3(view) * texture(gNormal, TexCoords).rgb);
+    vec3 V = normalize(-P);
+    
+    // Search radius in uv units at this depth
+    vec2 radius_uv = 0.5 * radius * vec2(projection[0][0], projection[1][1]) / -P.z;
+    
+    float slice_jitter = noise(gl_FragCoord.xy);
+    float step_jitter = noise(gl_FragCoord.xy + vec2(37.0, 17.0));
+    float rotation = fract(slice_jitter + 0.618034 * float(frameIndex));
+    
+    float visibility = 0.0;
+    vec3 bent = vec3(0.0);
+    for (int slice = 0; slice < slices; ++slice)
+    {
+        float phi = (float(slice) + rotation) * PI / float(slices);
+        vec2 omega = vec2(cos(phi), sin(phi));
+        
+        // Slice plane through V and the screen direction
+        vec3 direction = vec3(omega, 0.0);
+        vec3 ortho_direction = direction - dot(direction, V) * V;
+        vec3 axis = normalize(cross(direction, V));
+        vec3 projected_normal = N - axis * dot(N, axis);
+        float projected_length = length(projected_normal);
+        float sign_n = sign(dot(ortho_direction, projected_normal));
+        float cos_n = clamp(dot(projected_normal, V) / projected_length, 0.0, 1.0);
+        float n = sign_n * acos(cos_n);
+        
+        // Highest horizon (largest cosine to V) on each side
+        float horizon_cos[2] = float[](-1.0, -1.0);
+        for (int side = 0; side < 2; ++side)
+        {
+            vec2 side_dir = side == 0 ? omega : -omega;
+            for (int i = 0; i < steps; ++i)
+            {
+                vec2 uv = TexCoords + side_dir * radius_uv * (float(i) + step_jitter + 0.1) / float(steps);
+                if (uv.x <= 0.0 || uv.x >= 1.0 || uv.y <= 0.0 || uv.y >= 1.0 || texture(gShadow, uv).g >= 1.0)
+                    continue;
+                vec3 delta = viewPosition(uv) - P;
+                float dist2 = dot(delta, delta);
+                float sample_cos = dot(delta, V) * inversesqrt(dist2);
+                // Fade out occluders beyond the radius
+                float falloff = clamp(1.0 - dist2 / (radius * radius), 0.0, 1.0);
+                horizon_cos[side] = max(horizon_cos[side], mix(-1.0, sample_cos, falloff));
+            }
+        }
+        
+        // Horizon angles relative to V, clamped to the hemisphere around n
+        float h0 = -acos(horizon_cos[1]);
+        float h1 = acos(horizon_cos[0]);
+        h0 = n + clamp(h0 - n, -HALF_PI, HALF_PI);
+        h1 = n + clamp(h1 - n, -HALF_PI, HALF_PI);
+        
+        float arc0 = (cos_n + 2.0 * h0 * sin(n) - cos(2.0 * h0 - n)) / 4.0;
+        float arc1 = (cos_n + 2.0 * h1 * sin(n) - cos(2.0 * h1 - n)) / 4.0;
+        visibility += projected_length * (arc0 + arc1);
+        
+        // Cosine weighted mean direction of the visible arc
+        float t0 = (6.0 * sin(h0 - n) - sin(3.0 * h0 - n) + 6.0 * sin(h1 - n) - sin(3.0 * h1 - n)
+                    + 16.0 * sin(n) - 3.0 * (sin(h0 + n) + sin(h1 + n))) / 12.0;
+        float t1 = (-cos(3.0 * h0 - n) - cos(3.0 * h1 - n) + 8.0 * cos(n) - 3.0 * (cos(h0 + n) + cos(h1 + n))) / 12.0;
+        bent += projected_length * (normalize(ortho_direction) * t0 + V * t1);
+    }
+    visibility /= float(slices);
+    bent = length(bent) > 1e-4 ? normalize(bent) : N;
+    
+    FragColor = vec4(visibility, visibility, visibility, 1.0);
+    BentNormal = vec4(transpose(mat3(view)) * bent, 1.0);
+}
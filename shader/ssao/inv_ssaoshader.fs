@@ -14,7 +14,7 @@ int kernelSize = 64;
 float radius = 3.0;
 
 // tile noise texture over screen based on screen dimensions divided by noise size
-const vec2 noiseScale = vec2(1600.0f/4.0f, 1200.0f/4.0f);
+uniform vec2 noiseScale;
 
 uniform mat4 view;
 uniform mat4 projection;
@@ -0,0 +1,49 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+uniform sampler2D ssaoInput;
+uniform sampler2D depthInput;
+
+// (1, 0) or (0, 1)
+uniform vec2 direction;
+// Falloff of the depth weight, relative to the center depth
+uniform float depth_sigma;
+
+// 7-tap gaussian
+const float weights[4] = float[](0.2270270, 0.1945946, 0.1216216, 0.0540541);
+
+float LinearizeDepth(float depth)
+{
+    float NEAR = 1.0f;
+    float FAR = 40.0f;
+    
+    float z = depth * 2.0 - 1.0; // Back to NDC
+    return (2.0 * NEAR * FAR) / (FAR + NEAR - z * (FAR - NEAR));
+}
+
+void main()
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    ivec2 last = textureSize(ssaoInput, 0) - 1;
+    ivec2 stride = ivec2(direction);
+    
+    float center_depth = LinearizeDepth(texelFetch(depthInput, p, 0).g);
+    float result = texelFetch(ssaoInput, p, 0).r * weights[0];
+    float weight_sum = weights[0];
+    for (int i = 1; i < 4; ++i)
+    {
+        for (int side = -1; side <= 1; side += 2)
+        {
+            ivec2 q = clamp(p + stride * i * side, ivec2(0), last);
+            float depth = LinearizeDepth(texelFetch(depthInput, q, 0).g);
+            // Samples across a depth edge do not contribute
+            float w = weights[i] * exp(-abs(depth - center_depth) / (depth_sigma * center_depth));
+            result += texelFetch(ssaoInput, q, 0).r * w;
+            weight_sum += w;
+        }
+    }
+    result /= weight_sum;
+    FragColor = vec4(result, result, result, 1.0f);
+}
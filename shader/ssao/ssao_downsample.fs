@@ -0,0 +1,40 @@
+#version 330 core
+layout (location = 0) out vec4 lowPosition;
+layout (location = 1) out vec4 lowNormal;
+layout (location = 2) out vec4 lowDepth;
+
+in vec2 TexCoords;
+
+uniform sampler2D gPosition;
+uniform sampler2D gNormal;
+uniform sampler2D gShadow;
+
+// Full-res texels per low-res texel, per axis
+uniform int factor;
+
+void main()
+{
+    ivec2 base = ivec2(gl_FragCoord.xy) * factor;
+    ivec2 last = textureSize(gShadow, 0) - 1;
+    
+    // Closest texel of the footprint: keeps thin foreground geometry, and
+    // position, normal and depth all describe the same surface
+    ivec2 best = base;
+    float best_depth = 2.0;
+    for (int y = 0; y < factor; ++y)
+    {
+        for (int x = 0; x < factor; ++x)
+        {
+            ivec2 p = min(base + ivec2(x, y), last);
+            float depth = texelFetch(gShadow, p, 0).g;
+            if (depth < best_depth) {
+                best_depth = depth;
+                best = p;
+            }
+        }
+    }
+    
+    lowPosition = texelFetch(gPosition, best, 0);
+    lowNormal = texelFetch(gNormal, best, 0);
+    lowDepth = vec4(0.0, best_depth, 0.0, 1.0);
+}
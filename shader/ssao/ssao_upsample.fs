@@ -0,0 +1,64 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Low-res AO and the downsampled G-buffer it was computed on
+uniform sampler2D ssaoLow;
+uniform sampler2D depthLow;
+uniform sampler2D normalLow;
+// Full-res G-buffer
+uniform sampler2D gNormal;
+uniform sampler2D gShadow;
+
+uniform float depth_sigma;
+
+float LinearizeDepth(float depth)
+{
+    float NEAR = 1.0f;
+    float FAR = 40.0f;
+    
+    float z = depth * 2.0 - 1.0; // Back to NDC
+    return (2.0 * NEAR * FAR) / (FAR + NEAR - z * (FAR - NEAR));
+}
+
+void main()
+{
+    float depth = texture(gShadow, TexCoords).g;
+    if (depth >= 1.0f) {
+        FragColor = vec4(1.0f);
+        return;
+    }
+    depth = LinearizeDepth(depth);
+    vec3 normal = texture(gNormal, TexCoords).rgb;
+    
+    // The four low-res texels around this pixel and their bilinear weights
+    ivec2 last = textureSize(ssaoLow, 0) - 1;
+    vec2 pos = TexCoords * vec2(textureSize(ssaoLow, 0)) - 0.5;
+    ivec2 base = ivec2(floor(pos));
+    vec2 f = fract(pos);
+    vec4 bilinear = vec4((1.0 - f.x) * (1.0 - f.y), f.x * (1.0 - f.y), (1.0 - f.x) * f.y, f.x * f.y);
+    ivec2 offsets[4] = ivec2[](ivec2(0, 0), ivec2(1, 0), ivec2(0, 1), ivec2(1, 1));
+    
+    float result = 0.0;
+    float weight_sum = 0.0;
+    float best_diff = 1e20;
+    float nearest = 1.0;
+    for (int i = 0; i < 4; ++i)
+    {
+        ivec2 q = clamp(base + offsets[i], ivec2(0), last);
+        float sample_ao = texelFetch(ssaoLow, q, 0).r;
+        float diff = abs(LinearizeDepth(texelFetch(depthLow, q, 0).g) - depth);
+        float normal_weight = pow(max(dot(texelFetch(normalLow, q, 0).rgb, normal), 0.0), 8.0);
+        float w = bilinear[i] * exp(-diff / (depth_sigma * depth)) * normal_weight;
+        result += sample_ao * w;
+        weight_sum += w;
+        if (diff < best_diff) {
+            best_diff = diff;
+            nearest = sample_ao;
+        }
+    }
+    // No texel of the same surface: take the closest one in depth
+    result = weight_sum > 1e-4 ? result / weight_sum : nearest;
+    FragColor = vec4(result, result, result, 1.0f);
+}
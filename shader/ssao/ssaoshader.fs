@@ -10,12 +10,15 @@ uniform sampler2D noiseTexture;
 
 uniform vec3 samples[64];
 
-int kernelSize = 64;
+// Taps this frame, starting at kernelOffset: a temporally accumulated SSAO
+// takes a few taps per frame and walks through the whole kernel over frames
+uniform int kernelSize;
+uniform int kernelOffset;
 // float radius = 2.0;
 float radius = 0.5;
 
 // tile noise texture over screen based on screen dimensions divided by noise size
-const vec2 noiseScale = vec2(1600.0f/4.0f, 1200.0f/4.0f);
+uniform vec2 noiseScale;
 
 uniform mat4 view;
 uniform mat4 projection;
@@ -49,7 +52,7 @@ void main()
     for (int i = 0; i < kernelSize; ++i)
     {
         // get sample position
-        vec3 mysample = TBN * samples[i];
+        vec3 mysample = TBN * samples[(kernelOffset + i) % 64];
         mysample = fragPos + mysample * radius;
         
         // project sample position
@@ -68,7 +71,7 @@ void main()
             rangeCheck = 0;
         occlusion += (sampleDepth <= depth ? 1.0 : 0.0) * rangeCheck;
     }
-    occlusion = 1.0 - (occlusion / (kernelSize / 1.5));
+    occlusion = 1.0 - (occlusion / (float(kernelSize) / 1.5));
     //occlusion /= kernelSize;
     
     FragColor = vec4(occlusion, occlusion, occlusion, 1.0);
@@ -0,0 +1,220 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// G buffers
+uniform sampler2D gPosition;
+uniform sampler2D gNormal;
+uniform sampler2D gAlbedoSpec;
+uniform sampler2D gShadow;
+
+uniform vec3 lightPos;
+uniform vec3 viewPos;
+
+uniform mat4 VPMatrix;
+
+// Coarser than the single-frame march of the deferred shader; the start of
+// each ray is offset by a per-pixel, per-frame fraction of a step so the
+// temporal resolve averages the gaps out
+uniform float stepSize;
+uniform int maxSteps;
+uniform int frameIndex;
+
+// Hi-Z tracing: min depth pyramid of gShadow.g (r = closest depth per cell)
+uniform sampler2D hiZ;
+uniform int hiZLevels;
+uniform bool hiz_ssr;
+
+vec3 evalDiffuse(vec3 lightDir, vec3 color, vec3 normal)
+{
+    float diff = max(dot(lightDir, normal), 0.0);
+    return diff * color;
+}
+
+vec3 evalDirectLight(vec3 lightColor, float shadow)
+{
+    return (1.0 - shadow) * lightColor;
+}
+
+// Helper functions from games202 hw3
+// –---------------------------------
+
+// Get depth from camera view
+float getDepth(vec3 pos_world) {
+    vec4 pos_screen = VPMatrix * vec4(pos_world, 1.0);
+    float depth = pos_screen.z / pos_screen.w * 0.5 + 0.5;
+    return depth;
+}
+
+// Perspective division
+vec4 Project(vec4 a) {
+  return a / a.w;
+}
+
+// Position to screen space
+vec2 GetScreenCoord(vec3 pos_world) {
+    vec2 uv = Project(VPMatrix * vec4(pos_world, 1.0)).xy * 0.5 + 0.5;
+    return uv;
+}
+
+// GbufferDepth needs to be added
+float GetGBufferDepth(vec2 uv) {
+    float depth = texture(gShadow, uv).y;
+    return depth;
+}
+// –---------------------------------
+
+bool is_uv_outofscreen(vec2 uv) {
+    if (uv.x >= 1.0 || uv.x <= 0.0 || uv.y >= 1.0 || uv.y <= 0.0) {
+        return true;
+    }
+    else {
+        return false;
+    }
+}
+
+float LinearizeDepth(float depth)
+{
+    float NEAR = 1.0f;
+    float FAR = 40.0f;
+    
+    float z = depth * 2.0 - 1.0; // Back to NDC
+    return (2.0 * NEAR * FAR) / (FAR + NEAR - z * (FAR - NEAR));
+}
+
+// Interleaved gradient noise, decorrelated between frames by the golden ratio
+float jitter(vec2 pixel)
+{
+    float noise = fract(52.9829189 * fract(dot(pixel, vec2(0.06711056, 0.00583715))));
+    return fract(noise + 0.618034 * float(frameIndex));
+}
+
+vec3 rayMarch(vec3 origin_point, vec3 ray_dir) {
+    float dx = stepSize;
+    vec3 end_point = origin_point + (0.2 + jitter(gl_FragCoord.xy) * dx) * ray_dir;
+    
+    for (int i = 0; i < maxSteps; i++) {
+        vec3 test_point = end_point + dx * ray_dir;
+        float test_point_depth = getDepth(test_point);
+        
+        vec2 test_point_uv = GetScreenCoord(test_point);
+        if (is_uv_outofscreen(test_point_uv) == true) {
+            return vec3(-1000, -1000, -1000);
+        }
+        
+        float buffer_depth = GetGBufferDepth(test_point_uv);
+        
+        // Linearize depth
+        test_point_depth = LinearizeDepth(test_point_depth);
+        buffer_depth = LinearizeDepth(buffer_depth);
+        
+        // Thickness grows with the step so coarse steps do not skip thin hits
+        if (test_point_depth > buffer_depth + 1e-6 && test_point_depth < buffer_depth + 0.15 + dx) {
+            return test_point;
+        } else {
+            end_point = test_point;
+        }
+    }
+    return vec3(-1000, -1000, -1000);
+}
+
+// Hierarchical-Z trace in screen space (uv, depth). Depth after projection
+// is affine along the projected ray, so the ray is a line in that space and
+// it can step a whole pyramid cell at a time while it stays in front of the
+// closest depth of the cell, refining only where it may hit. Covers the
+// whole screen in at most HIZ_MAX_ITERATIONS fetches. Returns (uv, depth)
+// of the hit, x < 0 on a miss. start_offset is in level 0 texels.
+#define HIZ_MAX_ITERATIONS 64
+vec3 traceHiZ(vec3 origin_point, vec3 ray_dir, float start_offset) {
+    vec2 size0 = vec2(textureSize(hiZ, 0));
+    vec3 S = vec3(TexCoords, GetGBufferDepth(TexCoords));
+    // A point a little along the ray gives the screen-space direction, a far
+    // end point could lie behind the camera
+    vec4 clip = VPMatrix * vec4(origin_point + 0.01 * ray_dir, 1.0);
+    vec3 D = clip.xyz / clip.w * 0.5 + 0.5 - S;
+    float texels = length(D.xy * size0);
+    if (texels < 1e-6)
+        return vec3(-1.0);
+    // One level 0 texel per unit of t
+    D /= texels;
+    vec2 safe_D = vec2(abs(D.x) < 1e-8 ? 1e-8 : D.x, abs(D.y) < 1e-8 ? 1e-8 : D.y);
+    
+    int level = 0;
+    float t = 1.0 + start_offset;
+    for (int i = 0; i < HIZ_MAX_ITERATIONS; i++) {
+        vec3 p = S + t * D;
+        if (p.x <= 0.0 || p.x >= 1.0 || p.y <= 0.0 || p.y >= 1.0 || p.z <= 0.0 || p.z >= 1.0)
+            return vec3(-1.0);
+        
+        vec2 size = vec2(textureSize(hiZ, level));
+        vec2 cell = floor(p.xy * size);
+        float min_depth = texelFetch(hiZ, ivec2(cell), level).r;
+        
+        // Where the ray leaves the cell, and where it reaches its closest depth
+        vec2 t_boundary = ((cell + step(0.0, safe_D)) / size - S.xy) / safe_D;
+        float t_exit = min(t_boundary.x, t_boundary.y) + 0.01;
+        float t_surface = p.z >= min_depth ? t : (D.z > 0.0 ? (min_depth - S.z) / D.z : 1e20);
+        
+        if (t_surface < t_exit) {
+            if (level == 0) {
+                vec3 hit = S + t_surface * D;
+                if (LinearizeDepth(hit.z) - LinearizeDepth(min_depth) < 0.15)
+                    return hit;
+                // Passed behind the surface
+                t = t_exit;
+            }
+            else {
+                t = t_surface;
+                level--;
+            }
+        }
+        else {
+            // Empty cell: continue on a coarser level
+            t = t_exit;
+            level = min(level + 1, hiZLevels - 1);
+        }
+    }
+    return vec3(-1.0);
+}
+
+// Reflected radiance of mirror pixels (rgb), a = 1 where a ray hit
+void main()
+{
+    vec3 fragPos = texture(gPosition, TexCoords).rgb;
+    vec3 normal = texture(gNormal, TexCoords).rgb;
+    float depth = texture(gShadow, TexCoords).g;
+    float is_mirror = texture(gShadow, TexCoords).b;
+    
+    vec3 lightColor = vec3(1.5);
+    vec4 L = vec4(0.0f);
+    
+    if (depth < 1.0f && is_mirror >= 0.01) {
+        vec3 viewDir = normalize(viewPos - fragPos);
+        vec3 dir_new = reflect(-viewDir, normal);
+        
+        vec3 hit_pos;
+        bool hit;
+        if (hiz_ssr) {
+            // Jittered by a fraction of a texel
+            vec3 hit_screen = traceHiZ(fragPos, dir_new, jitter(gl_FragCoord.xy));
+            hit = hit_screen.x >= 0.0;
+            hit_pos = texture(gPosition, hit_screen.xy).xyz;
+        }
+        else {
+            hit_pos = rayMarch(fragPos, dir_new);
+            hit = abs(hit_pos.x + 1000) > 0.0001;
+        }
+        if (hit) {
+            vec2 uv_new = GetScreenCoord(hit_pos);
+            vec3 color_new = texture(gAlbedoSpec, uv_new).rgb;
+            vec3 normal_new = texture(gNormal, uv_new).rgb;
+            float shadow_new = texture(gShadow, uv_new).r;
+            vec3 lightdir_new = normalize(lightPos - hit_pos);
+            
+            L = vec4(evalDiffuse(lightdir_new, color_new, normal_new) * evalDirectLight(lightColor, shadow_new), 1.0f);
+        }
+    }
+    
+    FragColor = L;
+}
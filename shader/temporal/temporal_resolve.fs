@@ -0,0 +1,51 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Result of this frame and the accumulated history (rgb value, a linear depth)
+uniform sampler2D current;
+uniform sampler2D history;
+uniform sampler2D gPosition;
+uniform sampler2D gShadow;
+
+uniform mat4 prevViewProj;
+// Weight of the current frame
+uniform float alpha;
+uniform bool history_valid;
+
+float LinearizeDepth(float depth)
+{
+    float NEAR = 1.0f;
+    float FAR = 40.0f;
+    
+    float z = depth * 2.0 - 1.0; // Back to NDC
+    return (2.0 * NEAR * FAR) / (FAR + NEAR - z * (FAR - NEAR));
+}
+
+void main()
+{
+    vec3 value = texture(current, TexCoords).rgb;
+    float depth = texture(gShadow, TexCoords).g;
+    if (depth >= 1.0f) {
+        FragColor = vec4(value, 0.0f);
+        return;
+    }
+    
+    // Where this surface was on screen last frame; the scene is static so the
+    // world position fully determines the motion
+    vec3 fragPos = texture(gPosition, TexCoords).xyz;
+    vec4 prevClip = prevViewProj * vec4(fragPos, 1.0);
+    vec3 prevNDC = prevClip.xyz / prevClip.w;
+    vec2 prevUV = prevNDC.xy * 0.5 + 0.5;
+    float prevDepth = LinearizeDepth(prevNDC.z * 0.5 + 0.5);
+    
+    bool accept = history_valid && prevClip.w > 0.0
+        && all(greaterThan(prevUV, vec2(0.0))) && all(lessThan(prevUV, vec2(1.0)));
+    vec4 prev = texture(history, prevUV);
+    // Disocclusion: last frame saw a different surface at that pixel
+    accept = accept && abs(prev.a - prevDepth) < 0.05 * prevDepth;
+    
+    vec3 result = accept ? mix(prev.rgb, value, alpha) : value;
+    FragColor = vec4(result, LinearizeDepth(depth));
+}
@@ -0,0 +1,33 @@
+#version 330 core
+out vec4 FragColor;
+in vec2 TexCoords;
+
+uniform sampler2D scene;
+// 0: bilinear, 1: bilinear + contrast adaptive sharpening
+uniform int filter_mode;
+uniform float sharpness;
+
+void main()
+{
+    vec3 c = texture(scene, TexCoords).rgb;
+    if (filter_mode == 0) {
+        FragColor = vec4(c, 1.0);
+        return;
+    }
+
+    // Sharpen with the 4 neighbours one source texel away, less where the
+    // local contrast is already high so that edges do not ring
+    vec2 texel = 1.0 / vec2(textureSize(scene, 0));
+    vec3 n = texture(scene, TexCoords + vec2(0.0, texel.y)).rgb;
+    vec3 s = texture(scene, TexCoords - vec2(0.0, texel.y)).rgb;
+    vec3 e = texture(scene, TexCoords + vec2(texel.x, 0.0)).rgb;
+    vec3 w = texture(scene, TexCoords - vec2(texel.x, 0.0)).rgb;
+
+    vec3 mn = min(c, min(min(n, s), min(e, w)));
+    vec3 mx = max(c, max(max(n, s), max(e, w)));
+    vec3 amp = sqrt(clamp(min(mn, 1.0 - mx) / max(mx, vec3(1e-4)), 0.0, 1.0));
+    vec3 weight = -amp * mix(0.125, 0.2, sharpness);
+
+    vec3 color = (c + (n + s + e + w) * weight) / (1.0 + 4.0 * weight);
+    FragColor = vec4(clamp(color, 0.0, 1.0), 1.0);
+}
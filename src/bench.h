@@ -0,0 +1,117 @@
+//
+//  bench.h
+//  opengl_test
+//
+
+#ifndef bench_h
+#define bench_h
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "json.h"
+#include "gpuprofiler.h"
+
+// min/avg/percentiles/max of a series of frame times (ms)
+json benchSummary(std::vector<float> samples)
+{
+    json summary;
+    if (samples.empty())
+        return summary;
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](float p) {
+        return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+    };
+    double sum = 0.0;
+    for (float t : samples) sum += t;
+    summary["min"] = samples.front();
+    summary["avg"] = sum / samples.size();
+    summary["p50"] = percentile(0.50f);
+    summary["p95"] = percentile(0.95f);
+    summary["p99"] = percentile(0.99f);
+    summary["max"] = samples.back();
+    return summary;
+}
+
+// Writes per-frame CPU/GPU timings of the measured frames and their summary.
+// cpu_ms, segments and the profiler log all include the warm-up frames, which
+// are skipped. segments gives the camera path segment of each frame (-1 when
+// there is no path), frame times are also summarized per segment. extra is
+// merged into the result, e.g. culling counts.
+json writeBenchResults(const BenchSettings& settings, const std::vector<float>& cpu_ms, const GpuProfiler& profiler,
+                       const std::vector<int>& segments, const json& extra = json::object())
+{
+    json result;
+    result["settings"] = settings.path;
+    result["rendertype"] = settings.rendertype;
+    result["shadowtype"] = settings.shadowtype;
+    result["ssao"] = settings.ssao;
+    result["temporal"] = settings.temporal;
+    result["ssao_resolution"] = settings.ssao_resolution;
+    result["ao_technique"] = settings.ao_technique;
+    result["hiz_ssr"] = settings.hiz_ssr;
+    result["stencil_lighting"] = settings.stencil_lighting;
+    result["gpu_culling"] = settings.gpu_culling;
+    result["cpu_occlusion"] = settings.cpu_occlusion;
+    result["depth_prepass"] = settings.depth_prepass;
+    result["render_thread"] = settings.render_thread;
+    result["num_lights"] = settings.num_lights;
+    result["light_assignment"] = settings.light_assignment;
+    result["warmup_frames"] = settings.warmup_frames;
+    result["frames"] = settings.frames;
+    result["renderer"] = std::string((const char*)glGetString(GL_RENDERER));
+
+    std::vector<float> cpu(cpu_ms.begin() + std::min((size_t)settings.warmup_frames, cpu_ms.size()), cpu_ms.end());
+    result["cpu_ms"] = cpu;
+    result["summary"]["cpu"] = benchSummary(cpu);
+
+    size_t num_logged = profiler.log.size() / GPU_PASS_COUNT;
+    for (int pass = 0; pass < GPU_PASS_COUNT; pass++) {
+        std::vector<float> gpu;
+        bool ran = false;
+        for (size_t frame = settings.warmup_frames; frame < num_logged; frame++) {
+            float t = profiler.log[frame * GPU_PASS_COUNT + pass];
+            ran = ran || t >= 0.0f;
+            gpu.push_back(std::max(t, 0.0f));
+        }
+        if (!ran)
+            continue;
+        result["gpu_ms"][GPU_PASS_NAMES[pass]] = gpu;
+        result["summary"]["gpu"][GPU_PASS_NAMES[pass]] = benchSummary(gpu);
+    }
+
+    // Per camera path segment
+    size_t num_logged_frames = std::min(cpu_ms.size(), segments.size());
+    int num_segments = 0;
+    for (size_t frame = settings.warmup_frames; frame < num_logged_frames; frame++)
+        num_segments = std::max(num_segments, segments[frame] + 1);
+    for (int segment = 0; segment < num_segments; segment++) {
+        std::vector<float> cpu_segment, gpu_segment;
+        for (size_t frame = settings.warmup_frames; frame < num_logged_frames; frame++) {
+            if (segments[frame] != segment) continue;
+            cpu_segment.push_back(cpu_ms[frame]);
+            if (frame < num_logged)
+                gpu_segment.push_back(std::max(profiler.log[frame * GPU_PASS_COUNT + GPU_PASS_FRAME], 0.0f));
+        }
+        json entry;
+        entry["segment"] = segment;
+        entry["frames"] = cpu_segment.size();
+        entry["cpu"] = benchSummary(cpu_segment);
+        entry["gpu"] = benchSummary(gpu_segment);
+        result["segments"].push_back(entry);
+    }
+
+    for (auto& item : extra.items())
+        result[item.key()] = item.value();
+
+    std::ofstream f(settings.output);
+    f << result.dump(2) << std::endl;
+    std::cout << "Bench " << settings.path << ": cpu " << result["summary"]["cpu"].dump()
+              << ", written to " << settings.output << std::endl;
+    return result;
+}
+
+#endif /* bench_h */
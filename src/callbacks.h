@@ -16,7 +16,9 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     // make sure the viewport matches the new window dimensions; note that width and
     // height will be significantly larger than specified on retina displays.
     // glViewport(0, 0, width, height);
-    glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
+    // Not while a render thread holds the context, which sets the viewport every frame
+    if (glfwGetCurrentContext() == window)
+        glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
 }
 
 void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
@@ -38,12 +40,21 @@ void mouse_callback(GLFWwindow* window, double xposIn, double yposIn)
     lastY = ypos;
 
     if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS)
-        ourcamera.ProcessMouseMovement(xoffset, yoffset);
+        input_camera.ProcessMouseMovement(xoffset, yoffset);
 }
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-    ourcamera.ProcessMouseScroll(static_cast<float>(yoffset));
+    input_camera.ProcessMouseScroll(static_cast<float>(yoffset));
+}
+
+// true only on the frame a key goes down, so holding it triggers once
+bool keyPressedOnce(GLFWwindow *window, int key, bool& was_pressed)
+{
+    bool pressed = glfwGetKey(window, key) == GLFW_PRESS;
+    bool once = pressed && !was_pressed;
+    was_pressed = pressed;
+    return once;
 }
 
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
@@ -54,28 +65,36 @@ void processInput(GLFWwindow *window)
     
     float cameraSpeed = 0.025f; // adjust accordingly
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(FORWARD, cameraSpeed);
+        input_camera.ProcessKeyboard(FORWARD, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(BACKWARD, cameraSpeed);
+        input_camera.ProcessKeyboard(BACKWARD, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(LEFT, cameraSpeed);
+        input_camera.ProcessKeyboard(LEFT, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(RIGHT, cameraSpeed);
+        input_camera.ProcessKeyboard(RIGHT, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(UP, cameraSpeed);
+        input_camera.ProcessKeyboard(UP, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(DOWN, cameraSpeed);
+        input_camera.ProcessKeyboard(DOWN, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(MOUSE_LEFT, cameraSpeed);
+        input_camera.ProcessKeyboard(MOUSE_LEFT, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(MOUSE_RIGHT, cameraSpeed);
+        input_camera.ProcessKeyboard(MOUSE_RIGHT, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(MOUSE_UP, cameraSpeed);
+        input_camera.ProcessKeyboard(MOUSE_UP, cameraSpeed);
     if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
-        ourcamera.ProcessKeyboard(MOUSE_DOWN, cameraSpeed);
+        input_camera.ProcessKeyboard(MOUSE_DOWN, cameraSpeed);
     
     if (glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS)
         init_wave = true;
+
+    static bool f5_was_pressed = false, f6_was_pressed = false, f9_was_pressed = false;
+    if (keyPressedOnce(window, GLFW_KEY_F5, f5_was_pressed))
+        toggle_camera_recording = true;
+    if (keyPressedOnce(window, GLFW_KEY_F6, f6_was_pressed))
+        toggle_camera_playback = true;
+    if (keyPressedOnce(window, GLFW_KEY_F9, f9_was_pressed))
+        dump_cpu_trace = true;
 }
 
 #endif /* callbacks_h */
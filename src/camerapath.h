@@ -0,0 +1,184 @@
+//
+//  camerapath.h
+//  opengl_test
+//
+
+#ifndef camerapath_h
+#define camerapath_h
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+
+#include "camera.h"
+
+// One camera pose at a point in time (seconds since the path start)
+struct CameraKey
+{
+    float time;
+    glm::vec3 position;
+    float yaw;
+    float pitch;
+    float zoom;
+};
+
+// Camera pose timeline. Recording samples the camera once per frame at a
+// fixed timestep, playback evaluates the path at frame * timestep, so a path
+// replays the same views whatever the actual frame rate. The interval between
+// two keys is a segment; frame times are accumulated per segment.
+class CameraPath
+{
+public:
+    static const uint32_t MAGIC = 0x48545043; // "CPTH"
+    static const uint32_t VERSION = 1;
+
+    std::vector<CameraKey> keys;
+    float timestep = 1.0f / 60.0f;
+
+    bool recording = false;
+    bool playing = false;
+    int frame = 0;
+
+    // Per-segment frame time totals of the current playback
+    std::vector<double> segment_ms;
+    std::vector<int> segment_frames;
+
+    void addKey(float time, glm::vec3 position, float yaw, float pitch, float zoom = ZOOM) {
+        keys.push_back({time, position, yaw, pitch, zoom});
+    }
+
+    float duration() const {
+        return keys.empty() ? 0.0f : keys.back().time;
+    }
+
+    int numFrames() const {
+        return (int)(duration() / timestep) + 1;
+    }
+
+    int numSegments() const {
+        return std::max((int)keys.size() - 1, 1);
+    }
+
+    void startRecording() {
+        keys.clear();
+        frame = 0;
+        recording = true;
+        playing = false;
+    }
+
+    void record(const Camera& camera) {
+        if (!recording) return;
+        addKey(frame * timestep, camera.Position, camera.Yaw, camera.Pitch, camera.Zoom);
+        frame++;
+    }
+
+    void startPlayback() {
+        if (keys.empty()) return;
+        frame = 0;
+        playing = true;
+        recording = false;
+        segment_ms.assign(numSegments(), 0.0);
+        segment_frames.assign(numSegments(), 0);
+    }
+
+    // Segment the given time falls in
+    int segmentAt(float time) const {
+        int segment = 0;
+        while (segment + 2 < (int)keys.size() && keys[segment + 1].time <= time)
+            segment++;
+        return segment;
+    }
+
+    // Poses the camera at frame * timestep; false once past the end of the path
+    bool evaluate(int at_frame, Camera& camera) const {
+        if (keys.empty()) return false;
+        float time = at_frame * timestep;
+        if (time > duration() + 0.5f * timestep) return false;
+
+        int segment = segmentAt(time);
+        CameraKey a = keys[segment];
+        CameraKey b = keys[std::min(segment + 1, (int)keys.size() - 1)];
+        float t = b.time > a.time ? glm::clamp((time - a.time) / (b.time - a.time), 0.0f, 1.0f) : 0.0f;
+
+        camera.Position = glm::mix(a.position, b.position, t);
+        camera.Yaw = glm::mix(a.yaw, b.yaw, t);
+        camera.Pitch = glm::mix(a.pitch, b.pitch, t);
+        camera.Zoom = glm::mix(a.zoom, b.zoom, t);
+        camera.updateCameraVectors();
+        return true;
+    }
+
+    // Advances playback by one frame; stops (and returns false) at the end
+    bool play(Camera& camera) {
+        if (!playing) return false;
+        if (!evaluate(frame, camera)) {
+            playing = false;
+            return false;
+        }
+        frame++;
+        return true;
+    }
+
+    // Attributes the frame time of the frame last played to its segment
+    void reportFrame(float ms) {
+        if (frame == 0 || segment_ms.empty()) return;
+        int segment = segmentAt((frame - 1) * timestep);
+        segment_ms[segment] += ms;
+        segment_frames[segment]++;
+    }
+
+    void printSegments() const {
+        for (int segment = 0; segment < (int)segment_ms.size(); segment++) {
+            if (segment_frames[segment] == 0) continue;
+            printf("Camera path segment %d: %d frames, avg %.3f ms\n",
+                   segment, segment_frames[segment], segment_ms[segment] / segment_frames[segment]);
+        }
+    }
+
+    // Binary layout: magic, version, key count, timestep, then 7 floats per key
+    bool save(const std::string& path) const {
+        std::ofstream f(path, std::ios::binary);
+        if (!f) return false;
+        uint32_t count = (uint32_t)keys.size();
+        f.write((const char*)&MAGIC, sizeof(uint32_t));
+        f.write((const char*)&VERSION, sizeof(uint32_t));
+        f.write((const char*)&count, sizeof(uint32_t));
+        f.write((const char*)&timestep, sizeof(float));
+        for (const CameraKey& key : keys) {
+            float packed[7] = {key.time, key.position.x, key.position.y, key.position.z, key.yaw, key.pitch, key.zoom};
+            f.write((const char*)packed, sizeof(packed));
+        }
+        return (bool)f;
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream f(path, std::ios::binary);
+        if (!f) {
+            std::cout << "ERROR::CAMERA_PATH::Cannot open " << path << std::endl;
+            return false;
+        }
+        uint32_t magic = 0, version = 0, count = 0;
+        f.read((char*)&magic, sizeof(uint32_t));
+        f.read((char*)&version, sizeof(uint32_t));
+        f.read((char*)&count, sizeof(uint32_t));
+        f.read((char*)&timestep, sizeof(float));
+        if (!f || magic != MAGIC || version != VERSION) {
+            std::cout << "ERROR::CAMERA_PATH::Not a camera path file: " << path << std::endl;
+            return false;
+        }
+        keys.clear();
+        for (uint32_t i = 0; i < count; i++) {
+            float packed[7];
+            f.read((char*)packed, sizeof(packed));
+            if (!f) return false;
+            addKey(packed[0], glm::vec3(packed[1], packed[2], packed[3]), packed[4], packed[5], packed[6]);
+        }
+        return true;
+    }
+};
+
+#endif /* camerapath_h */
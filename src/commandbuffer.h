@@ -0,0 +1,123 @@
+//
+//  commandbuffer.h
+//  opengl_test
+//
+
+#ifndef commandbuffer_h
+#define commandbuffer_h
+
+#include <glad/glad.h>
+#include <vector>
+#include <algorithm>
+
+#include "cpuprofiler.h"
+#include "jobs.h"
+#include "glstate.h"
+
+// Draw calls recorded without GL, on any thread, and replayed in order on the
+// thread that holds the context
+class CommandBuffer
+{
+public:
+    void clear() {
+        commands.clear();
+    }
+
+    void bindProgram(unsigned int program) {
+        commands.push_back({ BIND_PROGRAM, program, 0 });
+    }
+    // 2D texture on unit
+    void bindTexture(unsigned int unit, unsigned int texture) {
+        commands.push_back({ BIND_TEXTURE, unit, texture });
+    }
+    // glDrawElements of count GL_UNSIGNED_INT indices from the start of the
+    // element buffer of vao
+    void drawElements(unsigned int vao, unsigned int count) {
+        commands.push_back({ DRAW_ELEMENTS, vao, count });
+    }
+
+    void replay() const {
+        for (const Command& command : commands) {
+            switch (command.op) {
+            case BIND_PROGRAM:
+                glstate.useProgram(command.a);
+                break;
+            case BIND_TEXTURE:
+                glstate.activeTexture(GL_TEXTURE0 + command.a);
+                glstate.bindTexture(GL_TEXTURE_2D, command.b);
+                break;
+            case DRAW_ELEMENTS:
+                glstate.bindVertexArray(command.a);
+                glDrawElements(GL_TRIANGLES, command.b, GL_UNSIGNED_INT, 0);
+                break;
+            }
+        }
+        // Same state as after Mesh::Draw
+        glstate.bindVertexArray(0);
+        glstate.activeTexture(GL_TEXTURE0);
+    }
+
+private:
+    enum Op { BIND_PROGRAM, BIND_TEXTURE, DRAW_ELEMENTS };
+    struct Command
+    {
+        Op op;
+        unsigned int a;
+        unsigned int b;
+    };
+    std::vector<Command> commands;
+};
+
+// The command buffers of one pass, one per chunk of its draws. Chunks are
+// recorded in parallel on the job system, replay waits for them and plays
+// them back in draw order. Buffers keep their memory from frame to frame.
+class CommandList
+{
+public:
+    ~CommandList() {
+        jobs.wait(recorded);
+    }
+
+    // body(buffer, first, last) records items [first, last) of count, in
+    // chunks of at least grain items. Returns before the chunks are recorded.
+    template<class F>
+    void record(unsigned int count, unsigned int grain, F body, const char* name = "Record commands") {
+        jobs.wait(recorded);
+        used = 0;
+        if (count == 0)
+            return;
+        unsigned int chunks = std::max(1u, std::min(count / std::max(grain, 1u), 4u * jobs.numThreads()));
+        unsigned int size = (count + chunks - 1) / chunks;
+        if (buffers.size() < chunks)
+            buffers.resize(chunks);
+        for (unsigned int first = 0; first < count; first += size) {
+            CommandBuffer* buffer = &buffers[used++];
+            unsigned int last = std::min(first + size, count);
+            jobs.run([buffer, body, first, last]() {
+                buffer->clear();
+                body(*buffer, first, last);
+            }, &recorded, name);
+        }
+    }
+
+    // Until the chunks queued by record() are recorded, e.g. before what
+    // they read changes
+    void wait() {
+        jobs.wait(recorded);
+    }
+
+    // On the GL thread
+    void replay() {
+        jobs.wait(recorded);
+        CPU_PROFILE_SCOPE("Replay commands");
+        for (unsigned int i = 0; i < used; i++)
+            buffers[i].replay();
+    }
+
+private:
+    std::vector<CommandBuffer> buffers;
+    unsigned int used = 0;
+    JobCounter recorded;
+};
+
+#endif /* commandbuffer_h */
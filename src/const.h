@@ -16,14 +16,37 @@ const unsigned int SCR_HEIGHT = 600;
 
 const unsigned int UI_WIDTH = 500;
 
+// Internal render resolution of the screen-space targets. Starts at the
+// window's framebuffer size and is changed by dynamic resolution scaling.
+unsigned int render_width = 2 * SCR_WIDTH;
+unsigned int render_height = 2 * SCR_HEIGHT;
+
+// Stencil classes written by the G-buffer pass, sky is the cleared 0
+const int STENCIL_OPAQUE = 1;
+const int STENCIL_MIRROR = 2;
+
+// Temporal accumulation: SSAO kernel taps per frame and the frames it takes
+// to cycle the 64 tap kernel, weight of the current frame for reflections
+const int SSAO_TEMPORAL_TAPS = 8;
+const int SSAO_TEMPORAL_FRAMES = 64 / SSAO_TEMPORAL_TAPS;
+const float SSR_TEMPORAL_ALPHA = 0.2f;
+
 // Camera
 Camera ourcamera(glm::vec3(0.0f, 0.0f, 5.0f));
+// Moved by the input and the UI on the main thread; ourcamera is the copy the
+// frame being rendered uses
+Camera input_camera = ourcamera;
 
 float lastX = SCR_WIDTH / 2.0f;
 float lastY = SCR_HEIGHT / 2.0f;
 bool firstMouse = true;
 
 bool init_wave = false;
+// Set by F9, the main loop writes the CPU trace and clears it
+bool dump_cpu_trace = false;
+// Set by F5 / F6, start or stop camera path recording / playback
+bool toggle_camera_recording = false;
+bool toggle_camera_playback = false;
 
 // C++ 20 has support for pi
 constexpr double pi = 3.14159265358979323846;
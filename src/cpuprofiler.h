@@ -0,0 +1,133 @@
+//
+//  cpuprofiler.h
+//  opengl_test
+//
+
+#ifndef cpuprofiler_h
+#define cpuprofiler_h
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A completed scope: name must be a string literal (only the pointer is kept)
+struct CpuEvent
+{
+    const char* name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+// Fixed-size event ring owned by one thread. Recording is a couple of clock
+// reads and a store, no locks and no allocation; the oldest events are
+// overwritten once the ring is full.
+struct CpuEventRing
+{
+    static const uint32_t SIZE = 1 << 16;
+
+    std::vector<CpuEvent> events;
+    uint32_t head = 0;
+    uint32_t count = 0;
+    uint32_t thread_index;
+
+    CpuEventRing(uint32_t in_thread_index) : events(SIZE), thread_index(in_thread_index) {}
+
+    void push(const char* name, uint64_t start_ns, uint64_t duration_ns) {
+        events[head] = {name, start_ns, duration_ns};
+        head = (head + 1) & (SIZE - 1);
+        if (count < SIZE) count++;
+    }
+};
+
+// Scoped CPU markers with Chrome trace (chrome://tracing, Perfetto) export.
+// Each thread records into its own thread_local ring, registered once on first
+// use; only registration and export take the lock.
+class CpuProfiler
+{
+public:
+    static inline bool enabled = true;
+    // Innermost open scope of the calling thread, nullptr outside any. Kept
+    // whether or not recording is enabled, the heap tracker reads it.
+    static inline thread_local const char* current_scope = nullptr;
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    static void record(const char* name, uint64_t start_ns, uint64_t end_ns) {
+        threadRing().push(name, start_ns, end_ns - start_ns);
+    }
+
+    // Writes every recorded event as complete ("X") events, timestamps in us.
+    // Reads the other threads' rings without synchronization: only call it
+    // while no other thread records, e.g. with the render thread joined and
+    // after JobSystem::waitIdle.
+    static bool dumpChromeTrace(const std::string& path) {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        std::ofstream file(path);
+        if (!file) return false;
+
+        file << "{\"traceEvents\":[\n";
+        bool first = true;
+        for (CpuEventRing* ring : rings) {
+            uint32_t start = ring->count < CpuEventRing::SIZE ? 0 : ring->head;
+            for (uint32_t i = 0; i < ring->count; i++) {
+                const CpuEvent& e = ring->events[(start + i) & (CpuEventRing::SIZE - 1)];
+                file << (first ? "" : ",\n")
+                     << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->thread_index
+                     << ",\"ts\":" << e.start_ns / 1000.0 << ",\"dur\":" << e.duration_ns / 1000.0 << "}";
+                first = false;
+            }
+        }
+        file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        return true;
+    }
+
+private:
+    static inline const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    static inline std::mutex rings_mutex;
+    static inline std::vector<CpuEventRing*> rings;
+
+    static CpuEventRing& threadRing() {
+        // Rings are never freed so a trace can still be dumped after a worker exits
+        thread_local CpuEventRing* ring = nullptr;
+        if (ring == nullptr) {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            ring = new CpuEventRing((uint32_t)rings.size());
+            rings.push_back(ring);
+        }
+        return *ring;
+    }
+};
+
+class CpuScope
+{
+public:
+    CpuScope(const char* in_name) : name(in_name), parent(CpuProfiler::current_scope) {
+        CpuProfiler::current_scope = name;
+        if (CpuProfiler::enabled) start_ns = CpuProfiler::now();
+    }
+
+    ~CpuScope() {
+        if (CpuProfiler::enabled && start_ns != 0)
+            CpuProfiler::record(name, start_ns, CpuProfiler::now());
+        CpuProfiler::current_scope = parent;
+    }
+
+private:
+    const char* name;
+    const char* parent;
+    uint64_t start_ns = 0;
+};
+
+#define CPU_PROFILE_CONCAT_(a, b) a##b
+#define CPU_PROFILE_CONCAT(a, b) CPU_PROFILE_CONCAT_(a, b)
+// Times the enclosing scope, e.g. CPU_PROFILE_SCOPE("Shadow pass");
+#define CPU_PROFILE_SCOPE(name) CpuScope CPU_PROFILE_CONCAT(cpu_profile_scope_, __LINE__)(name)
+
+#endif /* cpuprofiler_h */
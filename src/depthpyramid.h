@@ -0,0 +1,95 @@
+//
+//  depthpyramid.h
+//  opengl_test
+//
+
+#ifndef depthpyramid_h
+#define depthpyramid_h
+
+#include <vector>
+#include <algorithm>
+
+#include "shader_s.h"
+#include "objects.h"
+
+// Min/max depth mip chain (r = min, g = max). Level 0 copies one channel of a
+// depth texture, each further level bounds the 2x2 texels of the level above,
+// so a single fetch tells whether a region is entirely in front of or behind
+// a given depth.
+class DepthPyramid
+{
+public:
+    unsigned int texture;
+    int width;
+    int height;
+    int levels;
+    std::vector<unsigned int> FBOs;
+    std::vector<glm::ivec2> sizes;
+
+    DepthPyramid(int in_width, int in_height, const char* label) {
+        width = in_width;
+        height = in_height;
+        levels = 1;
+        while ((width >> levels) > 0 || (height >> levels) > 0)
+            levels++;
+
+        texture = genMinMaxPyramidTexture(width, height, levels, "Depth pyramid", label);
+
+        int w = width, h = height;
+        for (int level = 0; level < levels; level++) {
+            unsigned int FBO;
+            glGenFramebuffers(1, &FBO);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, level);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                std::cerr << "ERROR::FRAMEBUFFER:: Depth pyramid level " << level << " is not complete!" << std::endl;
+            FBOs.push_back(FBO);
+            sizes.push_back(glm::ivec2(w, h));
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+    };
+    ~DepthPyramid() {
+        glstate.deleteFramebuffers((GLsizei)FBOs.size(), FBOs.data());
+        gpumemory.deleteTextures(1, &texture);
+    };
+
+    // Rebuild every level from the given depth texture. Leaves the viewport
+    // at the size of the coarsest level, callers restore their own.
+    void build(Shader& initshader, Shader& reduceshader, Quads& quads, unsigned int depth_texture, int channel = 0)
+    {
+        glstate.disable(GL_DEPTH_TEST);
+        glstate.disable(GL_BLEND);
+
+        // Level 0
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, FBOs[0]);
+        glViewport(0, 0, sizes[0].x, sizes[0].y);
+        initshader.use();
+        initshader.setInt("depthMap", 0);
+        initshader.setInt("channel", channel);
+        glstate.activeTexture(GL_TEXTURE0);
+        glstate.bindTexture(GL_TEXTURE_2D, depth_texture);
+        quads.render();
+
+        // Each level only sees the level above it, so the level being written
+        // is never sampled at the same time
+        reduceshader.use();
+        reduceshader.setInt("pyramid", 0);
+        glstate.editTexture(GL_TEXTURE_2D, texture);
+        for (int level = 1; level < levels; level++) {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, FBOs[level]);
+            glViewport(0, 0, sizes[level].x, sizes[level].y);
+            quads.render();
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+        glstate.enable(GL_BLEND);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+};
+
+#endif /* depthpyramid_h */
@@ -0,0 +1,122 @@
+//
+//  gl4ext.h
+//  opengl_test
+//
+
+#ifndef gl4ext_h
+#define gl4ext_h
+
+#include <glad/glad.h>
+
+#include <iostream>
+#include <string>
+
+// Entry points newer than the GL 3.3 core profile glad was generated for.
+// They are loaded by hand after gladLoadGLLoader and each group is flagged
+// only when the context provides it (macOS stops at 4.1), callers keep a
+// GL 3.3 path for when it is not.
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+#ifndef GL_SHADER_STORAGE_BUFFER
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#endif
+#ifndef GL_TEXTURE_FETCH_BARRIER_BIT
+#define GL_TEXTURE_FETCH_BARRIER_BIT 0x00000008
+#endif
+#ifndef GL_SHADER_STORAGE_BARRIER_BIT
+#define GL_SHADER_STORAGE_BARRIER_BIT 0x00002000
+#endif
+#ifndef GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT 0x00000001
+#endif
+#ifndef GL_COMMAND_BARRIER_BIT
+#define GL_COMMAND_BARRIER_BIT 0x00000040
+#endif
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+#ifndef GL_PARAMETER_BUFFER
+#define GL_PARAMETER_BUFFER 0x80EE
+#endif
+#ifndef GL_BUFFER
+#define GL_BUFFER 0x82E0
+#endif
+
+typedef void (APIENTRYP PFNGL4DISPATCHCOMPUTEPROC)(GLuint num_groups_x, GLuint num_groups_y, GLuint num_groups_z);
+typedef void (APIENTRYP PFNGL4MEMORYBARRIERPROC)(GLbitfield barriers);
+typedef void (APIENTRYP PFNGL4DRAWARRAYSINDIRECTPROC)(GLenum mode, const void *indirect);
+typedef void (APIENTRYP PFNGL4DRAWELEMENTSINDIRECTPROC)(GLenum mode, GLenum type, const void *indirect);
+typedef void (APIENTRYP PFNGL4MULTIDRAWARRAYSINDIRECTPROC)(GLenum mode, const void *indirect, GLsizei drawcount, GLsizei stride);
+typedef void (APIENTRYP PFNGL4MULTIDRAWELEMENTSINDIRECTPROC)(GLenum mode, GLenum type, const void *indirect, GLsizei drawcount, GLsizei stride);
+typedef void (APIENTRYP PFNGL4MULTIDRAWARRAYSINDIRECTCOUNTPROC)(GLenum mode, const void *indirect, GLintptr drawcount, GLsizei maxdrawcount, GLsizei stride);
+typedef void (APIENTRYP PFNGL4MULTIDRAWELEMENTSINDIRECTCOUNTPROC)(GLenum mode, GLenum type, const void *indirect, GLintptr drawcount, GLsizei maxdrawcount, GLsizei stride);
+typedef void (APIENTRYP PFNGL4OBJECTLABELPROC)(GLenum identifier, GLuint name, GLsizei length, const GLchar *label);
+
+struct GL4Functions
+{
+    // 4.3: compute shaders, shader storage buffers
+    bool compute = false;
+    PFNGL4DISPATCHCOMPUTEPROC DispatchCompute = nullptr;
+    PFNGL4MEMORYBARRIERPROC MemoryBarrier = nullptr;
+    // 4.3: draw parameters from a GL_DRAW_INDIRECT_BUFFER (base instance included)
+    bool indirect = false;
+    PFNGL4DRAWARRAYSINDIRECTPROC DrawArraysIndirect = nullptr;
+    PFNGL4DRAWELEMENTSINDIRECTPROC DrawElementsIndirect = nullptr;
+    PFNGL4MULTIDRAWARRAYSINDIRECTPROC MultiDrawArraysIndirect = nullptr;
+    PFNGL4MULTIDRAWELEMENTSINDIRECTPROC MultiDrawElementsIndirect = nullptr;
+    // 4.6 or ARB_indirect_parameters: draw count from a GL_PARAMETER_BUFFER
+    bool indirect_count = false;
+    PFNGL4MULTIDRAWARRAYSINDIRECTCOUNTPROC MultiDrawArraysIndirectCount = nullptr;
+    PFNGL4MULTIDRAWELEMENTSINDIRECTCOUNTPROC MultiDrawElementsIndirectCount = nullptr;
+    // 4.3 or KHR_debug: names shown by debuggers, null when not available
+    PFNGL4OBJECTLABELPROC ObjectLabel = nullptr;
+};
+
+GL4Functions gl4;
+
+bool hasGLVersion(int major, int minor)
+{
+    return GLVersion.major > major || (GLVersion.major == major && GLVersion.minor >= minor);
+}
+
+bool hasGLExtension(const char* name)
+{
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+        if (std::string((const char*)glGetStringi(GL_EXTENSIONS, i)) == name)
+            return true;
+    }
+    return false;
+}
+
+// Call once the context is current and glad is loaded
+void loadGL4Functions(GLADloadproc load)
+{
+    if (hasGLVersion(4, 3)) {
+        gl4.DispatchCompute = (PFNGL4DISPATCHCOMPUTEPROC)load("glDispatchCompute");
+        gl4.MemoryBarrier = (PFNGL4MEMORYBARRIERPROC)load("glMemoryBarrier");
+        gl4.compute = gl4.DispatchCompute != nullptr && gl4.MemoryBarrier != nullptr;
+        gl4.DrawArraysIndirect = (PFNGL4DRAWARRAYSINDIRECTPROC)load("glDrawArraysIndirect");
+        gl4.DrawElementsIndirect = (PFNGL4DRAWELEMENTSINDIRECTPROC)load("glDrawElementsIndirect");
+        gl4.MultiDrawArraysIndirect = (PFNGL4MULTIDRAWARRAYSINDIRECTPROC)load("glMultiDrawArraysIndirect");
+        gl4.MultiDrawElementsIndirect = (PFNGL4MULTIDRAWELEMENTSINDIRECTPROC)load("glMultiDrawElementsIndirect");
+        gl4.indirect = gl4.DrawArraysIndirect != nullptr && gl4.DrawElementsIndirect != nullptr
+            && gl4.MultiDrawArraysIndirect != nullptr && gl4.MultiDrawElementsIndirect != nullptr;
+    }
+    // Some loaders return non-null for any name, so the extension is checked
+    if (gl4.indirect && (hasGLVersion(4, 6) || hasGLExtension("GL_ARB_indirect_parameters"))) {
+        const char* suffix = hasGLVersion(4, 6) ? "" : "ARB";
+        gl4.MultiDrawArraysIndirectCount = (PFNGL4MULTIDRAWARRAYSINDIRECTCOUNTPROC)load((std::string("glMultiDrawArraysIndirectCount") + suffix).c_str());
+        gl4.MultiDrawElementsIndirectCount = (PFNGL4MULTIDRAWELEMENTSINDIRECTCOUNTPROC)load((std::string("glMultiDrawElementsIndirectCount") + suffix).c_str());
+        gl4.indirect_count = gl4.MultiDrawArraysIndirectCount != nullptr && gl4.MultiDrawElementsIndirectCount != nullptr;
+    }
+    if (hasGLVersion(4, 3) || hasGLExtension("GL_KHR_debug"))
+        gl4.ObjectLabel = (PFNGL4OBJECTLABELPROC)load("glObjectLabel");
+    std::cout << "OpenGL " << GLVersion.major << "." << GLVersion.minor
+              << (gl4.compute ? ", compute shaders available" : ", no compute shaders")
+              << (gl4.indirect_count ? ", indirect draw count available" : "") << std::endl;
+}
+
+#endif /* gl4ext_h */
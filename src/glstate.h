@@ -0,0 +1,281 @@
+//
+//  glstate.h
+//  opengl_test
+//
+
+#ifndef glstate_h
+#define glstate_h
+
+#include <glad/glad.h>
+
+// Calls the cache sees, per kind
+enum GLStateCall
+{
+    GL_STATE_PROGRAM,
+    GL_STATE_VERTEX_ARRAY,
+    GL_STATE_ACTIVE_TEXTURE,
+    GL_STATE_TEXTURE,
+    GL_STATE_FRAMEBUFFER,
+    GL_STATE_CAPABILITY,
+    GL_STATE_DEPTH,
+    GL_STATE_BLEND,
+    GL_STATE_NUM_CALLS
+};
+
+const char* const GL_STATE_CALL_NAMES[GL_STATE_NUM_CALLS] = {
+    "Program", "Vertex array", "Active texture", "Texture", "Framebuffer",
+    "Enable/disable", "Depth func/mask", "Blend func"
+};
+
+// Calls between two calls of GLStateCache::frameStats: issued to GL, and
+// dropped because the state was already set
+struct GLStateStats
+{
+    int issued[GL_STATE_NUM_CALLS] = {};
+    int elided[GL_STATE_NUM_CALLS] = {};
+
+    int totalIssued() const {
+        int total = 0;
+        for (int count : issued) total += count;
+        return total;
+    }
+    int totalElided() const {
+        int total = 0;
+        for (int count : elided) total += count;
+        return total;
+    }
+};
+
+// Shadow copy of the program, vertex array, texture, framebuffer, depth and
+// blend state, dropping the calls that would not change it. Every call that
+// changes that state has to go through here, or be followed by invalidate().
+// The active texture unit is only set once a bind on it is issued, so after a
+// bind the unit is not necessarily active: code that then edits the texture
+// with glTex* binds it with editTexture. Objects are deleted through here too,
+// so that a recycled name is not taken for still bound.
+//
+// Only used on the thread that holds the GL context.
+class GLStateCache
+{
+public:
+    GLStateCache() {
+        invalidate();
+    }
+
+    // Forgets everything, e.g. after code that binds behind the cache
+    void invalidate() {
+        program = UNKNOWN;
+        vertex_array = UNKNOWN;
+        active_unit = UNKNOWN;
+        unit = 0;
+        for (auto& targets : textures)
+            for (GLuint& texture : targets)
+                texture = UNKNOWN;
+        draw_framebuffer = UNKNOWN;
+        read_framebuffer = UNKNOWN;
+        for (int& value : capabilities)
+            value = -1;
+        depth_func = UNKNOWN;
+        depth_mask = -1;
+        blend_src = UNKNOWN;
+        blend_dst = UNKNOWN;
+    }
+
+    void useProgram(GLuint id) {
+        if (id == program)
+            return elide(GL_STATE_PROGRAM);
+        program = id;
+        issue(GL_STATE_PROGRAM);
+        glUseProgram(id);
+    }
+
+    void bindVertexArray(GLuint id) {
+        if (id == vertex_array)
+            return elide(GL_STATE_VERTEX_ARRAY);
+        vertex_array = id;
+        issue(GL_STATE_VERTEX_ARRAY);
+        glBindVertexArray(id);
+    }
+
+    // Unit of the following binds, made active when one of them is issued
+    void activeTexture(GLenum texture_unit) {
+        unit = texture_unit - GL_TEXTURE0;
+    }
+
+    void bindTexture(GLenum target, GLuint texture) {
+        int slot = targetSlot(target);
+        if (slot < 0 || unit >= MAX_UNITS) {
+            syncActiveUnit();
+            issue(GL_STATE_TEXTURE);
+            glBindTexture(target, texture);
+            return;
+        }
+        if (textures[unit][slot] == texture)
+            return elide(GL_STATE_TEXTURE);
+        syncActiveUnit();
+        textures[unit][slot] = texture;
+        issue(GL_STATE_TEXTURE);
+        glBindTexture(target, texture);
+    }
+
+    // bindTexture for glTex* calls: the unit is active when it returns
+    void editTexture(GLenum target, GLuint texture) {
+        syncActiveUnit();
+        bindTexture(target, texture);
+    }
+
+    void bindFramebuffer(GLenum target, GLuint framebuffer) {
+        bool draw = target != GL_READ_FRAMEBUFFER;
+        bool read = target != GL_DRAW_FRAMEBUFFER;
+        if ((!draw || draw_framebuffer == framebuffer) && (!read || read_framebuffer == framebuffer))
+            return elide(GL_STATE_FRAMEBUFFER);
+        if (draw) draw_framebuffer = framebuffer;
+        if (read) read_framebuffer = framebuffer;
+        issue(GL_STATE_FRAMEBUFFER);
+        glBindFramebuffer(target, framebuffer);
+    }
+
+    void enable(GLenum capability) {
+        setCapability(capability, true);
+    }
+    void disable(GLenum capability) {
+        setCapability(capability, false);
+    }
+
+    void depthFunc(GLenum func) {
+        if (func == depth_func)
+            return elide(GL_STATE_DEPTH);
+        depth_func = func;
+        issue(GL_STATE_DEPTH);
+        glDepthFunc(func);
+    }
+
+    void depthMask(GLboolean flag) {
+        if (flag == depth_mask)
+            return elide(GL_STATE_DEPTH);
+        depth_mask = flag;
+        issue(GL_STATE_DEPTH);
+        glDepthMask(flag);
+    }
+
+    void blendFunc(GLenum src, GLenum dst) {
+        if (src == blend_src && dst == blend_dst)
+            return elide(GL_STATE_BLEND);
+        blend_src = src;
+        blend_dst = dst;
+        issue(GL_STATE_BLEND);
+        glBlendFunc(src, dst);
+    }
+
+    void deleteProgram(GLuint id) {
+        if (id == program)
+            program = UNKNOWN;
+        glDeleteProgram(id);
+    }
+
+    void deleteVertexArrays(GLsizei n, const GLuint* ids) {
+        for (GLsizei i = 0; i < n; i++)
+            if (ids[i] == vertex_array)
+                vertex_array = UNKNOWN;
+        glDeleteVertexArrays(n, ids);
+    }
+
+    void deleteTextures(GLsizei n, const GLuint* ids) {
+        for (GLsizei i = 0; i < n; i++)
+            for (auto& targets : textures)
+                for (GLuint& texture : targets)
+                    if (texture == ids[i])
+                        texture = UNKNOWN;
+        glDeleteTextures(n, ids);
+    }
+
+    void deleteFramebuffers(GLsizei n, const GLuint* ids) {
+        for (GLsizei i = 0; i < n; i++) {
+            if (ids[i] == draw_framebuffer) draw_framebuffer = UNKNOWN;
+            if (ids[i] == read_framebuffer) read_framebuffer = UNKNOWN;
+        }
+        glDeleteFramebuffers(n, ids);
+    }
+
+    // Counts since the previous call
+    GLStateStats frameStats() {
+        GLStateStats result = stats;
+        stats = GLStateStats();
+        return result;
+    }
+
+private:
+    static const GLuint UNKNOWN = ~0u;
+    static const unsigned int MAX_UNITS = 32;
+    enum { TEXTURE_2D, TEXTURE_CUBE_MAP, TEXTURE_BUFFER, NUM_TARGETS };
+    static const int NUM_CAPABILITIES = 4;
+
+    GLuint program;
+    GLuint vertex_array;
+    // Unit active in GL, and the unit binds go to
+    unsigned int active_unit;
+    unsigned int unit;
+    GLuint textures[MAX_UNITS][NUM_TARGETS];
+    GLuint draw_framebuffer;
+    GLuint read_framebuffer;
+    // 0 or 1, -1 unknown
+    int capabilities[NUM_CAPABILITIES];
+    GLenum depth_func;
+    int depth_mask;
+    GLenum blend_src;
+    GLenum blend_dst;
+
+    GLStateStats stats;
+
+    void issue(GLStateCall call) {
+        stats.issued[call]++;
+    }
+    void elide(GLStateCall call) {
+        stats.elided[call]++;
+    }
+
+    void syncActiveUnit() {
+        if (unit == active_unit)
+            return elide(GL_STATE_ACTIVE_TEXTURE);
+        active_unit = unit;
+        issue(GL_STATE_ACTIVE_TEXTURE);
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    static int targetSlot(GLenum target) {
+        switch (target) {
+        case GL_TEXTURE_2D: return TEXTURE_2D;
+        case GL_TEXTURE_CUBE_MAP: return TEXTURE_CUBE_MAP;
+        case GL_TEXTURE_BUFFER: return TEXTURE_BUFFER;
+        default: return -1;
+        }
+    }
+
+    static int capabilitySlot(GLenum capability) {
+        switch (capability) {
+        case GL_DEPTH_TEST: return 0;
+        case GL_BLEND: return 1;
+        case GL_CULL_FACE: return 2;
+        case GL_STENCIL_TEST: return 3;
+        default: return -1;
+        }
+    }
+
+    void setCapability(GLenum capability, bool on) {
+        int slot = capabilitySlot(capability);
+        if (slot >= 0 && capabilities[slot] == (int)on)
+            return elide(GL_STATE_CAPABILITY);
+        if (slot >= 0)
+            capabilities[slot] = on;
+        issue(GL_STATE_CAPABILITY);
+        if (on)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+};
+
+// The renderer's GL state, for the context in use
+GLStateCache glstate;
+
+#endif /* glstate_h */
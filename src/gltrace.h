@@ -0,0 +1,366 @@
+//
+//  gltrace.h
+//  opengl_test
+//
+
+#ifndef gltrace_h
+#define gltrace_h
+
+#include <glad/glad.h>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <algorithm>
+#include <unordered_map>
+
+#include "gl4ext.h"
+
+// GL call statistics, counted by wrappers swapped into the glad function
+// pointers (and those of gl4) once they are loaded. Built with GL_TRACE only,
+// which CMake defines outside of Release builds; without it the stats stay
+// empty and no call is wrapped.
+
+// Kinds of entry points
+enum GLCallKind
+{
+    GL_CALL_DRAW,
+    GL_CALL_DISPATCH,
+    GL_CALL_UNIFORM,
+    GL_CALL_BIND,
+    GL_CALL_STATE,
+    // Return GL state or results to the CPU: the driver has to catch up first
+    GL_CALL_SYNC,
+    // Object creation, uploads and vertex formats
+    GL_CALL_RESOURCE,
+    GL_CALL_OTHER,
+    GL_CALL_NUM_KINDS
+};
+
+const char* const GL_CALL_KIND_NAMES[GL_CALL_NUM_KINDS] = {
+    "draws", "dispatches", "uniforms", "binds", "state", "sync", "resource", "other"
+};
+
+// Entry points that are wrapped: X(name, kind) for glad's glad_gl<name>,
+// X4 for gl4.<name>
+#define GL_TRACE_ENTRY_POINTS(X, X4) \
+    X(DrawArrays, GL_CALL_DRAW) \
+    X(DrawElements, GL_CALL_DRAW) \
+    X(DrawArraysInstanced, GL_CALL_DRAW) \
+    X(DrawElementsInstanced, GL_CALL_DRAW) \
+    X4(DrawArraysIndirect, GL_CALL_DRAW) \
+    X4(DrawElementsIndirect, GL_CALL_DRAW) \
+    X4(MultiDrawArraysIndirect, GL_CALL_DRAW) \
+    X4(MultiDrawElementsIndirect, GL_CALL_DRAW) \
+    X4(MultiDrawArraysIndirectCount, GL_CALL_DRAW) \
+    X4(MultiDrawElementsIndirectCount, GL_CALL_DRAW) \
+    X4(DispatchCompute, GL_CALL_DISPATCH) \
+    X(Uniform1i, GL_CALL_UNIFORM) \
+    X(Uniform1f, GL_CALL_UNIFORM) \
+    X(Uniform2f, GL_CALL_UNIFORM) \
+    X(Uniform3f, GL_CALL_UNIFORM) \
+    X(Uniform3i, GL_CALL_UNIFORM) \
+    X(Uniform4f, GL_CALL_UNIFORM) \
+    X(UniformMatrix4fv, GL_CALL_UNIFORM) \
+    X(UniformBlockBinding, GL_CALL_UNIFORM) \
+    X(UseProgram, GL_CALL_BIND) \
+    X(BindVertexArray, GL_CALL_BIND) \
+    X(ActiveTexture, GL_CALL_BIND) \
+    X(BindTexture, GL_CALL_BIND) \
+    X(BindFramebuffer, GL_CALL_BIND) \
+    X(BindRenderbuffer, GL_CALL_BIND) \
+    X(BindBuffer, GL_CALL_BIND) \
+    X(BindBufferBase, GL_CALL_BIND) \
+    X(Enable, GL_CALL_STATE) \
+    X(Disable, GL_CALL_STATE) \
+    X(DepthFunc, GL_CALL_STATE) \
+    X(DepthMask, GL_CALL_STATE) \
+    X(BlendFunc, GL_CALL_STATE) \
+    X(ColorMask, GL_CALL_STATE) \
+    X(StencilFunc, GL_CALL_STATE) \
+    X(StencilMask, GL_CALL_STATE) \
+    X(StencilOp, GL_CALL_STATE) \
+    X(Viewport, GL_CALL_STATE) \
+    X(ClearColor, GL_CALL_STATE) \
+    X(DrawBuffer, GL_CALL_STATE) \
+    X(ReadBuffer, GL_CALL_STATE) \
+    X(PixelStorei, GL_CALL_STATE) \
+    X4(MemoryBarrier, GL_CALL_STATE) \
+    X(GetUniformLocation, GL_CALL_SYNC) \
+    X(GetUniformBlockIndex, GL_CALL_SYNC) \
+    X(CheckFramebufferStatus, GL_CALL_SYNC) \
+    X(GetIntegerv, GL_CALL_SYNC) \
+    X(GetError, GL_CALL_SYNC) \
+    X(GetQueryObjectiv, GL_CALL_SYNC) \
+    X(GetQueryObjectuiv, GL_CALL_SYNC) \
+    X(GetQueryObjectui64v, GL_CALL_SYNC) \
+    X(ReadPixels, GL_CALL_SYNC) \
+    X(GetTexImage, GL_CALL_SYNC) \
+    X(Finish, GL_CALL_SYNC) \
+    X(TexImage2D, GL_CALL_RESOURCE) \
+    X(TexParameteri, GL_CALL_RESOURCE) \
+    X(TexParameterfv, GL_CALL_RESOURCE) \
+    X(TexBuffer, GL_CALL_RESOURCE) \
+    X(GenerateMipmap, GL_CALL_RESOURCE) \
+    X(BufferData, GL_CALL_RESOURCE) \
+    X(BufferSubData, GL_CALL_RESOURCE) \
+    X(FramebufferTexture2D, GL_CALL_RESOURCE) \
+    X(FramebufferRenderbuffer, GL_CALL_RESOURCE) \
+    X(RenderbufferStorage, GL_CALL_RESOURCE) \
+    X(DrawBuffers, GL_CALL_RESOURCE) \
+    X(GenTextures, GL_CALL_RESOURCE) \
+    X(GenBuffers, GL_CALL_RESOURCE) \
+    X(GenFramebuffers, GL_CALL_RESOURCE) \
+    X(GenRenderbuffers, GL_CALL_RESOURCE) \
+    X(GenVertexArrays, GL_CALL_RESOURCE) \
+    X(VertexAttribPointer, GL_CALL_RESOURCE) \
+    X(VertexAttribIPointer, GL_CALL_RESOURCE) \
+    X(VertexAttribDivisor, GL_CALL_RESOURCE) \
+    X(EnableVertexAttribArray, GL_CALL_RESOURCE) \
+    X(Clear, GL_CALL_OTHER) \
+    X(ClearBufferfv, GL_CALL_OTHER) \
+    X(BlitFramebuffer, GL_CALL_OTHER) \
+    X(QueryCounter, GL_CALL_OTHER) \
+    X(BeginQuery, GL_CALL_OTHER) \
+    X(EndQuery, GL_CALL_OTHER)
+
+#define GL_TRACE_ENUM(name, kind) GL_ENTRY_##name,
+enum GLEntryPoint
+{
+    GL_TRACE_ENTRY_POINTS(GL_TRACE_ENUM, GL_TRACE_ENUM)
+    GL_NUM_ENTRY_POINTS
+};
+#undef GL_TRACE_ENUM
+
+#define GL_TRACE_NAME(name, kind) "gl" #name,
+const char* const GL_ENTRY_NAMES[GL_NUM_ENTRY_POINTS] = {
+    GL_TRACE_ENTRY_POINTS(GL_TRACE_NAME, GL_TRACE_NAME)
+};
+#undef GL_TRACE_NAME
+
+#define GL_TRACE_KIND(name, kind) kind,
+constexpr GLCallKind GL_ENTRY_KINDS[GL_NUM_ENTRY_POINTS] = {
+    GL_TRACE_ENTRY_POINTS(GL_TRACE_KIND, GL_TRACE_KIND)
+};
+#undef GL_TRACE_KIND
+
+// Calls of one frame, by entry point and by pass (the GPU profiler passes,
+// innermost open one)
+struct GLCallStats
+{
+    // Indices past the passes: calls outside of any
+    static const int MAX_PASSES = 32;
+    static const int OUTSIDE_PASSES = MAX_PASSES;
+
+    struct Pass
+    {
+        int calls[GL_CALL_NUM_KINDS] = {};
+        // Binds and state calls setting what was already set
+        int redundant = 0;
+        // Of the direct draws, indirect ones are counted on the GPU
+        long long triangles = 0;
+
+        int totalCalls() const {
+            int total = 0;
+            for (int count : calls) total += count;
+            return total;
+        }
+        void add(const Pass& other) {
+            for (int i = 0; i < GL_CALL_NUM_KINDS; i++)
+                calls[i] += other.calls[i];
+            redundant += other.redundant;
+            triangles += other.triangles;
+        }
+    };
+
+    int calls[GL_NUM_ENTRY_POINTS] = {};
+    int redundant[GL_NUM_ENTRY_POINTS] = {};
+    Pass passes[MAX_PASSES + 1];
+
+    Pass total() const {
+        Pass result;
+        for (const Pass& pass : passes)
+            result.add(pass);
+        return result;
+    }
+
+    void add(const GLCallStats& other) {
+        for (int i = 0; i < GL_NUM_ENTRY_POINTS; i++) {
+            calls[i] += other.calls[i];
+            redundant[i] += other.redundant[i];
+        }
+        for (int i = 0; i <= MAX_PASSES; i++)
+            passes[i].add(other.passes[i]);
+    }
+};
+
+class GLTrace
+{
+public:
+#ifdef GL_TRACE
+    static const bool ENABLED = true;
+#else
+    static const bool ENABLED = false;
+#endif
+
+    GLTrace() {
+        last_state.reserve(1024);
+    }
+
+    // Once glad and gl4 are loaded, on the thread holding the context
+    void install();
+
+    // Called by GpuProfiler around its passes
+    void beginPass(int pass) {
+        if (depth < MAX_DEPTH)
+            stack[depth] = pass;
+        depth++;
+    }
+    void endPass(int pass) {
+        // Closes the innermost open scope of this pass, like GpuProfiler
+        for (int i = (depth < MAX_DEPTH ? depth : MAX_DEPTH) - 1; i >= 0; i--) {
+            if (stack[i] == pass) {
+                depth = i;
+                return;
+            }
+        }
+    }
+
+    // Counts since the previous call
+    GLCallStats frameStats() {
+        GLCallStats result = stats;
+        stats = GLCallStats();
+        return result;
+    }
+
+    // Called by the wrappers
+    template<int Id, class... Args>
+    void record(Args... args) {
+        GLCallStats::Pass& pass = stats.passes[currentPass()];
+        stats.calls[Id]++;
+        pass.calls[GL_ENTRY_KINDS[Id]]++;
+        if constexpr (GL_ENTRY_KINDS[Id] == GL_CALL_DRAW)
+            pass.triangles += drawTriangles<Id>(args...);
+        if constexpr (GL_ENTRY_KINDS[Id] == GL_CALL_BIND || GL_ENTRY_KINDS[Id] == GL_CALL_STATE) {
+            if (setState<Id>(args...)) {
+                stats.redundant[Id]++;
+                pass.redundant++;
+            }
+        }
+    }
+
+private:
+    static const int MAX_DEPTH = 16;
+    int stack[MAX_DEPTH];
+    int depth = 0;
+    GLCallStats stats;
+    // Last arguments of the state entry points, by state slot
+    std::unordered_map<uint64_t, uint64_t> last_state;
+    GLenum active_texture = GL_TEXTURE0;
+
+    int currentPass() const {
+        int pass = depth > 0 ? stack[(depth < MAX_DEPTH ? depth : MAX_DEPTH) - 1] : GLCallStats::OUTSIDE_PASSES;
+        return pass >= 0 && pass < GLCallStats::MAX_PASSES ? pass : GLCallStats::OUTSIDE_PASSES;
+    }
+
+    static long long primitives(GLenum mode, GLsizei count, GLsizei instances) {
+        switch (mode) {
+        case GL_TRIANGLES: return (long long)(count / 3) * instances;
+        case GL_TRIANGLE_STRIP:
+        case GL_TRIANGLE_FAN: return (long long)std::max(count - 2, 0) * instances;
+        default: return 0;
+        }
+    }
+
+    template<int Id, class... Args>
+    static long long drawTriangles(Args... args) {
+        std::tuple<Args...> a(args...);
+        if constexpr (Id == GL_ENTRY_DrawArrays)
+            return primitives(std::get<0>(a), std::get<2>(a), 1);
+        else if constexpr (Id == GL_ENTRY_DrawElements)
+            return primitives(std::get<0>(a), std::get<1>(a), 1);
+        else if constexpr (Id == GL_ENTRY_DrawArraysInstanced)
+            return primitives(std::get<0>(a), std::get<2>(a), std::get<3>(a));
+        else if constexpr (Id == GL_ENTRY_DrawElementsInstanced)
+            return primitives(std::get<0>(a), std::get<1>(a), std::get<4>(a));
+        else
+            return 0;
+    }
+
+    template<class T>
+    static uint64_t bits(T value) {
+        uint64_t result = 0;
+        std::memcpy(&result, &value, std::min(sizeof(T), sizeof(result)));
+        return result;
+    }
+
+    // Whether the call sets what the previous call of the same state slot
+    // set. Slots are the entry point alone, plus the first argument for the
+    // entry points that select state with it (bind target, capability,
+    // pname) and the index of indexed buffer binds; texture binds also go by
+    // unit, and glEnable and glDisable share theirs. Elsewhere the first
+    // argument is part of the value: glColorMask(0, ...) then
+    // glColorMask(1, ...) changes one slot.
+    template<int Id, class... Args>
+    bool setState(Args... args) {
+        uint64_t value = 14695981039346656037ull;
+        ((value = (value ^ bits(args)) * 1099511628211ull), ...);
+        int slot_entry = Id == GL_ENTRY_Disable ? GL_ENTRY_Enable : Id;
+        if constexpr (Id == GL_ENTRY_Enable || Id == GL_ENTRY_Disable)
+            value = (value << 1) | (Id == GL_ENTRY_Enable);
+        uint64_t key = (uint64_t)slot_entry << 56;
+        if constexpr (Id == GL_ENTRY_BindTexture || Id == GL_ENTRY_BindBuffer || Id == GL_ENTRY_BindBufferBase ||
+                      Id == GL_ENTRY_BindFramebuffer || Id == GL_ENTRY_BindRenderbuffer ||
+                      Id == GL_ENTRY_Enable || Id == GL_ENTRY_Disable || Id == GL_ENTRY_PixelStorei)
+            key |= bits(std::get<0>(std::tuple<Args...>(args...))) & 0xffffffffull;
+        if constexpr (Id == GL_ENTRY_BindBufferBase)
+            key |= (bits(std::get<1>(std::tuple<Args...>(args...))) & 0xffffffull) << 32;
+        if constexpr (Id == GL_ENTRY_ActiveTexture)
+            active_texture = (GLenum)std::get<0>(std::tuple<Args...>(args...));
+        if constexpr (Id == GL_ENTRY_BindTexture)
+            key |= (uint64_t)(active_texture - GL_TEXTURE0) << 32;
+        auto found = last_state.find(key);
+        if (found != last_state.end() && found->second == value)
+            return true;
+        last_state[key] = value;
+        return false;
+    }
+};
+
+// The renderer's GL call statistics
+GLTrace gltrace;
+
+#ifdef GL_TRACE
+template<int Id, class F>
+struct GLTraceHook;
+
+template<int Id, class R, class... Args>
+struct GLTraceHook<Id, R (APIENTRYP)(Args...)>
+{
+    static inline R (APIENTRYP original)(Args...) = nullptr;
+
+    static R APIENTRY call(Args... args) {
+        gltrace.record<Id>(args...);
+        return original(args...);
+    }
+
+    static void install(R (APIENTRYP &slot)(Args...)) {
+        // Missing entry points stay missing, installing twice is a no-op
+        if (slot == nullptr || slot == &call)
+            return;
+        original = slot;
+        slot = &call;
+    }
+};
+
+void GLTrace::install() {
+#define GL_TRACE_HOOK(name, kind) GLTraceHook<GL_ENTRY_##name, decltype(glad_gl##name)>::install(glad_gl##name);
+#define GL_TRACE_HOOK4(name, kind) GLTraceHook<GL_ENTRY_##name, decltype(gl4.name)>::install(gl4.name);
+    GL_TRACE_ENTRY_POINTS(GL_TRACE_HOOK, GL_TRACE_HOOK4)
+#undef GL_TRACE_HOOK
+#undef GL_TRACE_HOOK4
+}
+#else
+void GLTrace::install() {}
+#endif
+
+#endif /* gltrace_h */
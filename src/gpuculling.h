@@ -0,0 +1,285 @@
+//
+//  gpuculling.h
+//  opengl_test
+//
+
+#ifndef gpuculling_h
+#define gpuculling_h
+
+#include <vector>
+
+#include "shader_s.h"
+#include "objects.h"
+#include "model.h"
+#include "gl4ext.h"
+#include "gpumemory.h"
+
+// Object-space box of one culled item and the command it draws with, must
+// match shader/culling/cull.comp
+struct CullItem
+{
+    glm::vec4 bounds_min;
+    glm::vec4 bounds_max;
+    unsigned int command;
+    unsigned int padding[3];
+};
+static_assert(sizeof(CullItem) == 48, "CullItem must match the std430 layout of cull.comp");
+
+const char* const FRUSTUM_PLANE_NAMES[6] = {
+    "frustumPlanes[0]", "frustumPlanes[1]", "frustumPlanes[2]",
+    "frustumPlanes[3]", "frustumPlanes[4]", "frustumPlanes[5]"
+};
+
+// GPU-driven visibility of one list of draws: the instances of an Objects
+// list, with one indirect command per forEachBatch batch, or the meshes of a
+// Model, with one command each. A compute pass tests every item's box against
+// the frustum and a Hi-Z pyramid (DepthPyramid, g = farthest depth) and bumps
+// the instance count of its command; surviving instances are copied into a
+// compacted InstanceData buffer drawn with base instances. The CPU only
+// issues one indirect draw per batch or mesh, whatever the object count.
+//
+// Culling runs in two phases. Phase 0 tests against last frame's pyramid
+// through last frame's view-projection and draws what passes; the pyramid is
+// rebuilt from that depth and phase 1 re-tests only what phase 0 found
+// occluded, which catches what was disoccluded this frame. Each phase has its
+// own commands and instance slots, so phase 1 never writes what the draws of
+// phase 0 read.
+class GpuCulling
+{
+public:
+    // Must match shader/culling/*.comp
+    static const int COMPUTE_GROUP_SIZE = 64;
+    static const int NUM_PHASES = 2;
+
+    // Transform of the Model's meshes
+    glm::mat4 model_matrix = glm::mat4(1.0f);
+    unsigned int num_items = 0;
+    unsigned int num_commands = 0;
+
+    static bool supported() {
+        return gl4.compute && gl4.indirect;
+    }
+
+    explicit GpuCulling(Objects& in_objects) : objects(&in_objects) {
+        genBuffers();
+        rebuild();
+    }
+    GpuCulling(Model& in_model, glm::mat4 in_model_matrix) : model(&in_model) {
+        model_matrix = in_model_matrix;
+        genBuffers();
+        rebuild();
+    }
+    ~GpuCulling() {
+        unsigned int buffers[6] = { itemBuffer, flagBuffer, commandBuffer, drawBuffer, countBuffer, culledBuffer };
+        gpumemory.deleteBuffers(6, buffers);
+    }
+    GpuCulling(const GpuCulling&) = delete;
+    GpuCulling& operator=(const GpuCulling&) = delete;
+
+    // Fills the commands of a phase. view_projection gives the frustum,
+    // occlusion_view_projection the camera the bound pyramid was built with;
+    // without occlusion only the frustum is tested. The pyramid is read from
+    // the hiZ sampler of the shader.
+    void cull(Shader& shader, int phase, const glm::mat4& view_projection, glm::mat4 occlusion_view_projection, bool occlusion) {
+        if (objects != nullptr && objects->num != num_items)
+            rebuild();
+        if (num_items == 0)
+            return;
+        if (objects != nullptr)
+            objects->updateInstances();
+
+        // Zero instance counts and draw count of this phase
+        unsigned int stride = commandStride();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, phase * num_commands * stride * sizeof(unsigned int),
+                        num_commands * stride * sizeof(unsigned int), &command_templates[phase * num_commands * stride]);
+        unsigned int zero = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, phase * sizeof(unsigned int), sizeof(unsigned int), &zero);
+
+        shader.use();
+        shader.setInt("numItems", (int)num_items);
+        shader.setInt("phase", phase);
+        shader.setInt("commandStride", (int)stride);
+        shader.setInt("baseInstanceOffset", (int)stride - 1);
+        shader.setInt("commandOffset", phase * (int)num_commands);
+        shader.setInt("instanceWords", objects != nullptr ? (int)(sizeof(InstanceData) / sizeof(unsigned int)) : 0);
+        shader.setMat4f("model", model_matrix);
+        shader.setMat4f("occlusionViewProjection", occlusion_view_projection);
+        shader.setBool("occlusion", occlusion);
+        // Gribb-Hartmann planes, inside when dot(plane, (p, 1)) >= 0
+        for (int i = 0; i < 6; i++) {
+            int axis = i / 2;
+            float sign = i % 2 == 0 ? 1.0f : -1.0f;
+            glm::vec4 plane;
+            for (int column = 0; column < 4; column++)
+                plane[column] = view_projection[column][3] + sign * view_projection[column][axis];
+            shader.setVec4f(FRUSTUM_PLANE_NAMES[i], plane);
+        }
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, itemBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, flagBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, commandBuffer);
+        if (objects != nullptr) {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, objects->instanceVBO);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, culledBuffer);
+        }
+        gl4.DispatchCompute((num_items + COMPUTE_GROUP_SIZE - 1) / COMPUTE_GROUP_SIZE, 1, 1);
+        // Read as draw commands and instance attributes
+        gl4.MemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    // Packs the non-empty commands of a phase and counts them, for drawAll
+    // on contexts with gl4.indirect_count
+    void compact(Shader& shader, int phase) {
+        if (num_items == 0 || !gl4.indirect_count)
+            return;
+        shader.use();
+        shader.setInt("numCommands", (int)num_commands);
+        shader.setInt("commandStride", (int)commandStride());
+        shader.setInt("commandOffset", phase * (int)num_commands);
+        shader.setInt("phase", phase);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, commandBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, drawBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, countBuffer);
+        gl4.DispatchCompute(1, 1, 1);
+        gl4.MemoryBarrier(GL_COMMAND_BARRIER_BIT);
+    }
+
+    // One batch of the Objects list, in forEachBatch order, with whatever
+    // state the caller set for it
+    void drawBatch(int phase, unsigned int batch) {
+        if (num_items == 0)
+            return;
+        objects->bindInstanceBuffer(culledBuffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        const void* offset = (const void*)(size_t)((phase * num_commands + batch) * commandStride() * sizeof(unsigned int));
+        if (objects->indexed)
+            gl4.DrawElementsIndirect(objects->primitive, GL_UNSIGNED_INT, offset);
+        else
+            gl4.DrawArraysIndirect(objects->primitive, offset);
+    }
+
+    // Every batch of the Objects list in one call, for passes without per
+    // batch state. With an indirect count the GPU also decides how many
+    // commands there are (after compact), otherwise empty ones are skipped
+    // by the GPU at the cost of their command fetch.
+    void drawAll(int phase) {
+        if (num_items == 0)
+            return;
+        objects->bindInstanceBuffer(culledBuffer);
+        GLsizei stride = commandStride() * sizeof(unsigned int);
+        const void* offset = (const void*)(size_t)(phase * num_commands * stride);
+        if (gl4.indirect_count) {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, drawBuffer);
+            glBindBuffer(GL_PARAMETER_BUFFER, countBuffer);
+            GLintptr count_offset = phase * sizeof(unsigned int);
+            if (objects->indexed)
+                gl4.MultiDrawElementsIndirectCount(objects->primitive, GL_UNSIGNED_INT, offset, count_offset, num_commands, stride);
+            else
+                gl4.MultiDrawArraysIndirectCount(objects->primitive, offset, count_offset, num_commands, stride);
+        }
+        else {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+            if (objects->indexed)
+                gl4.MultiDrawElementsIndirect(objects->primitive, GL_UNSIGNED_INT, offset, num_commands, stride);
+            else
+                gl4.MultiDrawArraysIndirect(objects->primitive, offset, num_commands, stride);
+        }
+    }
+
+    // Every mesh of the Model with its own textures
+    void drawMeshes(Shader& shader, int phase) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        for (unsigned int i = 0; i < model->meshes.size(); i++)
+            model->meshes[i].DrawIndirect(shader, (phase * num_commands + i) * commandStride() * sizeof(unsigned int));
+    }
+
+private:
+    Objects* objects = nullptr;
+    Model* model = nullptr;
+    // Commands of both phases with zero instance counts
+    std::vector<unsigned int> command_templates;
+    unsigned int itemBuffer, flagBuffer, commandBuffer, drawBuffer, countBuffer, culledBuffer;
+
+    // DrawElementsIndirectCommand or DrawArraysIndirectCommand, in uints;
+    // the instance count is the second and the base instance the last
+    unsigned int commandStride() const {
+        return objects == nullptr || objects->indexed ? 5 : 4;
+    }
+
+    void genBuffers() {
+        glGenBuffers(1, &itemBuffer);
+        glGenBuffers(1, &flagBuffer);
+        glGenBuffers(1, &commandBuffer);
+        glGenBuffers(1, &drawBuffer);
+        glGenBuffers(1, &countBuffer);
+        glGenBuffers(1, &culledBuffer);
+    }
+
+    // Items and command templates of the current list
+    void rebuild() {
+        std::vector<CullItem> items;
+        std::vector<unsigned int> commands;
+        unsigned int stride = commandStride();
+        if (objects != nullptr) {
+            num_items = objects->num;
+            objects->forEachBatch([&](unsigned int first, unsigned int count) {
+                unsigned int batch = (unsigned int)(commands.size() / stride);
+                for (unsigned int i = first; i < first + count; i++)
+                    items.push_back({ glm::vec4(objects->bounds_min, 0.0f), glm::vec4(objects->bounds_max, 0.0f), batch, {0, 0, 0} });
+                // count, instance count, first vertex / index, (base vertex,) base instance
+                commands.push_back(objects->vertex_count);
+                commands.push_back(0);
+                commands.push_back(0);
+                if (objects->indexed)
+                    commands.push_back(0);
+                commands.push_back(first);
+            });
+        }
+        else {
+            num_items = (unsigned int)model->meshes.size();
+            for (unsigned int i = 0; i < num_items; i++) {
+                const Mesh& mesh = model->meshes[i];
+                items.push_back({ glm::vec4(mesh.aabb_min, 0.0f), glm::vec4(mesh.aabb_max, 0.0f), i, {0, 0, 0} });
+                unsigned int command[5] = { (unsigned int)mesh.indices.size(), 0, 0, 0, 0 };
+                commands.insert(commands.end(), command, command + 5);
+            }
+        }
+        num_commands = (unsigned int)(commands.size() / stride);
+        if (num_items == 0)
+            return;
+
+        // Phase 1 takes the instance slots after those of phase 0
+        command_templates = commands;
+        command_templates.insert(command_templates.end(), commands.begin(), commands.end());
+        if (objects != nullptr) {
+            for (unsigned int i = 0; i < num_commands; i++)
+                command_templates[(num_commands + i) * stride + stride - 1] += num_items;
+        }
+
+        std::vector<unsigned int> flags(num_items, 0);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, itemBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, items.size() * sizeof(CullItem), items.data(), GL_STATIC_DRAW);
+        gpumemory.buffer(itemBuffer, items.size() * sizeof(CullItem), "GPU culling", "items");
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, flagBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, flags.size() * sizeof(unsigned int), flags.data(), GL_DYNAMIC_COPY);
+        gpumemory.buffer(flagBuffer, flags.size() * sizeof(unsigned int), "GPU culling", "visibility flags");
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, command_templates.size() * sizeof(unsigned int), command_templates.data(), GL_DYNAMIC_COPY);
+        gpumemory.buffer(commandBuffer, command_templates.size() * sizeof(unsigned int), "GPU culling", "command templates");
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, command_templates.size() * sizeof(unsigned int), nullptr, GL_DYNAMIC_COPY);
+        gpumemory.buffer(drawBuffer, command_templates.size() * sizeof(unsigned int), "GPU culling", "draw commands");
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_PHASES * sizeof(unsigned int), nullptr, GL_DYNAMIC_COPY);
+        gpumemory.buffer(countBuffer, NUM_PHASES * sizeof(unsigned int), "GPU culling", "draw counts");
+        if (objects != nullptr) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, culledBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_PHASES * num_items * sizeof(InstanceData), nullptr, GL_DYNAMIC_COPY);
+            gpumemory.buffer(culledBuffer, NUM_PHASES * num_items * sizeof(InstanceData), "GPU culling", "culled instances");
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+};
+
+#endif /* gpuculling_h */
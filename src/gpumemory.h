@@ -0,0 +1,269 @@
+//
+//  gpumemory.h
+//  opengl_test
+//
+
+#ifndef gpumemory_h
+#define gpumemory_h
+
+#include <glad/glad.h>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#include "gl4ext.h"
+#include "glstate.h"
+
+enum GpuMemoryCategory
+{
+    // Sampled images: model textures, lookup tables
+    GPU_MEMORY_TEXTURES,
+    // Textures rendered to
+    GPU_MEMORY_RENDER_TARGETS,
+    GPU_MEMORY_BUFFERS,
+    GPU_MEMORY_RENDERBUFFERS,
+    GPU_MEMORY_NUM_CATEGORIES
+};
+
+const char* const GPU_MEMORY_CATEGORY_NAMES[GPU_MEMORY_NUM_CATEGORIES] = {
+    "Textures", "Render targets", "Buffers", "Renderbuffers"
+};
+
+// Live totals of the registry, plain data that can be copied to the thread
+// showing them
+struct GpuMemoryStats
+{
+    static const int MAX_OWNERS = 32;
+
+    struct Owner
+    {
+        const char* name = nullptr;
+        size_t bytes = 0;
+        int objects = 0;
+    };
+
+    size_t bytes[GPU_MEMORY_NUM_CATEGORIES] = {};
+    int objects[GPU_MEMORY_NUM_CATEGORIES] = {};
+    size_t total = 0;
+    size_t peak = 0;
+    // By owner in registration order, past MAX_OWNERS in the last one
+    Owner owners[MAX_OWNERS];
+    int num_owners = 0;
+};
+
+// Every texture, buffer and renderbuffer is recorded here once its storage is
+// specified, and again when it is re-specified (resized), with its format,
+// size, an estimate of the bytes it takes and who owns it. The owner is a
+// string literal (a module or pass), the label names the object; both are set
+// as its GL label where glObjectLabel is available, for debuggers. Objects
+// are deleted through here, what is still recorded at exit is reported.
+//
+// Only used on the thread that holds the GL context.
+class GpuMemory : public GpuMemoryStats
+{
+public:
+    ~GpuMemory() {
+        reportLeaks();
+    }
+
+    // levels 1 without mipmaps, layers 6 for cube maps
+    void texture(GLuint id, GpuMemoryCategory category, GLenum internalformat, int width, int height,
+                 int levels, int layers, const char* owner, const std::string& label) {
+        Allocation& allocation = record(GL_TEXTURE, id, category, owner, label);
+        allocation.format = internalformat;
+        allocation.width = width;
+        allocation.height = height;
+        allocation.levels = levels;
+        allocation.layers = layers;
+        update(allocation, textureBytes(allocation));
+    }
+
+    // New size of a recorded texture, same format and levels
+    void resizeTexture(GLuint id, int width, int height) {
+        auto found = allocations.find(key(GL_TEXTURE, id));
+        if (found == allocations.end())
+            return;
+        found->second.width = width;
+        found->second.height = height;
+        update(found->second, textureBytes(found->second));
+    }
+
+    void buffer(GLuint id, size_t bytes, const char* owner, const std::string& label) {
+        Allocation& allocation = record(GL_BUFFER, id, GPU_MEMORY_BUFFERS, owner, label);
+        allocation.width = (int)std::min<size_t>(bytes, INT32_MAX);
+        update(allocation, bytes);
+    }
+
+    void renderbuffer(GLuint id, GLenum internalformat, int width, int height, const char* owner, const std::string& label) {
+        Allocation& allocation = record(GL_RENDERBUFFER, id, GPU_MEMORY_RENDERBUFFERS, owner, label);
+        allocation.format = internalformat;
+        allocation.width = width;
+        allocation.height = height;
+        update(allocation, (size_t)width * height * bytesPerTexel(internalformat));
+    }
+
+    void deleteTextures(GLsizei n, const GLuint* ids) {
+        for (GLsizei i = 0; i < n; i++)
+            forget(GL_TEXTURE, ids[i]);
+        glstate.deleteTextures(n, ids);
+    }
+
+    void deleteBuffers(GLsizei n, const GLuint* ids) {
+        for (GLsizei i = 0; i < n; i++)
+            forget(GL_BUFFER, ids[i]);
+        glDeleteBuffers(n, ids);
+    }
+
+    void deleteRenderbuffers(GLsizei n, const GLuint* ids) {
+        for (GLsizei i = 0; i < n; i++)
+            forget(GL_RENDERBUFFER, ids[i]);
+        glDeleteRenderbuffers(n, ids);
+    }
+
+    // Warns once each time the total goes over budget_mb
+    void checkBudget(float budget_mb) {
+        bool over = total > (size_t)(budget_mb * 1024.0f * 1024.0f);
+        if (over && !over_budget)
+            std::cout << "GPU memory: " << total / (1024.0 * 1024.0) << " MB is over the budget of "
+                      << budget_mb << " MB" << std::endl;
+        over_budget = over;
+    }
+
+    // Allocations still recorded, by owner
+    void reportLeaks() const {
+        if (allocations.empty())
+            return;
+        std::vector<const Allocation*> leaks;
+        for (const auto& entry : allocations)
+            leaks.push_back(&entry.second);
+        std::sort(leaks.begin(), leaks.end(), [](const Allocation* a, const Allocation* b) {
+            int order = std::strcmp(a->owner, b->owner);
+            return order != 0 ? order < 0 : a->id < b->id;
+        });
+        std::cout << "GPU memory: " << leaks.size() << " objects (" << total / 1024 << " KB) were not released:" << std::endl;
+        for (const Allocation* leak : leaks) {
+            std::cout << "  " << leak->owner << ": " << leak->label << " ("
+                      << GPU_MEMORY_CATEGORY_NAMES[leak->category] << " " << leak->id;
+            if (leak->category != GPU_MEMORY_BUFFERS)
+                std::cout << ", " << leak->width << "x" << leak->height;
+            std::cout << ", " << leak->bytes / 1024 << " KB)" << std::endl;
+        }
+    }
+
+    // Estimate, formats with three components taken as padded to four
+    static size_t bytesPerTexel(GLenum internalformat) {
+        switch (internalformat) {
+        case GL_RED: case GL_R8: return 1;
+        case GL_R16F: case GL_RG8: return 2;
+        case GL_RGB: case GL_RGB8: case GL_RGBA: case GL_RGBA8: case GL_R32F: case GL_RG16F: return 4;
+        case GL_DEPTH_COMPONENT: case GL_DEPTH_COMPONENT24: case GL_DEPTH_COMPONENT32F: case GL_DEPTH24_STENCIL8: return 4;
+        case GL_RGB16F: case GL_RGBA16F: case GL_RG32F: return 8;
+        case GL_RGB32F: case GL_RGBA32F: return 16;
+        default: return 4;
+        }
+    }
+
+    // Levels of a full mip chain
+    static int mipLevels(int width, int height) {
+        int levels = 1;
+        while (width > 1 || height > 1) {
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+            levels++;
+        }
+        return levels;
+    }
+
+private:
+    struct Allocation
+    {
+        GLenum type = 0;
+        GLuint id = 0;
+        GpuMemoryCategory category = GPU_MEMORY_TEXTURES;
+        GLenum format = 0;
+        int width = 0, height = 0, levels = 1, layers = 1;
+        size_t bytes = 0;
+        const char* owner = "";
+        int owner_index = 0;
+        std::string label;
+    };
+    std::unordered_map<uint64_t, Allocation> allocations;
+    bool over_budget = false;
+
+    static uint64_t key(GLenum type, GLuint id) {
+        return (uint64_t)type << 32 | id;
+    }
+
+    static size_t textureBytes(const Allocation& allocation) {
+        size_t bytes = 0;
+        int width = allocation.width, height = allocation.height;
+        for (int level = 0; level < allocation.levels; level++) {
+            bytes += (size_t)width * height * bytesPerTexel(allocation.format);
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+        return bytes * allocation.layers;
+    }
+
+    int ownerIndex(const char* owner) {
+        for (int i = 0; i < num_owners; i++)
+            if (std::strcmp(owners[i].name, owner) == 0)
+                return i;
+        if (num_owners == MAX_OWNERS)
+            return MAX_OWNERS - 1;
+        owners[num_owners].name = owner;
+        return num_owners++;
+    }
+
+    Allocation& record(GLenum type, GLuint id, GpuMemoryCategory category, const char* owner, const std::string& label) {
+        auto found = allocations.find(key(type, id));
+        if (found != allocations.end())
+            return found->second;
+        Allocation& allocation = allocations[key(type, id)];
+        allocation.type = type;
+        allocation.id = id;
+        allocation.category = category;
+        allocation.owner = owner;
+        allocation.owner_index = ownerIndex(owner);
+        allocation.label = label;
+        objects[category]++;
+        owners[allocation.owner_index].objects++;
+        if (gl4.ObjectLabel != nullptr) {
+            std::string name = std::string(owner) + ": " + label;
+            gl4.ObjectLabel(type, id, -1, name.c_str());
+        }
+        return allocation;
+    }
+
+    void update(Allocation& allocation, size_t bytes) {
+        account(allocation, -(long long)allocation.bytes);
+        allocation.bytes = bytes;
+        account(allocation, (long long)bytes);
+        peak = std::max(peak, total);
+    }
+
+    void account(const Allocation& allocation, long long delta) {
+        bytes[allocation.category] += delta;
+        owners[allocation.owner_index].bytes += delta;
+        total += delta;
+    }
+
+    void forget(GLenum type, GLuint id) {
+        auto found = allocations.find(key(type, id));
+        if (found == allocations.end())
+            return;
+        account(found->second, -(long long)found->second.bytes);
+        objects[found->second.category]--;
+        owners[found->second.owner_index].objects--;
+        allocations.erase(found);
+    }
+};
+
+// The renderer's GPU allocations
+GpuMemory gpumemory;
+
+#endif /* gpumemory_h */
@@ -0,0 +1,273 @@
+//
+//  gpuprofiler.h
+//  opengl_test
+//
+
+#ifndef gpuprofiler_h
+#define gpuprofiler_h
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+
+#include "gltrace.h"
+
+// Passes timed by the GPU profiler
+enum GpuPass {
+    GPU_PASS_SHADOW,
+    GPU_PASS_DEPTH_PREPASS,
+    GPU_PASS_GBUFFER,
+    GPU_PASS_SSAO,
+    GPU_PASS_SSAO_BLUR,
+    GPU_PASS_SSAO_UPSAMPLE,
+    GPU_PASS_CULL,
+    GPU_PASS_HIZ,
+    GPU_PASS_SSR,
+    GPU_PASS_TEMPORAL,
+    GPU_PASS_LIGHT_ASSIGN,
+    GPU_PASS_DEFERRED,
+    GPU_PASS_SWE_ADVECT,
+    GPU_PASS_SWE_HEIGHT,
+    GPU_PASS_SWE_VELOCITY,
+    GPU_PASS_SWE_SWAP,
+    GPU_PASS_MODEL,
+    GPU_PASS_UPSCALE,
+    GPU_PASS_IMGUI,
+    GPU_PASS_FRAME,
+    GPU_PASS_COUNT
+};
+
+static_assert(GPU_PASS_COUNT <= GLCallStats::MAX_PASSES, "GL call statistics by pass");
+
+const char* const GPU_PASS_NAMES[GPU_PASS_COUNT] = {
+    "Shadow",
+    "Depth pre-pass",
+    "G-buffer",
+    "SSAO",
+    "SSAO blur",
+    "SSAO upsample",
+    "Culling",
+    "Hi-Z build",
+    "SSR",
+    "Temporal resolve",
+    "Light assignment",
+    "Deferred",
+    "SWE advect",
+    "SWE height",
+    "SWE velocity",
+    "SWE swap",
+    "Model draw",
+    "Upscale",
+    "ImGui",
+    "Frame"
+};
+
+// Rolling per-pass results of the GPU profiler, plain data that can be copied
+// to the thread showing them
+struct GpuTimings
+{
+    static const int HISTORY = 256;
+
+    // Rolling per-pass history in ms, -1 when the pass did not run that frame
+    float history[GPU_PASS_COUNT][HISTORY];
+    int history_head = 0;
+    int history_count = 0;
+    // Frames whose results were not ready when their queries had to be reused
+    int dropped_frames = 0;
+
+    GpuTimings() {
+        std::fill(&history[0][0], &history[0][0] + GPU_PASS_COUNT * HISTORY, -1.0f);
+    }
+
+    // Latest sample of a pass (ms), -1 if it did not run
+    float latest(int pass) const {
+        if (history_count == 0) return -1.0f;
+        return history[pass][(history_head + HISTORY - 1) % HISTORY];
+    }
+
+    // Min, average and 99th percentile over the frames in which the pass ran
+    bool stats(int pass, float& min, float& avg, float& p99) const {
+        // On the stack, the UI asks every frame
+        float samples[HISTORY];
+        int count = 0;
+        for (int i = 0; i < history_count; i++) {
+            float t = history[pass][i];
+            if (t >= 0.0f) samples[count++] = t;
+        }
+        if (count == 0) return false;
+        std::sort(samples, samples + count);
+        float sum = 0.0f;
+        for (int i = 0; i < count; i++) sum += samples[i];
+        min = samples[0];
+        avg = sum / count;
+        p99 = samples[std::min(count - 1, (int)(0.99f * count))];
+        return true;
+    }
+
+    // History of a pass in chronological order, frames where it did not run as 0
+    void timeline(int pass, float* out) const {
+        int start = history_count < HISTORY ? 0 : history_head;
+        for (int i = 0; i < history_count; i++)
+            out[i] = std::max(history[pass][(start + i) % HISTORY], 0.0f);
+    }
+
+    // Writes the per-pass stats to <path> and the rolling history to <path>.frames.csv
+    bool exportCSV(const std::string& path) const {
+        std::ofstream file(path);
+        if (!file) return false;
+        file << "pass,samples,min_ms,avg_ms,p99_ms\n";
+        for (int pass = 0; pass < GPU_PASS_COUNT; pass++) {
+            float min, avg, p99;
+            if (!stats(pass, min, avg, p99)) continue;
+            int samples = 0;
+            for (int i = 0; i < history_count; i++)
+                samples += history[pass][i] >= 0.0f;
+            file << GPU_PASS_NAMES[pass] << "," << samples << "," << min << "," << avg << "," << p99 << "\n";
+        }
+
+        std::ofstream frames_file(path + ".frames.csv");
+        if (!frames_file) return false;
+        frames_file << "frame";
+        for (int pass = 0; pass < GPU_PASS_COUNT; pass++)
+            frames_file << "," << GPU_PASS_NAMES[pass];
+        frames_file << "\n";
+        int start = history_count < HISTORY ? 0 : history_head;
+        for (int i = 0; i < history_count; i++) {
+            frames_file << i;
+            for (int pass = 0; pass < GPU_PASS_COUNT; pass++)
+                frames_file << "," << history[pass][(start + i) % HISTORY];
+            frames_file << "\n";
+        }
+        return true;
+    }
+};
+
+// Per-pass GPU timings from GL_TIMESTAMP queries. Every frame owns its own set
+// of queries, and a frame is only read back FRAMES_IN_FLIGHT frames later when
+// its results are available, so the CPU never waits on the GPU. Timestamps
+// (rather than GL_TIME_ELAPSED) allow passes to nest, e.g. model draws inside
+// the G-buffer pass, and a pass issued several times per frame is summed.
+class GpuProfiler : public GpuTimings
+{
+public:
+    static const int FRAMES_IN_FLIGHT = 4;
+    static const int MAX_SCOPES = 32;
+
+    bool enabled = true;
+
+    // Benchmark mode: block on late results instead of dropping the frame, and
+    // keep every collected frame (GPU_PASS_COUNT floats each) beyond the history
+    bool wait_for_results = false;
+    bool keep_log = false;
+    std::vector<float> log;
+
+    GpuProfiler() {
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+            frames[i].queries.resize(2 * MAX_SCOPES);
+            glGenQueries(2 * MAX_SCOPES, frames[i].queries.data());
+        }
+    }
+
+    void beginFrame() {
+        if (enabled) {
+            current = (current + 1) % FRAMES_IN_FLIGHT;
+            collect(frames[current]);
+            frames[current].num_scopes = 0;
+        }
+        begin(GPU_PASS_FRAME);
+    }
+
+    void endFrame() {
+        end(GPU_PASS_FRAME);
+    }
+
+    // Reads back all frames still in flight, waiting for the GPU
+    void flush() {
+        if (!enabled) return;
+        bool wait = wait_for_results;
+        wait_for_results = true;
+        for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+            current = (current + 1) % FRAMES_IN_FLIGHT;
+            collect(frames[current]);
+            frames[current].num_scopes = 0;
+        }
+        wait_for_results = wait;
+    }
+
+    // The GL call statistics go by the same passes, timers enabled or not
+    void begin(GpuPass pass) {
+        gltrace.beginPass(pass);
+        if (!enabled) return;
+        Frame& frame = frames[current];
+        if (frame.num_scopes == MAX_SCOPES) return;
+        int scope = frame.num_scopes++;
+        frame.passes[scope] = pass;
+        frame.closed[scope] = false;
+        frame.last_query = 2 * scope;
+        glQueryCounter(frame.queries[2 * scope], GL_TIMESTAMP);
+    }
+
+    void end(GpuPass pass) {
+        gltrace.endPass(pass);
+        if (!enabled) return;
+        // Close the innermost open scope of this pass
+        Frame& frame = frames[current];
+        for (int scope = frame.num_scopes - 1; scope >= 0; scope--) {
+            if (frame.passes[scope] == pass && !frame.closed[scope]) {
+                glQueryCounter(frame.queries[2 * scope + 1], GL_TIMESTAMP);
+                frame.closed[scope] = true;
+                frame.last_query = 2 * scope + 1;
+                return;
+            }
+        }
+    }
+
+private:
+    struct Frame {
+        std::vector<unsigned int> queries;
+        GpuPass passes[MAX_SCOPES];
+        bool closed[MAX_SCOPES];
+        int num_scopes = 0;
+        int last_query = 0;
+    };
+
+    Frame frames[FRAMES_IN_FLIGHT];
+    int current = 0;
+
+    // Reads back a frame issued FRAMES_IN_FLIGHT frames ago, if its results
+    // have landed. Queries complete in order, so checking the last issued one
+    // is enough.
+    void collect(Frame& frame) {
+        if (frame.num_scopes == 0) return;
+
+        GLint available = 0;
+        if (!wait_for_results)
+            glGetQueryObjectiv(frame.queries[frame.last_query], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!wait_for_results && !available) {
+            dropped_frames++;
+            return;
+        }
+
+        float times[GPU_PASS_COUNT];
+        std::fill(times, times + GPU_PASS_COUNT, -1.0f);
+        for (int scope = 0; scope < frame.num_scopes; scope++) {
+            if (!frame.closed[scope]) continue;
+            GLuint64 t0 = 0, t1 = 0;
+            glGetQueryObjectui64v(frame.queries[2 * scope], GL_QUERY_RESULT, &t0);
+            glGetQueryObjectui64v(frame.queries[2 * scope + 1], GL_QUERY_RESULT, &t1);
+            float ms = (float)(t1 - t0) * 1e-6f;
+            int pass = frame.passes[scope];
+            times[pass] = std::max(times[pass], 0.0f) + ms;
+        }
+
+        for (int pass = 0; pass < GPU_PASS_COUNT; pass++)
+            history[pass][history_head] = times[pass];
+        if (keep_log)
+            log.insert(log.end(), times, times + GPU_PASS_COUNT);
+        history_head = (history_head + 1) % HISTORY;
+        history_count = std::min(history_count + 1, HISTORY);
+    }
+};
+
+#endif /* gpuprofiler_h */
@@ -0,0 +1,237 @@
+//
+//  heaptracker.h
+//  opengl_test
+//
+
+#ifndef heaptracker_h
+#define heaptracker_h
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "cpuprofiler.h"
+
+// Heap activity between two calls of HeapTracker::frameStats, plain data that
+// can be copied to the thread showing it
+struct HeapStats
+{
+    static const int MAX_SCOPES = 8;
+
+    struct Scope
+    {
+        const char* name = nullptr;
+        int allocations = 0;
+        size_t bytes = 0;
+    };
+
+    int allocations = 0;
+    int frees = 0;
+    size_t bytes = 0;
+    // Scopes that allocated the most, most allocations first
+    Scope scopes[MAX_SCOPES];
+    int num_scopes = 0;
+};
+
+// Counts every operator new and delete of the process, aligned ones included,
+// in builds with HEAP_TRACK, which replaces them below. Allocations are
+// charged to the innermost CPU_PROFILE_SCOPE of the thread making them (jobs
+// are scopes of their own), so a frame that allocates through new says
+// where. The renderer is meant not to allocate at all once it reached a
+// steady state: with assert_no_alloc, such a frame reports its scopes and
+// aborts.
+//
+// Allocations of C code (malloc), ImGui's included, are not seen.
+class HeapTracker
+{
+public:
+#ifdef HEAP_TRACK
+    static const bool ENABLED = true;
+#else
+    static const bool ENABLED = false;
+#endif
+
+    bool assert_no_alloc = false;
+
+    // From the replaced operators, any thread, before main too
+    void allocated(size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        Slot& slot = slotFor(CpuProfiler::current_scope);
+        slot.allocations.fetch_add(1, std::memory_order_relaxed);
+        slot.bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void freed() {
+        frees.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Counts since the previous call. Allocates nothing itself.
+    HeapStats frameStats() {
+        HeapStats stats;
+        stats.allocations = allocations.exchange(0);
+        stats.frees = frees.exchange(0);
+        stats.bytes = bytes.exchange(0);
+        for (Slot& slot : slots) {
+            const char* name = slot.name.load(std::memory_order_acquire);
+            if (name == nullptr)
+                continue;
+            HeapStats::Scope scope;
+            scope.name = name;
+            scope.allocations = slot.allocations.exchange(0);
+            scope.bytes = slot.bytes.exchange(0);
+            if (scope.allocations > 0)
+                insertScope(stats, scope);
+        }
+        return stats;
+    }
+
+    // For a frame that should not have allocated
+    void assertNoAllocations(const HeapStats& stats, int frame) const {
+        if (!assert_no_alloc || stats.allocations == 0)
+            return;
+        std::cerr << "Heap: frame " << frame << " made " << stats.allocations << " allocations ("
+                  << stats.bytes << " bytes) in the steady state" << std::endl;
+        for (int i = 0; i < stats.num_scopes; i++)
+            std::cerr << "  " << stats.scopes[i].name << ": " << stats.scopes[i].allocations
+                      << " allocations, " << stats.scopes[i].bytes << " bytes" << std::endl;
+        std::abort();
+    }
+
+private:
+    // Open addressing on the scope name pointer (a string literal). Slots are
+    // claimed once and never freed, past SLOTS names go to the overflow slot.
+    static const int SLOTS = 256;
+    struct Slot
+    {
+        std::atomic<const char*> name{nullptr};
+        std::atomic<int> allocations{0};
+        std::atomic<size_t> bytes{0};
+    };
+    Slot slots[SLOTS];
+    Slot overflow;
+
+    std::atomic<int> allocations{0};
+    std::atomic<int> frees{0};
+    std::atomic<size_t> bytes{0};
+
+    Slot& slotFor(const char* scope) {
+        if (scope == nullptr)
+            scope = "Outside scopes";
+        size_t hash = (size_t)(uintptr_t)scope;
+        hash ^= hash >> 17;
+        for (int probe = 0; probe < SLOTS; probe++) {
+            Slot& slot = slots[(hash + probe) & (SLOTS - 1)];
+            const char* name = slot.name.load(std::memory_order_acquire);
+            if (name == scope)
+                return slot;
+            if (name == nullptr) {
+                if (slot.name.compare_exchange_strong(name, scope, std::memory_order_acq_rel) || name == scope)
+                    return slot;
+            }
+        }
+        overflow.name.store("Other scopes", std::memory_order_release);
+        return overflow;
+    }
+
+    static void insertScope(HeapStats& stats, const HeapStats::Scope& scope) {
+        int i = stats.num_scopes < HeapStats::MAX_SCOPES ? stats.num_scopes++ : HeapStats::MAX_SCOPES;
+        while (i > 0 && stats.scopes[i - 1].allocations < scope.allocations) {
+            if (i < HeapStats::MAX_SCOPES)
+                stats.scopes[i] = stats.scopes[i - 1];
+            i--;
+        }
+        if (i < HeapStats::MAX_SCOPES)
+            stats.scopes[i] = scope;
+    }
+};
+
+// The process' heap activity. Constant-initialized: operator new runs before
+// any dynamic initializer.
+constinit HeapTracker heaptracker;
+
+#ifdef HEAP_TRACK
+// Replacements of the global allocation functions, on malloc and
+// aligned_alloc (whose size must be a multiple of the alignment)
+void* operator new(size_t size) {
+    heaptracker.allocated(size);
+    if (void* p = std::malloc(size != 0 ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    heaptracker.allocated(size);
+    return std::malloc(size != 0 ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+void operator delete(void* p) noexcept {
+    if (p == nullptr)
+        return;
+    heaptracker.freed();
+    std::free(p);
+}
+void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    operator delete(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+    heaptracker.allocated(size);
+    size_t align = (size_t)alignment;
+    if (void* p = std::aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return operator new(size, alignment);
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return operator new(size, alignment, std::nothrow);
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+void operator delete[](void* p, std::align_val_t) noexcept {
+    operator delete(p);
+}
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    operator delete(p);
+}
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    operator delete(p);
+}
+#endif
+
+#endif /* heaptracker_h */
@@ -0,0 +1,503 @@
+//
+//  jobs.h
+//  opengl_test
+//
+
+#ifndef jobs_h
+#define jobs_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+#include "cpuprofiler.h"
+
+// A std::function<void()> that never allocates: the callable is stored in
+// place and has to fit in CAPACITY bytes, checked when it is compiled. Jobs
+// are queued every frame, so a capture that outgrows it should be passed by
+// pointer rather than the capacity raised. Move-only.
+class Job
+{
+public:
+    static const size_t CAPACITY = 96;
+
+    Job() {}
+    template<class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Job>>>
+    Job(F&& f) {
+        typedef std::decay_t<F> T;
+        static_assert(sizeof(T) <= CAPACITY, "Job captures do not fit in Job::CAPACITY");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Job captures are over-aligned");
+        new (storage) T(std::forward<F>(f));
+        ops = &OPS<T>;
+    }
+    Job(Job&& other) noexcept {
+        take(other);
+    }
+    Job& operator=(Job&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+    ~Job() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return ops != nullptr;
+    }
+    void operator()() const {
+        ops->call(const_cast<unsigned char*>(storage));
+    }
+
+private:
+    struct Ops
+    {
+        void (*call)(void*);
+        // Move-constructs into to and destroys from
+        void (*move)(void* to, void* from);
+        void (*destroy)(void*);
+    };
+    template<class T>
+    static constexpr Ops OPS = {
+        [](void* f) { (*static_cast<T*>(f))(); },
+        [](void* to, void* from) { new (to) T(std::move(*static_cast<T*>(from))); static_cast<T*>(from)->~T(); },
+        [](void* f) { static_cast<T*>(f)->~T(); }
+    };
+
+    alignas(std::max_align_t) unsigned char storage[CAPACITY];
+    const Ops* ops = nullptr;
+
+    void take(Job& other) {
+        if (other.ops != nullptr)
+            other.ops->move(storage, other.storage);
+        ops = other.ops;
+        other.ops = nullptr;
+    }
+    void reset() {
+        if (ops != nullptr)
+            ops->destroy(storage);
+        ops = nullptr;
+    }
+};
+
+// Jobs still to finish. wait() returns once it is back to zero; jobs queued
+// with runAfter start then. A counter can be reused once it reached zero.
+class JobCounter
+{
+public:
+    JobCounter() {}
+    JobCounter(const JobCounter&) = delete;
+    JobCounter& operator=(const JobCounter&) = delete;
+
+    bool done() const {
+        return count.load(std::memory_order_acquire) == 0;
+    }
+
+private:
+    friend class JobSystem;
+    struct Continuation
+    {
+        Job job;
+        JobCounter* counter;
+        const char* name;
+        bool main_thread;
+    };
+    std::atomic<int> count{0};
+    std::mutex mutex;
+    std::vector<Continuation> continuations;
+};
+
+// Scheduler activity between two calls of JobSystem::frameStats
+struct JobStats
+{
+    int threads = 0;
+    int jobs = 0;
+    int main_thread_jobs = 0;
+    int steals = 0;
+    // Time spent running jobs, all threads together, and by the main thread
+    float busy_ms = 0.0f;
+    float main_busy_ms = 0.0f;
+};
+
+// Work-stealing scheduler. Every thread, the main one included, owns a deque:
+// a thread pushes and pops its own jobs at the back (most recent first, while
+// their data is in cache) and idle threads steal from the front of the
+// others. Waiting on a counter runs jobs instead of blocking, so jobs can wait
+// on the jobs they spawn. GL calls are only valid on the main thread, where
+// the context is current: those jobs go to a queue of their own, run by the
+// main thread when it waits or calls runMainThreadJobs. When the context moves
+// to a render thread, that thread takes the role with setMainThread.
+//
+// Before start(), or with no workers, jobs run inline where they are queued.
+class JobSystem
+{
+public:
+    ~JobSystem() {
+        stop();
+    }
+
+    // From the main thread, which becomes thread 0. num_workers 0 picks one
+    // worker per remaining hardware thread.
+    void start(unsigned int num_workers = 0) {
+        if (!threads.empty())
+            return;
+        if (num_workers == 0)
+            num_workers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        queues.clear();
+        for (unsigned int i = 0; i <= num_workers; i++)
+            queues.push_back(std::make_unique<Queue>());
+        thread_index = 0;
+        main_thread = std::this_thread::get_id();
+        stopping = false;
+        workers = num_workers;
+        for (unsigned int i = 1; i <= num_workers; i++)
+            threads.emplace_back([this, i]() { workerLoop(i); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+        threads.clear();
+        workers = 0;
+    }
+
+    // The calling thread now runs the main thread jobs. It shares queue 0
+    // with the thread that started the system.
+    void setMainThread() {
+        thread_index = 0;
+        main_thread = std::this_thread::get_id();
+    }
+
+    int numThreads() const {
+        return (int)workers + 1;
+    }
+
+    // name is shown in the CPU trace and must be a string literal
+    void run(Job job, JobCounter* counter = nullptr, const char* name = "Job") {
+        if (counter != nullptr)
+            counter->count.fetch_add(1, std::memory_order_relaxed);
+        schedule(std::move(job), counter, name);
+    }
+
+    // For jobs that make GL calls
+    void runOnMainThread(Job job, JobCounter* counter = nullptr, const char* name = "Main thread job") {
+        if (counter != nullptr)
+            counter->count.fetch_add(1, std::memory_order_relaxed);
+        scheduleOnMain(std::move(job), counter, name);
+    }
+
+    // Queues job once dependency is done, right away if it already is
+    void runAfter(JobCounter& dependency, Job job, JobCounter* counter = nullptr, const char* name = "Job", bool on_main_thread = false) {
+        if (counter != nullptr)
+            counter->count.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(dependency.mutex);
+            if (!dependency.done()) {
+                dependency.continuations.push_back({std::move(job), counter, name, on_main_thread});
+                return;
+            }
+        }
+        if (on_main_thread)
+            scheduleOnMain(std::move(job), counter, name);
+        else
+            schedule(std::move(job), counter, name);
+    }
+
+    // body(first, last) over [begin, end) in chunks of at least grain items,
+    // a few per thread so that stealing can even them out
+    template<class F>
+    void parallelFor(unsigned int begin, unsigned int end, unsigned int grain, F body, JobCounter& counter, const char* name = "Parallel for") {
+        if (begin >= end)
+            return;
+        unsigned int chunks = std::max(1u, std::min((end - begin) / std::max(grain, 1u), 4u * numThreads()));
+        unsigned int size = (end - begin + chunks - 1) / chunks;
+        for (unsigned int first = begin; first < end; first += size) {
+            unsigned int last = std::min(first + size, end);
+            run([body, first, last]() { body(first, last); }, &counter, name);
+        }
+    }
+
+    // parallelFor and wait; a single chunk runs right here
+    template<class F>
+    void parallelFor(unsigned int begin, unsigned int end, unsigned int grain, F body, const char* name = "Parallel for") {
+        if (end - begin <= std::max(grain, 1u) || workers == 0) {
+            if (begin < end)
+                body(begin, end);
+            return;
+        }
+        JobCounter counter;
+        parallelFor(begin, end, grain, body, counter, name);
+        wait(counter);
+    }
+
+    // Runs queued jobs until counter is done
+    void wait(JobCounter& counter) {
+        while (!counter.done()) {
+            if (!runOne())
+                std::this_thread::yield();
+        }
+        // The last job may still hold the lock, the counter can be destroyed after
+        std::lock_guard<std::mutex> lock(counter.mutex);
+    }
+
+    // Runs jobs until none is queued or running on any thread, e.g. before
+    // reading what the workers write outside of jobs' counters. From the
+    // thread that runs the main thread jobs.
+    void waitIdle() {
+        while (queued.load(std::memory_order_acquire) > 0 || running.load(std::memory_order_acquire) > 0 || hasMainThreadJobs()) {
+            if (!runOne())
+                std::this_thread::yield();
+        }
+    }
+
+    // Drains the main thread queue, e.g. once a frame
+    void runMainThreadJobs() {
+        while (runMainThreadJob()) {}
+    }
+
+    // Counts since the previous call
+    JobStats frameStats() {
+        JobStats stats;
+        stats.threads = numThreads();
+        stats.jobs = jobs_run.exchange(0);
+        stats.main_thread_jobs = main_jobs_run.exchange(0);
+        stats.steals = steals.exchange(0);
+        stats.busy_ms = busy_ns.exchange(0) / 1e6f;
+        stats.main_busy_ms = main_busy_ns.exchange(0) / 1e6f;
+        return stats;
+    }
+
+private:
+    struct Task
+    {
+        Job job;
+        JobCounter* counter;
+        const char* name;
+    };
+    // Double-ended ring of tasks. It only grows, by doubling when full, so
+    // once it held a frame's worth of jobs queueing allocates nothing.
+    class TaskRing
+    {
+    public:
+        TaskRing() : tasks(INITIAL_SIZE) {}
+
+        bool empty() const {
+            return count == 0;
+        }
+        void push_back(Task&& task) {
+            if (count == tasks.size())
+                grow();
+            tasks[(head + count) & (tasks.size() - 1)] = std::move(task);
+            count++;
+        }
+        Task pop_back() {
+            count--;
+            return std::move(tasks[(head + count) & (tasks.size() - 1)]);
+        }
+        Task pop_front() {
+            Task task = std::move(tasks[head]);
+            head = (head + 1) & (tasks.size() - 1);
+            count--;
+            return task;
+        }
+
+    private:
+        static const size_t INITIAL_SIZE = 256;
+        std::vector<Task> tasks;
+        size_t head = 0;
+        size_t count = 0;
+
+        void grow() {
+            std::vector<Task> grown(2 * tasks.size());
+            for (size_t i = 0; i < count; i++)
+                grown[i] = std::move(tasks[(head + i) & (tasks.size() - 1)]);
+            tasks.swap(grown);
+            head = 0;
+        }
+    };
+    struct Queue
+    {
+        std::mutex mutex;
+        TaskRing tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    // Set before the threads start, which read it
+    unsigned int workers = 0;
+    // Workers read it, the role can move while they run
+    std::atomic<std::thread::id> main_thread;
+    std::mutex main_mutex;
+    TaskRing main_tasks;
+
+    // Tasks in the queues, to know when workers may sleep
+    std::atomic<int> queued{0};
+    // Tasks taken from the queues and not finished yet
+    std::atomic<int> running{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    std::atomic<int> jobs_run{0};
+    std::atomic<int> main_jobs_run{0};
+    std::atomic<int> steals{0};
+    std::atomic<uint64_t> busy_ns{0};
+    std::atomic<uint64_t> main_busy_ns{0};
+
+    // Queue of the calling thread, -1 for threads the system does not know
+    static inline thread_local int thread_index = -1;
+
+    bool onMainThread() const {
+        return workers == 0 || std::this_thread::get_id() == main_thread;
+    }
+
+    void schedule(Job job, JobCounter* counter, const char* name) {
+        if (workers == 0) {
+            execute({std::move(job), counter, name});
+            return;
+        }
+        Queue& queue = *queues[std::max(thread_index, 0)];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back({std::move(job), counter, name});
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        // Taking the lock orders this with a worker about to sleep
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        wake.notify_one();
+    }
+
+    void scheduleOnMain(Job job, JobCounter* counter, const char* name) {
+        if (workers == 0) {
+            execute({std::move(job), counter, name});
+            return;
+        }
+        std::lock_guard<std::mutex> lock(main_mutex);
+        main_tasks.push_back({std::move(job), counter, name});
+    }
+
+    // Own jobs newest first, then the oldest of another thread
+    bool runOne() {
+        if (onMainThread() && runMainThreadJob())
+            return true;
+        if (workers == 0)
+            return false;
+        int self = std::max(thread_index, 0);
+        Task task;
+        if (pop(*queues[self], task, false)) {
+            execute(std::move(task));
+            running.fetch_sub(1, std::memory_order_release);
+            return true;
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            if (pop(*queues[(self + i) % queues.size()], task, true)) {
+                steals.fetch_add(1, std::memory_order_relaxed);
+                execute(std::move(task));
+                running.fetch_sub(1, std::memory_order_release);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool hasMainThreadJobs() {
+        std::lock_guard<std::mutex> lock(main_mutex);
+        return !main_tasks.empty();
+    }
+
+    bool runMainThreadJob() {
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(main_mutex);
+            if (main_tasks.empty())
+                return false;
+            task = main_tasks.pop_front();
+        }
+        main_jobs_run.fetch_add(1, std::memory_order_relaxed);
+        execute(std::move(task));
+        return true;
+    }
+
+    bool pop(Queue& queue, Task& task, bool front) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        task = front ? queue.tasks.pop_front() : queue.tasks.pop_back();
+        // Counted as running before it stops counting as queued
+        running.fetch_add(1, std::memory_order_relaxed);
+        queued.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    void execute(Task task) {
+        uint64_t start = CpuProfiler::now();
+        {
+            CpuScope scope(task.name);
+            task.job();
+        }
+        uint64_t duration = CpuProfiler::now() - start;
+        busy_ns.fetch_add(duration, std::memory_order_relaxed);
+        if (thread_index <= 0)
+            main_busy_ns.fetch_add(duration, std::memory_order_relaxed);
+        jobs_run.fetch_add(1, std::memory_order_relaxed);
+        if (task.counter != nullptr)
+            finish(*task.counter);
+    }
+
+    void finish(JobCounter& counter) {
+        // Swapped with the counter's, both lists keep their capacity
+        thread_local std::vector<JobCounter::Continuation> continuations;
+        {
+            std::lock_guard<std::mutex> lock(counter.mutex);
+            if (counter.count.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+            if (counter.continuations.empty())
+                return;
+            continuations.swap(counter.continuations);
+        }
+        // A continuation can finish another counter on this thread
+        std::vector<JobCounter::Continuation> ready;
+        ready.swap(continuations);
+        for (JobCounter::Continuation& c : ready) {
+            if (c.main_thread)
+                scheduleOnMain(std::move(c.job), c.counter, c.name);
+            else
+                schedule(std::move(c.job), c.counter, c.name);
+        }
+        ready.clear();
+        continuations.swap(ready);
+    }
+
+    void workerLoop(int index) {
+        thread_index = index;
+        while (true) {
+            if (runOne())
+                continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this]() { return stopping || queued.load(std::memory_order_acquire) > 0; });
+            if (stopping)
+                return;
+        }
+    }
+};
+
+// The renderer's scheduler, started in main
+JobSystem jobs;
+
+#endif /* jobs_h */
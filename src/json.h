@@ -1,9 +1,15 @@
+#ifndef json_h
+#define json_h
+
 #include <string>
 #include <iostream>
 #include <fstream>
 
 #include <nlohmann/json.hpp>
 #include <glm/glm.hpp>
+#include <filesystem>
+
+#include "camerapath.h"
 
 using json = nlohmann::json;
 
@@ -15,9 +21,9 @@ public:
     glm::vec3 scale;
 };
 
-ModelData load_json()
+ModelData load_json(const std::string& path = "../settings/medieval_town_1.json")
 {
-    std::ifstream f("../settings/medieval_town_1.json");
+    std::ifstream f(path);
     json data = json::parse(f);
 
     if (data.contains("model")) {
@@ -37,4 +43,166 @@ ModelData load_json()
 
         return model_data;
     }
-}
\ No newline at end of file
+}
+
+// Benchmark scene: the "camera_settings" of a demo file plus a "bench" block
+// choosing what to render and for how long
+class BenchSettings
+{
+public:
+    std::string path;
+    int rendertype = 0;
+    int shadowtype = 0;
+    bool ssao = false;
+    int warmup_frames = 60;
+    int frames = 300;
+    std::string output = "bench_result.json";
+    float render_scale = 1.0f;
+    bool dynamic_resolution = false;
+    bool temporal = false;
+    // 0 full, 1 half, 2 quarter
+    int ssao_resolution = 0;
+    // 0 ssao, 1 gtao
+    int ao_technique = 0;
+    bool hiz_ssr = true;
+    bool stencil_lighting = true;
+    bool gpu_culling = false;
+    bool cpu_occlusion = false;
+    bool depth_prepass = false;
+    // GL context on a render thread fed one frame ahead
+    bool render_thread = false;
+    // Local lights of the deferred pass, 0 every light / 1 CPU / 2 compute clusters
+    int num_lights = 0;
+    int light_assignment = 2;
+    float frame_budget_ms = 16.6f;
+
+    bool has_camera = false;
+    glm::vec3 camera_position;
+    float camera_yaw;
+    float camera_pitch;
+
+    // Played once over the measured frames when it has keys
+    CameraPath camera_path;
+};
+
+// A pose in the format of a "camera_settings" block
+CameraKey load_camera_key(json camera)
+{
+    CameraKey key;
+    key.time = camera.value("time", 0.0f);
+    key.position.x = camera["camera_position"]["x"];
+    key.position.y = camera["camera_position"]["y"];
+    key.position.z = camera["camera_position"]["z"];
+    key.yaw = camera["camera_yaw"];
+    key.pitch = camera["camera_pitch"];
+    key.zoom = camera.value("zoom", ZOOM);
+    return key;
+}
+
+// Loads a camera path from either a binary recording or a settings file. In a
+// settings file, "camera_path" lists poses, each either a camera_settings-like
+// object or the name of another settings file whose camera_settings is used
+// (e.g. the demo scenes); poses without "time" are "segment_seconds" apart.
+// A file with only a camera_settings block gives a single static pose.
+bool load_camera_path(const std::string& path, CameraPath& camera_path)
+{
+    if (std::filesystem::path(path).extension() != ".json")
+        return camera_path.load(path);
+
+    std::ifstream f(path);
+    if (!f) {
+        std::cout << "ERROR::CAMERA_PATH::Cannot open " << path << std::endl;
+        return false;
+    }
+    json data = json::parse(f);
+    camera_path.keys.clear();
+    camera_path.timestep = data.value("timestep", camera_path.timestep);
+
+    if (!data.contains("camera_path")) {
+        if (!data.contains("camera_settings"))
+            return false;
+        CameraKey key = load_camera_key(data["camera_settings"]);
+        camera_path.addKey(0.0f, key.position, key.yaw, key.pitch, key.zoom);
+        return true;
+    }
+
+    float segment_seconds = data.value("segment_seconds", 2.0f);
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    for (json entry : data["camera_path"]) {
+        CameraKey key;
+        if (entry.is_string()) {
+            std::ifstream other((directory / entry.get<std::string>()).string());
+            if (!other) {
+                std::cout << "ERROR::CAMERA_PATH::Cannot open " << entry << std::endl;
+                return false;
+            }
+            key = load_camera_key(json::parse(other)["camera_settings"]);
+        }
+        else {
+            key = load_camera_key(entry);
+        }
+        if (!entry.is_object() || !entry.contains("time"))
+            key.time = camera_path.keys.empty() ? 0.0f : camera_path.keys.back().time + segment_seconds;
+        camera_path.addKey(key.time, key.position, key.yaw, key.pitch, key.zoom);
+    }
+    return !camera_path.keys.empty();
+}
+
+bool load_bench_json(const std::string& path, BenchSettings& settings)
+{
+    std::ifstream f(path);
+    if (!f) {
+        std::cout << "ERROR::BENCH::Cannot open " << path << std::endl;
+        return false;
+    }
+    json data = json::parse(f);
+    settings.path = path;
+
+    if (data.contains("camera_settings")) {
+        json camera = data["camera_settings"];
+        settings.has_camera = true;
+        settings.camera_position.x = camera["camera_position"]["x"];
+        settings.camera_position.y = camera["camera_position"]["y"];
+        settings.camera_position.z = camera["camera_position"]["z"];
+        settings.camera_yaw = camera["camera_yaw"];
+        settings.camera_pitch = camera["camera_pitch"];
+    }
+
+    // A path in the settings file itself
+    if (data.contains("camera_path") && !load_camera_path(path, settings.camera_path))
+        return false;
+
+    if (data.contains("bench")) {
+        json bench = data["bench"];
+        settings.rendertype = bench.value("rendertype", settings.rendertype);
+        settings.shadowtype = bench.value("shadowtype", settings.shadowtype);
+        settings.ssao = bench.value("ssao", settings.ssao);
+        settings.warmup_frames = bench.value("warmup_frames", settings.warmup_frames);
+        settings.frames = bench.value("frames", settings.frames);
+        settings.output = bench.value("output", settings.output);
+        settings.render_scale = bench.value("render_scale", settings.render_scale);
+        settings.dynamic_resolution = bench.value("dynamic_resolution", settings.dynamic_resolution);
+        settings.temporal = bench.value("temporal", settings.temporal);
+        settings.ssao_resolution = bench.value("ssao_resolution", settings.ssao_resolution);
+        settings.ao_technique = bench.value("ao_technique", settings.ao_technique);
+        settings.hiz_ssr = bench.value("hiz_ssr", settings.hiz_ssr);
+        settings.stencil_lighting = bench.value("stencil_lighting", settings.stencil_lighting);
+        settings.gpu_culling = bench.value("gpu_culling", settings.gpu_culling);
+        settings.cpu_occlusion = bench.value("cpu_occlusion", settings.cpu_occlusion);
+        settings.depth_prepass = bench.value("depth_prepass", settings.depth_prepass);
+        settings.render_thread = bench.value("render_thread", settings.render_thread);
+        settings.num_lights = bench.value("num_lights", settings.num_lights);
+        settings.light_assignment = bench.value("light_assignment", settings.light_assignment);
+        settings.frame_budget_ms = bench.value("frame_budget_ms", settings.frame_budget_ms);
+
+        // Relative to the settings file
+        if (bench.contains("camera_path")) {
+            std::filesystem::path camera_path = std::filesystem::path(path).parent_path() / bench["camera_path"].get<std::string>();
+            if (!load_camera_path(camera_path.string(), settings.camera_path))
+                return false;
+        }
+    }
+    return true;
+}
+
+#endif /* json_h */
@@ -30,16 +30,24 @@ public:
         Diffuse = diffuse;
         Specular = specular;
         Position = position;
+        // Built once rather than concatenated each time the light is set
+        AmbientName = Name + ".ambient";
+        DiffuseName = Name + ".diffuse";
+        SpecularName = Name + ".specular";
+        PositionName = Name + ".position";
     }
     
     void shaderSetLight(Shader& shader)
     {
         shader.use();
-        shader.setVec3f(Name + ".ambient", Ambient);
-        shader.setVec3f(Name + ".diffuse", Diffuse);
-        shader.setVec3f(Name + ".specular", Specular);
-        shader.setVec3f(Name + ".position", Position);
+        shader.setVec3f(AmbientName.c_str(), Ambient);
+        shader.setVec3f(DiffuseName.c_str(), Diffuse);
+        shader.setVec3f(SpecularName.c_str(), Specular);
+        shader.setVec3f(PositionName.c_str(), Position);
     }
+
+private:
+    std::string AmbientName, DiffuseName, SpecularName, PositionName;
 };
 
 
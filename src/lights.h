@@ -0,0 +1,343 @@
+//
+//  lights.h
+//  opengl_test
+//
+
+#ifndef lights_h
+#define lights_h
+
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define LIGHTS_SSE
+#endif
+
+#include "shader_s.h"
+#include "gl4ext.h"
+#include "jobs.h"
+#include "gpumemory.h"
+
+// World space point light, or spot light when cos_outer >= -1. Laid out as
+// the three RGBA32F texels a light takes in the light buffer.
+struct LocalLight
+{
+    glm::vec3 position;
+    float radius;
+    glm::vec3 color;
+    // Cosines of the cone half angles, full intensity inside cos_inner
+    float cos_outer;
+    glm::vec3 direction;
+    float cos_inner;
+};
+static_assert(sizeof(LocalLight) == 12 * sizeof(float), "LocalLight must match 3 RGBA32F texels");
+
+// Many dynamic point/spot lights for the deferred pass. The view frustum is
+// split into TILES_X x TILES_Y tiles and SLICES exponential depth slices; each
+// cluster gets the list of lights whose sphere overlaps its view-space box,
+// so a pixel only shades the lights of its cluster. Assignment runs in a
+// compute shader when the context has one, otherwise on the CPU testing four
+// clusters at a time with SSE, slices spread over the job system. Lights, (offset, count) per cluster and the
+// light indices are read by the deferred shader as texture buffers, which
+// GLSL 3.30 can sample.
+class ClusteredLights
+{
+public:
+    static const int TILES_X = 16;
+    static const int TILES_Y = 9;
+    static const int SLICES = 24;
+    static const int TILES = TILES_X * TILES_Y;
+    static const int NUM_CLUSTERS = TILES * SLICES;
+    static const int MAX_LIGHTS = 4096;
+    static const int MAX_LIGHTS_PER_CLUSTER = 256;
+    // Must match shader/lights/cluster_assign.comp
+    static const int COMPUTE_GROUP_SIZE = 64;
+
+    // Those of Camera::SetProjectMatrix
+    float near_plane = 1.0f;
+    float far_plane = 400.0f;
+
+    std::vector<LocalLight> lights;
+    float radius = 2.0f;
+    // Lights dropped from full clusters by the last CPU assignment
+    int overflow = 0;
+    // Compute assignment writes a fixed slot per cluster, which needs a
+    // texture buffer larger than the GL 3.3 minimum
+    bool compute_supported = false;
+
+    unsigned int lightBuffer, lightTexture;
+    unsigned int gridBuffer, gridTexture;
+    unsigned int indexBuffer, indexTexture;
+
+    ClusteredLights() {
+        lightTexture = genTextureBuffer(lightBuffer, GL_RGBA32F, MAX_LIGHTS * sizeof(LocalLight), "lights");
+        gridTexture = genTextureBuffer(gridBuffer, GL_RG32UI, NUM_CLUSTERS * 2 * sizeof(uint32_t), "cluster grid");
+        indexTexture = genTextureBuffer(indexBuffer, GL_R32UI, NUM_CLUSTERS * MAX_LIGHTS_PER_CLUSTER * sizeof(uint32_t), "cluster indices");
+        GLint max_texels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+        max_index_texels = max_texels;
+        compute_supported = gl4.compute && max_texels >= NUM_CLUSTERS * MAX_LIGHTS_PER_CLUSTER;
+        slot_indices.resize(NUM_CLUSTERS * MAX_LIGHTS_PER_CLUSTER);
+        counts.resize(NUM_CLUSTERS);
+        grid.resize(2 * NUM_CLUSTERS);
+        packed_indices.reserve(NUM_CLUSTERS * MAX_LIGHTS_PER_CLUSTER);
+    }
+    ~ClusteredLights() {
+        unsigned int textures[3] = { lightTexture, gridTexture, indexTexture };
+        unsigned int buffers[3] = { lightBuffer, gridBuffer, indexBuffer };
+        glstate.deleteTextures(3, textures);
+        gpumemory.deleteBuffers(3, buffers);
+    }
+
+    // Same lights for the same count and seed. A quarter of them are spot
+    // lights pointing down, all are spread over the ground around the scene.
+    void generate(int count, float in_radius, unsigned int seed = 1) {
+        count = std::clamp(count, 0, MAX_LIGHTS);
+        radius = in_radius;
+        std::default_random_engine generator(seed);
+        std::uniform_real_distribution<float> random(0.0f, 1.0f);
+        lights.resize(count);
+        base_positions.resize(count);
+        phases.resize(count);
+        for (int i = 0; i < count; i++) {
+            LocalLight& light = lights[i];
+            base_positions[i] = glm::vec3(random(generator) * 40.0f - 20.0f, random(generator) * 3.0f - 0.5f, random(generator) * 40.0f - 20.0f);
+            phases[i] = random(generator) * 2.0f * (float)pi;
+            light.position = base_positions[i];
+            light.radius = radius;
+            // Saturated colors of about the same brightness
+            float hue = random(generator) * 6.0f;
+            auto channel = [&](float shift) {
+                return std::clamp(std::abs(std::fmod(hue + shift, 6.0f) - 3.0f) - 1.0f, 0.0f, 1.0f);
+            };
+            light.color = 2.0f * glm::vec3(channel(0.0f), channel(4.0f), channel(2.0f));
+            bool spot = i % 4 == 3;
+            light.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+            light.cos_outer = spot ? std::cos(glm::radians(40.0f)) : -2.0f;
+            light.cos_inner = spot ? std::cos(glm::radians(30.0f)) : -2.0f;
+        }
+    }
+
+    // Lights circle their generated position, time in seconds
+    void animate(float time) {
+        for (size_t i = 0; i < lights.size(); i++) {
+            float angle = 0.5f * time + phases[i];
+            lights[i].position = base_positions[i] + glm::vec3(std::cos(angle), 0.0f, std::sin(angle));
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, lights.size() * sizeof(LocalLight), lights.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    void assignCPU(const glm::mat4& view, const glm::mat4& projection) {
+        CPU_PROFILE_SCOPE("ClusteredLights::assignCPU");
+        if (projection != bounds_projection)
+            computeBounds(projection);
+        std::fill(counts.begin(), counts.end(), 0u);
+        overflow = 0;
+        float slice_scale = SLICES / std::log(far_plane / near_plane);
+
+        // View-space center and slice range of every light, then the slices
+        // on the workers: each cluster is filled by one job, in light order
+        light_slices.resize(lights.size());
+        jobs.parallelFor(0, (uint32_t)lights.size(), 256, [&](uint32_t first, uint32_t last) {
+            for (uint32_t index = first; index < last; index++) {
+                LightSlices& ls = light_slices[index];
+                ls.center = glm::vec3(view * glm::vec4(lights[index].position, 1.0f));
+                float r = lights[index].radius;
+                float depth_min = -ls.center.z - r;
+                float depth_max = -ls.center.z + r;
+                ls.first_slice = 0;
+                ls.last_slice = -1;
+                if (depth_max < near_plane || depth_min > far_plane)
+                    continue;
+                ls.first_slice = std::clamp((int)(std::log(std::max(depth_min, near_plane) / near_plane) * slice_scale), 0, SLICES - 1);
+                ls.last_slice = std::clamp((int)(std::log(std::min(depth_max, far_plane) / near_plane) * slice_scale), 0, SLICES - 1);
+            }
+        }, "Light slices");
+        std::fill(slice_overflow, slice_overflow + SLICES, 0);
+        jobs.parallelFor(0, SLICES, 1, [&](uint32_t job_first, uint32_t job_last) {
+            for (uint32_t index = 0; index < (uint32_t)lights.size(); index++) {
+                const LightSlices& ls = light_slices[index];
+                glm::vec3 center = ls.center;
+                float r = lights[index].radius;
+                for (int slice = std::max(ls.first_slice, (int)job_first); slice <= std::min(ls.last_slice, (int)job_last - 1); slice++) {
+                    int first = slice * TILES;
+#ifdef LIGHTS_SSE
+                    __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+                    __m128 r2 = _mm_set1_ps(r * r);
+                    __m128 zero = _mm_setzero_ps();
+                    for (int tile = 0; tile < TILES; tile += 4) {
+                        int cluster = first + tile;
+                        // Distance from the center to each box, per axis
+                        __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(&bounds_min_x[cluster]), cx), _mm_sub_ps(cx, _mm_load_ps(&bounds_max_x[cluster]))), zero);
+                        __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(&bounds_min_y[cluster]), cy), _mm_sub_ps(cy, _mm_load_ps(&bounds_max_y[cluster]))), zero);
+                        __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(&bounds_min_z[cluster]), cz), _mm_sub_ps(cz, _mm_load_ps(&bounds_max_z[cluster]))), zero);
+                        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                        int mask = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+                        for (int lane = 0; mask != 0; lane++, mask >>= 1)
+                            if (mask & 1)
+                                addToCluster(cluster + lane, index, slice_overflow[slice]);
+                    }
+#else
+                    for (int cluster = first; cluster < first + TILES; cluster++) {
+                        float dx = std::max({bounds_min_x[cluster] - center.x, center.x - bounds_max_x[cluster], 0.0f});
+                        float dy = std::max({bounds_min_y[cluster] - center.y, center.y - bounds_max_y[cluster], 0.0f});
+                        float dz = std::max({bounds_min_z[cluster] - center.z, center.z - bounds_max_z[cluster], 0.0f});
+                        if (dx * dx + dy * dy + dz * dz <= r * r)
+                            addToCluster(cluster, index, slice_overflow[slice]);
+                    }
+#endif
+                }
+            }
+        }, "Light assignment");
+        for (int slice = 0; slice < SLICES; slice++)
+            overflow += slice_overflow[slice];
+
+        // Compact the fixed slots into (offset, count) and one index list
+        packed_indices.clear();
+        for (int cluster = 0; cluster < NUM_CLUSTERS; cluster++) {
+            uint32_t count = counts[cluster];
+            if (packed_indices.size() + count > (size_t)max_index_texels) {
+                overflow += count;
+                count = 0;
+            }
+            grid[2 * cluster] = (uint32_t)packed_indices.size();
+            grid[2 * cluster + 1] = count;
+            const uint32_t* slot = &slot_indices[(size_t)cluster * MAX_LIGHTS_PER_CLUSTER];
+            packed_indices.insert(packed_indices.end(), slot, slot + count);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, gridBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, grid.size() * sizeof(uint32_t), grid.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, indexBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, packed_indices.size() * sizeof(uint32_t), packed_indices.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // The light buffer must be up to date (animate)
+    void assignCompute(Shader& shader, glm::mat4 view, const glm::mat4& projection) {
+        glm::mat4 inv_projection = glm::inverse(projection);
+        shader.use();
+        shader.setMat4f("view", view);
+        shader.setMat4f("invProjection", inv_projection);
+        shader.setInt("numLights", (int)lights.size());
+        shader.setFloat("nearPlane", near_plane);
+        shader.setFloat("farPlane", far_plane);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, lightBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gridBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, indexBuffer);
+        gl4.DispatchCompute((NUM_CLUSTERS + COMPUTE_GROUP_SIZE - 1) / COMPUTE_GROUP_SIZE, 1, 1);
+        // Read back through texelFetch by the lighting pass
+        gl4.MemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        overflow = 0;
+    }
+
+    // Binds the three texture buffers from first_unit on and sets the
+    // uniforms the deferred shader needs to find a pixel's cluster
+    void bind(Shader& shader, int first_unit) {
+        shader.setInt("lightData", first_unit);
+        shader.setInt("clusterGrid", first_unit + 1);
+        shader.setInt("clusterIndices", first_unit + 2);
+        shader.setInt("numLocalLights", (int)lights.size());
+        float log_range = std::log(far_plane / near_plane);
+        // slice = log(depth) * x - y
+        shader.setVec2f("clusterSliceScaleBias", glm::vec2(SLICES / log_range, SLICES * std::log(near_plane) / log_range));
+        glUniform3i(glGetUniformLocation(shader.ID, "clusterDims"), TILES_X, TILES_Y, SLICES);
+        unsigned int textures[3] = { lightTexture, gridTexture, indexTexture };
+        for (int i = 0; i < 3; i++) {
+            glstate.activeTexture(GL_TEXTURE0 + first_unit + i);
+            glstate.bindTexture(GL_TEXTURE_BUFFER, textures[i]);
+        }
+    }
+
+private:
+    std::vector<glm::vec3> base_positions;
+    std::vector<float> phases;
+
+    // View-space box of every cluster, one array per bound so four
+    // neighbouring tiles load into one register
+    alignas(16) float bounds_min_x[NUM_CLUSTERS];
+    alignas(16) float bounds_min_y[NUM_CLUSTERS];
+    alignas(16) float bounds_min_z[NUM_CLUSTERS];
+    alignas(16) float bounds_max_x[NUM_CLUSTERS];
+    alignas(16) float bounds_max_y[NUM_CLUSTERS];
+    alignas(16) float bounds_max_z[NUM_CLUSTERS];
+    glm::mat4 bounds_projection = glm::mat4(0.0f);
+
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> slot_indices;
+    std::vector<uint32_t> grid;
+    std::vector<uint32_t> packed_indices;
+    int max_index_texels = 0;
+
+    // Per light, for the slice jobs
+    struct LightSlices
+    {
+        glm::vec3 center;
+        int first_slice;
+        int last_slice;
+    };
+    std::vector<LightSlices> light_slices;
+    int slice_overflow[SLICES];
+
+    void addToCluster(int cluster, uint32_t index, int& dropped) {
+        if (counts[cluster] < MAX_LIGHTS_PER_CLUSTER)
+            slot_indices[(size_t)cluster * MAX_LIGHTS_PER_CLUSTER + counts[cluster]++] = index;
+        else
+            dropped++;
+    }
+
+    // Boxes around the four tile corner rays between the slice depths, as
+    // in cluster_assign.comp
+    void computeBounds(const glm::mat4& projection) {
+        bounds_projection = projection;
+        glm::mat4 inv_projection = glm::inverse(projection);
+        for (int slice = 0; slice < SLICES; slice++) {
+            float depth_near = near_plane * std::pow(far_plane / near_plane, (float)slice / SLICES);
+            float depth_far = near_plane * std::pow(far_plane / near_plane, (float)(slice + 1) / SLICES);
+            for (int y = 0; y < TILES_Y; y++) {
+                for (int x = 0; x < TILES_X; x++) {
+                    glm::vec3 box_min(1e30f), box_max(-1e30f);
+                    for (int corner = 0; corner < 4; corner++) {
+                        glm::vec2 ndc(2.0f * (x + (corner & 1)) / TILES_X - 1.0f, 2.0f * (y + (corner >> 1)) / TILES_Y - 1.0f);
+                        glm::vec4 p = inv_projection * glm::vec4(ndc, -1.0f, 1.0f);
+                        glm::vec3 ray = glm::vec3(p) / p.w;
+                        for (float depth : {depth_near, depth_far}) {
+                            glm::vec3 point = ray * (depth / -ray.z);
+                            box_min = glm::min(box_min, point);
+                            box_max = glm::max(box_max, point);
+                        }
+                    }
+                    int cluster = slice * TILES + y * TILES_X + x;
+                    bounds_min_x[cluster] = box_min.x;
+                    bounds_min_y[cluster] = box_min.y;
+                    bounds_min_z[cluster] = box_min.z;
+                    bounds_max_x[cluster] = box_max.x;
+                    bounds_max_y[cluster] = box_max.y;
+                    bounds_max_z[cluster] = box_max.z;
+                }
+            }
+        }
+    }
+
+    // The texture is a view of the buffer, only the buffer holds memory
+    static unsigned int genTextureBuffer(unsigned int& buffer, GLenum internalformat, size_t size, const char* label) {
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+        gpumemory.buffer(buffer, size, "Clustered lights", label);
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glstate.editTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, internalformat, buffer);
+        glstate.bindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        return texture;
+    }
+};
+
+#endif /* lights_h */
@@ -23,6 +23,8 @@
 #include <memory>
 #include <filesystem>
 #include <random>
+#include <chrono>
+#include <cstdlib>
 
 // UI (ref. https://github.com/ocornut/imgui)
 #include <imui/imgui.h>
@@ -42,58 +44,258 @@
 //#include "globjects.h"
 #include "myimgui.h"
 #include "json.h"
+#include "shadow.h"
+#include "depthpyramid.h"
+#include "gpuprofiler.h"
+#include "cpuprofiler.h"
+#include "offscreen.h"
+#include "bench.h"
+#include "regression.h"
+#include "resolution.h"
+#include "temporal.h"
+#include "ssao.h"
+#include "lights.h"
+#include "gpuculling.h"
+#include "occlusion.h"
+#include "overdraw.h"
+#include "jobs.h"
+#include "glstate.h"
+#include "gpumemory.h"
+#include "gltrace.h"
+#include "heaptracker.h"
+#include "renderthread.h"
+#include "commandbuffer.h"
 
-int main()
+int main(int argc, char** argv)
 {
-    // glfw: initialize and configure
-    glfwInit();
+    // Benchmark mode: --bench <settings.json> renders offscreen and exits
+    // -------------------------------------------------------------------
+    // --camera-path <file> (binary recording or settings JSON) is played back
+    // in both modes. --rendertype/--shadowtype/--ssao/--ao/--ssao-resolution/
+    // --lights/--light-assignment override the bench block, --golden <dir>
+    // checks the result against stored images, and with --check-timing
+    // against stored timings.
+    // --assert-no-alloc aborts when a steady-state frame calls operator new
+    // (builds with HEAP_TRACK); malloc, and so ImGui, is not seen.
+    // -------------------------------------------------------------------------
+    BenchSettings bench;
+    bool bench_mode = false;
+    CameraPath camera_path;
+    RegressionCheck regression;
+    int override_rendertype = -1, override_shadowtype = -1, override_ssao = -1;
+    int override_ao_technique = -1, override_ssao_resolution = -1;
+    int override_num_lights = -1, override_light_assignment = -1;
+    // A bad value, a missing one or an unknown flag stops here: a typo must
+    // not run another configuration than the one asked for
+    const char* usage =
+        "usage: Learn_OpenGL [--bench <settings.json>] [--camera-path <file>]\n"
+        "    [--rendertype 0-8] [--shadowtype 0-4] [--ssao 0|1] [--ao 0|1] [--ssao-resolution 0-2]\n"
+        "    [--lights 0-4096] [--light-assignment 0-2]\n"
+        "    [--golden <dir>] [--update-golden] [--min-psnr <dB>]\n"
+        "    [--check-timing] [--max-time-regression <fraction>]\n"
+        "    [--assert-no-alloc]";
+    std::string arg_error;
+    // Value of the flag at argv[i], i moves past it
+    auto stringValue = [&](int& i) -> const char* {
+        if (i + 1 >= argc) {
+            arg_error = std::string(argv[i]) + " needs a value";
+            return "";
+        }
+        return argv[++i];
+    };
+    auto intValue = [&](int& i, int min, int max) {
+        std::string flag = argv[i];
+        const char* text = stringValue(i);
+        char* end = nullptr;
+        long value = std::strtol(text, &end, 10);
+        if (arg_error.empty() && (end == text || *end != '\0' || value < min || value > max))
+            arg_error = flag + " takes an integer in [" + std::to_string(min) + ", " + std::to_string(max) + "], not '" + text + "'";
+        return (int)value;
+    };
+    auto floatValue = [&](int& i) {
+        std::string flag = argv[i];
+        const char* text = stringValue(i);
+        char* end = nullptr;
+        float value = std::strtof(text, &end);
+        if (arg_error.empty() && (end == text || *end != '\0' || !(value >= 0.0f)))
+            arg_error = flag + " takes a non-negative number, not '" + text + "'";
+        return value;
+    };
+    for (int i = 1; i < argc && arg_error.empty(); i++) {
+        std::string arg = argv[i];
+        if (arg == "--bench") {
+            bench_mode = true;
+            const char* path = stringValue(i);
+            if (arg_error.empty() && !load_bench_json(path, bench))
+                return -1;
+        }
+        else if (arg == "--camera-path") {
+            const char* path = stringValue(i);
+            if (arg_error.empty() && !load_camera_path(path, camera_path))
+                return -1;
+        }
+        else if (arg == "--rendertype")
+            override_rendertype = intValue(i, 0, 8);
+        else if (arg == "--shadowtype")
+            override_shadowtype = intValue(i, 0, 4);
+        else if (arg == "--ssao")
+            override_ssao = intValue(i, 0, 1);
+        else if (arg == "--ao")
+            override_ao_technique = intValue(i, 0, 1);
+        else if (arg == "--ssao-resolution")
+            override_ssao_resolution = intValue(i, 0, 2);
+        else if (arg == "--lights")
+            override_num_lights = intValue(i, 0, ClusteredLights::MAX_LIGHTS);
+        else if (arg == "--light-assignment")
+            override_light_assignment = intValue(i, 0, 2);
+        else if (arg == "--golden")
+            regression.golden_dir = stringValue(i);
+        else if (arg == "--update-golden")
+            regression.update = true;
+        else if (arg == "--min-psnr")
+            regression.min_psnr = floatValue(i);
+        else if (arg == "--check-timing")
+            regression.check_timing = true;
+        else if (arg == "--max-time-regression")
+            regression.max_time_regression = floatValue(i);
+        else if (arg == "--assert-no-alloc") {
+            if (!HeapTracker::ENABLED)
+                std::cout << "--assert-no-alloc needs a build with HEAP_TRACK" << std::endl;
+            else
+                std::cout << "--assert-no-alloc: checks operator new, allocations through malloc (ImGui's included) are not seen" << std::endl;
+            heaptracker.assert_no_alloc = true;
+        }
+        else
+            arg_error = "unknown argument '" + arg + "'";
+    }
+    if (!arg_error.empty()) {
+        std::cerr << arg_error << "\n" << usage << std::endl;
+        return -1;
+    }
+    if (override_rendertype >= 0) bench.rendertype = override_rendertype;
+    if (override_shadowtype >= 0) bench.shadowtype = override_shadowtype;
+    if (override_ssao >= 0) bench.ssao = override_ssao != 0;
+    if (override_ao_technique >= 0) bench.ao_technique = override_ao_technique;
+    if (override_ssao_resolution >= 0) bench.ssao_resolution = override_ssao_resolution;
+    if (override_num_lights >= 0) bench.num_lights = override_num_lights;
+    if (override_light_assignment >= 0) bench.light_assignment = override_light_assignment;
+    // Keep one result file per combination when sweeping
+    bool sweeping = override_rendertype >= 0 || override_shadowtype >= 0 || override_ssao >= 0
+        || override_ao_technique >= 0 || override_ssao_resolution >= 0
+        || override_num_lights >= 0 || override_light_assignment >= 0;
+    if (sweeping)
+        bench.output = std::filesystem::path(bench.output).stem().string() + "_" + RegressionCheck::caseName(bench) + ".json";
+    if (bench_mode && camera_path.keys.empty())
+        camera_path = bench.camera_path;
 
-    // macOS only supports up to OpenGL 4.1
+    GLFWwindow* window = nullptr;
+    OffscreenContext offscreen;
+    GLADloadproc loader = (GLADloadproc)glfwGetProcAddress;
+    if (bench_mode) {
+        if (!offscreen.create())
+            return -1;
+        loader = offscreen.loader();
+    }
+    else {
+        // glfw: initialize and configure
+        glfwInit();
+
+        // macOS only supports up to OpenGL 4.1
 #ifdef __APPLE__
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 #else
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
 #endif
 
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
 #ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
-    // glfw window creation. Bugs about windows size exist in macOS,
-    // see https://stackoverflow.com/questions/35715579/opengl-created-window-size-twice-as-large
-    // ------------------------------------------------------------------------------------------
+        // glfw window creation. Bugs about windows size exist in macOS,
+        // see https://stackoverflow.com/questions/35715579/opengl-created-window-size-twice-as-large
+        // ------------------------------------------------------------------------------------------
 #ifdef __APPLE__
-    GLFWwindow* window = glfwCreateWindow(SCR_WIDTH + UI_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
-    // GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+        window = glfwCreateWindow(SCR_WIDTH + UI_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+        // GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
 #else
-    GLFWwindow* window = glfwCreateWindow(2 * SCR_WIDTH, 2 * SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+        window = glfwCreateWindow(2 * SCR_WIDTH, 2 * SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
 #endif
-    if (window == nullptr)
-    {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
+        if (window == nullptr)
+        {
+            std::cout << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return -1;
+        }
+        glfwMakeContextCurrent(window);
+        glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+        // glfwSetCursorPosCallback(window, mouse_callback);
+        glfwSetScrollCallback(window, scroll_callback);
     }
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    // glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetScrollCallback(window, scroll_callback);
 
     // glad: load all OpenGL function pointers
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    if (!gladLoadGLLoader(loader))
     {
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
+    loadGL4Functions(loader);
+    gltrace.install();
     glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
 
     // Setup Dear ImGui context
     // ------------------------
     MyImgui myimgui(window, false, 0);
+
+    // Per-pass GPU timers shown in the UI
+    // -----------------------------------
+    GpuProfiler gpu_profiler;
+    myimgui.camera_path = &camera_path;
+
+    // Without a window everything that would go to the screen lands here
+    // ------------------------------------------------------------------
+    unsigned int screenFBO = 0;
+    std::vector<float> bench_cpu_ms;
+    std::vector<int> bench_segments;
+    if (bench_mode) {
+        screenFBO = genOffscreenTarget(2 * SCR_WIDTH, 2 * SCR_HEIGHT);
+        myimgui.rendertype = bench.rendertype;
+        myimgui.shadowtype = bench.shadowtype;
+        myimgui.ssao = bench.ssao;
+        myimgui.render_scale = bench.render_scale;
+        myimgui.dynamic_resolution = bench.dynamic_resolution;
+        myimgui.frame_budget_ms = bench.frame_budget_ms;
+        myimgui.temporal = bench.temporal;
+        myimgui.ssao_resolution = bench.ssao_resolution;
+        myimgui.ao_technique = bench.ao_technique;
+        myimgui.hiz_ssr = bench.hiz_ssr;
+        myimgui.stencil_lighting = bench.stencil_lighting;
+        myimgui.gpu_culling = bench.gpu_culling;
+        myimgui.cpu_occlusion = bench.cpu_occlusion;
+        myimgui.depth_prepass = bench.depth_prepass;
+        myimgui.num_lights = bench.num_lights;
+        myimgui.light_assignment = bench.light_assignment;
+        myimgui.render_thread = bench.render_thread;
+        if (bench.has_camera) {
+            input_camera.Position = bench.camera_position;
+            input_camera.Yaw = bench.camera_yaw;
+            input_camera.Pitch = bench.camera_pitch;
+            input_camera.updateCameraVectors();
+        }
+        // A camera path is played once over the measured frames
+        if (!camera_path.keys.empty())
+            bench.frames = camera_path.numFrames();
+        // Every measured frame must be read back, at the cost of waiting
+        gpu_profiler.wait_for_results = true;
+        gpu_profiler.keep_log = true;
+        // Reserved up front, the measured frames must not allocate
+        gpu_profiler.log.reserve((size_t)(bench.warmup_frames + bench.frames + GpuProfiler::FRAMES_IN_FLIGHT) * GPU_PASS_COUNT);
+        bench_cpu_ms.reserve(bench.warmup_frames + bench.frames);
+        bench_segments.reserve(bench.warmup_frames + bench.frames);
+    }
     
     // Set prefix
     // ----------
@@ -103,9 +305,22 @@ int main()
     // std::string prefix = "/Users/zhouxch/Playground/opengl_skybox/opengl_test/";
 #else
 //    std::string prefix = "D:/Learn_OpenGL/";
-    std::string prefix = "../";
+    std::filesystem::path prefix = std::filesystem::path("../");
 #endif
 
+    // Worker threads for loading and frame preparation; the material textures
+    // decode on them while the shaders compile
+    // ------------------------------------------------------------------------
+    jobs.start();
+    JobCounter textures_decoded;
+    DecodedImage cube_image, floor_image;
+    jobs.run([&]() {
+        cube_image = decodeImage((prefix / "media" / "materials" / "container2.png").string());
+    }, &textures_decoded, "Texture decode");
+    jobs.run([&]() {
+        floor_image = decodeImage((prefix / "media" / "materials" / "Asphalt031_4K-JPG/Asphalt031_4K-JPG_Color.jpg").string());
+    }, &textures_decoded, "Texture decode");
+
     // Set camera
     ourcamera.SetProjectMatrix((float)SCR_WIDTH / (float)SCR_HEIGHT);
     
@@ -116,10 +331,16 @@ int main()
     Shader lightshader(prefix / "shader" / "lightshader.vs", prefix / "shader" / "lightshader.fs");
     Shader screenshader(prefix / "shader" / "screenshader.vs", prefix / "shader" / "screenshader.fs");
     Shader depthmapshader(prefix / "shader" / "shadow_map" / "depthmapshader.vs", prefix / "shader" / "shadow_map" / "depthmapshader.fs");
+    Shader minmax_init_shader(prefix / "shader" / "shadow_map" / "minmaxshader.vs", prefix / "shader" / "shadow_map" / "minmax_init_shader.fs");
+    Shader momentshader(prefix / "shader" / "shadow_map" / "momentshader.vs", prefix / "shader" / "shadow_map" / "momentshader.fs");
+    Shader momentblurshader(prefix / "shader" / "shadow_map" / "minmaxshader.vs", prefix / "shader" / "shadow_map" / "momentblurshader.fs");
+    Shader minmax_reduce_shader(prefix / "shader" / "shadow_map" / "minmaxshader.vs", prefix / "shader" / "shadow_map" / "minmax_reduce_shader.fs");
     Shader blinnphongshader_shadow(prefix / "shader" / "blinnphongshader_shadow.vs", prefix / "shader" / "blinnphongshader_shadow.fs");
+    Shader depthprepassshader(prefix / "shader" / "depthprepass.vs", prefix / "shader" / "depthprepass.fs");
     Shader gbuffershader(prefix / "shader" / "gbuffershader.vs", prefix / "shader" / "gbuffershader.fs");
     Shader deferredrendershader(prefix / "shader" / "deferredrendershader.vs", prefix / "shader" / "deferredrendershader.fs");
     Shader objshader(prefix / "shader" / "objshader.vs", prefix / "shader" / "objshader.fs");
+    Shader upscaleshader(prefix / "shader" / "screenshader.vs", prefix / "shader" / "upscale" / "upscaleshader.fs");
 
     // Shallow water equation, simulation
     Shader fluidsimulationshader(prefix / "shader" / "fluidsimulationshader.vs", prefix / "shader" / "fluidsimulationshader.fs");
@@ -136,6 +357,12 @@ int main()
     Shader ssaoshader(prefix / "shader" / "ssao" / "ssaoshader.vs", prefix / "shader" / "ssao" / "ssaoshader.fs");
     Shader ssaoblurshader(prefix / "shader" / "ssao" / "ssaoblurshader.vs", prefix / "shader" / "ssao" / "ssaoblurshader.fs");
     Shader inv_ssaoshader(prefix / "shader" / "ssao" / "inv_ssaoshader.vs", prefix / "shader" / "ssao" / "inv_ssaoshader.fs");
+    Shader gtaoshader(prefix / "shader" / "ssao" / "ssaoshader.vs", prefix / "shader" / "ssao" / "gtaoshader.fs");
+    Shader ssao_downsample_shader(prefix / "shader" / "ssao" / "ssaoshader.vs", prefix / "shader" / "ssao" / "ssao_downsample.fs");
+    Shader ssao_bilateral_shader(prefix / "shader" / "ssao" / "ssaoshader.vs", prefix / "shader" / "ssao" / "ssao_bilateral_blur.fs");
+    Shader ssao_upsample_shader(prefix / "shader" / "ssao" / "ssaoshader.vs", prefix / "shader" / "ssao" / "ssao_upsample.fs");
+    Shader ssrshader(prefix / "shader" / "screenshader.vs", prefix / "shader" / "ssr" / "ssrshader.fs");
+    Shader temporalshader(prefix / "shader" / "screenshader.vs", prefix / "shader" / "temporal" / "temporal_resolve.fs");
 
     // Screen space scattering shader
     Shader sss_shader(prefix / "shader" / "sss" / "sss_shader.vs", prefix / "shader" / "sss" / "sss_shader.fs");
@@ -154,9 +381,10 @@ int main()
     
     // Generate texture
     // ----------------
-    unsigned int texture_cube = genTexture(prefix / "media" / "materials" / "container2.png", GL_CLAMP_TO_EDGE);
+    jobs.wait(textures_decoded);
+    unsigned int texture_cube = uploadImage(cube_image, GL_CLAMP_TO_EDGE, "Scene", "cube texture");
     // unsigned int texture_floor = genTexture(prefix + "media/material/wall.jpg", GL_REPEAT);
-    unsigned int texture_floor = genTexture(prefix / + "media" / "materials" / "Asphalt031_4K-JPG/Asphalt031_4K-JPG_Color.jpg", GL_REPEAT);
+    unsigned int texture_floor = uploadImage(floor_image, GL_REPEAT, "Scene", "floor texture");
 
     // Generate objects
     // ----------------
@@ -218,7 +446,8 @@ int main()
     for (int x = 0; x < 10; x+=2) {
         for (int y = 0; y < 10; y+=2) {
             glm::mat4 sphere_model = glm::translate(glm::mat4(1.0f), glm::vec3(x-5, y-5, 0.0f));
-            spheres.addObject(sphere_model, 0);
+            // Its own PBR material each, see pbr_shader's materials
+            spheres.addObject(sphere_model, 0, true, false, spheres.num);
         }
     }
     
@@ -265,21 +494,30 @@ int main()
             0.0f);
         ssaoNoise.push_back(noise);
     }
-    GLuint noiseTexture = gen44RandomBuffer(ssaoNoise);
+    GLuint noiseTexture = gen44RandomBuffer(ssaoNoise, "SSAO", "noise");
     
     // Shadow map
     // ----------
     unsigned int FBO_depthmap;
     glGenFramebuffers(1, &FBO_depthmap);
-    glBindFramebuffer(GL_FRAMEBUFFER, FBO_depthmap);
-        unsigned int texture_depth_framebuffer = genFrameBufferDepthTexture();
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO_depthmap);
+        unsigned int texture_depth_framebuffer = genFrameBufferDepthTexture("Shadows", "shadow map");
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture_depth_framebuffer, 0);
         glDrawBuffer(GL_NONE);
         glReadBuffer(GL_NONE);
     
         if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
             std::cerr << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Min/max mips of the shadow map and poisson disks for accelerated PCSS
+    // ---------------------------------------------------------------------
+    DepthPyramid shadow_pyramid(2 * SCR_WIDTH, 2 * SCR_HEIGHT, "shadow map min/max");
+    unsigned int poissonUBO = genPoissonDiskUBO();
+
+    // Prefilterable moments for EVSM, sharing the depth texture above
+    // ----------------------------------------------------------------
+    MomentShadowMap moment_shadow(2 * SCR_WIDTH, 2 * SCR_HEIGHT, texture_depth_framebuffer);
     
     // G-Buffer
     // --------
@@ -288,79 +526,267 @@ int main()
     GLuint attachments[4] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3};
 
     glGenFramebuffers(1, &gBuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, gBuffer);
         // Position buffer
-        gPosition = genGBufferRGBA16FTexture();
+        gPosition = genGBufferRGBA16FTexture("G-buffer", "position");
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gPosition, 0);
         // Normal buffer
-        gNormal = genGBufferRGBA16FTexture();
+        gNormal = genGBufferRGBA16FTexture("G-buffer", "normal");
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gNormal, 0);
         // Texture and specular value
-        gAlbedoSpec = genGBufferRGBATexture();
+        gAlbedoSpec = genGBufferRGBATexture("G-buffer", "albedo/specular");
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, gAlbedoSpec, 0);
         // Texture and specular value
-        gShadow = genGBufferRGBA32FTexture();
+        gShadow = genGBufferRGBA32FTexture("G-buffer", "shadow/depth");
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, gShadow, 0);
         // Tell OpenGL we are using color 123 to render
         glDrawBuffers(4, attachments);
-        // Depth render buffer
+        // Depth and stencil render buffer, the stencil holds the STENCIL_* class
         unsigned int rboDepth;
         glGenRenderbuffers(1, &rboDepth);
         glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
-            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
-            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rboDepth);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, render_width, render_height);
+            gpumemory.renderbuffer(rboDepth, GL_DEPTH24_STENCIL8, render_width, render_height, "G-buffer", "depth/stencil");
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rboDepth);
         glBindRenderbuffer(GL_RENDERBUFFER, 0);
         // finally check if framebuffer is complete
         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
             std::cout << "Framebuffer not complete!" << std::endl;
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
     
     // Generate ssao & ssao_blur buffer
     // --------------------
     GLuint ssaoFBO;
     glGenFramebuffers(1, &ssaoFBO);
-    glBindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
-    GLuint ssaoColorBuffer = genGBufferRed16FTexture();
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
+    GLuint ssaoColorBuffer = genGBufferRed16FTexture("SSAO", "occlusion");
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ssaoColorBuffer, 0);
+    // Bent normals, only written by GTAO
+    GLuint ssaoBentNormal = genGBufferRGBA16FTexture("SSAO", "bent normal");
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, ssaoBentNormal, 0);
+    unsigned int ssao_attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, ssao_attachments);
     
     GLuint ssaoBlurFBO;
     glGenFramebuffers(1, &ssaoBlurFBO);
-    glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
     //GLuint ssaoColorBufferBlur = genGBufferRGBATexture();
-    GLuint ssaoColorBufferBlur = genGBufferRed16FTexture();
+    GLuint ssaoColorBufferBlur = genGBufferRed16FTexture("SSAO", "occlusion blur");
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ssaoColorBufferBlur, 0);
+
+    // Generate ssr buffer and the temporal histories of ssao & ssr
+    // ------------------------------------------------------------
+    GLuint ssrFBO;
+    glGenFramebuffers(1, &ssrFBO);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, ssrFBO);
+    GLuint ssrColor = genGBufferRGBA16FTexture("SSR", "reflection");
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ssrColor, 0);
+    // G-buffer stencil, reflections are only traced on mirror pixels
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rboDepth);
+    TemporalHistory ao_history("SSAO");
+    TemporalHistory ssr_history("SSR");
+
+    // Half / quarter resolution ssao and its history
+    // ----------------------------------------------
+    // Hi-Z pyramid of the G-buffer depth for the reflections
+    // ------------------------------------------------------
+    std::unique_ptr<DepthPyramid> hiz = std::make_unique<DepthPyramid>(render_width, render_height, "Hi-Z");
+    // The pyramid holds the finished G-buffer depth of this frame (GPU
+    // culling builds it), of the last frame until renderToGbuffer runs
+    bool hiz_built = false;
+
+    LowResAO low_res_ao;
+    TemporalHistory low_res_ao_history("low-res SSAO");
+    auto resizeLowResAO = [&](int factor) {
+        low_res_ao.resize(render_width, render_height, factor);
+        low_res_ao_history.resize(low_res_ao.width, low_res_ao.height);
+    };
+    resizeLowResAO(low_res_ao.factor);
+
+    // Scene buffer at the render resolution, upscaled to the screen
+    // -------------------------------------------------------------
+    GLuint sceneFBO;
+    glGenFramebuffers(1, &sceneFBO);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+        GLuint sceneColor = genGBufferRGBATexture("Scene", "color");
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColor, 0);
+        unsigned int sceneDepth;
+        glGenRenderbuffers(1, &sceneDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, sceneDepth);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, render_width, render_height);
+            gpumemory.renderbuffer(sceneDepth, GL_DEPTH_COMPONENT24, render_width, render_height, "Scene", "depth");
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sceneDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Framebuffer not complete!" << std::endl;
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Scene color with the G-buffer depth/stencil, deferred lighting runs one
+    // stencil-tested pass per class
+    // ------------------------------------------------------------------------
+    GLuint lightingFBO;
+    glGenFramebuffers(1, &lightingFBO);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, lightingFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColor, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rboDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Framebuffer not complete!" << std::endl;
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Local lights and their cluster lists
+    // -----------------------------------
+    ClusteredLights clustered_lights;
+    std::unique_ptr<Shader> cluster_assign_shader;
+    if (clustered_lights.compute_supported)
+        cluster_assign_shader = std::make_unique<Shader>(prefix / "shader" / "lights" / "cluster_assign.comp");
+    else if (bench.light_assignment == 2) {
+        // Recorded as what actually ran
+        std::cout << "Light assignment: no compute shaders, using the CPU" << std::endl;
+        bench.light_assignment = 1;
+        myimgui.light_assignment = 1;
+    }
+
+    // GPU-driven visibility of the G-buffer draws
+    // ------------------------------------------
+    std::unique_ptr<Shader> cull_shader;
+    std::unique_ptr<Shader> cull_compact_shader;
+    std::unique_ptr<GpuCulling> cube_culling;
+    std::unique_ptr<GpuCulling> quad_culling;
+    std::unique_ptr<GpuCulling> sphere_culling;
+    std::vector<std::unique_ptr<GpuCulling>> model_culling;
+    if (GpuCulling::supported()) {
+        cull_shader = std::make_unique<Shader>(prefix / "shader" / "culling" / "cull.comp");
+        cull_compact_shader = std::make_unique<Shader>(prefix / "shader" / "culling" / "cull_compact.comp");
+        cull_shader->use();
+        cull_shader->setInt("hiZ", 8);
+        cube_culling = std::make_unique<GpuCulling>(cubes);
+        quad_culling = std::make_unique<GpuCulling>(quads);
+        sphere_culling = std::make_unique<GpuCulling>(spheres);
+    }
+    else if (bench.gpu_culling) {
+        // Recorded as what actually ran
+        std::cout << "GPU culling: no compute shaders or indirect draws, drawing everything" << std::endl;
+        bench.gpu_culling = false;
+        myimgui.gpu_culling = false;
+    }
+
+    // CPU visibility of the G-buffer and forward draws, any GL version
+    // ----------------------------------------------------------------
+    SoftwareOcclusion occlusion;
+    {
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), model_data.translate);
+        model = glm::scale(model, model_data.scale);
+        occlusion.addBoxOccluders(cubes);
+        occlusion.addBoxOccluders(quads);
+        occlusion.addModelOccluders(models[0], model);
+    }
+    std::vector<const Objects*> occlusion_objects = { &cubes, &quads };
+
+    // Model draws of each pass, recorded on worker threads
+    CommandList shadow_commands, gbuffer_commands, depth_commands, forward_commands;
+    auto allMeshes = [](unsigned int, unsigned int) { return true; };
+    OcclusionStats occlusion_sum;
+    int occlusion_frames = 0;
+    float overdraw_depth_sum = 0.0f, overdraw_shaded_sum = 0.0f;
+    int overdraw_frames = 0;
+
+    // Scheduler activity and GL state calls of the frame, summed over the
+    // measured bench frames
+    JobStats job_sum;
+    GLStateStats gl_state_sum;
+    GLCallStats gl_calls_sum;
+    long long heap_allocations_sum = 0;
+    int heap_allocations_max = 0;
+    int job_frames = 0;
+
+    // Fragments per pixel of the forward pass
+    OverdrawCounter overdraw;
+
+    // Dynamic resolution: reallocates the screen-space targets at a new scale
+    // -----------------------------------------------------------------------
+    ResolutionController resolution;
+    auto resizeRenderTargets = [&]() {
+        render_width = std::max(1, (int)std::lround(2 * SCR_WIDTH * resolution.scale));
+        render_height = std::max(1, (int)std::lround(2 * SCR_HEIGHT * resolution.scale));
+        resizeTexture(gPosition, GL_RGBA16F, GL_RGBA, GL_FLOAT, render_width, render_height);
+        resizeTexture(gNormal, GL_RGBA16F, GL_RGBA, GL_FLOAT, render_width, render_height);
+        resizeTexture(gAlbedoSpec, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, render_width, render_height);
+        resizeTexture(gShadow, GL_RGBA32F, GL_RGBA, GL_FLOAT, render_width, render_height);
+        resizeTexture(ssaoColorBuffer, GL_R16F, GL_RED, GL_FLOAT, render_width, render_height);
+        resizeTexture(ssaoBentNormal, GL_RGBA16F, GL_RGBA, GL_FLOAT, render_width, render_height);
+        resizeTexture(ssaoColorBufferBlur, GL_R16F, GL_RED, GL_FLOAT, render_width, render_height);
+        resizeTexture(sceneColor, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, render_width, render_height);
+        resizeTexture(ssrColor, GL_RGBA16F, GL_RGBA, GL_FLOAT, render_width, render_height);
+        ao_history.resize(render_width, render_height);
+        ssr_history.resize(render_width, render_height);
+        resizeLowResAO(low_res_ao.factor);
+        hiz = std::make_unique<DepthPyramid>(render_width, render_height, "Hi-Z");
+        hiz_built = false;
+        glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, render_width, render_height);
+        gpumemory.renderbuffer(rboDepth, GL_DEPTH24_STENCIL8, render_width, render_height, "G-buffer", "depth/stencil");
+        glBindRenderbuffer(GL_RENDERBUFFER, sceneDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, render_width, render_height);
+        gpumemory.renderbuffer(sceneDepth, GL_DEPTH_COMPONENT24, render_width, render_height, "Scene", "depth");
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        // The 4x4 noise tiles the screen once per 4 pixels (ssaoshader sets
+        // it per pass, it also runs at the low AO resolution)
+        glm::vec2 noiseScale(render_width / 4.0f, render_height / 4.0f);
+        inv_ssaoshader.use();
+        inv_ssaoshader.setVec2f("noiseScale", noiseScale);
+    };
     
     // Create SWE buffer1
     // ------------------
     GLuint sweFBO1;
     glGenFramebuffers(1, &sweFBO1);
-    glBindFramebuffer(GL_FRAMEBUFFER, sweFBO1);
-    GLuint sweBuffer1 = genGBufferSWETexture();
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO1);
+    GLuint sweBuffer1 = genGBufferSWETexture("Water", "SWE state 1");
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sweBuffer1, 0);
     
     // Create SWE buffer2
     // ------------------
     GLuint sweFBO2;
     glGenFramebuffers(1, &sweFBO2);
-    glBindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
-    GLuint sweBuffer2 = genGBufferSWETexture();
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
+    GLuint sweBuffer2 = genGBufferSWETexture("Water", "SWE state 2");
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sweBuffer2, 0);
     
     // Create height map buffer
     // ------------------------
     GLuint heightFBO;
     glGenFramebuffers(1, &heightFBO);
-    glBindFramebuffer(GL_FRAMEBUFFER, heightFBO);
-    GLuint heightBuffer = genGBufferHeightTexture();
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, heightFBO);
+    GLuint heightBuffer = genGBufferHeightTexture("Water", "height");
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, heightBuffer, 0);
+
+    // GPU memory made here, released while the context is still there; the
+    // classes above release theirs in their destructors. What is left over
+    // is reported at exit.
+    auto releaseGpuMemory = [&]() {
+        for (Model& m : models)
+            m.release();
+        GLuint textures[] = { texture_cube, texture_floor, noiseTexture, texture_depth_framebuffer,
+                              gPosition, gNormal, gAlbedoSpec, gShadow, ssaoColorBuffer, ssaoBentNormal,
+                              ssaoColorBufferBlur, ssrColor, sceneColor, sweBuffer1, sweBuffer2, heightBuffer };
+        gpumemory.deleteTextures(sizeof(textures) / sizeof(textures[0]), textures);
+        GLuint renderbuffers[] = { rboDepth, sceneDepth };
+        gpumemory.deleteRenderbuffers(2, renderbuffers);
+        gpumemory.deleteBuffers(1, &poissonUBO);
+        if (screenFBO != 0)
+            deleteOffscreenTarget(screenFBO);
+    };
     
     // OpenGL tests
     // ---------------------
-    glEnable(GL_DEPTH_TEST);
+    glstate.enable(GL_DEPTH_TEST);
     glEnable(GL_DEPTH_CLAMP);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    //glEnable(GL_CULL_FACE);
+    glstate.enable(GL_BLEND);
+    glstate.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    //glstate.enable(GL_CULL_FACE);
     
     // Shader properties
     // -----------------
@@ -372,12 +798,19 @@ int main()
     depthmapshader.use();
     depthmapshader.setMat4f("lightProjection", lightProjection);
     depthmapshader.setMat4f("lightView", lightView);
+    momentshader.use();
+    momentshader.setMat4f("lightProjection", lightProjection);
+    momentshader.setMat4f("lightView", lightView);
     // -----------------
     blinnphongshader_shadow.use();
     blinnphongshader_shadow.setInt("diffuseTexture", 0);
     blinnphongshader_shadow.setInt("shadowMap", 1);
     blinnphongshader_shadow.setMat4f("lightProjection", lightProjection);
     blinnphongshader_shadow.setMat4f("lightView", lightView);
+    blinnphongshader_shadow.setInt("shadowMinMax", 5);
+    blinnphongshader_shadow.setInt("shadowMinMaxLevels", shadow_pyramid.levels);
+    blinnphongshader_shadow.setInt("shadowMoments", 6);
+    blinnphongshader_shadow.setUniformBlockBinding("PoissonDisk", POISSON_DISK_BINDING);
     // -----------------
     gbuffershader.use();
     gbuffershader.setInt("texture_diffuse1", 0);
@@ -385,6 +818,10 @@ int main()
     gbuffershader.setVec3f("lightPos", light.Position);
     gbuffershader.setMat4f("lightProjection", lightProjection);
     gbuffershader.setMat4f("lightView", lightView);
+    gbuffershader.setInt("shadowMinMax", 5);
+    gbuffershader.setInt("shadowMinMaxLevels", shadow_pyramid.levels);
+    gbuffershader.setInt("shadowMoments", 6);
+    gbuffershader.setUniformBlockBinding("PoissonDisk", POISSON_DISK_BINDING);
     // -----------------
     deferredrendershader.use();
     deferredrendershader.setInt("gPosition", 0);
@@ -392,6 +829,23 @@ int main()
     deferredrendershader.setInt("gAlbedoSpec", 2);
     deferredrendershader.setInt("gShadow", 3);
     deferredrendershader.setInt("ssaoColorBufferBlur", 4);
+    deferredrendershader.setInt("ssrColor", 5);
+    deferredrendershader.setInt("bentNormals", 7);
+    deferredrendershader.setInt("hiZ", 8);
+    // Texture buffers, never left on a unit holding a 2D texture
+    deferredrendershader.setInt("lightData", 9);
+    deferredrendershader.setInt("clusterGrid", 10);
+    deferredrendershader.setInt("clusterIndices", 11);
+    // -----------------
+    ssrshader.use();
+    ssrshader.setInt("gPosition", 0);
+    ssrshader.setInt("gNormal", 1);
+    ssrshader.setInt("gAlbedoSpec", 2);
+    ssrshader.setInt("gShadow", 3);
+    // Twice the step of the per-frame march, half the steps
+    ssrshader.setFloat("stepSize", 0.1f);
+    ssrshader.setInt("maxSteps", 50);
+    ssrshader.setInt("hiZ", 8);
     // -----------------
     objshader.use();
     glm::mat4 model = glm::mat4(1.0f);
@@ -408,9 +862,19 @@ int main()
     ssaoshader.setInt("noiseTexture", 3);
     // Send kernel
     for (GLuint i = 0; i < 64; ++i) {
-        ssaoshader.setVec3f("samples[" + std::to_string(i) + "]", ssaoKernel[i]);
+        ssaoshader.setVec3f(("samples[" + std::to_string(i) + "]").c_str(), ssaoKernel[i]);
     }
     ssaoshader.setMat4f("projection", projection);
+    ssaoshader.setInt("kernelSize", 64);
+    ssaoshader.setInt("kernelOffset", 0);
+    // -----------------
+    gtaoshader.use();
+    gtaoshader.setInt("gPosition", 0);
+    gtaoshader.setInt("gNormal", 1);
+    gtaoshader.setInt("gShadow", 2);
+    gtaoshader.setMat4f("projection", projection);
+    // Same radius as the kernel of ssaoshader
+    gtaoshader.setFloat("radius", 0.5f);
     // -----------------
     inv_ssaoshader.use();
     inv_ssaoshader.setInt("gPosition", 0);
@@ -419,9 +883,12 @@ int main()
     inv_ssaoshader.setInt("noiseTexture", 3);
     // Send kernel
     for (GLuint i = 0; i < 64; ++i) {
-        inv_ssaoshader.setVec3f("samples[" + std::to_string(i) + "]", ssaoKernel[i]);
+        inv_ssaoshader.setVec3f(("samples[" + std::to_string(i) + "]").c_str(), ssaoKernel[i]);
     }
     inv_ssaoshader.setMat4f("projection", projection);
+    inv_ssaoshader.setVec2f("noiseScale", glm::vec2(render_width / 4.0f, render_height / 4.0f));
+    ssaoshader.use();
+    ssaoshader.setVec2f("noiseScale", glm::vec2(render_width / 4.0f, render_height / 4.0f));
     // -----------------
     pbr_shader.use();
     pbr_shader.setVec3f("light_pos", light.Position);
@@ -429,332 +896,712 @@ int main()
     // Set material properties
     pbr_shader.setVec3f("albedo", glm::vec3(1.0f, 0.0f, 0.0f));
     pbr_shader.setFloat("ao", 1.0f);
+    // Metallic along one axis of the sphere grid, roughness along the other
+    for (unsigned int i = 0; i < spheres.num; i++)
+        pbr_shader.setVec2f(("materials[" + std::to_string(i) + "]").c_str(), glm::vec2((i % 5 + 1) / 5.0f, (i / 5 + 1) / 5.0f));
+    upscaleshader.use();
+    upscaleshader.setInt("scene", 0);
     
     // glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
 
+    // Settings of the frame being rendered, from its packet
+    RenderSettings settings = myimgui;
+    // Frames rendered since anything changed that may allocate (the settings,
+    // a loaded model, the render scale or thread); past HEAP_SETTLE_FRAMES
+    // the renderer is in its steady state and a frame must not allocate
+    const int HEAP_SETTLE_FRAMES = 2 * GpuProfiler::FRAMES_IN_FLIGHT;
+    RenderSettings previous_settings = settings;
+    int settled_frames = 0;
+
+    // Temporal accumulation: frame counter and last frame's camera
+    unsigned int frame_index = 0;
+    glm::mat4 prev_view_projection = projection * input_camera.GetViewMatrix();
+
     // Lambda function of rendering to gbuffer
     // ---------------------------------------
     auto renderToGbuffer = [&]() {
+        CPU_PROFILE_SCOPE("G-buffer");
+        gpu_profiler.begin(GPU_PASS_GBUFFER);
         // Render to GBuffer
         // -----------------
-        glBindFramebuffer(GL_FRAMEBUFFER, gBuffer);
-        glEnable(GL_DEPTH_TEST);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+        glstate.enable(GL_DEPTH_TEST);
         // Setting g=1.0f is to init depth in gbuffer to 1.0f (farthest)
         glClearColor(0.2f, 1.0f, 0.3f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glStencilMask(0xFF);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+        // Visible surfaces tag their pixels with their stencil class
+        glstate.enable(GL_STENCIL_TEST);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
         gbuffershader.use();
         gbuffershader.setVec3f("viewPos", ourcamera.Position);
-        gbuffershader.setInt("imgui_shadowtype", myimgui.shadowtype);
+        gbuffershader.setInt("imgui_shadowtype", settings.shadowtype);
+        gbuffershader.setBool("pcss_accelerated", settings.pcss_accelerated);
         glm::mat4 view = ourcamera.GetViewMatrix();
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, model_data.translate);
+        model = glm::scale(model, model_data.scale);
         
         gbuffershader.setMVP(cubes.models[0], view);
+        glstate.activeTexture(GL_TEXTURE1);
+        glstate.bindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
         
-        // Render cube
-        for (int i = 0; i < cubes.num; i++) {
-            if (cubes.textures[i] > 0) {
-                gbuffershader.setModelMat(cubes.models[i]);
-                gbuffershader.setBool("is_mirror", cubes.ismirror[i]);
-                if (cubes.textures[i] > 0) {
-                    glActiveTexture(GL_TEXTURE0);
-                    glBindTexture(GL_TEXTURE_2D, cubes.textures[i]);
+        // Draws the scene, or with GPU culling what a culling phase kept
+        auto drawScene = [&](int phase) {
+            bool culled = phase >= 0;
+            // Model draws recorded while the cubes and floor are submitted
+            if (!culled)
+                occlusion.recordModels(gbuffer_commands, gbuffershader.ID, models, false, "Record G-buffer draws");
+            gbuffershader.use();
+            gbuffershader.setBool("instanced", true);
+            
+            // Render cube, one instanced draw per texture / material class
+            unsigned int batch = 0;
+            cubes.forEachBatch([&](unsigned int first, unsigned int count) {
+                if (cubes.textures[first] > 0) {
+                    gbuffershader.setBool("is_mirror", cubes.ismirror[first]);
+                    glStencilFunc(GL_ALWAYS, cubes.ismirror[first] ? STENCIL_MIRROR : STENCIL_OPAQUE, 0xFF);
+                    glstate.activeTexture(GL_TEXTURE0);
+                    glstate.bindTexture(GL_TEXTURE_2D, cubes.textures[first]);
+                    if (culled)
+                        cube_culling->drawBatch(phase, batch);
+                    else
+                        occlusion.renderInstanced(cubes, 0, first, count);
+                }
+                batch++;
+            });
+            
+            // Render floor
+            batch = 0;
+            quads.forEachBatch([&](unsigned int first, unsigned int count) {
+                gbuffershader.setBool("is_mirror", quads.ismirror[first]);
+                glStencilFunc(GL_ALWAYS, quads.ismirror[first] ? STENCIL_MIRROR : STENCIL_OPAQUE, 0xFF);
+                if (quads.textures[first] > 0) {
+                    glstate.activeTexture(GL_TEXTURE0);
+                    glstate.bindTexture(GL_TEXTURE_2D, quads.textures[first]);
                 }
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
-                cubes.render();
+                if (culled)
+                    quad_culling->drawBatch(phase, batch);
+                else
+                    occlusion.renderInstanced(quads, 1, first, count);
+                batch++;
+            });
+            
+            // Render loaded model
+            gbuffershader.setBool("instanced", false);
+            gbuffershader.setModelMat(model);
+            gbuffershader.setBool("is_mirror", false);
+            glStencilFunc(GL_ALWAYS, STENCIL_OPAQUE, 0xFF);
+            gpu_profiler.begin(GPU_PASS_MODEL);
+            if (culled) {
+                for (auto& culling : model_culling)
+                    culling->drawMeshes(gbuffershader, phase);
             }
-        }
+            else {
+                gbuffer_commands.replay();
+            }
+            gpu_profiler.end(GPU_PASS_MODEL);
+        };
         
-        // Render floor
-        for (int i = 0; i < quads.num; i++) {
-            gbuffershader.setModelMat(quads.models[i]);
-            gbuffershader.setBool("is_mirror", cubes.ismirror[i]);
-            if (quads.textures[i] > 0) {
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, quads.textures[i]);
+        // Culls every list for one phase, against the bound pyramid
+        auto cullScene = [&](int phase, const glm::mat4& view_projection, const glm::mat4& occlusion_view_projection, bool occlusion) {
+            gpu_profiler.begin(GPU_PASS_CULL);
+            glstate.activeTexture(GL_TEXTURE8);
+            glstate.bindTexture(GL_TEXTURE_2D, hiz->texture);
+            cube_culling->cull(*cull_shader, phase, view_projection, occlusion_view_projection, occlusion);
+            quad_culling->cull(*cull_shader, phase, view_projection, occlusion_view_projection, occlusion);
+            for (auto& culling : model_culling) {
+                culling->model_matrix = model;
+                culling->cull(*cull_shader, phase, view_projection, occlusion_view_projection, occlusion);
             }
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
-            quads.render();
-        }
+            gpu_profiler.end(GPU_PASS_CULL);
+        };
         
-        // Render loaded model
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::translate(model, model_data.translate);
-        model = glm::scale(model, model_data.scale);
-        gbuffershader.setModelMat(model);
-        gbuffershader.setBool("is_mirror", false);
-        for (Model m: models) {
-            m.Draw(gbuffershader);
+        bool hiz_history = hiz_built;
+        hiz_built = false;
+        if (settings.gpu_culling && cull_shader) {
+            // Models can be opened at runtime, which moves them
+            if (model_culling.size() != models.size()) {
+                model_culling.clear();
+                for (Model& m : models)
+                    model_culling.push_back(std::make_unique<GpuCulling>(m, model));
+            }
+            glm::mat4 view_projection = ourcamera.GetProjectMatrix() * view;
+            
+            // Phase 0: what last frame's depth does not hide
+            cullScene(0, view_projection, prev_view_projection, hiz_history);
+            drawScene(0);
+            
+            // Phase 1: re-test what phase 0 rejected against its own depth
+            gpu_profiler.begin(GPU_PASS_HIZ);
+            hiz->build(minmax_init_shader, minmax_reduce_shader, quads, gShadow, 1);
+            gpu_profiler.end(GPU_PASS_HIZ);
+            cullScene(1, view_projection, view_projection, true);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, gBuffer);
+            glViewport(0, 0, render_width, render_height);
+            glstate.enable(GL_DEPTH_TEST);
+            drawScene(1);
+            
+            // Complete pyramid for the reflections and the next frame
+            gpu_profiler.begin(GPU_PASS_HIZ);
+            hiz->build(minmax_init_shader, minmax_reduce_shader, quads, gShadow, 1);
+            gpu_profiler.end(GPU_PASS_HIZ);
+            glViewport(0, 0, render_width, render_height);
+            hiz_built = true;
+        }
+        else {
+            occlusion.finish();
+            drawScene(-1);
         }
+        glstate.disable(GL_STENCIL_TEST);
+        gpu_profiler.end(GPU_PASS_GBUFFER);
     };
-    
-    // render loop
-    while (!glfwWindowShouldClose(window))
-    {
-        // input
-        processInput(window);
+
+    // One frame from its packet, on the main thread or on the render thread
+    // ---------------------------------------------------------------------
+    int bench_frame = 0;
+    std::vector<float> bench_latency_ms;
+    if (bench_mode)
+        bench_latency_ms.reserve(bench.frames);
+    RenderThread renderer;
+    auto renderFrame = [&](FramePacket& packet) {
+        CPU_PROFILE_SCOPE("Render frame");
+        settings = packet.settings;
+        ourcamera = packet.camera;
+        gpu_profiler.enabled = settings.gpu_timers;
+        bool frame_changed = !(settings == previous_settings) || !packet.opened_file_path.empty();
+        previous_settings = settings;
+        if (!packet.opened_file_path.empty()) {
+            // No occlusion test is running between frames. Neither is a
+            // recording, which reads models; waiting keeps that true should
+            // the load move next to one.
+            for (CommandList* list : {&shadow_commands, &gbuffer_commands, &depth_commands, &forward_commands})
+                list->wait();
+            models.emplace_back(packet.opened_file_path);
+            packet.opened_file_path.clear();
+        }
+        gpu_profiler.beginFrame();
         
         glm::mat4 view = ourcamera.GetViewMatrix();
+
+        // Dynamic resolution, from the GPU time of a frame a few frames back
+        // ------------------------------------------------------------------
+        bool scale_changed = settings.dynamic_resolution
+            ? resolution.update(gpu_profiler.latest(GPU_PASS_FRAME), settings.frame_budget_ms)
+            : resolution.set(settings.render_scale);
+        if (scale_changed)
+            resizeRenderTargets();
+        frame_changed = frame_changed || scale_changed;
+        settled_frames = frame_changed ? 0 : settled_frames + 1;
+
+        // Occluders rasterized on worker threads while the shadow pass is
+        // submitted; the camera passes wait for the results
+        if (settings.cpu_occlusion && !(settings.gpu_culling && cull_shader)) {
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), model_data.translate);
+            model = glm::scale(model, model_data.scale);
+            occlusion.begin(ourcamera.GetProjectMatrix() * view, occlusion_objects, models, model);
+        }
+        else {
+            occlusion.invalidate();
+        }
         
         // Shadow
         // ------
-        if (myimgui.shadowtype != 0) {
+        if (settings.shadowtype != 0) {
+            CPU_PROFILE_SCOPE("Shadow pass");
+            gpu_profiler.begin(GPU_PASS_SHADOW);
+            // The shadow map keeps its size whatever the render resolution
+            glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
+
             // Render shadow map to frame buffer
             // ---------------------------------
-            glBindFramebuffer(GL_FRAMEBUFFER, FBO_depthmap);
-            glEnable(GL_DEPTH_TEST);
-            glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-            glClear(GL_DEPTH_BUFFER_BIT);
+            // EVSM renders moments alongside the depth, other types only depth
+            Shader& shadowshader = settings.shadowtype == 4 ? momentshader : depthmapshader;
+            glstate.enable(GL_DEPTH_TEST);
+            if (settings.shadowtype == 4) {
+                moment_shadow.bind();
+            }
+            else {
+                glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO_depthmap);
+                glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+                glClear(GL_DEPTH_BUFFER_BIT);
+            }
         
+            // Model draws recorded while the cubes and floor are submitted
+            Model::Record(shadow_commands, shadowshader.ID, models, false, allMeshes, "Record shadow draws");
+
             // Render cube
-            depthmapshader.use();
-            for (int i = 0; i < cubes.num; i++) {
-                if (cubes.cast_shadow[i]) {
-                    depthmapshader.setMat4f("model", cubes.models[i]);
-                    cubes.render();
-                }
-            }
+            shadowshader.use();
+            shadowshader.setBool("instanced", true);
+            cubes.forEachBatch([&](unsigned int first, unsigned int count) {
+                if (cubes.cast_shadow[first])
+                    cubes.renderInstanced(first, count);
+            });
+            
+            // Render floor
+            quads.renderInstanced();
             
             // render the loaded model
             glm::mat4 model = glm::translate(glm::mat4(1.0f), model_data.translate);
             //model = glm::scale(model, glm::vec3(0.5f, 0.5f, 0.5f));
             model = glm::scale(model, model_data.scale);
-            depthmapshader.setMat4f("model", model);
-            for (Model m: models) {
-                m.Draw(depthmapshader);
+            shadowshader.setBool("instanced", false);
+            shadowshader.setMat4f("model", model);
+            gpu_profiler.begin(GPU_PASS_MODEL);
+            shadow_commands.replay();
+            gpu_profiler.end(GPU_PASS_MODEL);
+
+            // Blur and mipmap the moments once per shadow update
+            if (settings.shadowtype == 4) {
+                moment_shadow.filter(momentblurshader, quads);
+                glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
+                glstate.activeTexture(GL_TEXTURE6);
+                glstate.bindTexture(GL_TEXTURE_2D, moment_shadow.moments);
             }
-            
-            // Render floor
-            for (int i = 0; i < quads.num; i++) {
-                depthmapshader.setMat4f("model", quads.models[i]);
-                quads.render();
+
+            // Min/max mips for the PCSS blocker search early-out
+            if (settings.shadowtype == 3 && settings.pcss_accelerated) {
+                shadow_pyramid.build(minmax_init_shader, minmax_reduce_shader, quads, texture_depth_framebuffer);
+                glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
+                glstate.activeTexture(GL_TEXTURE5);
+                glstate.bindTexture(GL_TEXTURE_2D, shadow_pyramid.texture);
             }
+
+            gpu_profiler.end(GPU_PASS_SHADOW);
         }
+        glViewport(0, 0, render_width, render_height);
         
-        if (myimgui.ssao && myimgui.rendertype != 2) {
+        if (settings.ssao && settings.rendertype != 2) {
+            CPU_PROFILE_SCOPE("SSAO");
             renderToGbuffer();
             
-            glBindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
-            //glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            // Full resolution, or on a closest-depth downsample of the G-buffer
+            bool low_res = settings.ssao_resolution > 0;
+            int factor = 1 << settings.ssao_resolution;
+            if (low_res && factor != low_res_ao.factor)
+                resizeLowResAO(factor);
+            GLuint ao_position = low_res ? low_res_ao.position : gPosition;
+            GLuint ao_normal = low_res ? low_res_ao.normal : gNormal;
+            GLuint ao_depth = low_res ? low_res_ao.depth : gShadow;
+            GLuint ao_raw = low_res ? low_res_ao.ao : ssaoColorBuffer;
+            int ao_width = low_res ? low_res_ao.width : render_width;
+            int ao_height = low_res ? low_res_ao.height : render_height;
+            
+            gpu_profiler.begin(GPU_PASS_SSAO);
+            if (low_res)
+                low_res_ao.downsample(ssao_downsample_shader, quads, gPosition, gNormal, gShadow);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, low_res ? low_res_ao.aoFBO : ssaoFBO);
+            //glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST); // Very important
-            ssaoshader.use();
-            ssaoshader.setViewMat(view);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, gPosition);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, gNormal);
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, gShadow);
-            glActiveTexture(GL_TEXTURE3);
-            glBindTexture(GL_TEXTURE_2D, noiseTexture);
+            glstate.disable(GL_DEPTH_TEST); // Very important
+            if (settings.ao_technique == 1) {
+                // A few horizon-searched directions, rotated every frame
+                gtaoshader.use();
+                gtaoshader.setViewMat(view);
+                gtaoshader.setInt("slices", settings.gtao_slices);
+                gtaoshader.setInt("steps", settings.gtao_steps);
+                gtaoshader.setInt("frameIndex", settings.temporal ? frame_index : 0);
+            }
+            else {
+                ssaoshader.use();
+                ssaoshader.setViewMat(view);
+                ssaoshader.setVec2f("noiseScale", glm::vec2(ao_width / 4.0f, ao_height / 4.0f));
+                // 8 of the 64 kernel taps per frame, the whole kernel every 8 frames
+                int taps = settings.temporal ? SSAO_TEMPORAL_TAPS : 64;
+                ssaoshader.setInt("kernelSize", taps);
+                ssaoshader.setInt("kernelOffset", settings.temporal ? (frame_index * taps) % 64 : 0);
+            }
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, ao_position);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, ao_normal);
+            glstate.activeTexture(GL_TEXTURE2);
+            glstate.bindTexture(GL_TEXTURE_2D, ao_depth);
+            glstate.activeTexture(GL_TEXTURE3);
+            glstate.bindTexture(GL_TEXTURE_2D, noiseTexture);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SSAO);
+            
+            GLuint ssao_result = ao_raw;
+            if (settings.temporal) {
+                gpu_profiler.begin(GPU_PASS_TEMPORAL);
+                TemporalHistory& history = low_res ? low_res_ao_history : ao_history;
+                history.resolve(temporalshader, quads, ao_raw, ao_position, ao_depth, prev_view_projection, 1.0f / SSAO_TEMPORAL_FRAMES);
+                ssao_result = history.output;
+                gpu_profiler.end(GPU_PASS_TEMPORAL);
+            }
             
             // 3. blur SSAO texture to remove noise
-            glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
-            // glBindFramebuffer(GL_FRAMEBUFFER, 0);
-            glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
-            ssaoblurshader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
-            quads.render();
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.begin(GPU_PASS_SSAO_BLUR);
+            if (low_res) {
+                low_res_ao.blur(ssao_bilateral_shader, quads, ssao_result);
+                gpu_profiler.end(GPU_PASS_SSAO_BLUR);
+                gpu_profiler.begin(GPU_PASS_SSAO_UPSAMPLE);
+                low_res_ao.upsample(ssao_upsample_shader, quads, ssaoBlurFBO, render_width, render_height, gNormal, gShadow);
+                gpu_profiler.end(GPU_PASS_SSAO_UPSAMPLE);
+            }
+            else {
+                glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
+                // glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+                glClear(GL_COLOR_BUFFER_BIT);
+                glstate.disable(GL_DEPTH_TEST);
+                ssaoblurshader.use();
+                glstate.activeTexture(GL_TEXTURE0);
+                glstate.bindTexture(GL_TEXTURE_2D, ssao_result);
+                quads.render();
+                gpu_profiler.end(GPU_PASS_SSAO_BLUR);
+            }
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
         }
         
         // Normal rendering
         // ----------------
-        if (myimgui.rendertype == 0) {
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (settings.rendertype == 0) {
+            CPU_PROFILE_SCOPE("Forward shading");
+            occlusion.finish();
+            // Model draws of both passes recorded while the rest is submitted
+            if (settings.depth_prepass)
+                occlusion.recordModels(depth_commands, depthprepassshader.ID, models, true, "Record depth pre-pass draws");
+            occlusion.recordModels(forward_commands, blinnphongshader_shadow.ID, models, false, "Record forward draws");
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
             
-            glEnable(GL_DEPTH_TEST);
+            glstate.enable(GL_DEPTH_TEST);
+
+            glm::mat4 model = glm::mat4(1.0f);
+            model = glm::translate(model, model_data.translate);
+            //model = glm::scale(model, glm::vec3(0.5f, 0.5f, 0.5f));    // it's a bit too big for our scene, so scale it down
+            model = glm::scale(model, model_data.scale);
+            //model = glm::scale(model, glm::vec3(100.0f, 100.0f, 100.0f));
+
+            // Depth pre-pass: positions only, no color, so that the lighting
+            // below shades each pixel once with GL_EQUAL and no depth writes
+            if (settings.depth_prepass) {
+                gpu_profiler.begin(GPU_PASS_DEPTH_PREPASS);
+                overdraw.begin(OverdrawCounter::DEPTH);
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                depthprepassshader.setMVP(cubes.models[0], view);
+                depthprepassshader.setBool("instanced", true);
+                // The light cube is drawn with its own shader, and depth test, below
+                cubes.forEachBatch([&](unsigned int first, unsigned int count) {
+                    if (cubes.textures[first] > 0)
+                        occlusion.renderInstanced(cubes, 0, first, count);
+                });
+                quads.forEachBatch([&](unsigned int first, unsigned int count) {
+                    occlusion.renderInstanced(quads, 1, first, count);
+                });
+                depthprepassshader.setBool("instanced", false);
+                depthprepassshader.setMVP(model, view);
+                depth_commands.replay();
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                overdraw.end(OverdrawCounter::DEPTH);
+                gpu_profiler.end(GPU_PASS_DEPTH_PREPASS);
+
+                glstate.depthFunc(GL_EQUAL);
+                glstate.depthMask(GL_FALSE);
+            }
+            overdraw.begin(OverdrawCounter::SHADED);
 
             blinnphongshader_shadow.setMVP(cubes.models[0], view);
             blinnphongshader_shadow.setVec3f("viewPos", ourcamera.Position);
-            blinnphongshader_shadow.setInt("imgui_shadowtype", myimgui.shadowtype);
+            blinnphongshader_shadow.setInt("imgui_shadowtype", settings.shadowtype);
+            blinnphongshader_shadow.setBool("pcss_accelerated", settings.pcss_accelerated);
+            blinnphongshader_shadow.setBool("instanced", true);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
             
             // Render cube
-            for (int i = 0; i < cubes.num; i++) {
-                if (cubes.textures[i] > 0) {
-                    blinnphongshader_shadow.setModelMat(cubes.models[i]);
-                    if (cubes.textures[i] > 0) {
-                        glActiveTexture(GL_TEXTURE0);
-                        glBindTexture(GL_TEXTURE_2D, cubes.textures[i]);
-                    }
-                    //glActiveTexture(GL_TEXTURE0);
-                    //glBindTexture(GL_TEXTURE_2D, cubes.textures[i]);
-                    glActiveTexture(GL_TEXTURE1);
-                    glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
-                    cubes.render();
+            cubes.forEachBatch([&](unsigned int first, unsigned int count) {
+                if (cubes.textures[first] > 0) {
+                    blinnphongshader_shadow.use();
+                    glstate.activeTexture(GL_TEXTURE0);
+                    glstate.bindTexture(GL_TEXTURE_2D, cubes.textures[first]);
+                    occlusion.renderInstanced(cubes, 0, first, count);
                 }
                 else {
                     lightshader.setMVP(cubes.models[2], view);
+                    if (settings.depth_prepass) {
+                        glstate.depthFunc(GL_LESS);
+                        glstate.depthMask(GL_TRUE);
+                    }
                     cubes.render();
+                    if (settings.depth_prepass) {
+                        glstate.depthFunc(GL_EQUAL);
+                        glstate.depthMask(GL_FALSE);
+                    }
                 }
-            }
+            });
             
             // Render floor
-            for (int i = 0; i < quads.num; i++) {
-                blinnphongshader_shadow.setMVP(quads.models[i], view);
-                if (quads.textures[i] > 0) {
-                    glActiveTexture(GL_TEXTURE0);
-                    glBindTexture(GL_TEXTURE_2D, quads.textures[i]);
+            blinnphongshader_shadow.use();
+            quads.forEachBatch([&](unsigned int first, unsigned int count) {
+                if (quads.textures[first] > 0) {
+                    glstate.activeTexture(GL_TEXTURE0);
+                    glstate.bindTexture(GL_TEXTURE_2D, quads.textures[first]);
                 }
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
-                quads.render();
-            }
+                occlusion.renderInstanced(quads, 1, first, count);
+            });
             
             // render the loaded model
             blinnphongshader_shadow.use();
-            glm::mat4 model = glm::mat4(1.0f);
-            model = glm::translate(model, model_data.translate);
-            //model = glm::scale(model, glm::vec3(0.5f, 0.5f, 0.5f));    // it's a bit too big for our scene, so scale it down
-            model = glm::scale(model, model_data.scale);
-            //model = glm::scale(model, glm::vec3(100.0f, 100.0f, 100.0f));
+            blinnphongshader_shadow.setBool("instanced", false);
             blinnphongshader_shadow.setMVP(model, view);
-            for (Model m: models) {
-                m.Draw(blinnphongshader_shadow);
-            }
+            gpu_profiler.begin(GPU_PASS_MODEL);
+            forward_commands.replay();
+            gpu_profiler.end(GPU_PASS_MODEL);
+
+            overdraw.end(OverdrawCounter::SHADED);
+            glstate.depthFunc(GL_LESS);
+            glstate.depthMask(GL_TRUE);
         }
         // Deferred rendering
         // ------------------
-        else if (myimgui.rendertype == 1) {
+        else if (settings.rendertype == 1) {
+            CPU_PROFILE_SCOPE("Deferred shading");
             renderToGbuffer();
+            glm::mat4 vpmat = projection * view;
+            
+            // Closest depth mips for the reflection tracing
+            if (settings.hiz_ssr) {
+                gpu_profiler.begin(GPU_PASS_HIZ);
+                if (!hiz_built) {
+                    hiz->build(minmax_init_shader, minmax_reduce_shader, quads, gShadow, 1);
+                    glViewport(0, 0, render_width, render_height);
+                }
+                glstate.activeTexture(GL_TEXTURE8);
+                glstate.bindTexture(GL_TEXTURE_2D, hiz->texture);
+                gpu_profiler.end(GPU_PASS_HIZ);
+            }
+            
+            // Move the local lights and sort them into clusters
+            // -------------------------------------------------
+            int light_assignment = settings.light_assignment == 2 && !cluster_assign_shader ? 1 : settings.light_assignment;
+            if (settings.num_lights > 0) {
+                CPU_PROFILE_SCOPE("Light assignment");
+                gpu_profiler.begin(GPU_PASS_LIGHT_ASSIGN);
+                if (settings.num_lights != (int)clustered_lights.lights.size() || settings.light_radius != clustered_lights.radius)
+                    clustered_lights.generate(settings.num_lights, settings.light_radius);
+                clustered_lights.animate(frame_index / 60.0f);
+                if (light_assignment == 1)
+                    clustered_lights.assignCPU(view, projection);
+                else if (light_assignment == 2)
+                    clustered_lights.assignCompute(*cluster_assign_shader, view, projection);
+                gpu_profiler.end(GPU_PASS_LIGHT_ASSIGN);
+            }
+            
+            // Jittered, coarse reflections accumulated over frames
+            // ----------------------------------------------------
+            if (settings.temporal) {
+                gpu_profiler.begin(GPU_PASS_SSR);
+                glstate.bindFramebuffer(GL_FRAMEBUFFER, ssrFBO);
+                glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+                glClear(GL_COLOR_BUFFER_BIT);
+                glstate.disable(GL_DEPTH_TEST);
+                if (settings.stencil_lighting) {
+                    glstate.enable(GL_STENCIL_TEST);
+                    glStencilMask(0x00);
+                    glStencilFunc(GL_EQUAL, STENCIL_MIRROR, 0xFF);
+                }
+                ssrshader.use();
+                glstate.activeTexture(GL_TEXTURE0);
+                glstate.bindTexture(GL_TEXTURE_2D, gPosition);
+                glstate.activeTexture(GL_TEXTURE1);
+                glstate.bindTexture(GL_TEXTURE_2D, gNormal);
+                glstate.activeTexture(GL_TEXTURE2);
+                glstate.bindTexture(GL_TEXTURE_2D, gAlbedoSpec);
+                glstate.activeTexture(GL_TEXTURE3);
+                glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+                ssrshader.setVec3f("lightPos", light.Position);
+                ssrshader.setVec3f("viewPos", ourcamera.Position);
+                ssrshader.setMat4f("VPMatrix", vpmat);
+                ssrshader.setInt("frameIndex", frame_index);
+                ssrshader.setBool("hiz_ssr", settings.hiz_ssr);
+                ssrshader.setInt("hiZLevels", hiz->levels);
+                quads.render();
+                glstate.disable(GL_STENCIL_TEST);
+                gpu_profiler.end(GPU_PASS_SSR);
+                
+                gpu_profiler.begin(GPU_PASS_TEMPORAL);
+                ssr_history.resolve(temporalshader, quads, ssrColor, gPosition, gShadow, prev_view_projection, SSR_TEMPORAL_ALPHA);
+                gpu_profiler.end(GPU_PASS_TEMPORAL);
+            }
     
             // Render to screen
             // ----------------
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.begin(GPU_PASS_DEFERRED);
+            // The clear is the sky, the G-buffer stencil limits each pass
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, settings.stencil_lighting ? lightingFBO : sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             deferredrendershader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, gPosition);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, gNormal);
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, gAlbedoSpec);
-            glActiveTexture(GL_TEXTURE3);
-            glBindTexture(GL_TEXTURE_2D, gShadow);
-            glActiveTexture(GL_TEXTURE4);
-            glBindTexture(GL_TEXTURE_2D, ssaoColorBufferBlur);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, gPosition);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, gNormal);
+            glstate.activeTexture(GL_TEXTURE2);
+            glstate.bindTexture(GL_TEXTURE_2D, gAlbedoSpec);
+            glstate.activeTexture(GL_TEXTURE3);
+            glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+            glstate.activeTexture(GL_TEXTURE4);
+            glstate.bindTexture(GL_TEXTURE_2D, ssaoColorBufferBlur);
+            glstate.activeTexture(GL_TEXTURE5);
+            glstate.bindTexture(GL_TEXTURE_2D, ssr_history.output);
+            glstate.activeTexture(GL_TEXTURE7);
+            glstate.bindTexture(GL_TEXTURE_2D, settings.ssao_resolution > 0 ? low_res_ao.bent_normal : ssaoBentNormal);
             // send light relevant uniforms
             deferredrendershader.setVec3f("lightPos", light.Position);
             deferredrendershader.setVec3f("viewPos", ourcamera.Position);
-            glm::mat4 vpmat = projection * view;
             deferredrendershader.setMat4f("VPMatrix", vpmat);
-            deferredrendershader.setInt("numray", myimgui.numray);
-            deferredrendershader.setBool("AO", myimgui.ssao);
+            deferredrendershader.setBool("ssr_temporal", settings.temporal);
+            deferredrendershader.setBool("hiz_ssr", settings.hiz_ssr);
+            deferredrendershader.setInt("hiZLevels", hiz->levels);
+            deferredrendershader.setBool("bent_normal_ambient", settings.ssao && settings.ao_technique == 1);
+            deferredrendershader.setInt("numray", settings.numray);
+            deferredrendershader.setBool("AO", settings.ssao);
+            deferredrendershader.setInt("numLocalLights", 0);
+            if (settings.num_lights > 0) {
+                clustered_lights.bind(deferredrendershader, 9);
+                deferredrendershader.setInt("light_assignment", light_assignment);
+                deferredrendershader.setViewMat(view);
+            }
             
-            // finally render quad
-            quads.render();
+            // finally render quad, once per stencil class
+            if (settings.stencil_lighting) {
+                glstate.enable(GL_STENCIL_TEST);
+                glStencilMask(0x00);
+                for (int stencil_class : {STENCIL_OPAQUE, STENCIL_MIRROR}) {
+                    glStencilFunc(GL_EQUAL, stencil_class, 0xFF);
+                    deferredrendershader.setInt("stencil_class", stencil_class);
+                    quads.render();
+                }
+                glstate.disable(GL_STENCIL_TEST);
+            }
+            else {
+                deferredrendershader.setInt("stencil_class", 0);
+                quads.render();
+            }
+            gpu_profiler.end(GPU_PASS_DEFERRED);
         }
         // Create SSAO texture
         // -------------------
-        else if (myimgui.rendertype == 2) {
+        else if (settings.rendertype == 2) {
+            CPU_PROFILE_SCOPE("SSAO debug");
             renderToGbuffer();
             
-            glBindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
-            //glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.begin(GPU_PASS_SSAO);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
+            //glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST); // Very important
+            glstate.disable(GL_DEPTH_TEST); // Very important
             ssaoshader.use();
             ssaoshader.setViewMat(view);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, gPosition);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, gNormal);
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, gShadow);
-            glActiveTexture(GL_TEXTURE3);
-            glBindTexture(GL_TEXTURE_2D, noiseTexture);
+            ssaoshader.setVec2f("noiseScale", glm::vec2(render_width / 4.0f, render_height / 4.0f));
+            ssaoshader.setInt("kernelSize", 64);
+            ssaoshader.setInt("kernelOffset", 0);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, gPosition);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, gNormal);
+            glstate.activeTexture(GL_TEXTURE2);
+            glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+            glstate.activeTexture(GL_TEXTURE3);
+            glstate.bindTexture(GL_TEXTURE_2D, noiseTexture);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SSAO);
             
             // 3. blur SSAO texture to remove noise
-            // glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.begin(GPU_PASS_SSAO_BLUR);
+            // glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             ssaoblurshader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
             quads.render();
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.end(GPU_PASS_SSAO_BLUR);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
         }
         // DEBUG: visualize depth map from light
         // -------------------------------------
-        else if (myimgui.rendertype == 3) {
+        else if (settings.rendertype == 3) {
+            CPU_PROFILE_SCOPE("Shadow map debug");
             // Shadowmap must be rendered before visualization
-            assert(myimgui.shadowtype != 0);
+            assert(settings.shadowtype != 0);
             
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             screenshader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
             
             // finally render quad
             quads.render();
         }
         // DEBUG mesh: render a curve
         // --------------------------
-        else if (myimgui.rendertype == 4) {
+        else if (settings.rendertype == 4) {
+            CPU_PROFILE_SCOPE("Height field");
             
             // Render floor
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            glEnable(GL_DEPTH_TEST);
+            glstate.enable(GL_DEPTH_TEST);
             
             blinnphongshader_shadow.setMVP(cubes.models[0], view);
             blinnphongshader_shadow.setVec3f("viewPos", ourcamera.Position);
-            blinnphongshader_shadow.setInt("imgui_shadowtype", myimgui.shadowtype);
+            blinnphongshader_shadow.setInt("imgui_shadowtype", settings.shadowtype);
+            blinnphongshader_shadow.setBool("pcss_accelerated", settings.pcss_accelerated);
             
             blinnphongshader_shadow.setMVP(quads.models[0], view);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, quads.textures[0]);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, quads.textures[0]);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
             quads.render();
             
-            // Render fluid surface
-            glBindFramebuffer(GL_FRAMEBUFFER, heightFBO);
+            // Render fluid surface (in the screen-sized viewport it was tuned for)
+            glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, heightFBO);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             fluidsimulationshader.use();
             quads.render();
+            glViewport(0, 0, render_width, render_height);
             
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             heightshader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, heightBuffer);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, heightBuffer);
             heightshader.setMVP(meshes.models[0], view);
             meshes.render();
         }
         // Shallow water equation
         // ----------------------
-        else if (myimgui.rendertype == 5) {
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        else if (settings.rendertype == 5) {
+            CPU_PROFILE_SCOPE("Shallow water");
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            glEnable(GL_DEPTH_TEST);
+            glstate.enable(GL_DEPTH_TEST);
             
             blinnphongshader_shadow.setMVP(cubes.models[0], view);
             blinnphongshader_shadow.setVec3f("viewPos", ourcamera.Position);
-            blinnphongshader_shadow.setInt("imgui_shadowtype", myimgui.shadowtype);
+            blinnphongshader_shadow.setInt("imgui_shadowtype", settings.shadowtype);
+            blinnphongshader_shadow.setBool("pcss_accelerated", settings.pcss_accelerated);
             
             // Render floor
             blinnphongshader_shadow.setMVP(quads.models[0], view);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, quads.textures[0]);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, quads.textures[0]);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
             quads.render();
 
             // Render floor (deffered rendering) (prepare to be used in refraction of SWE surface)
@@ -762,161 +1609,182 @@ int main()
 //                gbuffershader.setModelMat(quads.models[i]);
 //                gbuffershader.setBool("is_mirror", cubes.ismirror[i]);
 //                if (quads.textures[i] > 0) {
-//                    glActiveTexture(GL_TEXTURE0);
-//                    glBindTexture(GL_TEXTURE_2D, quads.textures[i]);
+//                    glstate.activeTexture(GL_TEXTURE0);
+//                    glstate.bindTexture(GL_TEXTURE_2D, quads.textures[i]);
 //                }
-//                glActiveTexture(GL_TEXTURE1);
-//                glBindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
+//                glstate.activeTexture(GL_TEXTURE1);
+//                glstate.bindTexture(GL_TEXTURE_2D, texture_depth_framebuffer);
 //                quads.render();
 //            }
 
             // SWE initialization (periodically)
             // ---------------------------------
-            // if (myimgui.swe_tick_count % 100 == 0) {
-            //     glBindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
+            // if (settings.swe_tick_count % 100 == 0) {
+            //     glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
             //     glClear(GL_COLOR_BUFFER_BIT);
-            //     glDisable(GL_DEPTH_TEST);
+            //     glstate.disable(GL_DEPTH_TEST);
             //     swe_init_shader.use();
-            //     glActiveTexture(GL_TEXTURE0);
-            //     glBindTexture(GL_TEXTURE_2D, sweBuffer1);
+            //     glstate.activeTexture(GL_TEXTURE0);
+            //     glstate.bindTexture(GL_TEXTURE_2D, sweBuffer1);
             //     quads.render();
             // }
-            // myimgui.swe_tick_count++;
+            // settings.swe_tick_count++;
+
+            // The simulation grid is independent of the render resolution
+            glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
 
             // SWE initialization (by keyboard)
             // --------------------------------
-            if (init_wave) {
-                glBindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
+            if (packet.init_wave) {
+                glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
                 glClear(GL_COLOR_BUFFER_BIT);
-                glDisable(GL_DEPTH_TEST);
+                glstate.disable(GL_DEPTH_TEST);
                 swe_init_shader.use();
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, sweBuffer1);
+                glstate.activeTexture(GL_TEXTURE0);
+                glstate.bindTexture(GL_TEXTURE_2D, sweBuffer1);
                 quads.render();
-                init_wave = false;
             }
 
             // SWE simulation
             // --------------
 
             // SWE advect
-            glBindFramebuffer(GL_FRAMEBUFFER, sweFBO1);
+            gpu_profiler.begin(GPU_PASS_SWE_ADVECT);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO1);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             swe_v_advect_shader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, sweBuffer2);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, sweBuffer2);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SWE_ADVECT);
 
             // SWE height integration
-            glBindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
+            gpu_profiler.begin(GPU_PASS_SWE_HEIGHT);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             swe_h_int_shader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, sweBuffer1);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, sweBuffer1);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SWE_HEIGHT);
 
             // SWE velocity integration
-            glBindFramebuffer(GL_FRAMEBUFFER, sweFBO1);
+            gpu_profiler.begin(GPU_PASS_SWE_VELOCITY);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO1);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             swe_v_int_shader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, sweBuffer2);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, sweBuffer2);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SWE_VELOCITY);
             
             // Swap buffers
-            glBindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
+            gpu_profiler.begin(GPU_PASS_SWE_SWAP);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sweFBO2);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             swe_writebuffer_shader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, sweBuffer1);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, sweBuffer1);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SWE_SWAP);
             
             // SWE rendering
             // -------------
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glViewport(0, 0, render_width, render_height);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             heightshader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, sweBuffer2);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, sweBuffer2);
             heightshader.setMVP(meshes.models[0], view);
             heightshader.setVec3f("viewPos", ourcamera.Position);
             meshes.render();
         }
         // Inversed SSAO
         // -------------
-        else if (myimgui.rendertype == 6) {
+        else if (settings.rendertype == 6) {
+            CPU_PROFILE_SCOPE("Inverse SSAO debug");
             renderToGbuffer();
             
-            glBindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
-            //glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.begin(GPU_PASS_SSAO);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
+            //glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST); // Very important
+            glstate.disable(GL_DEPTH_TEST); // Very important
             inv_ssaoshader.use();
             inv_ssaoshader.setViewMat(view);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, gPosition);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, gNormal);
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, gShadow);
-            glActiveTexture(GL_TEXTURE3);
-            glBindTexture(GL_TEXTURE_2D, noiseTexture);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, gPosition);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, gNormal);
+            glstate.activeTexture(GL_TEXTURE2);
+            glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+            glstate.activeTexture(GL_TEXTURE3);
+            glstate.bindTexture(GL_TEXTURE_2D, noiseTexture);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SSAO);
             
             // 3. blur SSAO texture to remove noise
-            // glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.begin(GPU_PASS_SSAO_BLUR);
+            // glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             ssaoblurshader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
             quads.render();
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.end(GPU_PASS_SSAO_BLUR);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
         }
         // Subsurface scattering
         // ---------------------
-        else if (myimgui.rendertype == 7) {
+        else if (settings.rendertype == 7) {
+            CPU_PROFILE_SCOPE("Subsurface scattering");
             renderToGbuffer();
             
             // Generate SSAO texture
-            glBindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
-            //glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            gpu_profiler.begin(GPU_PASS_SSAO);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoFBO);
+            //glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST); // Very important
+            glstate.disable(GL_DEPTH_TEST); // Very important
             inv_ssaoshader.use();
             inv_ssaoshader.setViewMat(view);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, gPosition);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, gNormal);
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, gShadow);
-            glActiveTexture(GL_TEXTURE3);
-            glBindTexture(GL_TEXTURE_2D, noiseTexture);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, gPosition);
+            glstate.activeTexture(GL_TEXTURE1);
+            glstate.bindTexture(GL_TEXTURE_2D, gNormal);
+            glstate.activeTexture(GL_TEXTURE2);
+            glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+            glstate.activeTexture(GL_TEXTURE3);
+            glstate.bindTexture(GL_TEXTURE_2D, noiseTexture);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SSAO);
             
             // Blur SSAO texture to remove noise
-            glBindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
+            gpu_profiler.begin(GPU_PASS_SSAO_BLUR);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, ssaoBlurFBO);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             ssaoblurshader.use();
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, ssaoColorBuffer);
             quads.render();
+            gpu_profiler.end(GPU_PASS_SSAO_BLUR);
             
             // Rendering floor
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClear(GL_COLOR_BUFFER_BIT);
-            glDisable(GL_DEPTH_TEST);
+            glstate.disable(GL_DEPTH_TEST);
             blinnphongshader_shadow.setMVP(quads.models[0], view);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, quads.textures[0]);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, quads.textures[0]);
             quads.render();
             
             // Rendering light
@@ -927,65 +1795,394 @@ int main()
             sss_shader.setMVP(cubes.models[2], view);
             sss_shader.setVec3f("lightPos", glm::vec3(7.0f, 1.0f, 7.0f));
             sss_shader.setVec3f("viewPos", ourcamera.Position);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, ssaoColorBufferBlur);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, ssaoColorBufferBlur);
             cubes.render();
         }
         // Physically based rendering
         // --------------------------
-        else if (myimgui.rendertype == 8) {
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        else if (settings.rendertype == 8) {
+            CPU_PROFILE_SCOPE("PBR");
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
             glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
             
-            glEnable(GL_DEPTH_TEST);
+            glstate.enable(GL_DEPTH_TEST);
             
             pbr_shader.use();
             pbr_shader.setVec3f("cam_pos", ourcamera.Position);
             
-            // Render sphere
-            for (int x = 0; x < 5; x++) {
-                for (int y = 0; y < 5; y++) {
-                    pbr_shader.setMVP(spheres.models[y * 5 + x], view);
-                    pbr_shader.setFloat("metallic", (float)(x+1) / 5.0f);
-                    pbr_shader.setFloat("roughness", (float)(y+1) / 5.0f);
-                    spheres.render();
+            // Render sphere, all in one draw with a material each. Culled
+            // against the frustum only, the GPU also decides the draw count.
+            if (settings.gpu_culling && cull_shader) {
+                gpu_profiler.begin(GPU_PASS_CULL);
+                sphere_culling->cull(*cull_shader, 0, projection * view, projection * view, false);
+                sphere_culling->compact(*cull_compact_shader, 0);
+                gpu_profiler.end(GPU_PASS_CULL);
+            }
+            pbr_shader.setMVP(spheres.models[0], view);
+            pbr_shader.setBool("instanced", true);
+            if (settings.gpu_culling && cull_shader)
+                sphere_culling->drawAll(0);
+            else
+                spheres.renderInstanced();
+        }
+        // Upscale the scene to the screen
+        // -------------------------------
+        gpu_profiler.begin(GPU_PASS_UPSCALE);
+        glViewport(0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT);
+        if (settings.upscale_filter == 0 || (render_width == 2 * SCR_WIDTH && render_height == 2 * SCR_HEIGHT)) {
+            glstate.bindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+            glstate.bindFramebuffer(GL_DRAW_FRAMEBUFFER, screenFBO);
+            glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        }
+        else {
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, screenFBO);
+            glstate.disable(GL_DEPTH_TEST);
+            upscaleshader.use();
+            upscaleshader.setInt("filter_mode", settings.upscale_filter);
+            upscaleshader.setFloat("sharpness", settings.upscale_sharpness);
+            glstate.activeTexture(GL_TEXTURE0);
+            glstate.bindTexture(GL_TEXTURE_2D, sceneColor);
+            quads.render();
+        }
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, screenFBO);
+        gpu_profiler.end(GPU_PASS_UPSCALE);
+
+        // UI built by the main thread
+        // ---------------------------
+        // Stats of a frame whose passes did not use the results
+        occlusion.finish();
+        jobs.runMainThreadJobs();
+        JobStats job_stats = jobs.frameStats();
+        GLStateStats gl_state_stats = glstate.frameStats();
+        gpu_profiler.begin(GPU_PASS_IMGUI);
+        // The backend restores the state it changes, the cache stays valid
+        myimgui.render(packet.ui.get());
+        gpu_profiler.end(GPU_PASS_IMGUI);
+
+        gpu_profiler.endFrame();
+        overdraw.endFrame(render_width * render_height);
+        GLCallStats gl_calls = gltrace.frameStats();
+        gpumemory.checkBudget(settings.gpu_memory_budget_mb);
+        // Both threads' allocations since the previous frame
+        HeapStats heap_stats = heaptracker.frameStats();
+        if (settled_frames >= HEAP_SETTLE_FRAMES && (!bench_mode || packet.frame >= bench.warmup_frames))
+            heaptracker.assertNoAllocations(heap_stats, packet.frame);
+
+        // Histories of passes that did not run this frame are stale
+        if (!settings.temporal || !settings.ssao || settings.rendertype == 2 || settings.ssao_resolution > 0)
+            ao_history.valid = false;
+        if (!settings.temporal || !settings.ssao || settings.rendertype == 2 || settings.ssao_resolution == 0)
+            low_res_ao_history.valid = false;
+        if (!settings.temporal || settings.rendertype != 1)
+            ssr_history.valid = false;
+        prev_view_projection = projection * view;
+        frame_index++;
+
+        if (!bench_mode) {
+            CPU_PROFILE_SCOPE("Swap");
+            glfwSwapBuffers(window);
+        }
+        float latency_ms = (CpuProfiler::now() - packet.input_time) / 1e6f;
+
+        if (bench_mode && packet.frame >= bench.warmup_frames) {
+            if (settings.cpu_occlusion) {
+                occlusion_sum.culled_draws += occlusion.stats.culled_draws;
+                occlusion_sum.culled_triangles += occlusion.stats.culled_triangles;
+                occlusion_sum.raster_ms += occlusion.stats.raster_ms;
+                occlusion_sum.test_ms += occlusion.stats.test_ms;
+                occlusion_frames++;
+            }
+            job_sum.threads = job_stats.threads;
+            job_sum.jobs += job_stats.jobs;
+            job_sum.main_thread_jobs += job_stats.main_thread_jobs;
+            job_sum.steals += job_stats.steals;
+            job_sum.busy_ms += job_stats.busy_ms;
+            job_sum.main_busy_ms += job_stats.main_busy_ms;
+            job_frames++;
+            for (int i = 0; i < GL_STATE_NUM_CALLS; i++) {
+                gl_state_sum.issued[i] += gl_state_stats.issued[i];
+                gl_state_sum.elided[i] += gl_state_stats.elided[i];
+            }
+            gl_calls_sum.add(gl_calls);
+            heap_allocations_sum += heap_stats.allocations;
+            heap_allocations_max = std::max(heap_allocations_max, heap_stats.allocations);
+            if (settings.rendertype == 0 && overdraw.shaded_per_pixel >= 0.0f) {
+                overdraw_depth_sum += std::max(overdraw.depth_per_pixel, 0.0f);
+                overdraw_shaded_sum += overdraw.shaded_per_pixel;
+                overdraw_frames++;
+            }
+            bench_latency_ms.push_back(latency_ms);
+        }
+
+        RenderFeedback& render_feedback = renderer.feedbackToPublish();
+        render_feedback.render_scale = resolution.scale;
+        render_feedback.render_width = render_width;
+        render_feedback.render_height = render_height;
+        render_feedback.job_stats = job_stats;
+        render_feedback.gl_state = gl_state_stats;
+        render_feedback.gl_calls = gl_calls;
+        render_feedback.gpu_memory = gpumemory;
+        render_feedback.heap = heap_stats;
+        render_feedback.occlusion = occlusion.stats;
+        render_feedback.overdraw = overdraw;
+        render_feedback.gpu = gpu_profiler;
+        render_feedback.latency_ms = latency_ms;
+        renderer.publish();
+    };
+
+    // The GL context moves with the rendering, between two frames
+    auto setRenderThread = [&](bool enabled) {
+        if (enabled == renderer.running())
+            return;
+        // Starting or joining the thread allocates. renderFrame owns
+        // settled_frames, only reset while no render thread runs.
+        if (enabled) {
+            settled_frames = 0;
+            auto makeCurrent = [&](bool current) {
+                if (bench_mode)
+                    offscreen.makeCurrent(current);
+                else
+                    glfwMakeContextCurrent(current ? window : nullptr);
+            };
+            makeCurrent(false);
+            renderer.start([makeCurrent]() { makeCurrent(true); jobs.setMainThread(); },
+                           renderFrame,
+                           [makeCurrent]() { makeCurrent(false); });
+        }
+        else {
+            renderer.stop();
+            settled_frames = 0;
+            if (bench_mode)
+                offscreen.makeCurrent(true);
+            else
+                glfwMakeContextCurrent(window);
+            jobs.setMainThread();
+        }
+    };
+
+    // render loop: input, UI and the frame packet here, GL in renderFrame
+    auto frame_start = std::chrono::steady_clock::now();
+    if (!bench_mode && !camera_path.keys.empty())
+        camera_path.startPlayback();
+    while (bench_mode ? bench_frame < bench.warmup_frames + bench.frames : !glfwWindowShouldClose(window))
+    {
+        CPU_PROFILE_SCOPE("Frame");
+        auto previous_frame_start = frame_start;
+        frame_start = std::chrono::steady_clock::now();
+        setRenderThread(myimgui.render_thread);
+        uint64_t input_time = CpuProfiler::now();
+
+        // input
+        if (!bench_mode) {
+            CPU_PROFILE_SCOPE("Input");
+            processInput(window);
+        }
+
+        // Camera path: fixed timestep poses override the input above
+        // -----------------------------------------------------------
+        if (bench_mode) {
+            // Warm-up frames stay on the first pose
+            int path_frame = std::max(bench_frame - bench.warmup_frames, 0);
+            bool on_path = camera_path.evaluate(path_frame, input_camera);
+            bench_segments.push_back(on_path && bench_frame >= bench.warmup_frames ? camera_path.segmentAt(path_frame * camera_path.timestep) : -1);
+        }
+        else {
+            if (toggle_camera_recording) {
+                toggle_camera_recording = false;
+                if (camera_path.recording) {
+                    camera_path.recording = false;
+                    camera_path.save("camera_path.bin");
+                }
+                else {
+                    camera_path.startRecording();
+                }
+            }
+            if (toggle_camera_playback) {
+                toggle_camera_playback = false;
+                if (camera_path.playing) {
+                    camera_path.playing = false;
+                }
+                else {
+                    if (camera_path.keys.empty())
+                        camera_path.load("camera_path.bin");
+                    camera_path.startPlayback();
                 }
             }
+            camera_path.record(input_camera);
+
+            // Wall time of the previous frame, including the swap
+            std::chrono::duration<float, std::milli> last_frame_ms = frame_start - previous_frame_start;
+            bool was_playing = camera_path.playing;
+            camera_path.reportFrame(last_frame_ms.count());
+            if (!camera_path.play(input_camera) && was_playing)
+                camera_path.printSegments();
         }
-        // Start the Dear ImGui frame
-        // --------------------------
-        myimgui.newframe();
 
-        if (!myimgui.opened_file_path.empty()) {
-            // An object can be placed here
-            models.emplace_back(myimgui.opened_file_path);
-            myimgui.opened_file_path.clear();
+        // UI, showing the render side results of an earlier frame
+        // -------------------------------------------------------
+        const RenderFeedback& feedback = renderer.readFeedback();
+        myimgui.gpu_timings = &feedback.gpu;
+        myimgui.occlusion_stats = &feedback.occlusion;
+        myimgui.overdraw = &feedback.overdraw;
+        myimgui.current_render_scale = feedback.render_scale;
+        myimgui.current_render_width = feedback.render_width;
+        myimgui.current_render_height = feedback.render_height;
+        myimgui.job_stats = feedback.job_stats;
+        myimgui.gl_state = feedback.gl_state;
+        myimgui.gl_calls = feedback.gl_calls;
+        myimgui.gpu_memory = feedback.gpu_memory;
+        myimgui.heap = feedback.heap;
+        myimgui.latency_ms = feedback.latency_ms;
+        ImDrawData* ui = myimgui.newframe();
+
+        if (dump_cpu_trace) {
+            // The threads' event rings are only read while no thread records:
+            // the render thread is joined (restarted next frame) and the
+            // workers drained
+            setRenderThread(false);
+            jobs.waitIdle();
+            CpuProfiler::dumpChromeTrace("cpu_trace.json");
+            dump_cpu_trace = false;
         }
+
         if (myimgui.camera_moved) {
-            ourcamera.Position.x = myimgui.camera_position[0];
-            ourcamera.Position.y = myimgui.camera_position[1];
-            ourcamera.Position.z = myimgui.camera_position[2];
+            input_camera.Position.x = myimgui.camera_position[0];
+            input_camera.Position.y = myimgui.camera_position[1];
+            input_camera.Position.z = myimgui.camera_position[2];
             myimgui.camera_moved = false;
         }
         if (myimgui.camera_yaw_moved) {
-            ourcamera.Yaw = myimgui.camera_yaw;
+            input_camera.Yaw = myimgui.camera_yaw;
             myimgui.camera_yaw_moved = false;
-            ourcamera.updateCameraVectors();
+            input_camera.updateCameraVectors();
         }
         if (myimgui.camera_pitch_moved) {
-            ourcamera.Pitch = myimgui.camera_pitch;
+            input_camera.Pitch = myimgui.camera_pitch;
             myimgui.camera_pitch_moved = false;
-            ourcamera.updateCameraVectors();
+            input_camera.updateCameraVectors();
         }
-        
-        // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-        glfwSwapBuffers(window);
+
+        // Frame packet, rendered here or by the render thread while the next
+        // one is prepared
+        // ------------------------------------------------------------------
+        FramePacket& packet = renderer.nextPacket();
+        packet.frame = bench_frame;
+        packet.input_time = input_time;
+        packet.camera = input_camera;
+        packet.settings = myimgui;
+        // Kept until the shallow water pass runs
+        packet.init_wave = init_wave && myimgui.rendertype == 5;
+        init_wave = init_wave && !packet.init_wave;
+        packet.opened_file_path = myimgui.opened_file_path;
+        myimgui.opened_file_path.clear();
+        packet.ui.capture(ui);
+        if (renderer.running())
+            renderer.submit();
+        else
+            renderFrame(packet);
+
+        if (bench_mode) {
+            std::chrono::duration<float, std::milli> frame_time = std::chrono::steady_clock::now() - frame_start;
+            bench_cpu_ms.push_back(frame_time.count());
+            bench_frame++;
+            continue;
+        }
+
+        // glfw: poll IO events (keys pressed/released, mouse moved etc.)
+        CPU_PROFILE_SCOPE("Poll events");
         glfwPollEvents();
     }
+    setRenderThread(false);
+
+    if (bench_mode) {
+        gpu_profiler.flush();
+        json extra = json::object();
+        if (occlusion_frames > 0) {
+            // Per measured frame averages
+            extra["occlusion"]["occluder_triangles"] = occlusion.stats.occluder_triangles;
+            extra["occlusion"]["tested"] = occlusion.stats.tested;
+            extra["occlusion"]["culled_draws"] = (float)occlusion_sum.culled_draws / occlusion_frames;
+            extra["occlusion"]["culled_triangles"] = (double)occlusion_sum.culled_triangles / occlusion_frames;
+            extra["occlusion"]["raster_ms"] = occlusion_sum.raster_ms / occlusion_frames;
+            extra["occlusion"]["test_ms"] = occlusion_sum.test_ms / occlusion_frames;
+        }
+        if (overdraw_frames > 0) {
+            // Fragments per pixel, read back a few frames late
+            if (bench.depth_prepass)
+                extra["overdraw"]["depth"] = overdraw_depth_sum / overdraw_frames;
+            extra["overdraw"]["shaded"] = overdraw_shaded_sum / overdraw_frames;
+        }
+        if (job_frames > 0) {
+            // Per measured frame averages
+            extra["jobs"]["threads"] = job_sum.threads;
+            extra["jobs"]["jobs"] = (float)job_sum.jobs / job_frames;
+            extra["jobs"]["main_thread_jobs"] = (float)job_sum.main_thread_jobs / job_frames;
+            extra["jobs"]["steals"] = (float)job_sum.steals / job_frames;
+            extra["jobs"]["busy_ms"] = job_sum.busy_ms / job_frames;
+            extra["jobs"]["main_busy_ms"] = job_sum.main_busy_ms / job_frames;
+            // State calls per frame, issued to GL and dropped by the cache
+            for (int i = 0; i < GL_STATE_NUM_CALLS; i++) {
+                extra["gl_state"]["issued"][GL_STATE_CALL_NAMES[i]] = (float)gl_state_sum.issued[i] / job_frames;
+                extra["gl_state"]["elided"][GL_STATE_CALL_NAMES[i]] = (float)gl_state_sum.elided[i] / job_frames;
+            }
+            // GL calls per frame, by kind, pass and entry point
+            if (GLTrace::ENABLED) {
+                GLCallStats::Pass total = gl_calls_sum.total();
+                for (int i = 0; i < GL_CALL_NUM_KINDS; i++)
+                    extra["gl_calls"][GL_CALL_KIND_NAMES[i]] = (float)total.calls[i] / job_frames;
+                extra["gl_calls"]["calls"] = (float)total.totalCalls() / job_frames;
+                extra["gl_calls"]["redundant"] = (float)total.redundant / job_frames;
+                extra["gl_calls"]["triangles"] = (double)total.triangles / job_frames;
+                for (int pass = 0; pass <= GLCallStats::MAX_PASSES; pass++) {
+                    const GLCallStats::Pass& stats = gl_calls_sum.passes[pass];
+                    if (stats.totalCalls() == 0 || (pass >= GPU_PASS_COUNT && pass != GLCallStats::OUTSIDE_PASSES))
+                        continue;
+                    json& entry = extra["gl_calls"]["passes"][pass < GPU_PASS_COUNT ? GPU_PASS_NAMES[pass] : "Outside passes"];
+                    entry["calls"] = (float)stats.totalCalls() / job_frames;
+                    entry["draws"] = (float)stats.calls[GL_CALL_DRAW] / job_frames;
+                    entry["uniforms"] = (float)stats.calls[GL_CALL_UNIFORM] / job_frames;
+                    entry["binds"] = (float)stats.calls[GL_CALL_BIND] / job_frames;
+                    entry["sync"] = (float)stats.calls[GL_CALL_SYNC] / job_frames;
+                    entry["redundant"] = (float)stats.redundant / job_frames;
+                    entry["triangles"] = (double)stats.triangles / job_frames;
+                }
+                for (int i = 0; i < GL_NUM_ENTRY_POINTS; i++)
+                    if (gl_calls_sum.calls[i] > 0)
+                        extra["gl_calls"]["entry_points"][GL_ENTRY_NAMES[i]] = (float)gl_calls_sum.calls[i] / job_frames;
+            }
+            if (HeapTracker::ENABLED) {
+                extra["heap"]["allocations"] = (float)heap_allocations_sum / job_frames;
+                extra["heap"]["max_allocations"] = heap_allocations_max;
+            }
+        }
+        // Allocations live at the end of the run, MB
+        for (int i = 0; i < GPU_MEMORY_NUM_CATEGORIES; i++)
+            extra["gpu_memory"][GPU_MEMORY_CATEGORY_NAMES[i]] = gpumemory.bytes[i] / (1024.0 * 1024.0);
+        extra["gpu_memory"]["total"] = gpumemory.total / (1024.0 * 1024.0);
+        extra["gpu_memory"]["peak"] = gpumemory.peak / (1024.0 * 1024.0);
+        // Input sampled to frame submitted, to compare with the render thread
+        if (!bench_latency_ms.empty())
+            extra["latency"] = benchSummary(bench_latency_ms);
+        json result = writeBenchResults(bench, bench_cpu_ms, gpu_profiler, bench_segments, extra);
+        int status = RegressionCheck::PASSED;
+        if (!regression.golden_dir.empty())
+            status = regression.run(bench, screenFBO, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, result);
+        releaseGpuMemory();
+        jobs.waitIdle();
+        CpuProfiler::dumpChromeTrace("cpu_trace.json");
+        offscreen.destroy();
+        return status;
+    }
+
+    // Keep the last frames' CPU markers for chrome://tracing
+    jobs.waitIdle();
+    CpuProfiler::dumpChromeTrace("cpu_trace.json");
 
     // optional: de-allocate all resources once they've outlived their purpose:
     lightshader.del();
+    releaseGpuMemory();
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
     glfwTerminate();
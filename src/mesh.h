@@ -14,9 +14,13 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "shader_s.h"
+#include "commandbuffer.h"
+#include "gpumemory.h"
 
+#include <cstdio>
 #include <string>
 #include <vector>
+#include <cmath>
 using namespace std;
 
 #define MAX_BONE_INFLUENCE 4
@@ -51,13 +55,18 @@ public:
     vector<unsigned int> indices;
     vector<Texture>      textures;
     unsigned int VAO;
+    // Positions only, in their own buffer, for depth-only passes
+    unsigned int depthVAO;
+    // object-space bounding box, for culling
+    glm::vec3 aabb_min;
+    glm::vec3 aabb_max;
 
     // constructor
     Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
     {
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
+        this->vertices = std::move(vertices);
+        this->indices = std::move(indices);
+        this->textures = std::move(textures);
 
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
@@ -65,6 +74,69 @@ public:
 
     // render the mesh
     void Draw(Shader &shader)
+    {
+        bindTextures(shader);
+        
+        // draw mesh
+        glstate.bindVertexArray(VAO);
+        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
+        glstate.bindVertexArray(0);
+
+        // always good practice to set everything back to defaults once configured.
+        glstate.activeTexture(GL_TEXTURE0);
+    }
+
+    // render the mesh's depth, no textures: the depth pre-pass reads 12
+    // bytes per vertex instead of the whole Vertex
+    void DrawDepth()
+    {
+        glstate.bindVertexArray(depthVAO);
+        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
+        glstate.bindVertexArray(0);
+    }
+
+    // Draw as commands, e.g. on a worker thread. The texture goes to unit 0
+    // like in Draw, where the sampler already points.
+    void Record(CommandBuffer &commands) const
+    {
+        if (!textures.empty())
+            commands.bindTexture(0, textures[0].id);
+        commands.drawElements(VAO, static_cast<unsigned int>(indices.size()));
+    }
+
+    // DrawDepth as commands
+    void RecordDepth(CommandBuffer &commands) const
+    {
+        commands.drawElements(depthVAO, static_cast<unsigned int>(indices.size()));
+    }
+
+    // render the mesh with the DrawElementsIndirectCommand at offset (bytes)
+    // of the bound GL_DRAW_INDIRECT_BUFFER, e.g. written by GPU culling
+    void DrawIndirect(Shader &shader, size_t offset)
+    {
+        bindTextures(shader);
+        glstate.bindVertexArray(VAO);
+        gl4.DrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)offset);
+        glstate.bindVertexArray(0);
+        glstate.activeTexture(GL_TEXTURE0);
+    }
+
+    // Deletes the vertex arrays and buffers, not the textures, which meshes
+    // share. Meshes are copied around with their GL names, so this is called
+    // once by the owner of the last copy rather than by a destructor.
+    void release()
+    {
+        GLuint vertex_arrays[] = { VAO, depthVAO };
+        GLuint buffers[] = { VBO, EBO, positionVBO };
+        glstate.deleteVertexArrays(2, vertex_arrays);
+        gpumemory.deleteBuffers(3, buffers);
+    }
+
+private:
+    // render data
+    unsigned int VBO, EBO, positionVBO;
+
+    void bindTextures(Shader &shader)
     {
         // Bug: textures.size() of model medieval_town/medieval_house_1 is 2 when compiled with MSVC,
         // throw the second (or first) copy solves the problem.
@@ -83,56 +155,59 @@ public:
         unsigned int heightNr   = 1;
         for(unsigned int i = 0; i < textures.size(); i++)
         {
-            glActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
-            // retrieve texture number (the N in diffuse_textureN)
-            string number;
-            string name = textures[i].type;
+            glstate.activeTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
+            // retrieve texture number (the N in diffuse_textureN), the
+            // uniform name is built on the stack: this runs for every draw
+            const string& name = textures[i].type;
+            unsigned int number = 0;
             if(name == "texture_diffuse")
-                number = std::to_string(diffuseNr++);
+                number = diffuseNr++;
             else if(name == "texture_specular")
-                number = std::to_string(specularNr++); // transfer unsigned int to string
+                number = specularNr++;
             else if(name == "texture_normal")
-                number = std::to_string(normalNr++); // transfer unsigned int to string
+                number = normalNr++;
              else if(name == "texture_height")
-                number = std::to_string(heightNr++); // transfer unsigned int to string
+                number = heightNr++;
+            char uniform[64];
+            if (number > 0)
+                snprintf(uniform, sizeof(uniform), "%s%u", name.c_str(), number);
+            else
+                snprintf(uniform, sizeof(uniform), "%s", name.c_str());
 
             // now set the sampler to the correct texture unit
-            glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
+            glUniform1i(glGetUniformLocation(shader.ID, uniform), i);
             // and finally bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
+            glstate.bindTexture(GL_TEXTURE_2D, textures[i].id);
         }
-        
-        // draw mesh
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-        // always good practice to set everything back to defaults once configured.
-        glActiveTexture(GL_TEXTURE0);
     }
 
-private:
-    // render data
-    unsigned int VBO, EBO;
-
     // initializes all the buffer objects/arrays
     void setupMesh()
     {
+        aabb_min = glm::vec3(INFINITY);
+        aabb_max = glm::vec3(-INFINITY);
+        for (const Vertex& vertex : vertices) {
+            aabb_min = glm::min(aabb_min, vertex.Position);
+            aabb_max = glm::max(aabb_max, vertex.Position);
+        }
+
         // create buffers/arrays
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
+        glstate.bindVertexArray(VAO);
         // load data into vertex buffers
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         // A great thing about structs is that their memory layout is sequential for all its items.
         // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
         // again translates to 3/2 floats which translates to a byte array.
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+        gpumemory.buffer(VBO, vertices.size() * sizeof(Vertex), "Model", "mesh vertices");
 
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        gpumemory.buffer(EBO, indices.size() * sizeof(unsigned int), "Model", "mesh indices");
 
         // set the vertex attribute pointers
         // vertex Positions
@@ -157,7 +232,22 @@ private:
         // weights
         glEnableVertexAttribArray(6);
         glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
-        glBindVertexArray(0);
+        glstate.bindVertexArray(0);
+
+        // position-only stream sharing the index buffer
+        vector<glm::vec3> positions(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++)
+            positions[i] = vertices[i].Position;
+        glGenVertexArrays(1, &depthVAO);
+        glGenBuffers(1, &positionVBO);
+        glstate.bindVertexArray(depthVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, positionVBO);
+        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), &positions[0], GL_STATIC_DRAW);
+        gpumemory.buffer(positionVBO, positions.size() * sizeof(glm::vec3), "Model", "mesh positions");
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        glstate.bindVertexArray(0);
     }
 };
 
@@ -18,6 +18,8 @@
 
 
 #include "mesh.h"
+#include "cpuprofiler.h"
+#include "jobs.h"
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -27,9 +29,20 @@
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <cstring>
 #include <vector>
 using namespace std;
 
+// Pixels of an image file, decoded by stb_image on any thread
+struct DecodedImage
+{
+    unsigned char *data = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+};
+DecodedImage decodeImage(const string &filename);
+unsigned int uploadImage(DecodedImage &image, GLenum wrap, const char *owner, const string &label);
 unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false);
 
 class Model
@@ -47,17 +60,66 @@ public:
         loadModel(path);
     }
 
+    // Deletes the GL objects of the meshes and textures. Models are copied,
+    // so like Mesh::release this is left to whoever holds the last copy.
+    void release()
+    {
+        for(Mesh &mesh : meshes)
+            mesh.release();
+        for(const Texture &texture : textures_loaded)
+            gpumemory.deleteTextures(1, &texture.id);
+    }
+
     // draws the model, and thus all its meshes
     void Draw(Shader &shader)
     {
         for(unsigned int i = 0; i < meshes.size(); i++)
             meshes[i].Draw(shader);
     }
+
+    // draws the depth of all its meshes from their position-only streams
+    void DrawDepth()
+    {
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            meshes[i].DrawDepth();
+    }
+
+    // Records Draw (DrawDepth when depth) of the models' meshes that
+    // visible(model, mesh) keeps, in chunks of meshes on the workers. Each
+    // chunk starts by binding program.
+    //
+    // The jobs keep a pointer to models and outlive the call: models must not
+    // be resized or reallocated until list.replay() or list.wait() returned.
+    template<class F>
+    static void Record(CommandList &list, unsigned int program, const vector<Model> &models, bool depth, F visible, const char *name)
+    {
+        unsigned int total = 0;
+        for (const Model &model : models)
+            total += model.meshes.size();
+        const vector<Model> *source = &models;
+        list.record(total, 64, [source, program, depth, visible](CommandBuffer &commands, unsigned int first, unsigned int last) {
+            commands.bindProgram(program);
+            // Global mesh index to model and mesh
+            unsigned int model = 0, base = 0;
+            for (unsigned int i = first; i < last; i++) {
+                while (i - base >= (*source)[model].meshes.size())
+                    base += (*source)[model++].meshes.size();
+                if (!visible(model, i - base))
+                    continue;
+                const Mesh &mesh = (*source)[model].meshes[i - base];
+                if (depth)
+                    mesh.RecordDepth(commands);
+                else
+                    mesh.Record(commands);
+            }
+        }, name);
+    }
     
 private:
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
     void loadModel(string const &path)
     {
+        CPU_PROFILE_SCOPE("Model::loadModel");
         // read file via ASSIMP
         Assimp::Importer importer;
         const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
@@ -71,34 +133,79 @@ private:
         directory = path.substr(0, path.find_last_of('/'));
 
         // process ASSIMP's root node recursively
-        processNode(scene->mRootNode, scene);
+        vector<aiMesh*> node_meshes;
+        processNode(scene->mRootNode, scene, node_meshes);
+
+        // the textures of each mesh, as indices into textures_loaded; new ones are
+        // decoded on the workers and created on this thread as each is decoded
+        size_t first_new = textures_loaded.size();
+        vector<vector<unsigned int>> mesh_textures(node_meshes.size());
+        for(unsigned int i = 0; i < node_meshes.size(); i++)
+            mesh_textures[i] = processMaterial(scene->mMaterials[node_meshes[i]->mMaterialIndex]);
+        vector<DecodedImage> images(textures_loaded.size());
+        JobCounter textures_done;
+        for(size_t t = first_new; t < textures_loaded.size(); t++)
+        {
+            jobs.run([this, &images, &textures_done, t]() {
+                images[t] = decodeImage(directory + '/' + textures_loaded[t].path);
+                jobs.runOnMainThread([this, &images, t]() {
+                    textures_loaded[t].id = uploadImage(images[t], GL_REPEAT, "Model", textures_loaded[t].path);
+                }, &textures_done, "Texture upload");
+            }, &textures_done, "Texture decode");
+        }
+
+        // vertices and indices on the workers too
+        vector<MeshData> mesh_data(node_meshes.size());
+        jobs.parallelFor(0, (unsigned int)node_meshes.size(), 1, [&](unsigned int first, unsigned int last) {
+            for(unsigned int i = first; i < last; i++)
+                mesh_data[i] = processMesh(node_meshes[i]);
+        }, "Model::processMesh");
+        jobs.wait(textures_done);
+
+        // buffers are GL objects, made here
+        meshes.reserve(meshes.size() + node_meshes.size());
+        for(unsigned int i = 0; i < node_meshes.size(); i++)
+        {
+            vector<Texture> textures;
+            for(unsigned int t : mesh_textures[i])
+                textures.push_back(textures_loaded[t]);
+            meshes.emplace_back(std::move(mesh_data[i].vertices), std::move(mesh_data[i].indices), textures);
+        }
     }
 
-    // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode *node, const aiScene *scene)
+    struct MeshData
+    {
+        vector<Vertex> vertices;
+        vector<unsigned int> indices;
+    };
+
+    // collects the meshes of a node and of its children, recursively, in the order they are drawn
+    void processNode(aiNode *node, const aiScene *scene, vector<aiMesh*> &node_meshes)
     {
-        // process each mesh located at the current node
+        // the meshes located at the current node
         for(unsigned int i = 0; i < node->mNumMeshes; i++)
         {
             // the node object only contains indices to index the actual objects in the scene.
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
-            aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            node_meshes.push_back(scene->mMeshes[node->mMeshes[i]]);
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for(unsigned int i = 0; i < node->mNumChildren; i++)
         {
-            processNode(node->mChildren[i], scene);
+            processNode(node->mChildren[i], scene, node_meshes);
         }
 
     }
 
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene)
+    // no GL calls, runs on any thread
+    MeshData processMesh(aiMesh *mesh)
     {
         // data to fill
-        vector<Vertex> vertices;
-        vector<unsigned int> indices;
-        vector<Texture> textures;
+        MeshData data;
+        vector<Vertex> &vertices = data.vertices;
+        vector<unsigned int> &indices = data.indices;
+        vertices.reserve(mesh->mNumVertices);
+        indices.reserve(3 * mesh->mNumFaces);
 
         // walk through each of the mesh's vertices
         for(unsigned int i = 0; i < mesh->mNumVertices; i++)
@@ -151,8 +258,13 @@ private:
             for(unsigned int j = 0; j < face.mNumIndices; j++)
                 indices.push_back(face.mIndices[j]);
         }
-        // process materials
-        aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
+        return data;
+    }
+
+    // the textures of a material as indices into textures_loaded
+    vector<unsigned int> processMaterial(aiMaterial *material)
+    {
+        vector<unsigned int> textures;
         // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
         // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER.
         // Same applies to other texture as the following list summarizes:
@@ -161,27 +273,20 @@ private:
         // normal: texture_normalN
 
         // 1. diffuse maps
-        vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
+        loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", textures);
         // 2. specular maps
-        vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+        loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular", textures);
         // 3. normal maps
-        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
-        textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
+        loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal", textures);
         // 4. height maps
-        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
-        textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
-        
-        // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height", textures);
+        return textures;
     }
 
-    // checks all material textures of a given type and loads the textures if they're not loaded yet.
-    // the required info is returned as a Texture struct.
-    vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
+    // checks all material textures of a given type and adds the textures to textures_loaded if they're not there yet,
+    // to be loaded by loadModel. their indices are appended to textures.
+    void loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName, vector<unsigned int> &textures)
     {
-        vector<Texture> textures;
         for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
         {
             aiString str;
@@ -192,7 +297,7 @@ private:
             {
                 if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
                 {
-                    textures.push_back(textures_loaded[j]);
+                    textures.push_back(j);
                     skip = true; // a texture with the same filepath has already been loaded, continue to next one. (optimization)
                     break;
                 }
@@ -200,56 +305,64 @@ private:
             if(!skip)
             {   // if texture hasn't been loaded already, load it
                 Texture texture;
-                texture.id = TextureFromFile(str.C_Str(), this->directory);
+                texture.id = 0;
                 texture.type = typeName;
                 texture.path = str.C_Str();
-                textures.push_back(texture);
+                textures.push_back((unsigned int)textures_loaded.size());
                 textures_loaded.push_back(texture);  // store it as texture loaded for entire model, to ensure we won't unnecessary load duplicate textures.
             }
         }
-        return textures;
     }
 };
 
 
-unsigned int TextureFromFile(const char *path, const string &directory, bool gamma)
+DecodedImage decodeImage(const string &filename)
 {
-    string filename = string(path);
-    filename = directory + '/' + filename;
+    CPU_PROFILE_SCOPE("decodeImage");
+    DecodedImage image;
+    image.data = stbi_load(filename.c_str(), &image.width, &image.height, &image.channels, 0);
+    if (!image.data)
+        std::cout << "Texture failed to load at path: " << filename << std::endl;
+    return image;
+}
 
+// creates a mipmapped texture of the image (GL, main thread) and frees its pixels.
+// a texture is made even when decoding failed, like before.
+unsigned int uploadImage(DecodedImage &image, GLenum wrap, const char *owner, const string &label)
+{
     unsigned int textureID;
     glGenTextures(1, &textureID);
-
-    int width, height, nrComponents;
-    unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-    if (data)
+    glstate.editTexture(GL_TEXTURE_2D, textureID);
+    if (image.data)
     {
         GLenum format;
-        if (nrComponents == 1)
+        if (image.channels == 1)
             format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
+        else if (image.channels == 4)
             format = GL_RGBA;
+        else
+            format = GL_RGB;
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+        glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.data);
         glGenerateMipmap(GL_TEXTURE_2D);
+        gpumemory.texture(textureID, GPU_MEMORY_TEXTURES, format, image.width, image.height,
+                          GpuMemory::mipLevels(image.width, image.height), 1, owner, label);
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        stbi_image_free(data);
-    }
-    else
-    {
-        std::cout << "Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
+        stbi_image_free(image.data);
+        image.data = nullptr;
     }
-
     return textureID;
 }
 
+unsigned int TextureFromFile(const char *path, const string &directory, bool gamma)
+{
+    DecodedImage image = decodeImage(directory + '/' + string(path));
+    return uploadImage(image, GL_REPEAT, "Model", path);
+}
+
 #endif /* model_h */
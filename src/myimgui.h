@@ -11,19 +11,85 @@
 // Project website: http://tinyfiledialogs.sourceforge.net
 #include "tinyfd/tinyfiledialogs.h"
 
-class MyImgui
+#include "gpuprofiler.h"
+#include "camerapath.h"
+#include "occlusion.h"
+#include "overdraw.h"
+#include "jobs.h"
+#include "glstate.h"
+#include "gltrace.h"
+#include "gpumemory.h"
+#include "heaptracker.h"
+
+// Everything the UI sets that changes how a frame is rendered. The render
+// side works from a copy taken once a frame.
+struct RenderSettings
 {
-public:
-    bool show_demo_window;
-    
     // Shadow type
     int shadowtype;
+    // PCSS with min/max shadow map mips and adaptive sample counts
+    bool pcss_accelerated = true;
     // Screen space reflection
     int rendertype;
     // Num of ray for SSR
     int numray;
     // Screen space ambient occlusion
     bool ssao;
+    // Deferred lighting as one stencil-tested pass per material class
+    bool stencil_lighting = true;
+    // Reflections traced through a Hi-Z pyramid instead of a linear march
+    bool hiz_ssr = true;
+    // G-buffer draws culled in compute against the frustum and Hi-Z (GL 4.3)
+    bool gpu_culling = false;
+    // Draws culled on the CPU against a software-rasterized depth buffer
+    bool cpu_occlusion = false;
+    // Forward path: depth-only pass first, then lighting with GL_EQUAL
+    bool depth_prepass = false;
+    // Fewer SSAO taps / coarser SSR per frame, accumulated over frames
+    bool temporal = false;
+    // SSAO at full, half or quarter render resolution
+    int ssao_resolution = 0;
+    // 0 hemisphere kernel SSAO, 1 ground-truth AO
+    int ao_technique = 0;
+    int gtao_slices = 2;
+    int gtao_steps = 4;
+    // Local point/spot lights of the deferred pass, and how they are found
+    // per pixel: 0 every light, 1 clusters assigned on the CPU, 2 in compute
+    int num_lights = 0;
+    float light_radius = 2.0f;
+    int light_assignment = 2;
+
+    // Dynamic resolution: internal render scale chasing a GPU frame budget
+    bool dynamic_resolution = false;
+    float frame_budget_ms = 16.6f;
+    // Fixed render scale when dynamic resolution is off
+    float render_scale = 1.0f;
+    int upscale_filter = 1;
+    float upscale_sharpness = 0.5f;
+
+    // Per-pass GPU timer queries
+    bool gpu_timers = true;
+    // Textures, buffers and renderbuffers above this are warned about, MB
+    float gpu_memory_budget_mb = 1024.0f;
+
+    // A frame rendered with the same settings as the last is in the steady state
+    bool operator==(const RenderSettings&) const = default;
+};
+
+class MyImgui : public RenderSettings
+{
+public:
+    bool show_demo_window;
+    // No window (benchmark mode): only the settings are used, nothing is drawn
+    bool headless;
+
+    // GL context on a render thread, one frame behind the UI and input
+    bool render_thread = false;
+    // Shown, set from the render side
+    float current_render_scale = 1.0f;
+    unsigned int current_render_width = 0, current_render_height = 0;
+    // Input sampled to frame presented, ms
+    float latency_ms = 0.0f;
 
     // User opened file
     std::string opened_file_path;
@@ -45,12 +111,54 @@ public:
     float camera_pitch = 0.0;
     bool camera_pitch_moved = false;
 
+    // Recorded / played camera path, controls shown when set
+    CameraPath* camera_path = nullptr;
+
+    // GPU pass timings, drawn in the performance section when set
+    const GpuTimings* gpu_timings = nullptr;
+    int profiler_pass = GPU_PASS_FRAME;
+    float profiler_timeline[GpuTimings::HISTORY];
+    // Last frame of the CPU occlusion culling, shown when set and enabled
+    const OcclusionStats* occlusion_stats = nullptr;
+    // Forward pass fragments per pixel, shown when set in normal rendering
+    const OverdrawStats* overdraw = nullptr;
+    // Job system activity of the last frame
+    JobStats job_stats;
+    // State calls of the last frame, issued and dropped by the GL state cache
+    GLStateStats gl_state;
+    // GL calls of the last frame, in builds with GL_TRACE
+    GLCallStats gl_calls;
+    // Live GPU allocations, as of the last frame
+    GpuMemoryStats gpu_memory;
+    // Heap allocations of the last frame, in builds with HEAP_TRACK
+    HeapStats heap;
+
     // List of shadow types
-    const char* shadowtype_list[4] = {
+    const char* shadowtype_list[5] = {
             "no shadow",
             "vanilla",
             "percentage-closer filtering (PCF)",
-            "percentage colser soft shadows (PCSS)"
+            "percentage colser soft shadows (PCSS)",
+            "exponential variance shadow maps (EVSM)"
+    };
+
+    const char* ao_technique_list[2] = {
+            "SSAO (64-tap hemisphere kernel)",
+            "GTAO (horizon search, bent normals)"
+    };
+    const char* ssao_resolution_list[3] = {
+            "Full",
+            "Half (bilateral upsample)",
+            "Quarter (bilateral upsample)"
+    };
+    const char* light_assignment_list[3] = {
+            "none (every light per pixel)",
+            "clusters, CPU (SSE)",
+            "clusters, compute shader"
+    };
+    const char* upscale_filter_list[2] = {
+            "bilinear",
+            "bilinear + contrast adaptive sharpening"
     };
 
     // List of render options
@@ -71,6 +179,18 @@ public:
             bool in_rendertype=false,
             int in_numray=0)
     {
+        show_demo_window = in_show_demo_window;
+        shadowtype = in_shadowtype;
+        rendertype = in_rendertype;
+        numray = in_numray;
+        swe_init = false;
+        ssao = false;
+        swe_tick_count = 0;
+
+        headless = window == nullptr;
+        if (headless)
+            return;
+
         // Setup Dear ImGui context
         // ------------------------
         IMGUI_CHECKVERSION();
@@ -83,14 +203,9 @@ public:
         ImGui_ImplGlfw_InitForOpenGL(window, true);
         const char* glsl_version = "#version 150";
         ImGui_ImplOpenGL3_Init(glsl_version);
-        
-        show_demo_window = in_show_demo_window;
-        shadowtype = in_shadowtype;
-        rendertype = in_rendertype;
-        numray = in_numray;
-        swe_init = false;
-        ssao = false;
-        swe_tick_count = 0;
+        // Font atlas and GL objects now, while the context is current here:
+        // frames can then be built on a thread without the context
+        ImGui_ImplOpenGL3_CreateDeviceObjects();
 
 #ifdef __linux__
         io.FontGlobalScale = 1.5f;
@@ -111,14 +226,20 @@ public:
 
     ~MyImgui()
     {
+        if (headless)
+            return;
         ImGui_ImplOpenGL3_Shutdown();
         ImGui_ImplGlfw_Shutdown();
         ImGui::DestroyContext();
     }
     
-    void newframe()
+    // Builds the UI of a frame without GL calls. The draw data is valid until
+    // the next call, nullptr when headless.
+    ImDrawData* newframe()
     {
-        ImGui_ImplOpenGL3_NewFrame();
+        if (headless)
+            return nullptr;
+        CPU_PROFILE_SCOPE("MyImgui::newframe");
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
         
@@ -135,13 +256,45 @@ public:
 
         ImGui::Combo("Shadow mapping type", &shadowtype, shadowtype_list, IM_ARRAYSIZE(shadowtype_list));
 
+        ImGui::Checkbox("Accelerated PCSS (min/max mips)", &pcss_accelerated);
+
         ImGui::Combo("Rendering type", &rendertype, rendertype_list, IM_ARRAYSIZE(rendertype_list));
         
         //ImGui::SeparatorText("Sliders");
         
         ImGui::Checkbox("Screen space ambient occlusion", &ssao);
+        if (ssao) {
+            ImGui::Combo("AO technique", &ao_technique, ao_technique_list, IM_ARRAYSIZE(ao_technique_list));
+            if (ao_technique == 1) {
+                ImGui::SliderInt("GTAO directions", &gtao_slices, 1, 4);
+                ImGui::SliderInt("GTAO steps", &gtao_steps, 2, 8);
+            }
+            ImGui::Combo("SSAO resolution", &ssao_resolution, ssao_resolution_list, IM_ARRAYSIZE(ssao_resolution_list));
+        }
+        ImGui::Checkbox("Stencil-masked lighting", &stencil_lighting);
+        ImGui::Checkbox("Hi-Z reflections", &hiz_ssr);
+        ImGui::Checkbox("GPU culling (GL 4.3)", &gpu_culling);
+        ImGui::Checkbox("CPU occlusion culling", &cpu_occlusion);
+        if (rendertype == 0)
+            ImGui::Checkbox("Depth pre-pass", &depth_prepass);
+        ImGui::Checkbox("Temporal accumulation (SSAO, SSR)", &temporal);
+        ImGui::SliderInt("Local lights", &num_lights, 0, 4096);
+        if (num_lights > 0) {
+            ImGui::Combo("Light assignment", &light_assignment, light_assignment_list, IM_ARRAYSIZE(light_assignment_list));
+            ImGui::SliderFloat("Light radius", &light_radius, 0.5f, 5.0f, "%.1f");
+        }
         
         //ImGui::SliderInt("Num of rays", &numray, 1, 8);
+
+        ImGui::Checkbox("Dynamic resolution", &dynamic_resolution);
+        if (dynamic_resolution)
+            ImGui::SliderFloat("GPU budget (ms)", &frame_budget_ms, 2.0f, 50.0f, "%.1f");
+        else
+            ImGui::SliderFloat("Render scale", &render_scale, 0.5f, 1.0f, "%.2f");
+        ImGui::Combo("Upscale filter", &upscale_filter, upscale_filter_list, IM_ARRAYSIZE(upscale_filter_list));
+        if (upscale_filter == 1)
+            ImGui::SliderFloat("Sharpness", &upscale_sharpness, 0.0f, 1.0f, "%.2f");
+        ImGui::Text("Render resolution %u x %u (scale %.2f)", current_render_width, current_render_height, current_render_scale);
         
         ImGui::Checkbox("Demo Window", &show_demo_window);      // Edit bools storing our window open/close state
         
@@ -172,6 +325,16 @@ public:
             camera_pitch_old = camera_pitch;
         }
 
+        if (camera_path != nullptr) {
+            if (ImGui::Button(camera_path->recording ? "Stop recording (F5)" : "Record path (F5)"))
+                toggle_camera_recording = true;
+            ImGui::SameLine();
+            if (ImGui::Button(camera_path->playing ? "Stop playback (F6)" : "Play path (F6)"))
+                toggle_camera_playback = true;
+            ImGui::SameLine();
+            ImGui::Text("%d keys, %.2f s", (int)camera_path->keys.size(), camera_path->duration());
+        }
+
         static char buf[32];
         ImGui::InputText(" input", buf, IM_ARRAYSIZE(buf));
 
@@ -204,11 +367,204 @@ public:
         // Performance
         ImGui::SeparatorText("Performance");
         ImGui::Text("Average %.3f ms/frame (%.1f FPS)", 1000.0f / io.Framerate, io.Framerate);
+        ImGui::Checkbox("Render thread", &render_thread);
+        if (latency_ms > 0.0f)
+            ImGui::Text("Latency: %.2f ms input to present", latency_ms);
+        if (gpu_timings != nullptr)
+            gpuProfilerPanel(*gpu_timings);
+        if (GLTrace::ENABLED)
+            glCallsPanel(gl_calls);
+        gpuMemoryPanel(gpu_memory);
+        if (HeapTracker::ENABLED)
+            heapPanel(heap);
+        if (job_stats.threads > 0)
+            ImGui::Text("Jobs: %d threads, %d jobs (%d main thread), %d steals, %.2f ms busy (%.2f main)",
+                        job_stats.threads, job_stats.jobs, job_stats.main_thread_jobs, job_stats.steals,
+                        job_stats.busy_ms, job_stats.main_busy_ms);
+        if (gl_state.totalIssued() + gl_state.totalElided() > 0 &&
+            ImGui::TreeNode("GL state", "GL state: %d calls issued, %d elided", gl_state.totalIssued(), gl_state.totalElided())) {
+            for (int i = 0; i < GL_STATE_NUM_CALLS; i++)
+                ImGui::Text("%-16s %6d issued %6d elided", GL_STATE_CALL_NAMES[i], gl_state.issued[i], gl_state.elided[i]);
+            ImGui::TreePop();
+        }
+        if (cpu_occlusion && occlusion_stats != nullptr) {
+            ImGui::Text("Occlusion: %d occluder tris, %d/%d draws and %lld tris culled",
+                        occlusion_stats->occluder_triangles, occlusion_stats->culled_draws, occlusion_stats->tested,
+                        occlusion_stats->culled_triangles);
+            ImGui::Text("Occlusion: raster %.3f ms, test %.3f ms", occlusion_stats->raster_ms, occlusion_stats->test_ms);
+        }
+        if (rendertype == 0 && overdraw != nullptr && overdraw->shaded_per_pixel >= 0.0f) {
+            if (overdraw->depth_per_pixel >= 0.0f)
+                ImGui::Text("Overdraw: %.2f depth, %.2f shaded fragments/pixel", overdraw->depth_per_pixel, overdraw->shaded_per_pixel);
+            else
+                ImGui::Text("Overdraw: %.2f shaded fragments/pixel", overdraw->shaded_per_pixel);
+        }
         ImGui::End();
 
-        // Rendering
         ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        return ImGui::GetDrawData();
+    }
+
+    // On the thread that holds the GL context
+    void render(ImDrawData* draw_data)
+    {
+        if (headless || draw_data == nullptr)
+            return;
+        ImGui_ImplOpenGL3_RenderDrawData(draw_data);
+    }
+
+    void gpuProfilerPanel(const GpuTimings& profiler)
+    {
+        if (!ImGui::CollapsingHeader("GPU passes"))
+            return;
+
+        ImGui::Checkbox("Enable GPU timers", &gpu_timers);
+        ImGui::SameLine();
+        if (ImGui::Button("Export CSV"))
+            profiler.exportCSV("gpu_profile.csv");
+        ImGui::Text("Dropped frames: %d", profiler.dropped_frames);
+
+        // Per-pass stats over the rolling history
+        if (ImGui::BeginTable("gpu_passes", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+            ImGui::TableSetupColumn("Pass");
+            ImGui::TableSetupColumn("Last (ms)");
+            ImGui::TableSetupColumn("Min");
+            ImGui::TableSetupColumn("Avg");
+            ImGui::TableSetupColumn("P99");
+            ImGui::TableHeadersRow();
+            for (int pass = 0; pass < GPU_PASS_COUNT; pass++) {
+                float min, avg, p99;
+                if (!profiler.stats(pass, min, avg, p99))
+                    continue;
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                if (ImGui::Selectable(GPU_PASS_NAMES[pass], profiler_pass == pass, ImGuiSelectableFlags_SpanAllColumns))
+                    profiler_pass = pass;
+                ImGui::TableNextColumn();
+                ImGui::Text("%.3f", std::max(profiler.latest(pass), 0.0f));
+                ImGui::TableNextColumn();
+                ImGui::Text("%.3f", min);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.3f", avg);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.3f", p99);
+            }
+            ImGui::EndTable();
+        }
+
+        // Timeline and distribution of the selected pass
+        int count = profiler.history_count;
+        if (count == 0)
+            return;
+        profiler.timeline(profiler_pass, profiler_timeline);
+        float max_ms = *std::max_element(profiler_timeline, profiler_timeline + count);
+        ImGui::PlotLines("Timeline", profiler_timeline, count, 0, GPU_PASS_NAMES[profiler_pass], 0.0f, max_ms * 1.2f, ImVec2(0, 60));
+
+        const int BINS = 32;
+        float bins[BINS] = {};
+        for (int i = 0; i < count; i++) {
+            int bin = max_ms > 0.0f ? (int)(profiler_timeline[i] / max_ms * (BINS - 1)) : 0;
+            bins[bin] += 1.0f;
+        }
+        ImGui::PlotHistogram("Histogram", bins, BINS, 0, "0 ms .. max", 0.0f, FLT_MAX, ImVec2(0, 60));
+    }
+
+    void glCallsPanel(const GLCallStats& stats)
+    {
+        if (!ImGui::CollapsingHeader("GL calls"))
+            return;
+
+        GLCallStats::Pass total = stats.total();
+        ImGui::Text("%d calls, %d draws, %lld triangles, %d redundant", total.totalCalls(),
+                    total.calls[GL_CALL_DRAW], total.triangles, total.redundant);
+        if (total.calls[GL_CALL_SYNC] > 0)
+            ImGui::TextColored(ImVec4(1.0f, 0.6f, 0.2f, 1.0f), "%d synchronous queries", total.calls[GL_CALL_SYNC]);
+
+        // By pass, calls outside of the passes last
+        if (ImGui::BeginTable("gl_passes", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+            ImGui::TableSetupColumn("Pass");
+            ImGui::TableSetupColumn("Calls");
+            ImGui::TableSetupColumn("Draws");
+            ImGui::TableSetupColumn("Triangles");
+            ImGui::TableSetupColumn("Uniforms");
+            ImGui::TableSetupColumn("Binds");
+            ImGui::TableSetupColumn("Redundant");
+            ImGui::TableHeadersRow();
+            for (int i = 0; i <= GLCallStats::MAX_PASSES; i++) {
+                const GLCallStats::Pass& pass = stats.passes[i];
+                if (pass.totalCalls() == 0 || (i >= GPU_PASS_COUNT && i != GLCallStats::OUTSIDE_PASSES))
+                    continue;
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::TextUnformatted(i < GPU_PASS_COUNT ? GPU_PASS_NAMES[i] : "Outside passes");
+                ImGui::TableNextColumn();
+                ImGui::Text("%d", pass.totalCalls());
+                ImGui::TableNextColumn();
+                ImGui::Text("%d", pass.calls[GL_CALL_DRAW]);
+                ImGui::TableNextColumn();
+                ImGui::Text("%lld", pass.triangles);
+                ImGui::TableNextColumn();
+                ImGui::Text("%d", pass.calls[GL_CALL_UNIFORM]);
+                ImGui::TableNextColumn();
+                ImGui::Text("%d", pass.calls[GL_CALL_BIND]);
+                ImGui::TableNextColumn();
+                ImGui::Text("%d", pass.redundant);
+            }
+            ImGui::EndTable();
+        }
+
+        if (ImGui::TreeNode("Entry points")) {
+            for (int i = 0; i < GL_NUM_ENTRY_POINTS; i++) {
+                if (stats.calls[i] == 0)
+                    continue;
+                ImVec4 color = GL_ENTRY_KINDS[i] == GL_CALL_SYNC ? ImVec4(1.0f, 0.6f, 0.2f, 1.0f) : ImGui::GetStyleColorVec4(ImGuiCol_Text);
+                ImGui::TextColored(color, "%-32s %6d (%s)", GL_ENTRY_NAMES[i], stats.calls[i], GL_CALL_KIND_NAMES[GL_ENTRY_KINDS[i]]);
+                if (stats.redundant[i] > 0) {
+                    ImGui::SameLine();
+                    ImGui::Text("%d redundant", stats.redundant[i]);
+                }
+            }
+            ImGui::TreePop();
+        }
+    }
+
+    void heapPanel(const HeapStats& stats)
+    {
+        if (stats.allocations == 0) {
+            ImGui::Text("Heap: no allocations");
+            return;
+        }
+        if (!ImGui::TreeNode("Heap", "Heap: %d allocations (%.1f KB), %d frees", stats.allocations, stats.bytes / 1024.0f, stats.frees))
+            return;
+        for (int i = 0; i < stats.num_scopes; i++)
+            ImGui::Text("%-24s %6d allocations %8.1f KB", stats.scopes[i].name, stats.scopes[i].allocations, stats.scopes[i].bytes / 1024.0f);
+        ImGui::TreePop();
+    }
+
+    void gpuMemoryPanel(const GpuMemoryStats& stats)
+    {
+        const float MB = 1024.0f * 1024.0f;
+        bool over_budget = stats.total > gpu_memory_budget_mb * MB;
+        if (over_budget)
+            ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "GPU memory: %.1f MB, over the %.0f MB budget",
+                               stats.total / MB, gpu_memory_budget_mb);
+        if (!ImGui::CollapsingHeader("GPU memory"))
+            return;
+
+        ImGui::Text("%.1f MB (peak %.1f MB)", stats.total / MB, stats.peak / MB);
+        ImGui::DragFloat("Budget (MB)", &gpu_memory_budget_mb, 16.0f, 64.0f, 16384.0f, "%.0f");
+        ImGui::ProgressBar(std::min(stats.total / (gpu_memory_budget_mb * MB), 1.0f), ImVec2(-1.0f, 0.0f));
+        for (int i = 0; i < GPU_MEMORY_NUM_CATEGORIES; i++)
+            ImGui::Text("%-16s %8.1f MB %5d objects", GPU_MEMORY_CATEGORY_NAMES[i], stats.bytes[i] / MB, stats.objects[i]);
+
+        if (ImGui::TreeNode("By owner")) {
+            for (int i = 0; i < stats.num_owners; i++) {
+                const GpuMemoryStats::Owner& owner = stats.owners[i];
+                if (owner.objects > 0)
+                    ImGui::Text("%-20s %8.2f MB %5d objects", owner.name, owner.bytes / MB, owner.objects);
+            }
+            ImGui::TreePop();
+        }
     }
 };
 
@@ -11,8 +11,25 @@
 #include <vector>
 #include <utility>
 #include <cmath>
+#include <cstddef>
 
 #include "const.h"
+#include "jobs.h"
+#include "glstate.h"
+#include "gpumemory.h"
+
+// Per-instance vertex attributes of Objects::renderInstanced (locations
+// 7-10 model, 11-13 normal matrix, 14 material)
+struct InstanceData
+{
+    glm::mat4 model;
+    glm::mat3 normal_matrix;
+    int material;
+};
+
+const unsigned int INSTANCE_ATTRIBUTE_MODEL = 7;
+const unsigned int INSTANCE_ATTRIBUTE_NORMAL_MATRIX = 11;
+const unsigned int INSTANCE_ATTRIBUTE_MATERIAL = 14;
 
 float* getCube();
 float* getCubeWithUV();
@@ -33,23 +50,138 @@ public:
     std::vector<unsigned int> textures;
     std::vector<bool> cast_shadow;
     std::vector<bool> ismirror;
+    // Material index of each instance, e.g. into a uniform array
+    std::vector<int> materials;
+    
+    // Instance attribute buffer, rebuilt on the next instanced draw after
+    // addObject or setModel
+    unsigned int instanceVBO = 0;
+    
+    // Shape of one instance for indirect draws and culling (gpuculling.h)
+    GLenum primitive = GL_TRIANGLES;
+    unsigned int vertex_count = 0;
+    bool indexed = false;
+    glm::vec3 bounds_min = glm::vec3(-0.5f);
+    glm::vec3 bounds_max = glm::vec3(0.5f);
     
     Objects() {};
     ~Objects() {
-        glDeleteVertexArrays(1, &VAO);
-        glDeleteBuffers(1, &VBO);
+        glstate.deleteVertexArrays(1, &VAO);
+        gpumemory.deleteBuffers(1, &VBO);
+        if (instanceVBO != 0)
+            gpumemory.deleteBuffers(1, &instanceVBO);
     };
     
-    void addObject(glm::mat4 in_model, unsigned int in_texture=0, bool in_cast_shadow=true, bool in_ismirrior=false) {
+    void addObject(glm::mat4 in_model, unsigned int in_texture=0, bool in_cast_shadow=true, bool in_ismirrior=false, int in_material=0) {
         num++;
         models.push_back(in_model); // TODO: change to std::move()
         textures.push_back(in_texture);
         cast_shadow.push_back(in_cast_shadow);
         ismirror.push_back(in_ismirrior);
+        materials.push_back(in_material);
+        instances_dirty = true;
     };
     
+    // Transforms must change through here for the instance buffer to follow
+    void setModel(unsigned int i, const glm::mat4& in_model) {
+        models[i] = in_model;
+        instances_dirty = true;
+    }
+    
+    // Uploads model and normal matrices and materials if anything changed
+    void updateInstances() {
+        if (!instances_dirty || num == 0)
+            return;
+        std::vector<InstanceData> instances(num);
+        // An inverse per instance, worth spreading once there are thousands
+        jobs.parallelFor(0, num, 1024, [&](unsigned int first, unsigned int last) {
+            for (unsigned int i = first; i < last; i++) {
+                instances[i].model = models[i];
+                instances[i].normal_matrix = glm::mat3(glm::transpose(glm::inverse(models[i])));
+                instances[i].material = materials[i];
+            }
+        }, "Objects::updateInstances");
+        if (instanceVBO == 0)
+            glGenBuffers(1, &instanceVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        glBufferData(GL_ARRAY_BUFFER, num * sizeof(InstanceData), instances.data(), GL_DYNAMIC_DRAW);
+        gpumemory.buffer(instanceVBO, num * sizeof(InstanceData), "Objects", "instances");
+        instances_dirty = false;
+        // Re-point the attributes at the new buffer
+        bound_first = -1;
+    }
+    
+    // Instances [first, first + count) in one draw. GL 3.3 has no base
+    // instance, so the attributes are pointed at the first one instead.
+    void renderInstanced(unsigned int first, unsigned int count) {
+        if (count == 0)
+            return;
+        updateInstances();
+        glstate.bindVertexArray(VAO);
+        if (bound_first != (int)first) {
+            pointInstanceAttributes(instanceVBO, first * sizeof(InstanceData));
+            bound_first = first;
+        }
+        drawInstances(count);
+    }
+    void renderInstanced() {
+        renderInstanced(0, num);
+    }
+    
+    // Sources the instance attributes from another buffer of InstanceData,
+    // e.g. culled instances drawn with a base instance. Binds the VAO.
+    void bindInstanceBuffer(unsigned int buffer) {
+        glstate.bindVertexArray(VAO);
+        pointInstanceAttributes(buffer, 0);
+        bound_first = -1;
+    }
+    
+    // Calls draw(first, count) for each run of consecutive instances with
+    // the same texture, shadow and mirror flags, i.e. what a pass can draw
+    // with one renderInstanced after setting its per-object state
+    template<class F>
+    void forEachBatch(F draw) {
+        unsigned int first = 0;
+        for (unsigned int i = 1; i <= num; i++) {
+            if (i == num || textures[i] != textures[first] || cast_shadow[i] != cast_shadow[first] || ismirror[i] != ismirror[first]) {
+                draw(first, i - first);
+                first = i;
+            }
+        }
+    }
+    
     virtual void _getVBOVAO() {};
     virtual void render() {};
+
+protected:
+    // glDraw*Instanced of the shape, the VAO is bound
+    virtual void drawInstances(unsigned int /* count */) {}
+
+private:
+    // Attribute pointers at the instance starting at base (bytes), the VAO
+    // is bound
+    void pointInstanceAttributes(unsigned int buffer, size_t base) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        for (unsigned int column = 0; column < 4; column++) {
+            unsigned int location = INSTANCE_ATTRIBUTE_MODEL + column;
+            glEnableVertexAttribArray(location);
+            glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(base + offsetof(InstanceData, model) + column * sizeof(glm::vec4)));
+            glVertexAttribDivisor(location, 1);
+        }
+        for (unsigned int column = 0; column < 3; column++) {
+            unsigned int location = INSTANCE_ATTRIBUTE_NORMAL_MATRIX + column;
+            glEnableVertexAttribArray(location);
+            glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(base + offsetof(InstanceData, normal_matrix) + column * sizeof(glm::vec3)));
+            glVertexAttribDivisor(location, 1);
+        }
+        glEnableVertexAttribArray(INSTANCE_ATTRIBUTE_MATERIAL);
+        glVertexAttribIPointer(INSTANCE_ATTRIBUTE_MATERIAL, 1, GL_INT, sizeof(InstanceData), (void*)(base + offsetof(InstanceData, material)));
+        glVertexAttribDivisor(INSTANCE_ATTRIBUTE_MATERIAL, 1);
+    }
+
+    bool instances_dirty = true;
+    // Instance the attribute pointers start at, -1 when not set up
+    int bound_first = -1;
 };
 
 // Object base class
@@ -60,11 +192,14 @@ public:
     Cubes() {
         _getCubeWithUV();
         _getVBOVAO();
+        vertex_count = 36;
     };
     void _getCube();
     void _getCubeWithUV();
     void _getVBOVAO() override;
     void render() override; // override;
+protected:
+    void drawInstances(unsigned int count) override;
 };
 
 // Object base class
@@ -75,10 +210,15 @@ public:
     Quads() {
         _getQuad();
         _getVBOVAO();
+        vertex_count = 6;
+        bounds_min = glm::vec3(-1.0f, -1.0f, 0.0f);
+        bounds_max = glm::vec3(1.0f, 1.0f, 0.0f);
     };
     void _getQuad();
     void _getVBOVAO() override;
     void render() override;
+protected:
+    void drawInstances(unsigned int count) override;
 };
 
 // Object base class
@@ -103,11 +243,16 @@ public:
         std::cout << "h_n, w_n: " << h_n << " " << w_n << std::endl;
         _getMesh2();
         _getVBOVAOEBO();
+        vertex_count = 6 * h_n * w_n;
+        bounds_min = glm::vec3(0.0f);
+        bounds_max = glm::vec3(w_n * dx, h_n * dx, 0.0f);
     };
     void _getMesh();
     void _getMesh2();
     void _getVBOVAOEBO();
     void render() override;
+protected:
+    void drawInstances(unsigned int count) override;
 };
 
 // Object base class
@@ -131,10 +276,20 @@ public:
 
     Spheres() {
         _getSphereWithUV();
+        primitive = GL_TRIANGLE_STRIP;
+        vertex_count = index_count;
+        indexed = true;
+        bounds_min = glm::vec3(-1.0f);
+        bounds_max = glm::vec3(1.0f);
     };
+    ~Spheres() {
+        gpumemory.deleteBuffers(1, &EBO);
+    }
     void _getSphereWithUV();
     // void _getVBOVAO() override;
     void render() override;
+protected:
+    void drawInstances(unsigned int count) override;
 };
 
 void Cubes::_getVBOVAO()
@@ -144,11 +299,12 @@ void Cubes::_getVBOVAO()
     glGenBuffers(1, &VBO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, 288 * sizeof(float), vertexarray, GL_STATIC_DRAW);
+    gpumemory.buffer(VBO, 288 * sizeof(float), "Objects", "Cubes vertices");
     
     // cubeVAO
     // -------
     glGenVertexArrays(1, &VAO);
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
@@ -165,11 +321,12 @@ void Quads::_getVBOVAO()
     glGenBuffers(1, &VBO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, 48 * sizeof(float), vertexarray, GL_STATIC_DRAW);
+    gpumemory.buffer(VBO, 48 * sizeof(float), "Objects", "Quads vertices");
     
     // squareVAO
     // ---------
     glGenVertexArrays(1, &VAO);
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
@@ -186,11 +343,12 @@ void Meshes::_getVBOVAOEBO()
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
 //    glBufferData(GL_ARRAY_BUFFER, 8 * (h_n+1) * (w_n+1) * sizeof(float), vertexarray, GL_STATIC_DRAW);
     glBufferData(GL_ARRAY_BUFFER, 8 * 6 * h_n * w_n * sizeof(float), vertexarray, GL_STATIC_DRAW);
+    gpumemory.buffer(VBO, 8 * 6 * h_n * w_n * sizeof(float), "Objects", "Meshes vertices");
     
     // squareVAO
     // ---------
     glGenVertexArrays(1, &VAO);
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
@@ -212,33 +370,49 @@ void Skyboxes::_getVBOVAO()
     glGenBuffers(1, &VBO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, 108 * sizeof(float), vertexarray, GL_STATIC_DRAW);
+    gpumemory.buffer(VBO, 108 * sizeof(float), "Objects", "Skyboxes vertices");
     
     glGenVertexArrays(1, &VAO);
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
 }
 
 void Cubes::render()
 {
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glDrawArrays(GL_TRIANGLES, 0, 36);
 }
 
 void Quads::render()
 {
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glDrawArrays(GL_TRIANGLES, 0, 6);
 }
 
 void Meshes::render()
 {
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glDrawArrays(GL_TRIANGLES, 0, 6 * h_n * w_n);
 //    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
 //    glDrawElements(GL_TRIANGLES, 8 * (h_n+1) * (w_n+1), GL_UNSIGNED_INT, 0);
 }
 
+void Cubes::drawInstances(unsigned int count)
+{
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 36, count);
+}
+
+void Quads::drawInstances(unsigned int count)
+{
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, count);
+}
+
+void Meshes::drawInstances(unsigned int count)
+{
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6 * h_n * w_n, count);
+}
+
 // Vertices functions
 // ------------------
 void Cubes::_getCube()
@@ -543,11 +717,13 @@ void Spheres::_getSphereWithUV()
         data.push_back(uv[i].y);
     }
 
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(float), &data[0], GL_STATIC_DRAW);
+    gpumemory.buffer(VBO, data.size() * sizeof(float), "Objects", "Spheres vertices");
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+    gpumemory.buffer(EBO, indices.size() * sizeof(unsigned int), "Objects", "Spheres indices");
     unsigned int stride = (3 + 2 + 3) * sizeof(float);
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
@@ -560,8 +736,13 @@ void Spheres::_getSphereWithUV()
 
 void Spheres::render()
 {
-    glBindVertexArray(VAO);
+    glstate.bindVertexArray(VAO);
     glDrawElements(GL_TRIANGLE_STRIP, this->index_count, GL_UNSIGNED_INT, 0);
 }
 
+void Spheres::drawInstances(unsigned int count)
+{
+    glDrawElementsInstanced(GL_TRIANGLE_STRIP, this->index_count, GL_UNSIGNED_INT, 0, count);
+}
+
 #endif /* objects_h */
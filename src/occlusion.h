@@ -0,0 +1,408 @@
+//
+//  occlusion.h
+//  opengl_test
+//
+
+#ifndef occlusion_h
+#define occlusion_h
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#include "objects.h"
+#include "model.h"
+#include "cpuprofiler.h"
+#include "jobs.h"
+
+// 8-wide rows with AVX2 when the CPU has it (checked at runtime, the rest of
+// the binary does not need it), scalar otherwise, e.g. on ARM
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define OCCLUSION_AVX2
+#define OCCLUSION_AVX2_TARGET __attribute__((target("avx2,fma")))
+inline bool cpuHasAVX2() { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"); }
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define OCCLUSION_AVX2
+#define OCCLUSION_AVX2_TARGET
+inline bool cpuHasAVX2() { return true; }
+#endif
+
+// What the last frame's software occlusion did
+struct OcclusionStats
+{
+    int occluder_triangles = 0;
+    int tested = 0;
+    int culled_draws = 0;
+    long long culled_triangles = 0;
+    float raster_ms = 0.0f;
+    float test_ms = 0.0f;
+};
+
+// CPU occlusion culling for contexts without compute (GL 3.3, macOS) and for
+// headless runs. A few chosen occluders (shapes that fill their bounds, the
+// largest meshes of a model) are rasterized into a small depth buffer, the
+// rows split over the job system's workers, and every instance and mesh box is then
+// tested against it before submission. Each 8x4 tile keeps its farthest
+// depth, so most boxes are settled by a handful of tiles. Pixels are covered
+// when their center is, like the GPU, so a box can hide behind an occluder
+// that leaves sub-pixel gaps at full resolution.
+//
+// begin() starts the work for a view and returns; it overlaps whatever the
+// main thread submits before finish(), e.g. the shadow pass.
+class SoftwareOcclusion
+{
+public:
+    static const int WIDTH = 320;
+    static const int HEIGHT = 192;
+    static const int TILE_WIDTH = 8;
+    static const int TILE_HEIGHT = 4;
+    static const int TILES_X = WIDTH / TILE_WIDTH;
+    static const int TILES_Y = HEIGHT / TILE_HEIGHT;
+    static const int NUM_BANDS = 8;
+    static const int MAX_OCCLUDER_TRIANGLES = 20000;
+
+    OcclusionStats stats;
+
+    SoftwareOcclusion() {
+        depth.resize(WIDTH * HEIGHT, 1.0f);
+        tile_max.resize(TILES_X * TILES_Y, 1.0f);
+#ifdef OCCLUSION_AVX2
+        use_avx2 = cpuHasAVX2();
+#endif
+    }
+    ~SoftwareOcclusion() {
+        finish();
+    }
+
+    // Instances that fill their object bounds (cubes, quads) as boxes;
+    // those that cast no shadow, like the light cube, are left out
+    void addBoxOccluders(const Objects& objects) {
+        glm::vec3 b[2] = { objects.bounds_min, objects.bounds_max };
+        // Two triangles per face, corners indexed by their x, y, z bits
+        static const int faces[6][4] = { {0, 2, 6, 4}, {1, 5, 7, 3}, {0, 4, 5, 1}, {2, 3, 7, 6}, {0, 1, 3, 2}, {4, 6, 7, 5} };
+        for (unsigned int i = 0; i < objects.num; i++) {
+            if (!objects.cast_shadow[i])
+                continue;
+            glm::vec3 corners[8];
+            for (int c = 0; c < 8; c++)
+                corners[c] = glm::vec3(objects.models[i] * glm::vec4(b[c & 1].x, b[(c >> 1) & 1].y, b[(c >> 2) & 1].z, 1.0f));
+            for (int f = 0; f < 6; f++) {
+                addTriangle(corners[faces[f][0]], corners[faces[f][1]], corners[faces[f][2]]);
+                addTriangle(corners[faces[f][0]], corners[faces[f][2]], corners[faces[f][3]]);
+            }
+        }
+    }
+
+    // The largest meshes of a model (buildings rather than props) with their
+    // own triangles, as many as the triangle budget allows
+    void addModelOccluders(const Model& model, const glm::mat4& model_matrix) {
+        std::vector<unsigned int> order(model.meshes.size());
+        for (unsigned int i = 0; i < order.size(); i++)
+            order[i] = i;
+        auto size = [&](unsigned int i) {
+            return glm::length(model.meshes[i].aabb_max - model.meshes[i].aabb_min);
+        };
+        std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return size(a) > size(b); });
+        for (unsigned int i : order) {
+            const Mesh& mesh = model.meshes[i];
+            if (occluder_vertices.size() / 3 + mesh.indices.size() / 3 > MAX_OCCLUDER_TRIANGLES)
+                continue;
+            for (unsigned int index : mesh.indices)
+                occluder_vertices.push_back(glm::vec3(model_matrix * glm::vec4(mesh.vertices[index].Position, 1.0f)));
+        }
+    }
+
+    void clearOccluders() {
+        occluder_vertices.clear();
+    }
+
+    // Rasterizes the occluders for view_projection and tests every instance
+    // of the lists and every mesh of the models, on worker threads. None of
+    // them may change before finish().
+    void begin(const glm::mat4& view_projection, const std::vector<const Objects*>& in_objects, const std::vector<Model>& in_models, const glm::mat4& model_matrix) {
+        finish();
+        objects = in_objects;
+        models = &in_models;
+        mesh_model_matrix = model_matrix;
+        jobs.run([this, view_projection]() {
+            run(view_projection);
+        }, &frame, "SoftwareOcclusion");
+        running = true;
+        valid = true;
+    }
+
+    // Waits for the work begun for this frame
+    void finish() {
+        if (!running)
+            return;
+        CPU_PROFILE_SCOPE("SoftwareOcclusion::finish");
+        jobs.wait(frame);
+        running = false;
+    }
+
+    // Results are kept until the next begin; after invalidate() everything
+    // counts as visible
+    void invalidate() {
+        finish();
+        valid = false;
+    }
+
+    bool instanceVisible(unsigned int list, unsigned int instance) const {
+        return !valid || list >= instance_visible.size() || instance_visible[list][instance];
+    }
+    bool meshVisible(unsigned int model, unsigned int mesh) const {
+        return !valid || model >= mesh_visible.size() || mesh_visible[model][mesh];
+    }
+
+    // Objects::renderInstanced over the runs of visible instances of a batch
+    void renderInstanced(Objects& list_objects, unsigned int list, unsigned int first, unsigned int count) {
+        unsigned int run = first;
+        for (unsigned int i = first; i <= first + count; i++) {
+            if (i == first + count || !instanceVisible(list, i)) {
+                list_objects.renderInstanced(run, i - run);
+                run = i + 1;
+            }
+        }
+    }
+
+    // Model::Record of the visible meshes, after finish()
+    void recordModels(CommandList& list, unsigned int program, const std::vector<Model>& in_models, bool depth, const char* name) {
+        const SoftwareOcclusion* self = this;
+        Model::Record(list, program, in_models, depth, [self](unsigned int model, unsigned int mesh) {
+            return self->meshVisible(model, mesh);
+        }, name);
+    }
+
+private:
+    std::vector<float> depth;
+    std::vector<float> tile_max;
+    std::vector<glm::vec3> occluder_vertices;
+    // x, y in buffer pixels, z window depth, w clip w
+    std::vector<glm::vec4> screen_vertices;
+    bool use_avx2 = false;
+
+    std::vector<const Objects*> objects;
+    const std::vector<Model>* models = nullptr;
+    glm::mat4 mesh_model_matrix;
+    std::vector<std::vector<char>> instance_visible;
+    std::vector<std::vector<char>> mesh_visible;
+    JobCounter frame;
+    bool running = false;
+    bool valid = false;
+
+    void addTriangle(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+        occluder_vertices.push_back(a);
+        occluder_vertices.push_back(b);
+        occluder_vertices.push_back(c);
+    }
+
+    void run(glm::mat4 view_projection) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        screen_vertices.resize(occluder_vertices.size());
+        jobs.parallelFor(0, (unsigned int)occluder_vertices.size(), 1024, [&](unsigned int first, unsigned int last) {
+            for (unsigned int i = first; i < last; i++) {
+                glm::vec4 clip = view_projection * glm::vec4(occluder_vertices[i], 1.0f);
+                float inv_w = 1.0f / clip.w;
+                screen_vertices[i] = glm::vec4((clip.x * inv_w * 0.5f + 0.5f) * WIDTH, (clip.y * inv_w * 0.5f + 0.5f) * HEIGHT,
+                                               clip.z * inv_w * 0.5f + 0.5f, clip.w);
+            }
+        }, "Occluder transform");
+
+        // Horizontal bands of whole tile rows, no two threads share a pixel
+        jobs.parallelFor(0, NUM_BANDS, 1, [this](unsigned int first, unsigned int last) {
+            for (unsigned int band = first; band < last; band++)
+                rasterBand(band);
+        }, "Occluder raster");
+        auto rastered = std::chrono::high_resolution_clock::now();
+
+        OcclusionStats frame_stats;
+        frame_stats.occluder_triangles = (int)(occluder_vertices.size() / 3);
+        instance_visible.resize(objects.size());
+        for (size_t list = 0; list < objects.size(); list++) {
+            const Objects& o = *objects[list];
+            long long triangles = o.primitive == GL_TRIANGLE_STRIP ? o.vertex_count - 2 : o.vertex_count / 3;
+            instance_visible[list].resize(o.num);
+            for (unsigned int i = 0; i < o.num; i++) {
+                bool visible = boxVisible(view_projection * o.models[i], o.bounds_min, o.bounds_max);
+                instance_visible[list][i] = visible;
+                frame_stats.tested++;
+                if (!visible) {
+                    frame_stats.culled_draws++;
+                    frame_stats.culled_triangles += triangles;
+                }
+            }
+        }
+        mesh_visible.resize(models->size());
+        glm::mat4 mvp = view_projection * mesh_model_matrix;
+        for (size_t m = 0; m < models->size(); m++) {
+            const Model& model = (*models)[m];
+            mesh_visible[m].resize(model.meshes.size());
+            jobs.parallelFor(0, (unsigned int)model.meshes.size(), 64, [&](unsigned int first, unsigned int last) {
+                for (unsigned int i = first; i < last; i++)
+                    mesh_visible[m][i] = boxVisible(mvp, model.meshes[i].aabb_min, model.meshes[i].aabb_max);
+            }, "Occlusion test");
+            for (size_t i = 0; i < model.meshes.size(); i++) {
+                frame_stats.tested++;
+                if (!mesh_visible[m][i]) {
+                    frame_stats.culled_draws++;
+                    frame_stats.culled_triangles += model.meshes[i].indices.size() / 3;
+                }
+            }
+        }
+        auto tested = std::chrono::high_resolution_clock::now();
+        frame_stats.raster_ms = std::chrono::duration<float, std::milli>(rastered - start).count();
+        frame_stats.test_ms = std::chrono::duration<float, std::milli>(tested - rastered).count();
+        stats = frame_stats;
+    }
+
+    // Clears and rasterizes the rows of a band, then its tile maxima
+    void rasterBand(int band) {
+        const int rows = HEIGHT / NUM_BANDS;
+        int y_begin = band * rows;
+        int y_end = y_begin + rows;
+        std::fill(depth.begin() + y_begin * WIDTH, depth.begin() + y_end * WIDTH, 1.0f);
+
+        for (size_t t = 0; t + 2 < screen_vertices.size(); t += 3) {
+            glm::vec4 v0 = screen_vertices[t], v1 = screen_vertices[t + 1], v2 = screen_vertices[t + 2];
+            // Crossing the near plane: not an occluder, which stays conservative
+            if (v0.w <= 1e-4f || v1.w <= 1e-4f || v2.w <= 1e-4f)
+                continue;
+            float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+            if (std::abs(area) < 1e-8f)
+                continue;
+            // Counter-clockwise, edges >= 0 inside
+            if (area < 0.0f) {
+                std::swap(v1, v2);
+                area = -area;
+            }
+            int x0 = std::max((int)std::floor(std::min({v0.x, v1.x, v2.x})), 0);
+            int x1 = std::min((int)std::ceil(std::max({v0.x, v1.x, v2.x})), WIDTH);
+            int y0 = std::max((int)std::floor(std::min({v0.y, v1.y, v2.y})), y_begin);
+            int y1 = std::min((int)std::ceil(std::max({v0.y, v1.y, v2.y})), y_end);
+            if (x0 >= x1 || y0 >= y1)
+                continue;
+
+            // Edge i: a x + b y + c, from the vertex opposite to it
+            float a[3] = { v1.y - v2.y, v2.y - v0.y, v0.y - v1.y };
+            float b[3] = { v2.x - v1.x, v0.x - v2.x, v1.x - v0.x };
+            float c[3] = { v1.x * v2.y - v2.x * v1.y, v2.x * v0.y - v0.x * v2.y, v0.x * v1.y - v1.x * v0.y };
+            // Depth plane from the barycentrics
+            float inv_area = 1.0f / area;
+            float za = (a[0] * v0.z + a[1] * v1.z + a[2] * v2.z) * inv_area;
+            float zb = (b[0] * v0.z + b[1] * v1.z + b[2] * v2.z) * inv_area;
+            float zc = (c[0] * v0.z + c[1] * v1.z + c[2] * v2.z) * inv_area;
+
+            // Rows start on a multiple of 8 so whole 8-wide groups stay in the row
+            x0 &= ~7;
+            for (int y = y0; y < y1; y++) {
+                float py = y + 0.5f;
+#ifdef OCCLUSION_AVX2
+                if (use_avx2) {
+                    rasterRowAVX2(&depth[y * WIDTH], x0, x1, py, a, b, c, za, zb, zc);
+                    continue;
+                }
+#endif
+                float* row = &depth[y * WIDTH];
+                for (int x = x0; x < x1; x++) {
+                    float px = x + 0.5f;
+                    if (a[0] * px + b[0] * py + c[0] >= 0.0f && a[1] * px + b[1] * py + c[1] >= 0.0f && a[2] * px + b[2] * py + c[2] >= 0.0f)
+                        row[x] = std::min(row[x], za * px + zb * py + zc);
+                }
+            }
+        }
+
+        for (int ty = y_begin / TILE_HEIGHT; ty < y_end / TILE_HEIGHT; ty++) {
+            for (int tx = 0; tx < TILES_X; tx++) {
+                float farthest = 0.0f;
+                for (int y = ty * TILE_HEIGHT; y < (ty + 1) * TILE_HEIGHT; y++)
+                    for (int x = tx * TILE_WIDTH; x < (tx + 1) * TILE_WIDTH; x++)
+                        farthest = std::max(farthest, depth[y * WIDTH + x]);
+                tile_max[ty * TILES_X + tx] = farthest;
+            }
+        }
+    }
+
+#ifdef OCCLUSION_AVX2
+    // Eight pixels per step: coverage of the three edges as a mask, the depth
+    // kept only where it is covered and closer
+    OCCLUSION_AVX2_TARGET
+    static void rasterRowAVX2(float* row, int x0, int x1, float py, const float* a, const float* b, const float* c, float za, float zb, float zc) {
+        __m256 lane = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+        __m256 zero = _mm256_setzero_ps();
+        __m256 ea[3], erow[3];
+        for (int i = 0; i < 3; i++) {
+            ea[i] = _mm256_set1_ps(a[i]);
+            erow[i] = _mm256_set1_ps(b[i] * py + c[i]);
+        }
+        __m256 z_a = _mm256_set1_ps(za);
+        __m256 z_row = _mm256_set1_ps(zb * py + zc);
+        for (int x = x0; x < x1; x += 8) {
+            __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), lane);
+            __m256 inside = _mm256_cmp_ps(_mm256_fmadd_ps(ea[0], px, erow[0]), zero, _CMP_GE_OQ);
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_fmadd_ps(ea[1], px, erow[1]), zero, _CMP_GE_OQ));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_fmadd_ps(ea[2], px, erow[2]), zero, _CMP_GE_OQ));
+            if (_mm256_movemask_ps(inside) == 0)
+                continue;
+            __m256 old_depth = _mm256_loadu_ps(row + x);
+            __m256 new_depth = _mm256_min_ps(old_depth, _mm256_fmadd_ps(z_a, px, z_row));
+            _mm256_storeu_ps(row + x, _mm256_blendv_ps(old_depth, new_depth, inside));
+        }
+    }
+#endif
+
+    // False when the box is behind the rasterized depth everywhere it covers
+    bool boxVisible(const glm::mat4& mvp, const glm::vec3& bounds_min, const glm::vec3& bounds_max) const {
+        glm::vec3 b[2] = { bounds_min, bounds_max };
+        float x_min = 1e30f, y_min = 1e30f, x_max = -1e30f, y_max = -1e30f, nearest = 1.0f;
+        int outside[6] = { 0, 0, 0, 0, 0, 0 };
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec4 clip = mvp * glm::vec4(b[corner & 1].x, b[(corner >> 1) & 1].y, b[(corner >> 2) & 1].z, 1.0f);
+            outside[0] += clip.x < -clip.w;
+            outside[1] += clip.x > clip.w;
+            outside[2] += clip.y < -clip.w;
+            outside[3] += clip.y > clip.w;
+            outside[4] += clip.z < -clip.w;
+            outside[5] += clip.z > clip.w;
+            // Crosses the near plane, in front of every occluder
+            if (clip.w <= 1e-4f)
+                return true;
+            float inv_w = 1.0f / clip.w;
+            float x = (clip.x * inv_w * 0.5f + 0.5f) * WIDTH;
+            float y = (clip.y * inv_w * 0.5f + 0.5f) * HEIGHT;
+            x_min = std::min(x_min, x);
+            x_max = std::max(x_max, x);
+            y_min = std::min(y_min, y);
+            y_max = std::max(y_max, y);
+            nearest = std::min(nearest, clip.z * inv_w * 0.5f + 0.5f);
+        }
+        // All corners beyond one frustum plane
+        for (int plane = 0; plane < 6; plane++)
+            if (outside[plane] == 8)
+                return false;
+        // A box is not hidden by its own rasterized faces
+        nearest -= 1e-5f;
+
+        int px0 = std::clamp((int)std::floor(x_min), 0, WIDTH - 1);
+        int px1 = std::clamp((int)std::ceil(x_max), 1, WIDTH);
+        int py0 = std::clamp((int)std::floor(y_min), 0, HEIGHT - 1);
+        int py1 = std::clamp((int)std::ceil(y_max), 1, HEIGHT);
+        for (int ty = py0 / TILE_HEIGHT; ty <= (py1 - 1) / TILE_HEIGHT; ty++) {
+            for (int tx = px0 / TILE_WIDTH; tx <= (px1 - 1) / TILE_WIDTH; tx++) {
+                if (tile_max[ty * TILES_X + tx] < nearest)
+                    continue;
+                // Some pixel of the tile is farther, look at those under the box
+                for (int y = std::max(py0, ty * TILE_HEIGHT); y < std::min(py1, (ty + 1) * TILE_HEIGHT); y++)
+                    for (int x = std::max(px0, tx * TILE_WIDTH); x < std::min(px1, (tx + 1) * TILE_WIDTH); x++)
+                        if (depth[y * WIDTH + x] >= nearest)
+                            return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif /* occlusion_h */
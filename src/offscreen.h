@@ -0,0 +1,190 @@
+//
+//  offscreen.h
+//  opengl_test
+//
+
+#ifndef offscreen_h
+#define offscreen_h
+
+#include <iostream>
+
+#include "glstate.h"
+#include "gpumemory.h"
+
+// Headless OpenGL context for the benchmark mode. On Linux this is an EGL
+// surfaceless context (EGL_MESA_platform_surfaceless), which needs neither a
+// display server nor a GPU: Mesa's llvmpipe works. Elsewhere a hidden GLFW
+// window is used instead. Either way there is no usable default framebuffer,
+// the renderer draws into the FBO returned by genOffscreenTarget().
+#if defined(__linux__)
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+class OffscreenContext
+{
+public:
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+
+    bool create() {
+        auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay != nullptr)
+            display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (display == EGL_NO_DISPLAY)
+            display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+            std::cout << "ERROR::EGL::Failed to initialize display" << std::endl;
+            return false;
+        }
+
+        const EGLint config_attribs[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_NONE
+        };
+        EGLConfig config;
+        EGLint num_configs = 0;
+        if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0) {
+            std::cout << "ERROR::EGL::No OpenGL config" << std::endl;
+            return false;
+        }
+
+        eglBindAPI(EGL_OPENGL_API);
+
+        // Same version as the windowed path, falling back to the 3.3 core minimum
+        const EGLint versions[2][2] = {{4, 6}, {3, 3}};
+        for (const auto& version : versions) {
+            const EGLint context_attribs[] = {
+                EGL_CONTEXT_MAJOR_VERSION, version[0],
+                EGL_CONTEXT_MINOR_VERSION, version[1],
+                EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                EGL_NONE
+            };
+            context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+            if (context != EGL_NO_CONTEXT)
+                break;
+        }
+        if (context == EGL_NO_CONTEXT) {
+            std::cout << "ERROR::EGL::Failed to create an OpenGL 3.3 core context" << std::endl;
+            return false;
+        }
+
+        if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+            std::cout << "ERROR::EGL::Surfaceless contexts are not supported" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    GLADloadproc loader() {
+        return (GLADloadproc)eglGetProcAddress;
+    }
+
+    // Binds the context to the calling thread, or releases it so that another
+    // thread can bind it
+    void makeCurrent(bool current) {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, current ? context : EGL_NO_CONTEXT);
+    }
+
+    void destroy() {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+    }
+};
+
+#else
+
+class OffscreenContext
+{
+public:
+    GLFWwindow* window = nullptr;
+
+    bool create() {
+        glfwInit();
+#ifdef __APPLE__
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#else
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+#endif
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        window = glfwCreateWindow(1, 1, "LearnOpenGL bench", NULL, NULL);
+        if (window == nullptr) {
+            std::cout << "Failed to create hidden GLFW window" << std::endl;
+            glfwTerminate();
+            return false;
+        }
+        glfwMakeContextCurrent(window);
+        // Do not let the driver throttle to the display refresh rate
+        glfwSwapInterval(0);
+        return true;
+    }
+
+    GLADloadproc loader() {
+        return (GLADloadproc)glfwGetProcAddress;
+    }
+
+    void makeCurrent(bool current) {
+        glfwMakeContextCurrent(current ? window : nullptr);
+    }
+
+    void destroy() {
+        glfwTerminate();
+    }
+};
+
+#endif
+
+// Color + depth target standing in for the default framebuffer
+unsigned int genOffscreenTarget(unsigned int width, unsigned int height)
+{
+    unsigned int FBO;
+    glGenFramebuffers(1, &FBO);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO);
+
+    unsigned int color;
+    glGenTextures(1, &color);
+    glstate.editTexture(GL_TEXTURE_2D, color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    gpumemory.texture(color, GPU_MEMORY_RENDER_TARGETS, GL_RGBA8, width, height, 1, 1, "Offscreen", "color");
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+
+    unsigned int rbo;
+    glGenRenderbuffers(1, &rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    gpumemory.renderbuffer(rbo, GL_DEPTH_COMPONENT24, width, height, "Offscreen", "depth");
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbo);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "Offscreen framebuffer not complete!" << std::endl;
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+    return FBO;
+}
+
+// Deletes a target of genOffscreenTarget with its attachments
+void deleteOffscreenTarget(unsigned int FBO)
+{
+    GLint color = 0, rbo = 0;
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_NAME, &color);
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_NAME, &rbo);
+    glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+    glstate.deleteFramebuffers(1, &FBO);
+    GLuint texture = color, renderbuffer = rbo;
+    gpumemory.deleteTextures(1, &texture);
+    gpumemory.deleteRenderbuffers(1, &renderbuffer);
+}
+
+#endif /* offscreen_h */
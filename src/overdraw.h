@@ -0,0 +1,83 @@
+//
+//  overdraw.h
+//  opengl_test
+//
+
+#ifndef overdraw_h
+#define overdraw_h
+
+#include <glad/glad.h>
+#include <algorithm>
+
+// Forward pass fragments per pixel, -1 when the counter did not run that frame
+struct OverdrawStats
+{
+    float depth_per_pixel = -1.0f;
+    float shaded_per_pixel = -1.0f;
+};
+
+// Fragments per pixel of the forward pass from GL_SAMPLES_PASSED queries:
+// how many passed the depth test in the depth pre-pass, and how many were
+// shaded. Read back FRAMES_IN_FLIGHT frames later, like GpuProfiler.
+class OverdrawCounter : public OverdrawStats
+{
+public:
+    static const int FRAMES_IN_FLIGHT = 4;
+    enum Counter { DEPTH, SHADED, NUM_COUNTERS };
+
+    OverdrawCounter() {
+        for (Frame& frame : frames)
+            glGenQueries(NUM_COUNTERS, frame.queries);
+    }
+    ~OverdrawCounter() {
+        for (Frame& frame : frames)
+            glDeleteQueries(NUM_COUNTERS, frame.queries);
+    }
+
+    void begin(Counter counter) {
+        glBeginQuery(GL_SAMPLES_PASSED, frames[current].queries[counter]);
+    }
+    void end(Counter counter) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        frames[current].issued[counter] = true;
+    }
+
+    // pixels: render resolution of the counted frame
+    void endFrame(unsigned int pixels) {
+        Frame& frame = frames[current];
+        frame.pixels = pixels;
+        current = (current + 1) % FRAMES_IN_FLIGHT;
+        collect(frames[current]);
+    }
+
+private:
+    struct Frame
+    {
+        unsigned int queries[NUM_COUNTERS];
+        bool issued[NUM_COUNTERS] = { false, false };
+        unsigned int pixels = 0;
+    };
+    Frame frames[FRAMES_IN_FLIGHT];
+    int current = 0;
+
+    // The oldest frame, about to be reused
+    void collect(Frame& frame) {
+        if (!frame.issued[SHADED])
+            return;
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[SHADED], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint samples[NUM_COUNTERS] = { 0, 0 };
+            for (int counter = 0; counter < NUM_COUNTERS; counter++)
+                if (frame.issued[counter])
+                    glGetQueryObjectuiv(frame.queries[counter], GL_QUERY_RESULT, &samples[counter]);
+            float pixels = (float)std::max(frame.pixels, 1u);
+            depth_per_pixel = frame.issued[DEPTH] ? samples[DEPTH] / pixels : -1.0f;
+            shaded_per_pixel = samples[SHADED] / pixels;
+        }
+        // A result still pending after FRAMES_IN_FLIGHT frames is dropped
+        frame.issued[DEPTH] = frame.issued[SHADED] = false;
+    }
+};
+
+#endif /* overdraw_h */
@@ -0,0 +1,189 @@
+//
+//  regression.h
+//  opengl_test
+//
+
+#ifndef regression_h
+#define regression_h
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <cmath>
+#include <cstdint>
+
+#include "json.h"
+#include "gpuprofiler.h"
+#include "glstate.h"
+
+// Golden-image and frame-time checks for the benchmark mode. The last frame of
+// a run is compared with a stored image (PSNR) and, with --check-timing, the
+// measured frame time with a stored baseline. Timings only compare on the
+// machine and GL renderer that wrote the baseline, so that check is opt-in
+// and skipped against another renderer. A missing reference skips the case
+// (SKIPPED, the exit code CTest is told to report as skipped) rather than
+// passing it; --update-golden (re)writes them.
+class RegressionCheck
+{
+public:
+    std::string golden_dir;
+    bool update = false;
+    // Lowest accepted PSNR against the golden image
+    float min_psnr = 40.0f;
+    // Largest accepted relative increase of the average frame time
+    float max_time_regression = 0.10f;
+    bool check_timing = false;
+
+    // Results of run(), used as the exit code of the benchmark
+    static const int PASSED = 0;
+    static const int FAILED = 1;
+    static const int SKIPPED = 77;
+
+    // e.g. demo_ssao_r1_s2_ao, _t with temporal accumulation, _l1024a2 with
+    // 1024 local lights assigned in compute, _c with GPU culling, _o with CPU
+    // occlusion culling, _z with a depth pre-pass, _rt on a render thread,
+    // _x50 at a fixed 50% render scale, _d166 with dynamic resolution for a
+    // 16.6 ms budget, _nohiz with linear SSR and _nostencil without stencil
+    // lighting. Every setting that changes the image is in the name, with the
+    // defaults left out so that their references keep their names.
+    static std::string caseName(const BenchSettings& settings) {
+        std::string name = std::filesystem::path(settings.path).stem().string();
+        name += "_r" + std::to_string(settings.rendertype) + "_s" + std::to_string(settings.shadowtype);
+        if (settings.ssao) name += "_ao";
+        if (settings.ssao && settings.ao_technique == 1) name += "_gtao";
+        if (settings.ssao && settings.ssao_resolution > 0) name += std::to_string(1 << settings.ssao_resolution);
+        if (settings.temporal) name += "_t";
+        if (settings.gpu_culling) name += "_c";
+        if (settings.cpu_occlusion) name += "_o";
+        if (settings.depth_prepass) name += "_z";
+        if (settings.render_thread) name += "_rt";
+        if (settings.dynamic_resolution)
+            name += "_d" + std::to_string((int)std::lround(settings.frame_budget_ms * 10.0f));
+        else if (settings.render_scale != 1.0f)
+            name += "_x" + std::to_string((int)std::lround(settings.render_scale * 100.0f));
+        if (!settings.hiz_ssr) name += "_nohiz";
+        if (!settings.stencil_lighting) name += "_nostencil";
+        if (settings.num_lights > 0) name += "_l" + std::to_string(settings.num_lights) + "a" + std::to_string(settings.light_assignment);
+        return name;
+    }
+
+    // FAILED when the image or the timing regressed, SKIPPED when a reference
+    // to check against is missing
+    int run(const BenchSettings& settings, unsigned int fbo, int width, int height, const json& result) {
+        std::filesystem::path base = std::filesystem::path(golden_dir) / caseName(settings);
+        std::string image_path = base.string() + ".ppm";
+        std::string baseline_path = base.string() + ".json";
+
+        std::vector<uint8_t> image = readFramebuffer(fbo, width, height);
+        // Average GPU frame time when available, CPU otherwise (e.g. no timer queries)
+        float frame_ms = result["summary"].contains("gpu") && result["summary"]["gpu"].contains(GPU_PASS_NAMES[GPU_PASS_FRAME])
+            ? result["summary"]["gpu"][GPU_PASS_NAMES[GPU_PASS_FRAME]]["avg"].get<float>()
+            : result["summary"]["cpu"]["avg"].get<float>();
+
+        bool passed = true, skipped = false;
+        std::vector<uint8_t> golden;
+        int golden_width = 0, golden_height = 0;
+        if (update) {
+            std::filesystem::create_directories(golden_dir);
+            writePPM(image_path, image, width, height);
+            std::cout << "Regression " << caseName(settings) << ": wrote golden image " << image_path << std::endl;
+        }
+        else if (!readPPM(image_path, golden, golden_width, golden_height)) {
+            std::cout << "Regression " << caseName(settings) << ": SKIPPED, no golden image " << image_path
+                      << " (--update-golden writes it)" << std::endl;
+            skipped = true;
+        }
+        else if (golden_width != width || golden_height != height) {
+            std::cout << "Regression " << caseName(settings) << ": FAILED, golden image is "
+                      << golden_width << "x" << golden_height << std::endl;
+            passed = false;
+        }
+        else {
+            float value = psnr(image, golden);
+            bool ok = value >= min_psnr;
+            std::cout << "Regression " << caseName(settings) << ": PSNR " << value << " dB"
+                      << (ok ? "" : ", FAILED (min " + std::to_string(min_psnr) + ")") << std::endl;
+            if (!ok) {
+                writePPM(base.string() + ".actual.ppm", image, width, height);
+                passed = false;
+            }
+        }
+
+        std::ifstream baseline_file(baseline_path);
+        if (update) {
+            json baseline;
+            baseline["frame_ms"] = frame_ms;
+            baseline["renderer"] = result["renderer"];
+            std::ofstream(baseline_path) << baseline.dump(2) << std::endl;
+            std::cout << "Regression " << caseName(settings) << ": wrote baseline " << frame_ms << " ms" << std::endl;
+        }
+        else if (check_timing && !baseline_file) {
+            std::cout << "Regression " << caseName(settings) << ": timing SKIPPED, no baseline " << baseline_path
+                      << " (--update-golden writes it)" << std::endl;
+            skipped = true;
+        }
+        else if (check_timing) {
+            json baseline = json::parse(baseline_file);
+            float baseline_ms = baseline["frame_ms"];
+            if (baseline["renderer"] != result["renderer"]) {
+                std::cout << "Regression " << caseName(settings) << ": timing SKIPPED, baseline is from "
+                          << baseline["renderer"] << std::endl;
+                skipped = true;
+            }
+            else {
+                bool ok = frame_ms <= baseline_ms * (1.0f + max_time_regression);
+                std::cout << "Regression " << caseName(settings) << ": " << frame_ms << " ms (baseline "
+                          << baseline_ms << " ms)" << (ok ? "" : ", FAILED") << std::endl;
+                passed = passed && ok;
+            }
+        }
+        return !passed ? FAILED : skipped ? SKIPPED : PASSED;
+    }
+
+    static std::vector<uint8_t> readFramebuffer(unsigned int fbo, int width, int height) {
+        std::vector<uint8_t> pixels(3 * width * height);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+        // GL rows are bottom-up, image files top-down
+        for (int y = 0; y < height / 2; y++)
+            std::swap_ranges(pixels.begin() + 3 * width * y, pixels.begin() + 3 * width * (y + 1),
+                             pixels.begin() + 3 * width * (height - 1 - y));
+        return pixels;
+    }
+
+    static float psnr(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+        double mse = 0.0;
+        for (size_t i = 0; i < a.size(); i++) {
+            double d = (double)a[i] - (double)b[i];
+            mse += d * d;
+        }
+        mse /= a.size();
+        if (mse == 0.0) return INFINITY;
+        return (float)(10.0 * std::log10(255.0 * 255.0 / mse));
+    }
+
+    // Binary PPM (P6)
+    static void writePPM(const std::string& path, const std::vector<uint8_t>& pixels, int width, int height) {
+        std::ofstream f(path, std::ios::binary);
+        f << "P6\n" << width << " " << height << "\n255\n";
+        f.write((const char*)pixels.data(), pixels.size());
+    }
+
+    static bool readPPM(const std::string& path, std::vector<uint8_t>& pixels, int& width, int& height) {
+        std::ifstream f(path, std::ios::binary);
+        if (!f) return false;
+        std::string magic;
+        int max_value;
+        f >> magic >> width >> height >> max_value;
+        f.get();
+        if (magic != "P6" || max_value != 255) return false;
+        pixels.resize(3 * width * height);
+        f.read((char*)pixels.data(), pixels.size());
+        return (bool)f;
+    }
+};
+
+#endif /* regression_h */
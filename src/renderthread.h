@@ -0,0 +1,242 @@
+//
+//  renderthread.h
+//  opengl_test
+//
+
+#ifndef renderthread_h
+#define renderthread_h
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include <imui/imgui.h>
+
+#include "camera.h"
+#include "myimgui.h"
+#include "gpuprofiler.h"
+#include "occlusion.h"
+#include "overdraw.h"
+#include "jobs.h"
+#include "glstate.h"
+#include "gpumemory.h"
+#include "heaptracker.h"
+
+// Copy of the UI draw lists of a frame, which ImGui overwrites when the next
+// frame is built. The lists and their buffers are kept and reused.
+class UiDrawData
+{
+public:
+    UiDrawData() {}
+    UiDrawData(const UiDrawData&) = delete;
+    UiDrawData& operator=(const UiDrawData&) = delete;
+    ~UiDrawData() {
+        for (ImDrawList* list : lists)
+            IM_DELETE(list);
+    }
+
+    // source nullptr: no UI this frame
+    void capture(const ImDrawData* source) {
+        valid = source != nullptr && source->Valid;
+        if (!valid)
+            return;
+        data.Clear();
+        data.Valid = true;
+        data.DisplayPos = source->DisplayPos;
+        data.DisplaySize = source->DisplaySize;
+        data.FramebufferScale = source->FramebufferScale;
+        for (int i = 0; i < source->CmdListsCount; i++) {
+            const ImDrawList* from = source->CmdLists[i];
+            if ((size_t)i == lists.size())
+                lists.push_back(IM_NEW(ImDrawList)(from->_Data));
+            ImDrawList* to = lists[i];
+            copy(to->CmdBuffer, from->CmdBuffer);
+            copy(to->IdxBuffer, from->IdxBuffer);
+            copy(to->VtxBuffer, from->VtxBuffer);
+            to->Flags = from->Flags;
+            // Not AddDrawList, which checks the write cursors of lists being built
+            data.CmdLists.push_back(to);
+            data.CmdListsCount++;
+            data.TotalIdxCount += to->IdxBuffer.Size;
+            data.TotalVtxCount += to->VtxBuffer.Size;
+        }
+    }
+
+    ImDrawData* get() {
+        return valid ? &data : nullptr;
+    }
+
+private:
+    ImDrawData data;
+    std::vector<ImDrawList*> lists;
+    bool valid = false;
+
+    // ImVector's assignment frees first, resize keeps the capacity
+    template<class T>
+    static void copy(ImVector<T>& to, const ImVector<T>& from) {
+        to.resize(from.Size);
+        if (from.Size > 0)
+            std::memcpy(to.Data, from.Data, from.size_in_bytes());
+    }
+};
+
+// What the main thread hands over for one frame. Filled by the main thread,
+// then only read by the render side until it is done with the frame.
+struct FramePacket
+{
+    int frame = 0;
+    // CpuProfiler::now() when the input of the frame was sampled
+    uint64_t input_time = 0;
+    Camera camera;
+    RenderSettings settings;
+    // Shallow water: reset the height field
+    bool init_wave = false;
+    // Model to load, empty for none
+    std::string opened_file_path;
+    UiDrawData ui;
+};
+
+// Render side results shown by the UI, published once a frame
+struct RenderFeedback
+{
+    float render_scale = 1.0f;
+    unsigned int render_width = 0, render_height = 0;
+    JobStats job_stats;
+    GLStateStats gl_state;
+    GLCallStats gl_calls;
+    GpuMemoryStats gpu_memory;
+    HeapStats heap;
+    OcclusionStats occlusion;
+    OverdrawStats overdraw;
+    GpuTimings gpu;
+    // Input sampled to frame presented (swapped, or submitted offscreen)
+    float latency_ms = 0.0f;
+};
+
+// Owns the GL context on a thread of its own and renders the packets the main
+// thread submits. There are two packets: the main thread fills one while the
+// other is rendered, so it runs at most one frame ahead. Without the thread
+// the main thread renders the packets itself, nextPacket never waits.
+class RenderThread
+{
+public:
+    typedef std::function<void(FramePacket&)> RenderFunction;
+
+    ~RenderThread() {
+        stop();
+    }
+
+    bool running() const {
+        return thread.joinable();
+    }
+
+    // acquire and release run on the render thread, first and last, to move
+    // the GL context to it and back
+    void start(Job acquire, RenderFunction render, Job release) {
+        if (running())
+            return;
+        stopping = false;
+        read = write;
+        thread = std::thread([this, acquire = std::move(acquire), render = std::move(render), release = std::move(release)]() {
+            acquire();
+            loop(render);
+            release();
+        });
+    }
+
+    // Renders the packets already submitted, then ends the thread
+    void stop() {
+        if (!running())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        thread.join();
+    }
+
+    // Packet to fill next, once the render side is done with it
+    FramePacket& nextPacket() {
+        CPU_PROFILE_SCOPE("Wait for render thread");
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return !ready[write]; });
+        return packets[write];
+    }
+
+    // Hands the packet from nextPacket to the render thread
+    void submit() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready[write] = true;
+        }
+        changed.notify_all();
+        write ^= 1;
+    }
+
+    // Feedback the render side fills, every field, before publish()
+    RenderFeedback& feedbackToPublish() {
+        return feedback_slots[fill_slot];
+    }
+
+    void publish() {
+        std::lock_guard<std::mutex> lock(feedback_mutex);
+        std::swap(fill_slot, published_slot);
+        fresh = true;
+    }
+
+    // Latest published feedback, valid until the next call
+    const RenderFeedback& readFeedback() {
+        std::lock_guard<std::mutex> lock(feedback_mutex);
+        if (fresh) {
+            std::swap(shown_slot, published_slot);
+            fresh = false;
+        }
+        return feedback_slots[shown_slot];
+    }
+
+private:
+    FramePacket packets[2];
+    bool ready[2] = { false, false };
+    // Packet filled next by the main thread, and rendered next
+    int write = 0;
+    int read = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread thread;
+
+    // Triple buffer: the render side fills one slot while the main thread
+    // shows another, the third is the latest published. Handing one over
+    // swaps indices under the lock, the GPU timing history is not copied.
+    std::mutex feedback_mutex;
+    RenderFeedback feedback_slots[3];
+    int fill_slot = 0;
+    int published_slot = 1;
+    int shown_slot = 2;
+    bool fresh = false;
+
+    void loop(const RenderFunction& render) {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this]() { return ready[read] || stopping; });
+                if (!ready[read])
+                    return;
+            }
+            render(packets[read]);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ready[read] = false;
+            }
+            changed.notify_all();
+            read ^= 1;
+        }
+    }
+};
+
+#endif /* renderthread_h */
@@ -0,0 +1,62 @@
+//
+//  resolution.h
+//  opengl_test
+//
+
+#ifndef resolution_h
+#define resolution_h
+
+#include <cmath>
+#include <algorithm>
+
+// Dynamic resolution: picks the render scale (fraction of the output size per
+// axis) that keeps the measured GPU frame time within a budget. The cost of
+// the screen-space passes grows with the pixel count, i.e. with scale^2, so
+// the scale is corrected by sqrt(budget / time). Scales are quantized and held
+// for a few frames so the render targets are not reallocated every frame and
+// the timings have caught up with the previous change before the next one.
+class ResolutionController
+{
+public:
+    float scale = 1.0f;
+    float min_scale = 0.5f;
+    float max_scale = 1.0f;
+    float step = 0.05f;
+    // Frames to wait after a change, longer than the GPU timer readback latency
+    int cooldown_frames = 8;
+    // Grow only when this far below the budget, avoids oscillating around it
+    float headroom = 0.85f;
+
+    float smoothed_ms = 0.0f;
+
+    // Feeds one GPU frame time (ms); returns true when the scale changed
+    bool update(float gpu_ms, float budget_ms) {
+        if (gpu_ms <= 0.0f) return false;
+        smoothed_ms = smoothed_ms == 0.0f ? gpu_ms : 0.9f * smoothed_ms + 0.1f * gpu_ms;
+        if (frames_since_change++ < cooldown_frames) return false;
+
+        float target = scale;
+        if (smoothed_ms > budget_ms || smoothed_ms < headroom * budget_ms)
+            target = scale * std::sqrt(budget_ms / smoothed_ms);
+        target = std::clamp(std::round(target / step) * step, min_scale, max_scale);
+        // Only grow as far as the larger scale is still expected to fit the budget
+        while (target > scale + 1e-3f && smoothed_ms * (target * target) / (scale * scale) > budget_ms)
+            target -= step;
+        return set(target);
+    }
+
+    // Fixed scale, e.g. when dynamic resolution is off
+    bool set(float new_scale) {
+        new_scale = std::clamp(new_scale, min_scale, max_scale);
+        if (std::abs(new_scale - scale) < 1e-3f) return false;
+        scale = new_scale;
+        frames_since_change = 0;
+        smoothed_ms = 0.0f;
+        return true;
+    }
+
+private:
+    int frames_since_change = 0;
+};
+
+#endif /* resolution_h */
@@ -17,6 +17,9 @@
 #include <filesystem>
 
 #include "const.h"
+#include "cpuprofiler.h"
+#include "gl4ext.h"
+#include "glstate.h"
 
 class Shader
 {
@@ -26,6 +29,7 @@ public:
     // ------------------------------------------------------------------------
     Shader(std::filesystem::path vertexPath, std::filesystem::path fragmentPath)
     {
+        CPU_PROFILE_SCOPE("Shader::Shader");
         // 1. retrieve the vertex/fragment source code from filePath
         std::string vertexCode;
         std::string fragmentCode;
@@ -81,49 +85,95 @@ public:
         glDeleteShader(vertex);
         glDeleteShader(fragment);
     }
+    // compute program, only on contexts with gl4.compute (see gl4ext.h)
+    // ------------------------------------------------------------------------
+    explicit Shader(std::filesystem::path computePath)
+    {
+        CPU_PROFILE_SCOPE("Shader::Shader");
+        std::string computeCode;
+        std::ifstream cShaderFile;
+        cShaderFile.exceptions (std::ifstream::failbit | std::ifstream::badbit);
+        try
+        {
+            cShaderFile.open(computePath.c_str());
+            std::stringstream cShaderStream;
+            cShaderStream << cShaderFile.rdbuf();
+            cShaderFile.close();
+            computeCode = cShaderStream.str();
+        }
+        catch (std::ifstream::failure& e)
+        {
+            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
+            std::cout << computePath << std::endl;
+        }
+
+        const char* cShaderCode = computeCode.c_str();
+        unsigned int compute = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(compute, 1, &cShaderCode, NULL);
+        glCompileShader(compute);
+        checkCompileErrors(compute, "COMPUTE");
+        ID = glCreateProgram();
+        glAttachShader(ID, compute);
+        glLinkProgram(ID);
+        checkCompileErrors(ID, "PROGRAM");
+        glDeleteShader(compute);
+    }
     // activate the shader
     // ------------------------------------------------------------------------
     void use()
     {
-        glUseProgram(ID);
+        glstate.useProgram(ID);
     }
     void del()
     {
-        glDeleteProgram(ID);
+        glstate.deleteProgram(ID);
     }
-    // utility uniform functions
+    // utility uniform functions, set every frame: names are plain C strings so
+    // that passing a literal does not build a std::string
     unsigned int getID()
     {
         return ID;
     }
     // ------------------------------------------------------------------------
-    void setBool(const std::string &name, bool value) const
+    void setBool(const char* name, bool value) const
+    {
+        glUniform1i(glGetUniformLocation(ID, name), (int)value);
+    }
+    // ------------------------------------------------------------------------
+    void setInt(const char* name, int value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+        glUniform1i(glGetUniformLocation(ID, name), value);
     }
     // ------------------------------------------------------------------------
-    void setInt(const std::string &name, int value) const
+    void setFloat(const char* name, float value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1f(glGetUniformLocation(ID, name), value);
     }
     // ------------------------------------------------------------------------
-    void setFloat(const std::string &name, float value) const
+    void setVec2f(const char* name, glm::vec2 values) const
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform2f(glGetUniformLocation(ID, name), values[0], values[1]);
     }
     // ------------------------------------------------------------------------
-    void setVec3f(const std::string &name, glm::vec3 values) const
+    void setVec3f(const char* name, glm::vec3 values) const
     {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), values[0], values[1], values[2]);
+        glUniform3f(glGetUniformLocation(ID, name), values[0], values[1], values[2]);
     }
-    void setVec4f(const std::string &name, glm::vec4 values) const
+    void setVec4f(const char* name, glm::vec4 values) const
+    {
+        glUniform4f(glGetUniformLocation(ID, name), values[0], values[1], values[2], values[3]);
+    }
+    // ------------------------------------------------------------------------
+    void setMat4f(const char* name, glm::mat4 &matrix) const
     {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), values[0], values[1], values[2], values[3]);
+        glUniformMatrix4fv(glGetUniformLocation(ID, name), 1, GL_FALSE, glm::value_ptr(matrix));
     }
     // ------------------------------------------------------------------------
-    void setMat4f(const std::string &name, glm::mat4 &matrix) const
+    void setUniformBlockBinding(const char* name, unsigned int binding) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
+        unsigned int index = glGetUniformBlockIndex(ID, name);
+        if (index != GL_INVALID_INDEX)
+            glUniformBlockBinding(ID, index, binding);
     }
     // ------------------------------------------------------------------------
     void setModelMat(glm::mat4 &mat)
@@ -0,0 +1,162 @@
+//
+//  shadow.h
+//  opengl_test
+//
+
+#ifndef shadow_h
+#define shadow_h
+
+#include <vector>
+#include <cmath>
+
+#include "const.h"
+#include "shader_s.h"
+#include "objects.h"
+
+// Spiral poisson disks used by PCF and PCSS, same construction as the
+// per-fragment poissonDiskSamples() of GAMES 202 but generated once. The sets
+// are stored back to back in the "PoissonDisk" uniform block, two samples per
+// vec4, at vec4 offsets 0, 8 and 24 (see POISSON_SET_* in the shaders).
+const int POISSON_NUM_SETS = 3;
+const int POISSON_SET_SIZES[POISSON_NUM_SETS] = {16, 32, 64};
+const int POISSON_SET_RINGS[POISSON_NUM_SETS] = {3, 5, 10};
+const unsigned int POISSON_DISK_BINDING = 0;
+
+unsigned int genPoissonDiskUBO()
+{
+    std::vector<glm::vec2> samples;
+    for (int set = 0; set < POISSON_NUM_SETS; set++) {
+        int num_samples = POISSON_SET_SIZES[set];
+        float angle_step = 2.0f * pi * POISSON_SET_RINGS[set] / num_samples;
+        float radius_step = 1.0f / num_samples;
+
+        float angle = 0.0f;
+        float radius = radius_step;
+        for (int i = 0; i < num_samples; i++) {
+            samples.push_back(glm::vec2(std::cos(angle), std::sin(angle)) * std::pow(radius, 0.75f));
+            radius += radius_step;
+            angle += angle_step;
+        }
+    }
+
+    unsigned int UBO;
+    glGenBuffers(1, &UBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+    glBufferData(GL_UNIFORM_BUFFER, samples.size() * sizeof(glm::vec2), &samples[0], GL_STATIC_DRAW);
+    gpumemory.buffer(UBO, samples.size() * sizeof(glm::vec2), "Shadows", "poisson disk");
+    glBindBufferBase(GL_UNIFORM_BUFFER, POISSON_DISK_BINDING, UBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    return UBO;
+}
+
+// Exponential variance shadow map (EVSM). The moments are rendered in the
+// shadow pass, blurred with a separable gaussian and mipmapped once per
+// update, after which every pixel resolves its shadow with one trilinear
+// fetch instead of many depth compares.
+const float EVSM_POSITIVE_EXPONENT = 40.0f;
+const float EVSM_NEGATIVE_EXPONENT = 5.0f;
+
+class MomentShadowMap
+{
+public:
+    int width;
+    int height;
+    int blur_radius = 4;
+
+    unsigned int moments;
+    unsigned int moments_blur;
+    unsigned int FBO;
+    unsigned int blurFBO;
+
+    // The depth texture of the regular shadow map is shared as depth
+    // attachment, so it stays valid for the shadow map visualization.
+    MomentShadowMap(int in_width, int in_height, unsigned int depth_texture)
+    {
+        width = in_width;
+        height = in_height;
+
+        moments = genMomentTexture(width, height, true, "Shadows", "EVSM moments");
+        moments_blur = genMomentTexture(width, height, false, "Shadows", "EVSM blur");
+
+        // Outside of the light frustum: moments of the far plane
+        float border[4];
+        farMoments(border);
+        glstate.editTexture(GL_TEXTURE_2D, moments);
+        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+        glstate.editTexture(GL_TEXTURE_2D, moments_blur);
+        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+
+        glGenFramebuffers(1, &FBO);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, moments, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR::FRAMEBUFFER:: Moment shadow map is not complete!" << std::endl;
+
+        glGenFramebuffers(1, &blurFBO);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, blurFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, moments_blur, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR::FRAMEBUFFER:: Moment blur buffer is not complete!" << std::endl;
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    ~MomentShadowMap()
+    {
+        glstate.deleteFramebuffers(1, &FBO);
+        glstate.deleteFramebuffers(1, &blurFBO);
+        gpumemory.deleteTextures(1, &moments);
+        gpumemory.deleteTextures(1, &moments_blur);
+    }
+
+    static void farMoments(float* values)
+    {
+        float pos = std::exp(EVSM_POSITIVE_EXPONENT);
+        float neg = -std::exp(-EVSM_NEGATIVE_EXPONENT);
+        values[0] = pos;
+        values[1] = pos * pos;
+        values[2] = neg;
+        values[3] = neg * neg;
+    }
+
+    // Bind the moment framebuffer and clear it to the far plane
+    void bind()
+    {
+        float clear_moments[4];
+        farMoments(clear_moments);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glClearBufferfv(GL_COLOR, 0, clear_moments);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+    // Separable blur (moments -> moments_blur -> moments), then rebuild the
+    // mip chain. Leaves the viewport at the moment map size.
+    void filter(Shader& blurshader, Quads& quads)
+    {
+        glstate.disable(GL_DEPTH_TEST);
+        glstate.disable(GL_BLEND);
+        glViewport(0, 0, width, height);
+
+        blurshader.use();
+        blurshader.setInt("moments", 0);
+        blurshader.setInt("blur_radius", blur_radius);
+        glstate.activeTexture(GL_TEXTURE0);
+
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, blurFBO);
+        blurshader.setVec2f("direction", glm::vec2(1.0f, 0.0f));
+        glstate.bindTexture(GL_TEXTURE_2D, moments);
+        quads.render();
+
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, FBO);
+        blurshader.setVec2f("direction", glm::vec2(0.0f, 1.0f));
+        glstate.bindTexture(GL_TEXTURE_2D, moments_blur);
+        quads.render();
+
+        glstate.editTexture(GL_TEXTURE_2D, moments);
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+        glstate.enable(GL_BLEND);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+};
+
+#endif /* shadow_h */
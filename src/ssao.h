@@ -0,0 +1,197 @@
+//
+//  ssao.h
+//  opengl_test
+//
+
+#ifndef ssao_h
+#define ssao_h
+
+#include <iostream>
+#include <algorithm>
+
+#include "shader_s.h"
+#include "objects.h"
+#include "texture.h"
+
+// SSAO at 1/2 or 1/4 of the render resolution. The G-buffer is reduced to
+// the closest texel of each footprint (position, normal and depth of the same
+// texel), occlusion is computed and blurred on that, and a joint bilateral
+// upsample weighs the four nearest low-res texels by how well their depth and
+// normal match the full-res pixel, so AO does not bleed over silhouettes.
+class LowResAO
+{
+public:
+    // Render resolution divided by factor, per axis
+    int factor = 2;
+    int width = 1;
+    int height = 1;
+    // Edge-stopping falloff of the blur and upsample, relative view depth
+    float depth_sigma = 0.02f;
+
+    // Downsampled G-buffer, depth in .g like gShadow
+    unsigned int position;
+    unsigned int normal;
+    unsigned int depth;
+    unsigned int ao;
+    unsigned int ao_blur;
+    // Written by GTAO alongside ao
+    unsigned int bent_normal;
+
+    unsigned int gbufferFBO;
+    // ao + bent_normal, the AO pass
+    unsigned int aoFBO;
+    unsigned int blurFBO;
+    // ao only, the second blur pass
+    unsigned int resultFBO;
+
+    LowResAO()
+    {
+        position = genTarget(GL_RGBA16F, GL_RGBA, "position");
+        normal = genTarget(GL_RGBA16F, GL_RGBA, "normal");
+        depth = genTarget(GL_RG32F, GL_RG, "depth");
+        ao = genTarget(GL_R16F, GL_RED, "ao");
+        ao_blur = genTarget(GL_R16F, GL_RED, "ao blur");
+        bent_normal = genTarget(GL_RGBA16F, GL_RGBA, "bent normal");
+        // Sampled filtered by the lighting pass
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        glGenFramebuffers(1, &gbufferFBO);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, gbufferFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, position, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, depth, 0);
+        unsigned int attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+        glDrawBuffers(3, attachments);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "ERROR::FRAMEBUFFER:: Low-res G-buffer is not complete!" << std::endl;
+
+        glGenFramebuffers(1, &aoFBO);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, aoFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ao, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, bent_normal, 0);
+        glDrawBuffers(2, attachments);
+
+        glGenFramebuffers(1, &blurFBO);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, blurFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ao_blur, 0);
+
+        glGenFramebuffers(1, &resultFBO);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, resultFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ao, 0);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    ~LowResAO()
+    {
+        glstate.deleteFramebuffers(1, &gbufferFBO);
+        glstate.deleteFramebuffers(1, &aoFBO);
+        glstate.deleteFramebuffers(1, &blurFBO);
+        glstate.deleteFramebuffers(1, &resultFBO);
+        unsigned int textures[6] = { position, normal, depth, ao, ao_blur, bent_normal };
+        gpumemory.deleteTextures(6, textures);
+    }
+
+    void resize(int render_width, int render_height, int in_factor)
+    {
+        factor = in_factor;
+        width = std::max(1, render_width / factor);
+        height = std::max(1, render_height / factor);
+        resizeTexture(position, GL_RGBA16F, GL_RGBA, GL_FLOAT, width, height);
+        resizeTexture(normal, GL_RGBA16F, GL_RGBA, GL_FLOAT, width, height);
+        resizeTexture(depth, GL_RG32F, GL_RG, GL_FLOAT, width, height);
+        resizeTexture(ao, GL_R16F, GL_RED, GL_FLOAT, width, height);
+        resizeTexture(ao_blur, GL_R16F, GL_RED, GL_FLOAT, width, height);
+        resizeTexture(bent_normal, GL_RGBA16F, GL_RGBA, GL_FLOAT, width, height);
+    }
+
+    // Leaves the viewport at the low resolution
+    void downsample(Shader& shader, Quads& quads, unsigned int gPosition, unsigned int gNormal, unsigned int gShadow)
+    {
+        glViewport(0, 0, width, height);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, gbufferFBO);
+        glstate.disable(GL_DEPTH_TEST);
+        glstate.disable(GL_BLEND);
+        shader.use();
+        shader.setInt("gPosition", 0);
+        shader.setInt("gNormal", 1);
+        shader.setInt("gShadow", 2);
+        shader.setInt("factor", factor);
+        glstate.activeTexture(GL_TEXTURE0);
+        glstate.bindTexture(GL_TEXTURE_2D, gPosition);
+        glstate.activeTexture(GL_TEXTURE1);
+        glstate.bindTexture(GL_TEXTURE_2D, gNormal);
+        glstate.activeTexture(GL_TEXTURE2);
+        glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+        quads.render();
+        glstate.enable(GL_BLEND);
+    }
+
+    // Separable depth-aware blur of input (input -> ao_blur -> ao)
+    void blur(Shader& shader, Quads& quads, unsigned int input)
+    {
+        glViewport(0, 0, width, height);
+        glstate.disable(GL_DEPTH_TEST);
+        shader.use();
+        shader.setInt("ssaoInput", 0);
+        shader.setInt("depthInput", 1);
+        shader.setFloat("depth_sigma", depth_sigma);
+        glstate.activeTexture(GL_TEXTURE1);
+        glstate.bindTexture(GL_TEXTURE_2D, depth);
+
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, blurFBO);
+        shader.setVec2f("direction", glm::vec2(1.0f, 0.0f));
+        glstate.activeTexture(GL_TEXTURE0);
+        glstate.bindTexture(GL_TEXTURE_2D, input);
+        quads.render();
+
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, resultFBO);
+        shader.setVec2f("direction", glm::vec2(0.0f, 1.0f));
+        glstate.bindTexture(GL_TEXTURE_2D, ao_blur);
+        quads.render();
+    }
+
+    // Joint bilateral upsample of ao into fbo, at the full render resolution
+    void upsample(Shader& shader, Quads& quads, unsigned int fbo, int render_width, int render_height,
+                  unsigned int gNormal, unsigned int gShadow)
+    {
+        glViewport(0, 0, render_width, render_height);
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glstate.disable(GL_DEPTH_TEST);
+        shader.use();
+        shader.setInt("ssaoLow", 0);
+        shader.setInt("depthLow", 1);
+        shader.setInt("normalLow", 2);
+        shader.setInt("gNormal", 3);
+        shader.setInt("gShadow", 4);
+        shader.setFloat("depth_sigma", depth_sigma);
+        glstate.activeTexture(GL_TEXTURE0);
+        glstate.bindTexture(GL_TEXTURE_2D, ao);
+        glstate.activeTexture(GL_TEXTURE1);
+        glstate.bindTexture(GL_TEXTURE_2D, depth);
+        glstate.activeTexture(GL_TEXTURE2);
+        glstate.bindTexture(GL_TEXTURE_2D, normal);
+        glstate.activeTexture(GL_TEXTURE3);
+        glstate.bindTexture(GL_TEXTURE_2D, gNormal);
+        glstate.activeTexture(GL_TEXTURE4);
+        glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+        quads.render();
+    }
+
+private:
+    // Fetched per texel, never filtered
+    static unsigned int genTarget(GLint internalformat, GLenum format, const char* label)
+    {
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glstate.editTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalformat, 1, 1, 0, format, GL_FLOAT, NULL);
+        gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, internalformat, 1, 1, 1, 1, "Low-res AO", label);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        return texture;
+    }
+};
+
+#endif /* ssao_h */
@@ -0,0 +1,90 @@
+//
+//  temporal.h
+//  opengl_test
+//
+
+#ifndef temporal_h
+#define temporal_h
+
+#include "shader_s.h"
+#include "objects.h"
+#include "texture.h"
+#include "const.h"
+
+// Ping-pong history of a screen-space effect (SSAO, SSR) accumulated over
+// frames. Each resolve reprojects last frame's result with the previous
+// view-projection matrix, rejects it where the surface was not visible
+// (depth mismatch, off screen) and blends in the current, cheaper, frame.
+// rgb holds the accumulated value, a the linear depth it was computed at.
+class TemporalHistory
+{
+public:
+    unsigned int textures[2];
+    unsigned int FBOs[2];
+    // Result of the last resolve
+    unsigned int output;
+    // False until the first resolve, and again after a resize or a reset
+    bool valid = false;
+
+    TemporalHistory(const char* label) {
+        for (int i = 0; i < 2; i++) {
+            glGenFramebuffers(1, &FBOs[i]);
+            glstate.bindFramebuffer(GL_FRAMEBUFFER, FBOs[i]);
+            textures[i] = genGBufferRGBA16FTexture("Temporal history", label);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i], 0);
+        }
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, 0);
+        output = textures[0];
+    }
+    ~TemporalHistory() {
+        glstate.deleteFramebuffers(2, FBOs);
+        gpumemory.deleteTextures(2, textures);
+    }
+    TemporalHistory(const TemporalHistory&) = delete;
+    TemporalHistory& operator=(const TemporalHistory&) = delete;
+
+    void resize(int width, int height) {
+        for (int i = 0; i < 2; i++)
+            resizeTexture(textures[i], GL_RGBA16F, GL_RGBA, GL_FLOAT, width, height);
+        valid = false;
+    }
+
+    // Blends current (unit 0) into the history; alpha is the weight of the
+    // current frame where the history is accepted
+    void resolve(Shader& shader, Quads& quads, unsigned int current, unsigned int gPosition, unsigned int gShadow,
+                 glm::mat4 prev_view_projection, float alpha) {
+        glstate.bindFramebuffer(GL_FRAMEBUFFER, FBOs[write]);
+        glstate.disable(GL_DEPTH_TEST);
+        // a is the depth, not a coverage
+        glstate.disable(GL_BLEND);
+        shader.use();
+        shader.setInt("current", 0);
+        shader.setInt("history", 1);
+        shader.setInt("gPosition", 2);
+        shader.setInt("gShadow", 3);
+        shader.setMat4f("prevViewProj", prev_view_projection);
+        shader.setFloat("alpha", alpha);
+        shader.setBool("history_valid", valid);
+        glstate.activeTexture(GL_TEXTURE0);
+        glstate.bindTexture(GL_TEXTURE_2D, current);
+        glstate.activeTexture(GL_TEXTURE1);
+        glstate.bindTexture(GL_TEXTURE_2D, textures[1 - write]);
+        glstate.activeTexture(GL_TEXTURE2);
+        glstate.bindTexture(GL_TEXTURE_2D, gPosition);
+        glstate.activeTexture(GL_TEXTURE3);
+        glstate.bindTexture(GL_TEXTURE_2D, gShadow);
+        quads.render();
+        glstate.enable(GL_BLEND);
+
+        output = textures[write];
+        write = 1 - write;
+        valid = true;
+    }
+
+private:
+    int write = 0;
+};
+
+#endif /* temporal_h */
@@ -8,53 +8,25 @@
 #ifndef texture_h
 #define texture_h
 
-unsigned int genTexture(std::filesystem::path path, GLenum handle_edge)
+// Decoding can run on a worker first (decodeImage in model.h), see main
+unsigned int genTexture(std::filesystem::path path, GLenum handle_edge, const char* owner)
 {
-    unsigned int texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    
-    int width, height, nrChannels;
-    unsigned char *data = stbi_load(path.c_str(), &width, &height, &nrChannels, 0);
-    if (data) {
-        GLenum format;
-        if (nrChannels == 1)
-            format = GL_RED;
-        else if (nrChannels == 3)
-            format = GL_RGB;
-        else if (nrChannels == 4)
-            format = GL_RGBA;
-        else
-            format = GL_RGB;
-        
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-        
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, handle_edge);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, handle_edge);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    }
-    else {
-        std::cout << "Failed to load texture" << std::endl;
-    }
-    
-    stbi_image_free(data);
-    
-    return texture;
+    DecodedImage image = decodeImage(path.string());
+    return uploadImage(image, handle_edge, owner, path.filename().string());
 }
 
-unsigned int genCubeMapTexture(std::vector<std::string> faces)
+unsigned int genCubeMapTexture(std::vector<std::string> faces, const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    glstate.editTexture(GL_TEXTURE_CUBE_MAP, texture);
     
     int width, height, nrChannels;
     for (unsigned int i = 0; i < faces.size(); i++) {
         unsigned char *data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
         if (data) {
             glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+            gpumemory.texture(texture, GPU_MEMORY_TEXTURES, GL_RGB, width, height, 1, 6, owner, label);
             stbi_image_free(data);
         }
         else {
@@ -71,13 +43,14 @@ unsigned int genCubeMapTexture(std::vector<std::string> faces)
     return texture;
 }
 
-unsigned int genFrameBufferColorTexture()
+unsigned int genFrameBufferColorTexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, render_width, render_height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGB, render_width, render_height, 1, 1, owner, label);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -85,13 +58,14 @@ unsigned int genFrameBufferColorTexture()
     return texture;
 }
 
-unsigned int genFrameBufferDepthTexture()
+unsigned int genFrameBufferDepthTexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
 
     glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_DEPTH_COMPONENT, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 1, 1, owner, label);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -104,12 +78,54 @@ unsigned int genFrameBufferDepthTexture()
     return texture;
 }
 
-unsigned int genGBufferRGBA16FTexture()
+unsigned int genMomentTexture(int width, int height, bool mipmap, const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGBA32F, width, height,
+                      mipmap ? GpuMemory::mipLevels(width, height) : 1, 1, owner, label);
+    if (mipmap) {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    }
+    else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    return texture;
+}
+
+unsigned int genMinMaxPyramidTexture(int width, int height, int levels, const char* owner, const std::string& label)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RG32F, width, height, levels, 1, owner, label);
+    for (int level = 0; level < levels; level++) {
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RG32F, width, height, 0, GL_RG, GL_FLOAT, NULL);
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return texture;
+}
+
+unsigned int genGBufferRGBA16FTexture(const char* owner, const std::string& label)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, render_width, render_height, 0, GL_RGBA, GL_FLOAT, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGBA16F, render_width, render_height, 1, 1, owner, label);
 //    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 //    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, NULL);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -121,12 +137,13 @@ unsigned int genGBufferRGBA16FTexture()
     return texture;
 }
 
-unsigned int genGBufferRGB16FTexture()
+unsigned int genGBufferRGB16FTexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, NULL);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, render_width, render_height, 0, GL_RGB, GL_FLOAT, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGB16F, render_width, render_height, 1, 1, owner, label);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -136,12 +153,13 @@ unsigned int genGBufferRGB16FTexture()
     return texture;
 }
 
-unsigned int genGBufferRGBA32FTexture()
+unsigned int genGBufferRGBA32FTexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, render_width, render_height, 0, GL_RGBA, GL_FLOAT, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGBA32F, render_width, render_height, 1, 1, owner, label);
 //    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 //    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGB, GL_FLOAT, NULL);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -153,12 +171,13 @@ unsigned int genGBufferRGBA32FTexture()
     return texture;
 }
 
-unsigned int genGBufferRGBATexture()
+unsigned int genGBufferRGBATexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, render_width, render_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGBA, render_width, render_height, 1, 1, owner, label);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -168,12 +187,13 @@ unsigned int genGBufferRGBATexture()
     return texture;
 }
 
-unsigned int genGBufferRedTexture()
+unsigned int genGBufferRedTexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, render_width, render_height, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RED, render_width, render_height, 1, 1, owner, label);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
@@ -181,12 +201,13 @@ unsigned int genGBufferRedTexture()
     return texture;
 }
 
-unsigned int genGBufferRed16FTexture()
+unsigned int genGBufferRed16FTexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, 2 * SCR_WIDTH, 2 * SCR_HEIGHT, 0, GL_RED, GL_FLOAT, NULL);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, render_width, render_height, 0, GL_RED, GL_FLOAT, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_R16F, render_width, render_height, 1, 1, owner, label);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
@@ -194,12 +215,22 @@ unsigned int genGBufferRed16FTexture()
     return texture;
 }
 
-unsigned int gen44RandomBuffer(std::vector<glm::vec3>& ssaoNoise)
+// Re-specifies the storage of a render target at a new size. The texture name,
+// its sampling parameters and the framebuffers it is attached to are kept.
+void resizeTexture(unsigned int texture, GLint internalformat, GLenum format, GLenum type, int width, int height)
+{
+    glstate.editTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalformat, width, height, 0, format, type, NULL);
+    gpumemory.resizeTexture(texture, width, height);
+}
+
+unsigned int gen44RandomBuffer(std::vector<glm::vec3>& ssaoNoise, const char* owner, const std::string& label)
 {
     GLuint noiseTexture;
     glGenTextures(1, &noiseTexture);
-    glBindTexture(GL_TEXTURE_2D, noiseTexture);
+    glstate.editTexture(GL_TEXTURE_2D, noiseTexture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, 4, 4, 0, GL_RGB, GL_FLOAT, &ssaoNoise[0]);
+    gpumemory.texture(noiseTexture, GPU_MEMORY_TEXTURES, GL_RGB16F, 4, 4, 1, 1, owner, label);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -207,12 +238,13 @@ unsigned int gen44RandomBuffer(std::vector<glm::vec3>& ssaoNoise)
     return noiseTexture;
 }
 
-unsigned int genGBufferHeightTexture()
+unsigned int genGBufferHeightTexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 160, 120, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGBA, 160, 120, 1, 1, owner, label);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -222,12 +254,13 @@ unsigned int genGBufferHeightTexture()
     return texture;
 }
 
-unsigned int genGBufferSWETexture()
+unsigned int genGBufferSWETexture(const char* owner, const std::string& label)
 {
     unsigned int texture;
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    glstate.editTexture(GL_TEXTURE_2D, texture);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, 100, 100, 0, GL_RGB, GL_FLOAT, NULL);
+    gpumemory.texture(texture, GPU_MEMORY_RENDER_TARGETS, GL_RGB32F, 100, 100, 1, 1, owner, label);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);